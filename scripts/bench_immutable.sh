@@ -0,0 +1,38 @@
+#!/bin/sh
+# Compares a default mount against an immutable one (-o immutable).
+# Every pass stats and reads the whole tree; from the second pass on an
+# immutable mount should be answered by the kernel caches.
+#
+# Usage: scripts/bench_immutable.sh <mount_fat16 binary> <mountpoint> [passes]
+# Run it from the directory that holds fat16.img.
+
+BIN=${1:?mount_fat16 binary}
+MNT=${2:?mountpoint}
+PASSES=${3:-5}
+
+now() {
+  date +%s.%N
+}
+
+run() {
+  "$BIN" "$MNT" "$@" || exit 1
+  sleep 1
+
+  i=1
+  while [ "$i" -le "$PASSES" ]; do
+    start=$(now)
+    find "$MNT" -exec stat {} + > /dev/null
+    find "$MNT" -type f -exec cat {} + > /dev/null
+    end=$(now)
+    echo "  pass $i: $(awk "BEGIN { printf \"%.3f\", $end - $start }") s"
+    i=$((i + 1))
+  done
+
+  fusermount -u "$MNT"
+}
+
+echo "default mount"
+run
+
+echo "immutable mount"
+run -o immutable
@@ -0,0 +1,248 @@
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "backend.h"
+#include "log.h"
+
+/* Device presets: latency (us), seek (us per GiB), bandwidth (KiB/s) */
+static const struct {
+  const char *Name;
+  THROTTLE Throttle;
+} presets[] = {
+  /* 7200 rpm disk: half a turn, a seek across the platter, 150 MiB/s */
+  { "hdd", { 4200, 8000, 150 * 1024 } },
+  /* SD card: flash access time, no seeks, 20 MiB/s */
+  { "sd", { 500, 0, 20 * 1024 } },
+  /* Network block device: a round trip per read, 100 Mbit/s */
+  { "net", { 2000, 0, 12 * 1024 } },
+};
+
+/* An image file mapped by the mmap backend */
+typedef struct {
+  FILE *fd;
+  const char *Map;
+  off_t Size;
+} MAPPING;
+
+static MAPPING maps[BACKEND_MAPS];
+static int map_cnt;
+static pthread_rwlock_t maps_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* State of the throttled device: reads queue for the transfer and seek, the
+ * latency of each one overlaps with the others */
+static const SECTOR_BACKEND *inner;
+static THROTTLE throttle;
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t busy_until;
+static off_t head;
+static uint64_t reads, read_bytes, delay_ns;
+
+/* Mapping of an image file, NULL if it is not mapped yet. Called with
+ * maps_lock held */
+static MAPPING *mapping_find(FILE *fd)
+{
+  int i;
+
+  for (i = 0; i < map_cnt; i++) {
+    if (maps[i].fd == fd) {
+      return &maps[i];
+    }
+  }
+  return NULL;
+}
+
+/* Copies the mapping of an image file, made on its first read. Returns 0, or
+ * -1 if it cannot be mapped. The mapping stays until the file is forgotten,
+ * which only happens once nothing reads it any more */
+static int mapping_of(FILE *fd, MAPPING *Copy)
+{
+  struct stat st;
+  MAPPING *Mapping;
+  void *Map;
+
+  pthread_rwlock_rdlock(&maps_lock);
+  Mapping = mapping_find(fd);
+  if (Mapping != NULL) {
+    *Copy = *Mapping;
+  }
+  pthread_rwlock_unlock(&maps_lock);
+  if (Mapping != NULL) {
+    return 0;
+  }
+
+  pthread_rwlock_wrlock(&maps_lock);
+  Mapping = mapping_find(fd);
+  if (Mapping == NULL && map_cnt < BACKEND_MAPS && fstat(fileno(fd), &st) == 0 &&
+      st.st_size > 0) {
+    Map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(fd), 0);
+    if (Map != MAP_FAILED) {
+      madvise(Map, st.st_size, MADV_RANDOM);
+      Mapping = &maps[map_cnt++];
+      Mapping->fd = fd;
+      Mapping->Map = Map;
+      Mapping->Size = st.st_size;
+    }
+  }
+  if (Mapping != NULL) {
+    *Copy = *Mapping;
+  }
+  pthread_rwlock_unlock(&maps_lock);
+  return Mapping != NULL ? 0 : -1;
+}
+
+/* mmap backend read, plain pread for a file that could not be mapped */
+static ssize_t mmap_pread(FILE *fd, void *buffer, size_t size, off_t offset)
+{
+  MAPPING Mapping;
+
+  if (mapping_of(fd, &Mapping) != 0) {
+    return sector_backend_pread.pread(fd, buffer, size, offset);
+  }
+  if (offset >= Mapping.Size) {
+    return 0;
+  }
+  if ((off_t) size > Mapping.Size - offset) {
+    size = Mapping.Size - offset;
+  }
+  memcpy(buffer, Mapping.Map + offset, size);
+  return size;
+}
+
+/* Unmaps an image file about to be closed */
+static void mmap_forget(FILE *fd)
+{
+  int i;
+
+  pthread_rwlock_wrlock(&maps_lock);
+  for (i = 0; i < map_cnt; i++) {
+    if (maps[i].fd == fd) {
+      munmap((void *) maps[i].Map, maps[i].Size);
+      maps[i] = maps[--map_cnt];
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&maps_lock);
+}
+
+const SECTOR_BACKEND backend_mmap = { "mmap", mmap_pread, mmap_forget };
+
+const SECTOR_BACKEND *backend_by_name(const char *Name)
+{
+  if (strcmp(Name, sector_backend_pread.Name) == 0) {
+    return &sector_backend_pread;
+  }
+  if (strcmp(Name, backend_mmap.Name) == 0) {
+    return &backend_mmap;
+  }
+  return NULL;
+}
+
+int backend_preset(const char *Name, THROTTLE *Throttle)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(presets) / sizeof(presets[0]); i++) {
+    if (strcmp(presets[i].Name, Name) == 0) {
+      *Throttle = presets[i].Throttle;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* Monotonic clock in nanoseconds */
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Sleeps until a time of the monotonic clock */
+static void sleep_until(uint64_t Deadline)
+{
+  struct timespec ts;
+
+  ts.tv_sec = Deadline / 1000000000;
+  ts.tv_nsec = Deadline % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    continue;
+  }
+}
+
+/**
+ * Throttled backend read. The device serves one read at a time: each waits
+ * for the previous ones, then for its seek (the distance from where the
+ * last read ended) and its transfer at the bandwidth cap. The access
+ * latency is paid by every read on its own, as a device with a deep queue
+ * would.
+ * ============================================================================
+ * Return
+ * What the inner backend returns, once the delay has passed.
+ * ============================================================================
+ * Parameters
+ * @fd: The image file.
+ * @buffer: Receives the bytes.
+ * @size: Number of bytes to read.
+ * @offset: Offset of the first byte in the image.
+**/
+static ssize_t throttled_pread(FILE *fd, void *buffer, size_t size, off_t offset)
+{
+  uint64_t Start = now_ns(), Done, Busy;
+  off_t Distance;
+
+  pthread_mutex_lock(&device_lock);
+  Distance = offset > head ? offset - head : head - offset;
+  Busy = (uint64_t) ((double) Distance * throttle.Seek * 1000 / (1 << 30));
+  if (throttle.Bandwidth != 0) {
+    Busy += (uint64_t) size * 1000000000 / ((uint64_t) throttle.Bandwidth * 1024);
+  }
+  busy_until = (busy_until > Start ? busy_until : Start) + Busy;
+  Done = busy_until + (uint64_t) throttle.Latency * 1000;
+  head = offset + size;
+  reads++;
+  read_bytes += size;
+  delay_ns += Done - Start;
+  pthread_mutex_unlock(&device_lock);
+
+  ssize_t res = inner->pread(fd, buffer, size, offset);
+
+  sleep_until(Done);
+  return res;
+}
+
+/* Forgets an image file in the inner backend */
+static void throttled_forget(FILE *fd)
+{
+  if (inner->forget != NULL) {
+    inner->forget(fd);
+  }
+}
+
+static const SECTOR_BACKEND backend_throttle = { "throttled", throttled_pread, throttled_forget };
+
+const SECTOR_BACKEND *backend_throttled(const SECTOR_BACKEND *Inner, const THROTTLE *Throttle)
+{
+  inner = Inner;
+  throttle = *Throttle;
+  return &backend_throttle;
+}
+
+int backend_report(char *buffer, size_t size)
+{
+  int Length;
+
+  pthread_mutex_lock(&device_lock);
+  Length = snprintf(buffer, size, "backend %s\nlatency_us %u\nseek_us_per_gib %u\n"
+                    "bandwidth_kib %u\nreads %llu\nbytes %llu\ndelay_ms %llu\n",
+                    inner != NULL ? inner->Name : "none", throttle.Latency, throttle.Seek,
+                    throttle.Bandwidth, (unsigned long long) reads,
+                    (unsigned long long) read_bytes, (unsigned long long) delay_ns / 1000000);
+  pthread_mutex_unlock(&device_lock);
+  return Length;
+}
@@ -0,0 +1,37 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stdint.h>
+
+#include "sector.h"
+
+/* Most image files the mmap backend keeps mapped at once */
+#define BACKEND_MAPS 64
+
+/* Slow storage emulated by the throttled backend */
+typedef struct {
+  unsigned int Latency;   /* us added to every read */
+  unsigned int Seek;      /* us per GiB between the end of the previous read
+                           * and the start of this one */
+  unsigned int Bandwidth; /* KiB/s shared by all reads, 0 for no limit */
+} THROTTLE;
+
+/* Reads copied out of a shared read-only mapping of the image file */
+extern const SECTOR_BACKEND backend_mmap;
+
+/* Backend by name ("pread" or "mmap"), NULL for an unknown name */
+const SECTOR_BACKEND *backend_by_name(const char *Name);
+
+/* Fills Throttle with a preset ("hdd", "sd" or "net"). Returns 0, or -1 for
+ * an unknown preset */
+int backend_preset(const char *Name, THROTTLE *Throttle);
+
+/* Backend reading through Inner, delayed as Throttle says. There is only
+ * one throttled device per process */
+const SECTOR_BACKEND *backend_throttled(const SECTOR_BACKEND *Inner, const THROTTLE *Throttle);
+
+/* Writes the reads and delays of the throttled backend as text. Returns the
+ * length of the whole report, which is cut at 'size' bytes */
+int backend_report(char *buffer, size_t size);
+
+#endif
@@ -0,0 +1,206 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "batch.h"
+#include "log.h"
+
+/* Writes a string as a JSON string */
+static void json_string(FILE *Out, const char *s)
+{
+  fputc('"', Out);
+  for (; *s != '\0'; s++) {
+    unsigned char c = *s;
+
+    /* Bytes of UTF-8 characters (long names) go out as they are */
+    if (c == '"' || c == '\\') {
+      fprintf(Out, "\\%c", c);
+    } else if (c < 0x20 || c == 0x7f) {
+      fprintf(Out, "\\u%04x", c);
+    } else {
+      fputc(c, Out);
+    }
+  }
+  fputc('"', Out);
+}
+
+/* Paths are sorted by their directory first (without regard to case, as
+ * lookups compare names), then as plain strings, so the paths of one
+ * directory are next to each other and never split by those of its
+ * subdirectories */
+static int path_cmp(const void *a, const void *b)
+{
+  const char *A = *(char * const *) a, *B = *(char * const *) b;
+  const char *SlashA = strrchr(A, '/'), *SlashB = strrchr(B, '/');
+  size_t LenA = SlashA == NULL ? 0 : SlashA - A, LenB = SlashB == NULL ? 0 : SlashB - B;
+  int cmp = strncasecmp(A, B, LenA < LenB ? LenA : LenB);
+
+  if (cmp != 0) {
+    return cmp;
+  }
+  if (LenA != LenB) {
+    return LenA < LenB ? -1 : 1;
+  }
+  return strcmp(A, B);
+}
+
+/* Reads the non-empty lines of a stream */
+static char **read_paths(FILE *In, DWORD *PathCnt)
+{
+  char **Paths = NULL;
+  DWORD Cap = 0;
+  char *line = NULL;
+  size_t lineCap = 0;
+  ssize_t len;
+
+  *PathCnt = 0;
+  while ((len = getline(&line, &lineCap, In)) != -1) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+    if (len == 0) {
+      continue;
+    }
+    if (*PathCnt == Cap) {
+      Cap = Cap == 0 ? 256 : Cap * 2;
+      Paths = realloc(Paths, Cap * sizeof(char *));
+      if (Paths == NULL) {
+        log_msg("Out of memory!\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    Paths[*PathCnt] = strdup(line);
+    if (Paths[*PathCnt] == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    (*PathCnt)++;
+  }
+  free(line);
+  return Paths;
+}
+
+/* Writes the clusters of a file or directory as runs of adjacent clusters.
+ * Returns 0, or -1 if the chain is broken */
+static int print_extents(VOLUME *Vol, DIR_ENTRY *Dir, FILE *Out)
+{
+  CHAIN_WALK Walk;
+  WORD RunStart, RunEnd;
+  int res, first = 1;
+
+  fputs(",\"extents\":[", Out);
+
+  /* The root directory is a fixed region right before the data region */
+  if (Dir->DIR_Name[0] == '/') {
+    fprintf(Out, "[%lld,%u]]", (long long) Vol->FirstRootDirSecNum << Vol->Geo.SectorShift,
+            (Vol->FirstDataSector - Vol->FirstRootDirSecNum) << Vol->Geo.SectorShift);
+    return 0;
+  }
+  if (Dir->DIR_FstClusLO == 0) {
+    fputc(']', Out);
+    return 0;
+  }
+  if (chain_start(Vol, &Walk, Dir->DIR_FstClusLO) != 0) {
+    fputc(']', Out);
+    return -1;
+  }
+
+  RunStart = RunEnd = Walk.Cluster;
+  do {
+    res = chain_next(Vol, &Walk);
+    if (res == 1 && Walk.Cluster == RunEnd + 1) {
+      RunEnd = Walk.Cluster;
+      continue;
+    }
+    fprintf(Out, "%s[%lld,%u]", first ? "" : ",", (long long) cluster_offset(Vol, RunStart),
+            (DWORD) (RunEnd - RunStart + 1) << Vol->Geo.ClusterShift);
+    first = 0;
+    RunStart = RunEnd = Walk.Cluster;
+  } while (res == 1);
+
+  fputc(']', Out);
+  return res;
+}
+
+/* Writes the JSON line of one path */
+static void print_result(VOLUME *Vol, const char *Path, DIR_ENTRY *Dir, int res,
+                         FILE *Out)
+{
+  fputs("{\"path\":", Out);
+  json_string(Out, Path);
+
+  if (res != 0) {
+    fprintf(Out, ",\"error\":\"%s\"}\n", res == -ENAMETOOLONG ? "name too long" :
+            res == -ENOTDIR ? "not a directory" : "not found");
+    return;
+  }
+
+  fprintf(Out, ",\"type\":\"%s\",\"attr\":%u,\"size\":%u,\"first_cluster\":%u,"
+          "\"mtime\":%lld", Dir->DIR_Attr & ATTR_DIRECTORY ? "dir" : "file",
+          Dir->DIR_Attr, Dir->DIR_FileSize, Dir->DIR_FstClusLO,
+          Dir->DIR_Name[0] == '/' ? 0LL : (long long) dir_mtime(Dir));
+  if (print_extents(Vol, Dir, Out) != 0) {
+    fputs(",\"error\":\"broken cluster chain\"", Out);
+  }
+  fputs("}\n", Out);
+}
+
+/**
+ * Looks up every path listed in a stream, one per line, and writes one JSON
+ * line per path: its type, attributes, size, first cluster and extents (runs
+ * of adjacent clusters as [image offset, bytes]), or an error. The paths are
+ * sorted by directory first, so the paths of one directory come one after
+ * the other and its parents are walked once for all of them; the results
+ * come out in that order. The FAT and directories read are cached for the whole batch.
+ * ============================================================================
+ * Return
+ * 0 if every path was found, 1 otherwise.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @In: Stream listing the paths.
+ * @Out: Stream the JSON lines are written to.
+**/
+int batch_lookup(VOLUME *Vol, FILE *In, FILE *Out)
+{
+  DWORD PathCnt, i;
+  char **Paths = read_paths(In, &PathCnt);
+  char *Parent = NULL;
+  DIR_ENTRY ParentDir, Dir;
+  int ParentRes = 0, res, missing = 0;
+
+  qsort(Paths, PathCnt, sizeof(char *), path_cmp);
+
+  for (i = 0; i < PathCnt; i++) {
+    char *Slash = strrchr(Paths[i], '/');
+    size_t ParentLen = Slash == NULL ? 0 : Slash - Paths[i];
+
+    /* Siblings share the lookup of their directory */
+    if (Parent == NULL || strlen(Parent) != ParentLen ||
+        strncasecmp(Parent, Paths[i], ParentLen) != 0) {
+      free(Parent);
+      Parent = strndup(Paths[i], ParentLen);
+      if (Parent == NULL) {
+        log_msg("Out of memory!\n");
+        exit(EXIT_FAILURE);
+      }
+      ParentRes = path_lookup(Vol, Parent, &ParentDir);
+    }
+
+    if (ParentRes != 0) {
+      res = ParentRes;
+    } else {
+      res = path_lookup_at(Vol, &ParentDir, Slash == NULL ? Paths[i] : Slash + 1, &Dir);
+    }
+    if (res != 0) {
+      missing = 1;
+    }
+    print_result(Vol, Paths[i], &Dir, res, Out);
+    free(Paths[i]);
+  }
+
+  free(Parent);
+  free(Paths);
+  return missing;
+}
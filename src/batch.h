@@ -0,0 +1,11 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+
+#include "fat16.h"
+
+/* Prototypes (documentation in the functions definitions) */
+int batch_lookup(VOLUME *Vol, FILE *In, FILE *Out);
+
+#endif
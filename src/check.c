@@ -0,0 +1,536 @@
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "check.h"
+#include "log.h"
+
+/* Names of the problem kinds in the report */
+static const char *check_kind_names[CHECK_KINDS] = {
+  "bad_bpb", "out_of_range", "cycle", "cross_link", "chain_short", "chain_long",
+  "bad_directory"
+};
+
+/* Problem listed in the report */
+typedef struct {
+  int Kind;
+  char *Path;
+  DWORD Cluster;
+} CHECK_PROBLEM;
+
+/* Directory waiting to be read, 0 as cluster for the root directory */
+typedef struct {
+  char *Path;
+  WORD Cluster;
+  DWORD Id;
+} CHECK_JOB;
+
+/* Directories queued by one thread: it pushes and pops at the tail, idle
+ * threads steal from the head */
+typedef struct {
+  pthread_mutex_t lock;
+  CHECK_JOB *Jobs;
+  DWORD Head;
+  DWORD Tail;
+  DWORD Cap;
+} CHECK_DEQUE;
+
+/* State of one check */
+typedef struct {
+  VOLUME *Vol;
+  WORD *Fat;
+  DWORD MaxCluster;
+  DWORD ClusterSize;
+  DWORD *Owner;
+  DWORD NextId;
+  CHECK_DEQUE *Deques;
+  int Threads;
+  DWORD Pending;
+  DWORD Files;
+  DWORD Dirs;
+  DWORD Used;
+  pthread_mutex_t lock;
+  CHECK_PROBLEM Listed[CHECK_MAX_LISTED];
+  DWORD ListedCnt;
+  DWORD Counts[CHECK_KINDS];
+} CHECK;
+
+/* One thread of the check */
+typedef struct {
+  CHECK *C;
+  int Self;
+  pthread_t tid;
+} CHECK_WORKER;
+
+static void check_problem(CHECK *C, int Kind, const char *Path, DWORD Cluster)
+{
+  pthread_mutex_lock(&C->lock);
+  C->Counts[Kind]++;
+  if (C->ListedCnt < CHECK_MAX_LISTED) {
+    CHECK_PROBLEM *P = &C->Listed[C->ListedCnt++];
+
+    P->Kind = Kind;
+    P->Path = strdup(Path);
+    P->Cluster = Cluster;
+
+    if (P->Path == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  pthread_mutex_unlock(&C->lock);
+}
+
+/**
+ * Follows the cluster chain of an entry and claims its clusters. A cluster
+ * the entry already claimed closes a cycle, one claimed by another entry is
+ * cross-linked; either way, and on a cluster out of the data region, the walk
+ * stops, so it never takes more steps than there are clusters.
+ * ============================================================================
+ * Return
+ * 0 for a sound chain, -1 if a problem was reported.
+ * ============================================================================
+ * Parameters
+ * @C: Check state.
+ * @First: First cluster of the chain.
+ * @Id: Number of the entry, unique in this check.
+ * @Path: Path of the entry, for the report.
+ * @Chain: Receives the clusters of the chain (NULL not to keep them).
+ * @Len: Receives the number of clusters claimed.
+**/
+static int chain_check(CHECK *C, WORD First, DWORD Id, const char *Path,
+                       WORD **Chain, DWORD *Len)
+{
+  DWORD ClusterN = First, n = 0, Cap = 0;
+  int res = 0;
+
+  if (Chain != NULL) {
+    *Chain = NULL;
+  }
+
+  for (;;) {
+    DWORD Prev = 0;
+
+    if (ClusterN < 2 || ClusterN > C->MaxCluster) {
+      check_problem(C, CHECK_OUT_OF_RANGE, Path, ClusterN);
+      res = -1;
+      break;
+    }
+    if (!__atomic_compare_exchange_n(&C->Owner[ClusterN], &Prev, Id, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      check_problem(C, Prev == Id ? CHECK_CYCLE : CHECK_CROSS_LINK, Path, ClusterN);
+      res = -1;
+      break;
+    }
+
+    if (Chain != NULL) {
+      if (n == Cap) {
+        Cap = Cap == 0 ? 16 : Cap * 2;
+        *Chain = realloc(*Chain, Cap * sizeof(WORD));
+
+        if (*Chain == NULL) {
+          log_msg("Out of memory!\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+      (*Chain)[n] = ClusterN;
+    }
+    n++;
+
+    if (C->Fat[ClusterN] >= 0xfff8) {
+      break;
+    }
+    ClusterN = C->Fat[ClusterN];
+  }
+
+  __atomic_add_fetch(&C->Used, n, __ATOMIC_RELAXED);
+  *Len = n;
+  return res;
+}
+
+static void deque_push(CHECK_DEQUE *D, CHECK_JOB *Job)
+{
+  pthread_mutex_lock(&D->lock);
+  /* Reuses the room left by stolen jobs before growing */
+  if (D->Tail == D->Cap && D->Head > 0) {
+    memmove(D->Jobs, D->Jobs + D->Head, (D->Tail - D->Head) * sizeof(CHECK_JOB));
+    D->Tail -= D->Head;
+    D->Head = 0;
+  }
+  if (D->Tail == D->Cap) {
+    D->Cap = D->Cap == 0 ? 64 : D->Cap * 2;
+    D->Jobs = realloc(D->Jobs, D->Cap * sizeof(CHECK_JOB));
+
+    if (D->Jobs == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  D->Jobs[D->Tail++] = *Job;
+  pthread_mutex_unlock(&D->lock);
+}
+
+/* Takes the newest job of a deque (Steal = 0) or the oldest one (Steal = 1).
+ * Returns 0 when the deque is empty */
+static int deque_take(CHECK_DEQUE *D, CHECK_JOB *Job, int Steal)
+{
+  int Found = 0;
+
+  pthread_mutex_lock(&D->lock);
+  if (D->Head < D->Tail) {
+    *Job = Steal ? D->Jobs[D->Head++] : D->Jobs[--D->Tail];
+    if (D->Head == D->Tail) {
+      D->Head = D->Tail = 0;
+    }
+    Found = 1;
+  }
+  pthread_mutex_unlock(&D->lock);
+  return Found;
+}
+
+/**
+ * Reads a directory and checks its entries: the chain of every file against
+ * its size, and every subdirectory, queued on the deque of this thread.
+ * ============================================================================
+ * Return
+ * There is no return in this function.
+ * ============================================================================
+ * Parameters
+ * @C: Check state.
+ * @Self: Index of the calling thread.
+ * @Job: Directory to check.
+**/
+static void check_dir(CHECK *C, int Self, CHECK_JOB *Job)
+{
+  VOLUME *Vol = C->Vol;
+  BYTE *Raw;
+  DWORD Size, Off, i;
+
+  if (Job->Cluster == 0) {
+    Size = Vol->Bpb.BPB_RootEntCnt * BYTES_PER_DIR;
+    Raw = malloc(Size);
+
+    if (Raw == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    if (sector_pread(Vol->fd, Raw, Size, (off_t) Vol->FirstRootDirSecNum *
+                     Vol->Bpb.BPB_BytsPerSec) != (ssize_t) Size) {
+      check_problem(C, CHECK_BAD_DIRECTORY, Job->Path, 0);
+      free(Raw);
+      return;
+    }
+  } else {
+    WORD *Chain;
+    DWORD Len;
+
+    /* What a broken chain still reaches is read, its entries count too */
+    chain_check(C, Job->Cluster, Job->Id, Job->Path, &Chain, &Len);
+    Size = Len * C->ClusterSize;
+    Raw = malloc(Size > 0 ? Size : 1);
+
+    if (Raw == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < Len; i++) {
+      if (sector_pread(Vol->fd, Raw + i * C->ClusterSize, C->ClusterSize,
+                       cluster_offset(Vol, Chain[i])) != (ssize_t) C->ClusterSize) {
+        check_problem(C, CHECK_BAD_DIRECTORY, Job->Path, Chain[i]);
+        Size = i * C->ClusterSize;
+        break;
+      }
+    }
+    free(Chain);
+  }
+
+  for (Off = 0; Off + BYTES_PER_DIR <= Size; Off += BYTES_PER_DIR) {
+    DIR_ENTRY *Entry = (DIR_ENTRY *) (Raw + Off);
+
+    if (Entry->DIR_Name[0] == 0x00) {
+      break;
+    }
+    if (Entry->DIR_Name[0] == 0xE5 || Entry->DIR_Name[0] == '.' ||
+        (Entry->DIR_Attr & ATTR_VOLUME_ID)) {
+      continue;
+    }
+
+    BYTE *Name = path_decode(Entry->DIR_Name);
+    char *Path = malloc(strlen(Job->Path) + strlen((char *) Name) + 2);
+    DWORD Id = __atomic_add_fetch(&C->NextId, 1, __ATOMIC_RELAXED);
+
+    if (Path == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    sprintf(Path, "%s%s%s", Job->Path, Job->Cluster == 0 ? "" : "/", Name);
+    free(Name);
+
+    if (Entry->DIR_Attr & ATTR_DIRECTORY) {
+      __atomic_add_fetch(&C->Dirs, 1, __ATOMIC_RELAXED);
+
+      if (Entry->DIR_FstClusLO == 0) {
+        check_problem(C, CHECK_BAD_DIRECTORY, Path, 0);
+        free(Path);
+        continue;
+      }
+
+      /* The path now belongs to the job */
+      CHECK_JOB Sub = { Path, Entry->DIR_FstClusLO, Id };
+
+      __atomic_add_fetch(&C->Pending, 1, __ATOMIC_RELAXED);
+      deque_push(&C->Deques[Self], &Sub);
+      continue;
+    }
+
+    /* A file owns as many clusters as its size needs, no more */
+    DWORD Need = (Entry->DIR_FileSize + C->ClusterSize - 1) / C->ClusterSize;
+    DWORD Len = 0;
+
+    __atomic_add_fetch(&C->Files, 1, __ATOMIC_RELAXED);
+    if (Entry->DIR_FstClusLO == 0) {
+      if (Need > 0) {
+        check_problem(C, CHECK_CHAIN_SHORT, Path, 0);
+      }
+    } else if (chain_check(C, Entry->DIR_FstClusLO, Id, Path, NULL, &Len) == 0) {
+      if (Len < Need) {
+        check_problem(C, CHECK_CHAIN_SHORT, Path, Entry->DIR_FstClusLO);
+      } else if (Len > Need) {
+        check_problem(C, CHECK_CHAIN_LONG, Path, Entry->DIR_FstClusLO);
+      }
+    }
+    free(Path);
+  }
+
+  free(Raw);
+}
+
+/* Checks the directories of its own deque, then steals from the others, until
+ * no directory is left anywhere */
+static void *check_worker(void *arg)
+{
+  CHECK_WORKER *W = arg;
+  CHECK *C = W->C;
+  CHECK_JOB Job;
+  int i;
+
+  for (;;) {
+    int Found = deque_take(&C->Deques[W->Self], &Job, 0);
+
+    for (i = 1; !Found && i < C->Threads; i++) {
+      Found = deque_take(&C->Deques[(W->Self + i) % C->Threads], &Job, 1);
+    }
+
+    if (Found) {
+      check_dir(C, W->Self, &Job);
+      free(Job.Path);
+      __atomic_sub_fetch(&C->Pending, 1, __ATOMIC_RELEASE);
+    } else if (__atomic_load_n(&C->Pending, __ATOMIC_ACQUIRE) == 0) {
+      return NULL;
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+/* Whether the BPB describes a volume the image can hold */
+static int check_bpb(VOLUME *Vol)
+{
+  BPB_BS *Bpb = &Vol->Bpb;
+  DWORD TotSec = Bpb->BPB_TotSec16 != 0 ? Bpb->BPB_TotSec16 : Bpb->BPB_TotSec32;
+  struct stat st;
+
+  if (Bpb->BPB_BytsPerSec < 512 || Bpb->BPB_BytsPerSec > 4096 ||
+      (Bpb->BPB_BytsPerSec & (Bpb->BPB_BytsPerSec - 1)) != 0) {
+    return -1;
+  }
+  if (Bpb->BPB_SecPerClus == 0 || (Bpb->BPB_SecPerClus & (Bpb->BPB_SecPerClus - 1)) != 0) {
+    return -1;
+  }
+  if (Bpb->BPB_RsvdSecCnt == 0 || Bpb->BPB_NumFATS == 0 || Bpb->BPB_FATSz16 == 0 ||
+      Bpb->BPB_RootEntCnt == 0 || TotSec <= Vol->FirstDataSector) {
+    return -1;
+  }
+  if (fstat(fileno(Vol->fd), &st) != 0 ||
+      st.st_size < (off_t) TotSec * Bpb->BPB_BytsPerSec) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Writes a string as a JSON string */
+static void json_string(FILE *Report, const char *s)
+{
+  fputc('"', Report);
+  for (; *s != '\0'; s++) {
+    unsigned char c = *s;
+
+    if (c == '"' || c == '\\') {
+      fprintf(Report, "\\%c", c);
+    } else if (c < 0x20 || c >= 0x7f) {
+      fprintf(Report, "\\u%04x", c);
+    } else {
+      fputc(c, Report);
+    }
+  }
+  fputc('"', Report);
+}
+
+/* Orders listed problems by path, then kind */
+static int problem_cmp(const void *a, const void *b)
+{
+  const CHECK_PROBLEM *A = a, *B = b;
+  int d = strcmp(A->Path, B->Path);
+
+  if (d != 0) {
+    return d;
+  }
+  return A->Kind - B->Kind;
+}
+
+/**
+ * Checks a volume before it is trusted: the BPB against the image, then every
+ * cluster chain reached from the directory tree for cycles, cross-links,
+ * clusters out of the data region and lengths that do not match the file
+ * size. The FAT is loaded once; directories are shared between the threads
+ * through per-thread deques, idle threads stealing the oldest directories of
+ * the others, so a deep or wide subtree does not hold back the rest.
+ * ============================================================================
+ * Return
+ * Number of problems found, 0 when the volume is consistent.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @threads: Number of threads, the calling one included.
+ * @Report: Stream the JSON report is written to, NULL for none.
+**/
+int check_volume(VOLUME *Vol, int threads, FILE *Report)
+{
+  CHECK *C = calloc(1, sizeof(CHECK));
+  CHECK_WORKER *Workers;
+  struct timespec Start, End;
+  DWORD c, i, Lost = 0, Bad = 0, Problems = 0;
+  int Started;
+
+  if (C == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &Start);
+  C->Vol = Vol;
+  C->Threads = threads > 0 ? threads : 1;
+  pthread_mutex_init(&C->lock, NULL);
+
+  /* The FAT, in one read */
+  if (check_bpb(Vol) == 0) {
+    size_t FatSize = (size_t) Vol->Bpb.BPB_FATSz16 * Vol->Bpb.BPB_BytsPerSec;
+
+    C->Fat = malloc(FatSize);
+    if (C->Fat == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    if (sector_pread(Vol->fd, C->Fat, FatSize, (off_t) Vol->Bpb.BPB_RsvdSecCnt *
+                     Vol->Bpb.BPB_BytsPerSec) != (ssize_t) FatSize) {
+      free(C->Fat);
+      C->Fat = NULL;
+    }
+  }
+
+  if (C->Fat == NULL) {
+    check_problem(C, CHECK_BAD_BPB, "/", 0);
+  } else {
+    C->MaxCluster = fat_max_cluster(Vol);
+    C->ClusterSize = Vol->Geo.ClusterSize;
+    C->Owner = calloc(C->MaxCluster + 1, sizeof(DWORD));
+    C->Deques = calloc(C->Threads, sizeof(CHECK_DEQUE));
+    Workers = calloc(C->Threads, sizeof(CHECK_WORKER));
+
+    if (C->Owner == NULL || C->Deques == NULL || Workers == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    /* The root directory starts on the deque of the calling thread */
+    CHECK_JOB Root = { strdup("/"), 0, 0 };
+
+    if (Root.Path == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < (DWORD) C->Threads; i++) {
+      pthread_mutex_init(&C->Deques[i].lock, NULL);
+      Workers[i].C = C;
+      Workers[i].Self = i;
+    }
+    C->Pending = 1;
+    deque_push(&C->Deques[0], &Root);
+
+    for (Started = 1; Started < C->Threads; Started++) {
+      if (pthread_create(&Workers[Started].tid, NULL, check_worker, &Workers[Started]) != 0) {
+        break;
+      }
+    }
+    check_worker(&Workers[0]);
+    for (i = 1; i < (DWORD) Started; i++) {
+      pthread_join(Workers[i].tid, NULL);
+    }
+
+    /* Allocated clusters no entry reaches, and bad clusters */
+    for (c = 2; c <= C->MaxCluster; c++) {
+      if (C->Fat[c] == 0xfff7) {
+        Bad++;
+      } else if (C->Fat[c] != 0 && C->Owner[c] == 0) {
+        Lost++;
+      }
+    }
+
+    for (i = 0; i < (DWORD) C->Threads; i++) {
+      pthread_mutex_destroy(&C->Deques[i].lock);
+      free(C->Deques[i].Jobs);
+    }
+    free(C->Deques);
+    free(Workers);
+    free(C->Owner);
+    free(C->Fat);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &End);
+  for (i = 0; i < CHECK_KINDS; i++) {
+    Problems += C->Counts[i];
+  }
+
+  if (Report != NULL) {
+    qsort(C->Listed, C->ListedCnt, sizeof(CHECK_PROBLEM), problem_cmp);
+
+    fprintf(Report, "{\n  \"clusters\": %u,\n  \"cluster_size\": %u,\n",
+            C->MaxCluster > 1 ? C->MaxCluster - 1 : 0, C->ClusterSize);
+    fprintf(Report, "  \"files\": %u,\n  \"directories\": %u,\n", C->Files, C->Dirs);
+    fprintf(Report, "  \"used_clusters\": %u,\n  \"lost_clusters\": %u,\n"
+            "  \"bad_clusters\": %u,\n", C->Used, Lost, Bad);
+    fprintf(Report, "  \"threads\": %d,\n  \"elapsed_ms\": %.3f,\n", C->Threads,
+            (End.tv_sec - Start.tv_sec) * 1e3 + (End.tv_nsec - Start.tv_nsec) / 1e6);
+    fprintf(Report, "  \"problems\": %u,\n  \"counts\": {", Problems);
+    for (i = 0; i < CHECK_KINDS; i++) {
+      fprintf(Report, "%s\"%s\": %u", i > 0 ? ", " : "", check_kind_names[i], C->Counts[i]);
+    }
+    fprintf(Report, "},\n  \"listed\": [");
+    for (i = 0; i < C->ListedCnt; i++) {
+      fprintf(Report, "%s\n    {\"kind\": \"%s\", \"path\": ", i > 0 ? "," : "",
+              check_kind_names[C->Listed[i].Kind]);
+      json_string(Report, C->Listed[i].Path);
+      fprintf(Report, ", \"cluster\": %u}", C->Listed[i].Cluster);
+    }
+    fprintf(Report, "%s]\n}\n", C->ListedCnt > 0 ? "\n  " : "");
+  }
+
+  for (i = 0; i < C->ListedCnt; i++) {
+    free(C->Listed[i].Path);
+  }
+  pthread_mutex_destroy(&C->lock);
+  free(C);
+  return Problems;
+}
@@ -0,0 +1,29 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+#include "fat16.h"
+
+/* Default number of threads walking the directory tree */
+#define CHECK_THREADS 4
+
+/* Most problems listed one by one in the report, the rest are only counted */
+#define CHECK_MAX_LISTED 1000
+
+/* Kinds of problems the checker finds */
+#define CHECK_BAD_BPB 0
+#define CHECK_OUT_OF_RANGE 1
+#define CHECK_CYCLE 2
+#define CHECK_CROSS_LINK 3
+#define CHECK_CHAIN_SHORT 4
+#define CHECK_CHAIN_LONG 5
+#define CHECK_BAD_DIRECTORY 6
+#define CHECK_KINDS 7
+
+/* Checks the cluster chains and the directory tree of the volume with
+ * 'threads' threads and writes a JSON report to 'Report' (none when NULL).
+ * Returns the number of problems found, 0 for a consistent volume */
+int check_volume(VOLUME *Vol, int threads, FILE *Report);
+
+#endif
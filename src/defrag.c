@@ -0,0 +1,667 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "defrag.h"
+#include "log.h"
+
+/* File or directory of the volume and the clusters it owns */
+typedef struct {
+  char *Path;
+  DIR_ENTRY Dir;
+  DWORD Parent;
+  DWORD EntryOff;
+  WORD *Chain;
+  DWORD ChainLen;
+  DWORD Fragments;
+  BYTE *Raw;
+  DWORD RawSize;
+  WORD *NewChain;
+  WORD NewFirst;
+  DWORD Alias;
+} DEFRAG_NODE;
+
+/* The whole volume as the defragmenter sees it */
+typedef struct {
+  VOLUME *Vol;
+  WORD *Fat;
+  DWORD FatEntries;
+  DWORD MaxCluster;
+  DWORD ClusterSize;
+  DEFRAG_NODE *Nodes;
+  DWORD NodeCnt;
+  DWORD NodeCap;
+  DWORD *WalkedBy;
+  DWORD *Order;
+  DWORD OrderCnt;
+  DWORD Broken;
+} DEFRAG;
+
+/* Directory entry at a byte offset of directory contents */
+#define RAW_ENTRY(Raw, Off) ((DIR_ENTRY *) ((Raw) + (Off)))
+
+/* Reads all of a byte range of the image, NULL on a short read */
+static BYTE *read_range_alloc(VOLUME *Vol, off_t Offset, size_t Size)
+{
+  BYTE *Buffer = malloc(Size > 0 ? Size : 1);
+
+  if (Buffer == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  if (sector_pread(Vol->fd, Buffer, Size, Offset) != (ssize_t) Size) {
+    free(Buffer);
+    return NULL;
+  }
+  return Buffer;
+}
+
+/**
+ * Follows a cluster chain in the FAT. The walk stops at the end of chain
+ * mark, at a free, bad or out of range cluster, or after Limit clusters, so
+ * a cyclic chain cannot keep it going.
+ * ============================================================================
+ * Return
+ * The clusters of the chain, in order (NULL when empty).
+ * ============================================================================
+ * Parameters
+ * @T: Defragmenter state, with the FAT loaded.
+ * @First: First cluster of the chain.
+ * @Limit: Most clusters to follow.
+ * @Len: Receives the number of clusters.
+ * @Fragments: Receives the number of contiguous runs of the chain.
+**/
+static WORD *chain_walk(DEFRAG *T, WORD First, DWORD Limit, DWORD *Len, DWORD *Fragments)
+{
+  DWORD Cap = 16, n = 0, f = 0;
+  WORD *Chain = malloc(Cap * sizeof(WORD));
+  DWORD ClusterN = First;
+
+  if (Chain == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  while (n < Limit && ClusterN >= 2 && ClusterN <= T->MaxCluster) {
+    if (n == Cap) {
+      Cap *= 2;
+      Chain = realloc(Chain, Cap * sizeof(WORD));
+
+      if (Chain == NULL) {
+        log_msg("Out of memory!\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (n == 0 || Chain[n - 1] + 1 != ClusterN) {
+      f++;
+    }
+    Chain[n++] = ClusterN;
+    if (T->Fat[ClusterN] >= 0xfff8) {
+      break;
+    }
+    ClusterN = T->Fat[ClusterN];
+  }
+
+  *Len = n;
+  *Fragments = f;
+  if (n == 0) {
+    free(Chain);
+    return NULL;
+  }
+  return Chain;
+}
+
+static DWORD node_add(DEFRAG *T)
+{
+  if (T->NodeCnt == T->NodeCap) {
+    T->NodeCap *= 2;
+    T->Nodes = realloc(T->Nodes, T->NodeCap * sizeof(DEFRAG_NODE));
+    T->Order = realloc(T->Order, T->NodeCap * sizeof(DWORD));
+
+    if (T->Nodes == NULL || T->Order == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memset(&T->Nodes[T->NodeCnt], 0, sizeof(DEFRAG_NODE));
+  return T->NodeCnt++;
+}
+
+/**
+ * Reads a directory, adds its entries and walks its subdirectories depth
+ * first. Order receives the directory, then its files, then what its
+ * subdirectories add: the layout the defragmented image gets.
+ * ============================================================================
+ * Return
+ * There is no return in this function.
+ * ============================================================================
+ * Parameters
+ * @T: Defragmenter state.
+ * @d: Index of the directory node, 0 for the root directory.
+**/
+static void walk_dir(DEFRAG *T, DWORD d)
+{
+  VOLUME *Vol = T->Vol;
+  DWORD Off, First, i;
+
+  if (d == 0) {
+    T->Nodes[0].RawSize = Vol->Bpb.BPB_RootEntCnt * BYTES_PER_DIR;
+    T->Nodes[0].Raw = read_range_alloc(Vol, (off_t) Vol->FirstRootDirSecNum *
+                                       Vol->Bpb.BPB_BytsPerSec, T->Nodes[0].RawSize);
+  } else {
+    DEFRAG_NODE *D = &T->Nodes[d];
+
+    D->Chain = chain_walk(T, D->Dir.DIR_FstClusLO, T->MaxCluster, &D->ChainLen, &D->Fragments);
+    D->RawSize = D->ChainLen * T->ClusterSize;
+    D->Raw = malloc(D->RawSize > 0 ? D->RawSize : 1);
+
+    if (D->Raw == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < D->ChainLen; i++) {
+      if (sector_pread(Vol->fd, D->Raw + i * T->ClusterSize, T->ClusterSize,
+                       cluster_offset(T->Vol, D->Chain[i])) != (ssize_t) T->ClusterSize) {
+        memset(D->Raw + i * T->ClusterSize, 0, T->ClusterSize);
+        T->Broken++;
+      }
+    }
+    T->Order[T->OrderCnt++] = d;
+  }
+
+  if (T->Nodes[d].Raw == NULL) {
+    T->Nodes[d].RawSize = 0;
+    T->Broken++;
+    return;
+  }
+
+  /* Every used entry that owns clusters, long name and volume label entries
+   * do not */
+  First = T->NodeCnt;
+  for (Off = 0; Off + BYTES_PER_DIR <= T->Nodes[d].RawSize; Off += BYTES_PER_DIR) {
+    DIR_ENTRY *Entry = RAW_ENTRY(T->Nodes[d].Raw, Off);
+    DWORD c = 0;
+
+    if (Entry->DIR_Name[0] == 0x00) {
+      break;
+    }
+    if (Entry->DIR_Name[0] == 0xE5 || Entry->DIR_Name[0] == '.' ||
+        (Entry->DIR_Attr & ATTR_VOLUME_ID)) {
+      continue;
+    }
+
+    c = node_add(T);
+    DEFRAG_NODE *Node = &T->Nodes[c];
+    char *ParentPath = T->Nodes[d].Path;
+    BYTE *Name = path_decode(Entry->DIR_Name);
+
+    Node->Dir = *Entry;
+    Node->Parent = d;
+    Node->EntryOff = Off;
+    Node->Path = malloc(strlen(ParentPath) + strlen((char *) Name) + 2);
+
+    if (Node->Path == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    sprintf(Node->Path, "%s%s%s", ParentPath, d == 0 ? "" : "/", Name);
+    free(Name);
+
+    /* A file owns as many clusters as its size needs */
+    if (!(Entry->DIR_Attr & ATTR_DIRECTORY)) {
+      DWORD Need = (Entry->DIR_FileSize + T->ClusterSize - 1) / T->ClusterSize;
+
+      Node->Chain = chain_walk(T, Entry->DIR_FstClusLO, Need, &Node->ChainLen,
+                               &Node->Fragments);
+      if (Node->ChainLen < Need) {
+        log_msg("%s: cluster chain shorter than the file\n", Node->Path);
+        T->Broken++;
+      }
+      T->Order[T->OrderCnt++] = c;
+    }
+  }
+
+  for (i = First; i < T->NodeCnt; i++) {
+    WORD ClusterN = T->Nodes[i].Dir.DIR_FstClusLO;
+
+    if (T->Nodes[i].Parent != d || !(T->Nodes[i].Dir.DIR_Attr & ATTR_DIRECTORY)) {
+      continue;
+    }
+
+    /* Reached twice: the entries share the clusters of the first one */
+    if (ClusterN >= 2 && ClusterN <= T->MaxCluster && T->WalkedBy[ClusterN] != 0) {
+      log_msg("%s: directory already reached as %s\n", T->Nodes[i].Path,
+              T->Nodes[T->WalkedBy[ClusterN]].Path);
+      T->Nodes[i].Alias = T->WalkedBy[ClusterN];
+      continue;
+    }
+    if (ClusterN >= 2 && ClusterN <= T->MaxCluster) {
+      T->WalkedBy[ClusterN] = i;
+    }
+    walk_dir(T, i);
+  }
+}
+
+/**
+ * Loads the FAT and walks the directory tree.
+ * ============================================================================
+ * Return
+ * 0 on success, -1 if the FAT or the root directory could not be read.
+ * ============================================================================
+ * Parameters
+ * @T: Defragmenter state to fill.
+ * @Vol: Structure that contains essential data about the File System.
+**/
+static int defrag_load(DEFRAG *T, VOLUME *Vol)
+{
+  BPB_BS *Bpb = &Vol->Bpb;
+
+  memset(T, 0, sizeof(DEFRAG));
+  T->Vol = Vol;
+  T->ClusterSize = Vol->Geo.ClusterSize;
+  T->FatEntries = Bpb->BPB_FATSz16 * Bpb->BPB_BytsPerSec / 2;
+  T->Fat = (WORD *) read_range_alloc(Vol, (off_t) Bpb->BPB_RsvdSecCnt * Bpb->BPB_BytsPerSec,
+                                     T->FatEntries * 2);
+  if (T->Fat == NULL) {
+    return -1;
+  }
+
+  T->MaxCluster = fat_max_cluster(Vol);
+
+  T->NodeCap = 1024;
+  T->Nodes = malloc(T->NodeCap * sizeof(DEFRAG_NODE));
+  T->Order = malloc(T->NodeCap * sizeof(DWORD));
+  T->WalkedBy = calloc(65536, sizeof(DWORD));
+
+  if (T->Nodes == NULL || T->Order == NULL || T->WalkedBy == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* The root directory */
+  node_add(T);
+  T->Nodes[0].Path = strdup("/");
+  T->Nodes[0].Dir.DIR_Attr = ATTR_DIRECTORY;
+  walk_dir(T, 0);
+
+  return T->Nodes[0].Raw == NULL ? -1 : 0;
+}
+
+static void defrag_free(DEFRAG *T)
+{
+  DWORD i;
+
+  for (i = 0; i < T->NodeCnt; i++) {
+    free(T->Nodes[i].Path);
+    free(T->Nodes[i].Chain);
+    free(T->Nodes[i].NewChain);
+    free(T->Nodes[i].Raw);
+  }
+  free(T->Nodes);
+  free(T->Order);
+  free(T->WalkedBy);
+  free(T->Fat);
+}
+
+/**
+ * Reports the fragments and clusters of every file and directory, the free
+ * space and a volume-wide fragmentation score: the share of the steps from
+ * one cluster of a chain to the next that jump elsewhere on the image
+ * (0% when every chain is contiguous, 100% when no two clusters are).
+ * ============================================================================
+ * Return
+ * 0 on success, -1 if the volume could not be read.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Report: Stream the report is written to.
+**/
+int defrag_analyze(VOLUME *Vol, FILE *Report)
+{
+  DEFRAG T;
+  DWORD i, c, Run = 0, LargestRun = 0, Free = 0, Bad = 0;
+  DWORD Files = 0, Dirs = 0, Fragmented = 0;
+  uint64_t Steps = 0, Jumps = 0;
+
+  if (defrag_load(&T, Vol) != 0) {
+    defrag_free(&T);
+    return -1;
+  }
+
+  fprintf(Report, "%9s %9s  %s\n", "FRAGMENTS", "CLUSTERS", "PATH");
+  for (i = 1; i < T.NodeCnt; i++) {
+    DEFRAG_NODE *Node = &T.Nodes[i];
+    int IsDir = (Node->Dir.DIR_Attr & ATTR_DIRECTORY) != 0;
+
+    fprintf(Report, "%9u %9u  %s%s\n", Node->Fragments, Node->ChainLen, Node->Path,
+            IsDir ? "/" : "");
+    if (IsDir) {
+      Dirs++;
+    } else {
+      Files++;
+    }
+    if (Node->Fragments > 1) {
+      Fragmented++;
+    }
+    if (Node->ChainLen > 0) {
+      Steps += Node->ChainLen - 1;
+      Jumps += Node->Fragments - 1;
+    }
+  }
+
+  /* Free space, in runs of free clusters */
+  for (c = 2; c <= T.MaxCluster; c++) {
+    if (T.Fat[c] == 0) {
+      Free++;
+      if (++Run > LargestRun) {
+        LargestRun = Run;
+      }
+    } else {
+      if (T.Fat[c] == 0xfff7) {
+        Bad++;
+      }
+      Run = 0;
+    }
+  }
+
+  fprintf(Report, "\nFiles: %u (%u fragmented), directories: %u\n", Files, Fragmented, Dirs);
+  fprintf(Report, "Clusters: %u of %u bytes, %u free, %u bad, largest free run %u\n",
+          T.MaxCluster - 1, T.ClusterSize, Free, Bad, LargestRun);
+  fprintf(Report, "Fragmentation score: %.1f%%\n",
+          Steps > 0 ? 100.0 * Jumps / Steps : 0.0);
+  if (T.Broken > 0) {
+    fprintf(Report, "Damaged chains or directories: %u\n", T.Broken);
+  }
+
+  defrag_free(&T);
+  return 0;
+}
+
+/* Writes all of a buffer at an offset of a file */
+static int write_all(int fd, const void *Data, size_t Size, off_t Offset)
+{
+  while (Size > 0) {
+    ssize_t Result = pwrite(fd, Data, Size, Offset);
+
+    if (Result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    Data = (const char *) Data + Result;
+    Offset += Result;
+    Size -= Result;
+  }
+  return 0;
+}
+
+/**
+ * Copies the clusters of a file to their new place, merging the clusters that
+ * are contiguous both in the old and in the new chain into one copy.
+ * ============================================================================
+ * Return
+ * 0 on success, -1 on a read or write error.
+ * ============================================================================
+ * Parameters
+ * @T: Defragmenter state, with the node allocated.
+ * @Node: The file.
+ * @out: Output image.
+ * @Buffer: Buffer of DEFRAG_COPY_SIZE bytes (or one cluster if larger).
+**/
+static int copy_file(DEFRAG *T, DEFRAG_NODE *Node, int out, BYTE *Buffer)
+{
+  DWORD PerCopy = DEFRAG_COPY_SIZE / T->ClusterSize;
+  DWORD i = 0, j;
+
+  if (PerCopy == 0) {
+    PerCopy = 1;
+  }
+
+  while (i < Node->ChainLen) {
+    for (j = i + 1; j < Node->ChainLen && j - i < PerCopy &&
+         Node->Chain[j] == Node->Chain[j - 1] + 1 &&
+         Node->NewChain[j] == Node->NewChain[j - 1] + 1; j++) {
+    }
+
+    size_t Size = (size_t) (j - i) * T->ClusterSize;
+
+    if (sector_pread(T->Vol->fd, Buffer, Size, cluster_offset(T->Vol, Node->Chain[i])) != (ssize_t) Size ||
+        write_all(out, Buffer, Size, cluster_offset(T->Vol, Node->NewChain[i])) != 0) {
+      return -1;
+    }
+    i = j;
+  }
+  return 0;
+}
+
+/**
+ * Gives every chain its new clusters, in traversal order, and links them in
+ * the new FAT. Entries that share a directory share its new chain.
+ * ============================================================================
+ * Return
+ * 0 on success, -1 if the chains do not fit in the volume.
+ * ============================================================================
+ * Parameters
+ * @T: Defragmenter state, with the tree walked.
+ * @NewFat: New FAT, holding only the reserved entries and the bad clusters.
+ * @Used: Receives the number of clusters given out.
+**/
+static int allocate(DEFRAG *T, WORD *NewFat, DWORD *Used)
+{
+  DWORD i, k, Next = 2;
+
+  for (k = 0; k < T->OrderCnt; k++) {
+    DEFRAG_NODE *Node = &T->Nodes[T->Order[k]];
+
+    if (Node->ChainLen == 0) {
+      continue;
+    }
+    Node->NewChain = malloc(Node->ChainLen * sizeof(WORD));
+
+    if (Node->NewChain == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < Node->ChainLen; i++) {
+      while (Next <= T->MaxCluster && NewFat[Next] == 0xfff7) {
+        Next++;
+      }
+      if (Next > T->MaxCluster) {
+        log_msg("The files do not fit in the volume (cross-linked chains?)\n");
+        return -1;
+      }
+      Node->NewChain[i] = Next++;
+      if (i > 0) {
+        NewFat[Node->NewChain[i - 1]] = Node->NewChain[i];
+      }
+    }
+    NewFat[Node->NewChain[Node->ChainLen - 1]] = 0xffff;
+    Node->NewFirst = Node->NewChain[0];
+  }
+
+  for (i = 1; i < T->NodeCnt; i++) {
+    if (T->Nodes[i].Alias != 0) {
+      T->Nodes[i].NewFirst = T->Nodes[T->Nodes[i].Alias].NewFirst;
+    }
+  }
+  *Used = Next - 2;
+  return 0;
+}
+
+/* Points the entries of every directory, '.' and '..' included, to the new
+ * chains */
+static void relink(DEFRAG *T)
+{
+  DWORD i, Off;
+
+  for (i = 1; i < T->NodeCnt; i++) {
+    DEFRAG_NODE *Node = &T->Nodes[i];
+    DEFRAG_NODE *Parent = &T->Nodes[Node->Parent];
+
+    RAW_ENTRY(Parent->Raw, Node->EntryOff)->DIR_FstClusLO = Node->NewFirst;
+
+    if (!(Node->Dir.DIR_Attr & ATTR_DIRECTORY) || Node->Raw == NULL) {
+      continue;
+    }
+    for (Off = 0; Off + BYTES_PER_DIR <= Node->RawSize; Off += BYTES_PER_DIR) {
+      DIR_ENTRY *Entry = RAW_ENTRY(Node->Raw, Off);
+
+      if (Entry->DIR_Name[0] == 0x00) {
+        break;
+      }
+      if (memcmp(Entry->DIR_Name, ".          ", 11) == 0) {
+        Entry->DIR_FstClusLO = Node->NewFirst;
+      } else if (memcmp(Entry->DIR_Name, "..         ", 11) == 0) {
+        Entry->DIR_FstClusLO = Node->Parent == 0 ? 0 : Parent->NewFirst;
+      }
+    }
+  }
+}
+
+/**
+ * Writes the defragmented volume: reserved sectors, every FAT copy, the root
+ * directory, then the chains in their new places.
+ * ============================================================================
+ * Return
+ * 0 on success, -1 on a read or write error.
+ * ============================================================================
+ * Parameters
+ * @T: Defragmenter state, allocated and relinked.
+ * @NewFat: New FAT.
+ * @out: Output image, already sized like the source.
+**/
+static int write_image(DEFRAG *T, WORD *NewFat, int out)
+{
+  VOLUME *Vol = T->Vol;
+  BPB_BS *Bpb = &Vol->Bpb;
+  size_t Reserved = (size_t) Bpb->BPB_RsvdSecCnt * Bpb->BPB_BytsPerSec;
+  BYTE *Buffer;
+  DWORD i, k;
+
+  /* Reserved sectors (boot sector and BPB) as they are */
+  Buffer = read_range_alloc(Vol, 0, Reserved);
+  if (Buffer == NULL || write_all(out, Buffer, Reserved, 0) != 0) {
+    free(Buffer);
+    return -1;
+  }
+  free(Buffer);
+
+  for (i = 0; i < Bpb->BPB_NumFATS; i++) {
+    if (write_all(out, NewFat, T->FatEntries * sizeof(WORD),
+                  (off_t) (Bpb->BPB_RsvdSecCnt + i * Bpb->BPB_FATSz16) *
+                  Bpb->BPB_BytsPerSec) != 0) {
+      return -1;
+    }
+  }
+
+  if (write_all(out, T->Nodes[0].Raw, T->Nodes[0].RawSize,
+                (off_t) Vol->FirstRootDirSecNum * Bpb->BPB_BytsPerSec) != 0) {
+    return -1;
+  }
+
+  Buffer = malloc(T->ClusterSize > DEFRAG_COPY_SIZE ? T->ClusterSize : DEFRAG_COPY_SIZE);
+
+  if (Buffer == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (k = 0; k < T->OrderCnt; k++) {
+    DEFRAG_NODE *Node = &T->Nodes[T->Order[k]];
+    int Failed = 0;
+
+    if (Node->Dir.DIR_Attr & ATTR_DIRECTORY) {
+      /* Directory contents with the rewritten entries */
+      for (i = 0; i < Node->ChainLen && !Failed; i++) {
+        Failed = write_all(out, Node->Raw + i * T->ClusterSize, T->ClusterSize,
+                           cluster_offset(T->Vol, Node->NewChain[i])) != 0;
+      }
+    } else if (Node->ChainLen > 0) {
+      Failed = copy_file(T, Node, out, Buffer) != 0;
+    }
+    if (Failed) {
+      log_msg("%s: could not copy\n", Node->Path);
+      free(Buffer);
+      return -1;
+    }
+  }
+
+  free(Buffer);
+  return 0;
+}
+
+/**
+ * Writes a defragmented copy of the volume. Every directory, followed by its
+ * files, then its subdirectories, gets contiguous clusters from the start of
+ * the data region; both FAT copies, the first cluster of every entry and the
+ * '.' and '..' entries are rewritten to match. Clusters no entry owns are
+ * left free in the copy and bad clusters stay where they are.
+ * ============================================================================
+ * Return
+ * 0 on success, -1 if the copy could not be written.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @OutPath: Path of the image to write, must not be the source image.
+**/
+int defrag_write(VOLUME *Vol, const char *OutPath)
+{
+  DEFRAG T;
+  struct stat In, Out;
+  DWORD i, Used;
+  int out, res = -1;
+
+  if (defrag_load(&T, Vol) != 0) {
+    log_msg("Could not read the FAT or the root directory\n");
+    defrag_free(&T);
+    return -1;
+  }
+
+  /* New FAT: media and end marks, and the bad clusters, stay as they are */
+  WORD *NewFat = calloc(T.FatEntries, sizeof(WORD));
+
+  if (NewFat == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  NewFat[0] = T.Fat[0];
+  NewFat[1] = T.Fat[1];
+  for (i = 2; i <= T.MaxCluster; i++) {
+    if (T.Fat[i] == 0xfff7) {
+      NewFat[i] = 0xfff7;
+    }
+  }
+
+  if (allocate(&T, NewFat, &Used) != 0) {
+    free(NewFat);
+    defrag_free(&T);
+    return -1;
+  }
+  relink(&T);
+
+  /* Writing the copy, never over the source */
+  out = open(OutPath, O_WRONLY | O_CREAT, 0644);
+  if (out < 0) {
+    log_msg("%s: %s\n", OutPath, strerror(errno));
+  } else if (fstat(fileno(Vol->fd), &In) != 0 || fstat(out, &Out) != 0 ||
+             (In.st_dev == Out.st_dev && In.st_ino == Out.st_ino)) {
+    log_msg("%s: cannot write over the source image\n", OutPath);
+  } else if (ftruncate(out, 0) != 0 || ftruncate(out, In.st_size) != 0 ||
+             write_image(&T, NewFat, out) != 0 || fsync(out) != 0) {
+    log_msg("%s: could not write the image\n", OutPath);
+  } else {
+    log_msg("Wrote %s: %u entries in %u clusters\n", OutPath, T.NodeCnt - 1, Used);
+    res = 0;
+  }
+  if (out >= 0) {
+    close(out);
+  }
+
+  free(NewFat);
+  defrag_free(&T);
+  return res;
+}
@@ -0,0 +1,15 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include <stdio.h>
+
+#include "fat16.h"
+
+/* Largest single copy (bytes) while writing a defragmented image */
+#define DEFRAG_COPY_SIZE (1024 * 1024)
+
+/* Prototypes (documentation in the functions definitions) */
+int defrag_analyze(VOLUME *Vol, FILE *Report);
+int defrag_write(VOLUME *Vol, const char *OutPath);
+
+#endif
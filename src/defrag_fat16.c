@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "defrag.h"
+#include "fat16.h"
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2 && argc != 3) {
+    printf("Usage: ./defrag_fat16 <FAT16 image> [<output image>]\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Initializing a FAT16 volume */
+  VOLUME *Vol = pre_init_fat16(argv[1]);
+
+  if (argc == 2) {
+    if (defrag_analyze(Vol, stdout) != 0) {
+      printf("%s: could not read the volume\n", argv[1]);
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    if (defrag_write(Vol, argv[2]) != 0) {
+      printf("%s: could not write the defragmented image\n", argv[2]);
+      exit(EXIT_FAILURE);
+    }
+    volume_close(Vol);
+
+    /* Analyzing the result */
+    Vol = pre_init_fat16(argv[2]);
+    if (defrag_analyze(Vol, stdout) != 0) {
+      printf("%s: could not read the volume\n", argv[2]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  volume_close(Vol);
+  return 0;
+}
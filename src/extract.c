@@ -0,0 +1,832 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "extract.h"
+#include "log.h"
+
+/* File or directory found while walking the image */
+typedef struct {
+  char *Path;
+  DIR_ENTRY Dir;
+  off_t Size;
+  off_t Written;
+  DWORD FirstRun;
+  DWORD RunCnt;
+} EXTRACT_NODE;
+
+/* Physically contiguous piece of one file */
+typedef struct {
+  off_t ImageOffset;
+  size_t Length;
+  DWORD Node;
+  off_t FileOffset;
+} EXTRACT_RUN;
+
+/* One read of the image and the runs it holds */
+typedef struct EXTRACT_CHUNK {
+  char *Data;
+  off_t ImageOffset;
+  size_t Size;
+  DWORD FirstRun;
+  DWORD RunCnt;
+  struct EXTRACT_CHUNK *next;
+} EXTRACT_CHUNK;
+
+/* Chunks handed from one side of the pipeline to the other */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  EXTRACT_CHUNK *head, *tail;
+  int closed;
+} CHUNK_QUEUE;
+
+/* State of one extraction */
+typedef struct {
+  VOLUME *Vol;
+  EXTRACT_NODE *Nodes;
+  DWORD NodeCnt;
+  DWORD NodeCap;
+  EXTRACT_RUN *Runs;
+  DWORD RunCnt;
+  DWORD RunCap;
+  CHUNK_QUEUE Free;
+  CHUNK_QUEUE Full;
+  DWORD Parent;
+  int OutFd;
+  FILE *Tar;
+  int Errors;
+  uint64_t Bytes;
+  DWORD Reads;
+} EXTRACT;
+
+/* Per writer thread state */
+typedef struct EXTRACT_WRITER {
+  EXTRACT *Ex;
+  void (*write)(struct EXTRACT_WRITER *Writer, EXTRACT_CHUNK *Chunk);
+  DWORD Node;
+  int fd;
+} EXTRACT_WRITER;
+
+static void queue_init(CHUNK_QUEUE *Queue)
+{
+  pthread_mutex_init(&Queue->lock, NULL);
+  pthread_cond_init(&Queue->cond, NULL);
+  Queue->head = Queue->tail = NULL;
+  Queue->closed = 0;
+}
+
+static void queue_destroy(CHUNK_QUEUE *Queue)
+{
+  pthread_mutex_destroy(&Queue->lock);
+  pthread_cond_destroy(&Queue->cond);
+}
+
+static void queue_push(CHUNK_QUEUE *Queue, EXTRACT_CHUNK *Chunk)
+{
+  pthread_mutex_lock(&Queue->lock);
+  Chunk->next = NULL;
+  if (Queue->tail == NULL) {
+    Queue->head = Chunk;
+  } else {
+    Queue->tail->next = Chunk;
+  }
+  Queue->tail = Chunk;
+  pthread_cond_signal(&Queue->cond);
+  pthread_mutex_unlock(&Queue->lock);
+}
+
+/* Waits for a chunk. NULL once the queue is closed and drained */
+static EXTRACT_CHUNK *queue_pop(CHUNK_QUEUE *Queue)
+{
+  EXTRACT_CHUNK *Chunk;
+
+  pthread_mutex_lock(&Queue->lock);
+  while (Queue->head == NULL && !Queue->closed) {
+    pthread_cond_wait(&Queue->cond, &Queue->lock);
+  }
+  Chunk = Queue->head;
+  if (Chunk != NULL) {
+    Queue->head = Chunk->next;
+    if (Queue->head == NULL) {
+      Queue->tail = NULL;
+    }
+  }
+  pthread_mutex_unlock(&Queue->lock);
+  return Chunk;
+}
+
+static void queue_close(CHUNK_QUEUE *Queue)
+{
+  pthread_mutex_lock(&Queue->lock);
+  Queue->closed = 1;
+  pthread_cond_broadcast(&Queue->cond);
+  pthread_mutex_unlock(&Queue->lock);
+}
+
+static void extract_error(EXTRACT *Ex)
+{
+  __atomic_add_fetch(&Ex->Errors, 1, __ATOMIC_RELAXED);
+}
+
+/* dir_iterate_names callback: appends the files and directories of a
+ * directory */
+static int extract_collect(DIR_ENTRY *Entry, const char *Name, void *arg)
+{
+  EXTRACT *Ex = arg;
+  EXTRACT_NODE *Node;
+  char *ParentPath;
+
+  if (Entry->DIR_Name[0] == '.') {
+    return 0;
+  }
+
+  /* A name that could leave the output directory is never extracted */
+  if (!name_valid(Name)) {
+    log_msg("%s%s%s: invalid name, skipped\n", Ex->Nodes[Ex->Parent].Path,
+            Ex->Parent == 0 ? "" : "/", Name);
+    extract_error(Ex);
+    return 0;
+  }
+
+  if (Ex->NodeCnt == Ex->NodeCap) {
+    Ex->NodeCap *= 2;
+    Ex->Nodes = realloc(Ex->Nodes, Ex->NodeCap * sizeof(EXTRACT_NODE));
+
+    if (Ex->Nodes == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  ParentPath = Ex->Nodes[Ex->Parent].Path;
+  Node = &Ex->Nodes[Ex->NodeCnt++];
+  memset(Node, 0, sizeof(EXTRACT_NODE));
+  Node->Path = malloc(strlen(ParentPath) + strlen(Name) + 2);
+
+  if (Node->Path == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Paths are relative to the output, the root is the empty path */
+  sprintf(Node->Path, "%s%s%s", ParentPath, ParentPath[0] == '\0' ? "" : "/", Name);
+  Node->Dir = *Entry;
+  Node->Size = Entry->DIR_Attr & ATTR_DIRECTORY ? 0 : Entry->DIR_FileSize;
+  return 0;
+}
+
+/* Appends a run, split so that no run is larger than one read */
+static void extract_add_run(EXTRACT *Ex, DWORD Node, off_t ImageOffset,
+                            size_t Length, off_t FileOffset)
+{
+  while (Length > 0) {
+    size_t Piece = Length > EXTRACT_READ_SIZE ? EXTRACT_READ_SIZE : Length;
+
+    if (Ex->RunCnt == Ex->RunCap) {
+      Ex->RunCap *= 2;
+      Ex->Runs = realloc(Ex->Runs, Ex->RunCap * sizeof(EXTRACT_RUN));
+
+      if (Ex->Runs == NULL) {
+        log_msg("Out of memory!\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    Ex->Runs[Ex->RunCnt].ImageOffset = ImageOffset;
+    Ex->Runs[Ex->RunCnt].Length = Piece;
+    Ex->Runs[Ex->RunCnt].Node = Node;
+    Ex->Runs[Ex->RunCnt].FileOffset = FileOffset;
+    Ex->RunCnt++;
+
+    ImageOffset += Piece;
+    FileOffset += Piece;
+    Length -= Piece;
+  }
+}
+
+/**
+ * Walks the whole directory tree breadth first and maps every file to the
+ * runs of the image that hold it. Nothing but directory and FAT sectors is
+ * read here.
+ * ============================================================================
+ * Return
+ * There is no return in this function.
+ * ============================================================================
+ * Parameters
+ * @Ex: Extraction state, receives the nodes and their runs.
+**/
+static void extract_walk(EXTRACT *Ex)
+{
+  VOLUME *Vol = Ex->Vol;
+  DWORD ClusterSize = Vol->Geo.ClusterSize;
+  DWORD i;
+  BYTE *Walked;
+  int j, n;
+
+  Ex->NodeCap = 1024;
+  Ex->Nodes = malloc(Ex->NodeCap * sizeof(EXTRACT_NODE));
+  Ex->RunCap = 1024;
+  Ex->Runs = malloc(Ex->RunCap * sizeof(EXTRACT_RUN));
+
+  /* One bit per cluster, a directory reached twice is not walked again */
+  Walked = calloc(65536 / 8, 1);
+
+  if (Ex->Nodes == NULL || Ex->Runs == NULL || Walked == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* The root directory */
+  memset(&Ex->Nodes[0], 0, sizeof(EXTRACT_NODE));
+  Ex->Nodes[0].Path = strdup("");
+  Ex->Nodes[0].Dir.DIR_Attr = ATTR_DIRECTORY;
+  Ex->NodeCnt = 1;
+
+  for (i = 0; i < Ex->NodeCnt; i++) {
+    WORD ClusterN = Ex->Nodes[i].Dir.DIR_FstClusLO;
+
+    if (!(Ex->Nodes[i].Dir.DIR_Attr & ATTR_DIRECTORY)) {
+      continue;
+    }
+    if (i != 0 && (ClusterN < 2 || Walked[ClusterN / 8] & (1 << (ClusterN % 8)))) {
+      continue;
+    }
+    Walked[ClusterN / 8] |= 1 << (ClusterN % 8);
+
+    Ex->Parent = i;
+    dir_iterate_names(Vol, i == 0 ? 0 : ClusterN, extract_collect, Ex);
+  }
+  free(Walked);
+
+  /* Cluster runs of every file, in file order */
+  int MaxExtents = 0;
+  EXTENT *Extents = NULL;
+
+  for (i = 0; i < Ex->NodeCnt; i++) {
+    EXTRACT_NODE *Node = &Ex->Nodes[i];
+    off_t FileOffset = 0;
+
+    Node->FirstRun = Ex->RunCnt;
+    Node->RunCnt = 0;
+    if (Node->Size == 0) {
+      continue;
+    }
+
+    int Clusters = (Node->Size + ClusterSize - 1) / ClusterSize;
+
+    if (Clusters > MaxExtents) {
+      MaxExtents = Clusters;
+      Extents = realloc(Extents, MaxExtents * sizeof(EXTENT));
+
+      if (Extents == NULL) {
+        log_msg("Out of memory!\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    n = file_extents(Vol, &Node->Dir, 0, Node->Size, Extents, Clusters);
+    if (n < 0) {
+      log_msg("%s: cluster chain shorter than the file, extracted empty\n", Node->Path);
+      extract_error(Ex);
+      Node->Size = 0;
+      continue;
+    }
+    for (j = 0; j < n; j++) {
+      extract_add_run(Ex, i, Extents[j].ImageOffset, Extents[j].Length, FileOffset);
+      FileOffset += Extents[j].Length;
+    }
+    Node->RunCnt = Ex->RunCnt - Node->FirstRun;
+  }
+  free(Extents);
+}
+
+/* Orders runs by their place in the image */
+static int run_offset_cmp(const void *a, const void *b)
+{
+  const EXTRACT_RUN *A = a, *B = b;
+
+  if (A->ImageOffset != B->ImageOffset) {
+    return A->ImageOffset < B->ImageOffset ? -1 : 1;
+  }
+  return A->Node < B->Node ? -1 : A->Node > B->Node;
+}
+
+/* Orders files by the place of their first run in the image */
+static EXTRACT *order_ex;
+
+static int node_offset_cmp(const void *a, const void *b)
+{
+  EXTRACT_NODE *A = &order_ex->Nodes[*(const DWORD *) a];
+  EXTRACT_NODE *B = &order_ex->Nodes[*(const DWORD *) b];
+  off_t OffA = order_ex->Runs[A->FirstRun].ImageOffset;
+  off_t OffB = order_ex->Runs[B->FirstRun].ImageOffset;
+
+  if (OffA != OffB) {
+    return OffA < OffB ? -1 : 1;
+  }
+  return A < B ? -1 : A > B;
+}
+
+/**
+ * Reader side of the pipeline. Runs that follow each other on the image, with
+ * holes of at most EXTRACT_GAP bytes, are fetched by a single read of up to
+ * EXTRACT_READ_SIZE bytes, so the image is read sequentially in the order of
+ * Runs.
+ * ============================================================================
+ * Return
+ * There is no return in this function.
+ * ============================================================================
+ * Parameters
+ * @Ex: Extraction state.
+ * @Inline: Writer that takes every chunk right after it is read, NULL to hand
+ * the chunks to the writer threads.
+**/
+static void extract_read(EXTRACT *Ex, EXTRACT_WRITER *Inline)
+{
+  DWORD i = 0, j;
+
+  while (i < Ex->RunCnt) {
+    EXTRACT_CHUNK *Chunk = queue_pop(&Ex->Free);
+    off_t Start = Ex->Runs[i].ImageOffset;
+    off_t End = Start + Ex->Runs[i].Length;
+
+    for (j = i + 1; j < Ex->RunCnt; j++) {
+      EXTRACT_RUN *Run = &Ex->Runs[j];
+
+      if (Run->ImageOffset < End || Run->ImageOffset - End > EXTRACT_GAP ||
+          Run->ImageOffset + (off_t) Run->Length - Start > EXTRACT_READ_SIZE) {
+        break;
+      }
+      End = Run->ImageOffset + Run->Length;
+    }
+
+    Chunk->ImageOffset = Start;
+    Chunk->Size = End - Start;
+    Chunk->FirstRun = i;
+    Chunk->RunCnt = j - i;
+
+    ssize_t Result = sector_pread(Ex->Vol->fd, Chunk->Data, Chunk->Size, Start);
+    if (Result != (ssize_t) Chunk->Size) {
+      log_msg("Short read at image offset %lld\n", (long long) Start);
+      extract_error(Ex);
+      memset(Chunk->Data + (Result < 0 ? 0 : Result), 0,
+             Chunk->Size - (Result < 0 ? 0 : Result));
+    }
+    Ex->Reads++;
+    Ex->Bytes += Chunk->Size;
+
+    if (Inline != NULL) {
+      Inline->write(Inline, Chunk);
+      queue_push(&Ex->Free, Chunk);
+    } else {
+      queue_push(&Ex->Full, Chunk);
+    }
+    i = j;
+  }
+  queue_close(&Ex->Full);
+}
+
+/* Writes all of a buffer at a file offset */
+static int write_all(int fd, const char *Data, size_t Size, off_t Offset)
+{
+  while (Size > 0) {
+    ssize_t Result = pwrite(fd, Data, Size, Offset);
+
+    if (Result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    Data += Result;
+    Offset += Result;
+    Size -= Result;
+  }
+  return 0;
+}
+
+/* Writer side when extracting to a directory: every run goes to its file at
+ * its own offset, so writers and runs may go in any order */
+static void dir_write_chunk(EXTRACT_WRITER *Writer, EXTRACT_CHUNK *Chunk)
+{
+  EXTRACT *Ex = Writer->Ex;
+  DWORD i;
+
+  for (i = Chunk->FirstRun; i < Chunk->FirstRun + Chunk->RunCnt; i++) {
+    EXTRACT_RUN *Run = &Ex->Runs[i];
+    EXTRACT_NODE *Node = &Ex->Nodes[Run->Node];
+
+    /* Runs of one file are mostly next to each other, keep it open */
+    if (Writer->fd < 0 || Writer->Node != Run->Node) {
+      if (Writer->fd >= 0) {
+        close(Writer->fd);
+      }
+      Writer->Node = Run->Node;
+      Writer->fd = openat(Ex->OutFd, Node->Path, O_WRONLY);
+      if (Writer->fd < 0) {
+        log_msg("%s: %s\n", Node->Path, strerror(errno));
+        extract_error(Ex);
+        continue;
+      }
+    }
+
+    if (write_all(Writer->fd, Chunk->Data + (Run->ImageOffset - Chunk->ImageOffset),
+                  Run->Length, Run->FileOffset) != 0) {
+      log_msg("%s: %s\n", Node->Path, strerror(errno));
+      extract_error(Ex);
+    }
+  }
+}
+
+/* ustar header block */
+typedef struct {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+} TAR_HEADER;
+
+/* Archive path of a node, directories end with '/'. Returns -1 if it does
+ * not fit a ustar header */
+static int tar_path(EXTRACT_NODE *Node, char *Path, size_t Size)
+{
+  int Length = snprintf(Path, Size, "%s%s", Node->Path,
+                        Node->Dir.DIR_Attr & ATTR_DIRECTORY ? "/" : "");
+
+  return Length < 0 || (size_t) Length >= Size ? -1 : Length;
+}
+
+/* Where a path is split between the prefix and name fields of the header:
+ * -1 if it needs no split, the index of the '/' otherwise. Returns -2 if the
+ * path cannot be stored */
+static int tar_split(const char *Path, size_t Length)
+{
+  size_t i;
+
+  if (Length <= sizeof(((TAR_HEADER *) 0)->name)) {
+    return -1;
+  }
+  for (i = 0; i < Length && i <= sizeof(((TAR_HEADER *) 0)->prefix); i++) {
+    if (Path[i] == '/' && Length - i - 1 <= sizeof(((TAR_HEADER *) 0)->name) &&
+        Length - i - 1 > 0) {
+      return i;
+    }
+  }
+  return -2;
+}
+
+/* Checks that a node can be stored in the archive */
+static int tar_fits(EXTRACT_NODE *Node)
+{
+  char Path[512];
+  int Length = tar_path(Node, Path, sizeof(Path));
+
+  if (Length < 0 || tar_split(Path, Length) == -2) {
+    log_msg("%s: path too long for tar, skipped\n", Node->Path);
+    return 0;
+  }
+  return 1;
+}
+
+/* Writes the tar header of a node, which must fit (see tar_fits) */
+static int tar_header(EXTRACT *Ex, EXTRACT_NODE *Node)
+{
+  TAR_HEADER Header;
+  char Path[512];
+  unsigned int Sum = 0;
+  int Length, Split;
+  size_t i;
+
+  Length = tar_path(Node, Path, sizeof(Path));
+  Split = tar_split(Path, Length);
+  memset(&Header, 0, sizeof(Header));
+
+  /* Long paths are split at a '/' between prefix and name */
+  if (Split >= 0) {
+    memcpy(Header.prefix, Path, Split);
+    memcpy(Header.name, Path + Split + 1, Length - Split - 1);
+  } else {
+    memcpy(Header.name, Path, Length);
+  }
+
+  if (Node->Dir.DIR_Attr & ATTR_DIRECTORY) {
+    strcpy(Header.mode, "0000755");
+    Header.typeflag = '5';
+  } else {
+    strcpy(Header.mode, "0000644");
+    Header.typeflag = '0';
+  }
+  strcpy(Header.uid, "0000000");
+  strcpy(Header.gid, "0000000");
+  snprintf(Header.size, sizeof(Header.size), "%011llo", (unsigned long long) Node->Size);
+  snprintf(Header.mtime, sizeof(Header.mtime), "%011llo",
+           (unsigned long long) dir_mtime(&Node->Dir));
+  memcpy(Header.magic, "ustar", 6);
+  memcpy(Header.version, "00", 2);
+
+  /* Checksum is computed with its own field filled with spaces */
+  memset(Header.chksum, ' ', sizeof(Header.chksum));
+  for (i = 0; i < sizeof(Header); i++) {
+    Sum += ((unsigned char *) &Header)[i];
+  }
+  snprintf(Header.chksum, sizeof(Header.chksum), "%06o", Sum);
+  Header.chksum[7] = ' ';
+
+  if (fwrite(&Header, sizeof(Header), 1, Ex->Tar) != 1) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Pads the data of a file to the next tar block */
+static int tar_pad(EXTRACT *Ex, off_t Size)
+{
+  static const char Zero[512];
+  size_t Pad = (512 - Size % 512) % 512;
+
+  if (Pad > 0 && fwrite(Zero, Pad, 1, Ex->Tar) != 1) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Writer side of a tar stream: a single writer that takes the chunks in the
+ * order they were read, which is the order of the files in the archive */
+static void tar_write_chunk(EXTRACT_WRITER *Writer, EXTRACT_CHUNK *Chunk)
+{
+  EXTRACT *Ex = Writer->Ex;
+  DWORD i;
+
+  for (i = Chunk->FirstRun; i < Chunk->FirstRun + Chunk->RunCnt; i++) {
+    EXTRACT_RUN *Run = &Ex->Runs[i];
+    EXTRACT_NODE *Node = &Ex->Nodes[Run->Node];
+
+    if (Run->FileOffset == 0 && tar_header(Ex, Node) != 0) {
+      extract_error(Ex);
+    }
+    if (fwrite(Chunk->Data + (Run->ImageOffset - Chunk->ImageOffset),
+               Run->Length, 1, Ex->Tar) != 1) {
+      extract_error(Ex);
+    }
+    Node->Written += Run->Length;
+    if (Node->Written == Node->Size && tar_pad(Ex, Node->Size) != 0) {
+      extract_error(Ex);
+    }
+  }
+}
+
+/* Writer thread: drains the read chunks and gives the buffers back */
+static void *extract_writer(void *arg)
+{
+  EXTRACT_WRITER *Writer = arg;
+  EXTRACT_CHUNK *Chunk;
+
+  while ((Chunk = queue_pop(&Writer->Ex->Full)) != NULL) {
+    Writer->write(Writer, Chunk);
+    queue_push(&Writer->Ex->Free, Chunk);
+  }
+
+  if (Writer->fd >= 0) {
+    close(Writer->fd);
+  }
+  return NULL;
+}
+
+/**
+ * Runs the pipeline: this thread reads the image in the order of Runs while
+ * the writer threads drain the chunks it fills.
+ * ============================================================================
+ * Return
+ * There is no return in this function.
+ * ============================================================================
+ * Parameters
+ * @Ex: Extraction state, with Runs already in reading order.
+ * @write: Writes the runs of one chunk to the output.
+ * @Writers: Number of writer threads, at most EXTRACT_WRITERS.
+**/
+static void extract_pipeline(EXTRACT *Ex,
+                             void (*write)(EXTRACT_WRITER *, EXTRACT_CHUNK *),
+                             int Writers)
+{
+  EXTRACT_CHUNK Chunks[EXTRACT_BUFFERS];
+  EXTRACT_WRITER State[EXTRACT_WRITERS];
+  pthread_t Threads[EXTRACT_WRITERS];
+  int i, Started = 0;
+
+  queue_init(&Ex->Free);
+  queue_init(&Ex->Full);
+  for (i = 0; i < EXTRACT_BUFFERS; i++) {
+    Chunks[i].Data = malloc(EXTRACT_READ_SIZE);
+
+    if (Chunks[i].Data == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    queue_push(&Ex->Free, &Chunks[i]);
+  }
+
+  for (i = 0; i < Writers; i++) {
+    State[i].Ex = Ex;
+    State[i].write = write;
+    State[i].fd = -1;
+    if (pthread_create(&Threads[Started], NULL, extract_writer, &State[i]) == 0) {
+      Started++;
+    }
+  }
+
+  if (Started == 0) {
+    /* No thread could be started, every chunk is written once read */
+    extract_read(Ex, &State[0]);
+    if (State[0].fd >= 0) {
+      close(State[0].fd);
+    }
+  } else {
+    extract_read(Ex, NULL);
+    for (i = 0; i < Started; i++) {
+      pthread_join(Threads[i], NULL);
+    }
+  }
+
+  for (i = 0; i < EXTRACT_BUFFERS; i++) {
+    free(Chunks[i].Data);
+  }
+  queue_destroy(&Ex->Free);
+  queue_destroy(&Ex->Full);
+}
+
+static void extract_free(EXTRACT *Ex)
+{
+  DWORD i;
+
+  for (i = 0; i < Ex->NodeCnt; i++) {
+    free(Ex->Nodes[i].Path);
+  }
+  free(Ex->Nodes);
+  free(Ex->Runs);
+}
+
+/**
+ * Copies every file and directory of the image into a host directory. All
+ * files are created first, then the data is read in image order and each run
+ * is written at its offset in its file.
+ * ============================================================================
+ * Return
+ * 0 on success, -1 if anything could not be extracted.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @OutDir: Host directory to extract into, created if missing.
+**/
+int extract_dir(VOLUME *Vol, const char *OutDir)
+{
+  EXTRACT Ex;
+  DWORD i;
+
+  memset(&Ex, 0, sizeof(Ex));
+  Ex.Vol = Vol;
+
+  if (mkdir(OutDir, 0755) != 0 && errno != EEXIST) {
+    log_msg("%s: %s\n", OutDir, strerror(errno));
+    return -1;
+  }
+  Ex.OutFd = open(OutDir, O_RDONLY | O_DIRECTORY);
+  if (Ex.OutFd < 0) {
+    log_msg("%s: %s\n", OutDir, strerror(errno));
+    return -1;
+  }
+
+  extract_walk(&Ex);
+
+  /* Breadth first order creates every directory before its children */
+  for (i = 1; i < Ex.NodeCnt; i++) {
+    EXTRACT_NODE *Node = &Ex.Nodes[i];
+
+    if (Node->Dir.DIR_Attr & ATTR_DIRECTORY) {
+      if (mkdirat(Ex.OutFd, Node->Path, 0755) != 0 && errno != EEXIST) {
+        log_msg("%s: %s\n", Node->Path, strerror(errno));
+        extract_error(&Ex);
+      }
+    } else {
+      int fd = openat(Ex.OutFd, Node->Path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+      if (fd < 0 || ftruncate(fd, Node->Size) != 0) {
+        log_msg("%s: %s\n", Node->Path, strerror(errno));
+        extract_error(&Ex);
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  qsort(Ex.Runs, Ex.RunCnt, sizeof(EXTRACT_RUN), run_offset_cmp);
+  extract_pipeline(&Ex, dir_write_chunk, EXTRACT_WRITERS);
+
+  /* Modification times last, once nothing writes to the files anymore */
+  for (i = 1; i < Ex.NodeCnt; i++) {
+    struct timespec Times[2];
+
+    Times[0].tv_sec = Times[1].tv_sec = dir_mtime(&Ex.Nodes[i].Dir);
+    Times[0].tv_nsec = Times[1].tv_nsec = 0;
+    utimensat(Ex.OutFd, Ex.Nodes[i].Path, Times, 0);
+  }
+
+  log_msg("Extracted %u entries, %llu bytes in %u reads\n", Ex.NodeCnt - 1,
+          (unsigned long long) Ex.Bytes, Ex.Reads);
+
+  close(Ex.OutFd);
+  extract_free(&Ex);
+  return Ex.Errors == 0 ? 0 : -1;
+}
+
+/**
+ * Writes every file and directory of the image as a ustar stream. Directories
+ * and empty files come first, then the files in the order of their first
+ * cluster on the image; inside a file the data has to follow file order, so
+ * only fragmented files make the reads seek.
+ * ============================================================================
+ * Return
+ * 0 on success, -1 if anything could not be extracted.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Out: Stream the archive is written to.
+**/
+int extract_tar(VOLUME *Vol, FILE *Out)
+{
+  EXTRACT Ex;
+  DWORD i, j, k, Files = 0;
+  static const char Zero[1024];
+
+  memset(&Ex, 0, sizeof(Ex));
+  Ex.Vol = Vol;
+  Ex.Tar = Out;
+  Ex.OutFd = -1;
+
+  extract_walk(&Ex);
+
+  DWORD *Order = malloc(Ex.NodeCnt * sizeof(DWORD));
+  EXTRACT_RUN *Runs = malloc((Ex.RunCnt + 1) * sizeof(EXTRACT_RUN));
+
+  if (Order == NULL || Runs == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Entries without data have nothing to read */
+  for (i = 1; i < Ex.NodeCnt; i++) {
+    if (!tar_fits(&Ex.Nodes[i])) {
+      extract_error(&Ex);
+    } else if (Ex.Nodes[i].RunCnt == 0) {
+      if (tar_header(&Ex, &Ex.Nodes[i]) != 0) {
+        extract_error(&Ex);
+      }
+    } else {
+      Order[Files++] = i;
+    }
+  }
+
+  order_ex = &Ex;
+  qsort(Order, Files, sizeof(DWORD), node_offset_cmp);
+
+  for (i = 0, k = 0; i < Files; i++) {
+    EXTRACT_NODE *Node = &Ex.Nodes[Order[i]];
+
+    for (j = 0; j < Node->RunCnt; j++) {
+      Runs[k++] = Ex.Runs[Node->FirstRun + j];
+    }
+  }
+  free(Ex.Runs);
+  Ex.Runs = Runs;
+  Ex.RunCnt = k;
+  free(Order);
+
+  extract_pipeline(&Ex, tar_write_chunk, 1);
+
+  /* End of archive */
+  if (fwrite(Zero, sizeof(Zero), 1, Out) != 1 || fflush(Out) != 0) {
+    extract_error(&Ex);
+  }
+
+  log_msg("Archived %u entries, %llu bytes in %u reads\n", Ex.NodeCnt - 1,
+          (unsigned long long) Ex.Bytes, Ex.Reads);
+
+  extract_free(&Ex);
+  return Ex.Errors == 0 ? 0 : -1;
+}
@@ -0,0 +1,21 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include <stdio.h>
+
+#include "fat16.h"
+
+/* Largest single read of the image */
+#define EXTRACT_READ_SIZE (4 * 1024 * 1024)
+/* Holes between two runs up to this size are read through instead of seeked over */
+#define EXTRACT_GAP (64 * 1024)
+/* Read buffers in flight between the reader and the writers */
+#define EXTRACT_BUFFERS 8
+/* Writer threads when extracting to a directory */
+#define EXTRACT_WRITERS 2
+
+/* Prototypes (documentation in the functions definitions) */
+int extract_dir(VOLUME *Vol, const char *OutDir);
+int extract_tar(VOLUME *Vol, FILE *Out);
+
+#endif
@@ -0,0 +1,1620 @@
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include "fat16.h"
+#include "log.h"
+#include "overlay.h"
+#include "probe.h"
+
+/**
+ * Opens a FAT16 image: reads the BPB, calculates the first sector of the root
+ * and data sections and sets up empty caches.
+ * ============================================================================
+ * Return
+ * @Vol: Structure that contains essential data about the File System (BPB,
+ * first sector number of the Data Region, number of sectors in the root
+ * directory and the first sector number of the Root Directory Region), or
+ * NULL with errno set if the image cannot be opened or is not a supported
+ * FAT16 volume (EINVAL).
+ * ============================================================================
+ * Parameters
+ * @ImagePath: Path of the FAT16 image file.
+**/
+VOLUME *volume_open(const char *ImagePath)
+{
+  /* Opening the FAT16 image file */
+  FILE *fd = fopen(ImagePath, "rb");
+  int i;
+
+  if (fd == NULL) {
+    return NULL;
+  }
+
+  VOLUME *Vol = malloc(sizeof(VOLUME));
+
+  if (Vol == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  Vol->fd = fd;
+  Vol->Overlay = NULL;
+  pthread_mutex_init(&Vol->WriteLock, NULL);
+  Vol->Delayed = NULL;
+  Vol->DelayedLimit = Vol->DelayedBytes = 0;
+  Vol->DelayedClusters = 0;
+  Vol->Writers = NULL;
+
+  /* Reads the BPB, at the start of the boot sector whatever its size */
+  if (sector_pread(Vol->fd, &Vol->Bpb, sizeof(BPB_BS), 0) != sizeof(BPB_BS)) {
+    log_msg("Could not read the boot sector!\n");
+    sector_forget(fd);
+    fclose(fd);
+    free(Vol);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* Shifts and masks of the sector and cluster sizes */
+  if (geometry_init(Vol) != 0) {
+    log_msg("Unsupported geometry: %u bytes per sector, %u sectors per cluster!\n",
+            Vol->Bpb.BPB_BytsPerSec, Vol->Bpb.BPB_SecPerClus);
+    sector_forget(fd);
+    fclose(fd);
+    free(Vol);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* First sector of the root directory */
+  Vol->FirstRootDirSecNum = Vol->Bpb.BPB_RsvdSecCnt
+    + (Vol->Bpb.BPB_FATSz16 * Vol->Bpb.BPB_NumFATS);
+
+  /* Number of sectors in the root directory */
+  DWORD RootDirSectors = ((Vol->Bpb.BPB_RootEntCnt * 32) + Vol->Geo.SectorMask) >>
+    Vol->Geo.SectorShift;
+
+  /* First sector of the data region (cluster #2) */
+  Vol->FirstDataSector = Vol->Bpb.BPB_RsvdSecCnt + (Vol->Bpb.BPB_NumFATS *
+    Vol->Bpb.BPB_FATSz16) + RootDirSectors;
+  Vol->Geo.DataOffset = (off_t) Vol->FirstDataSector << Vol->Geo.SectorShift;
+
+  /* Highest cluster a chain may go through */
+  Vol->MaxCluster = fat_max_cluster(Vol);
+  Vol->AbortedWalks = 0;
+  Vol->Counted = 0;
+
+  /* Empty caches, filled as the FAT and the directories are read */
+  Vol->Cache = calloc(1, sizeof(VOLUME_CACHE));
+
+  if (Vol->Cache == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  Vol->Cache->Fat = malloc((size_t) Vol->Bpb.BPB_FATSz16 << Vol->Geo.SectorShift);
+  Vol->Cache->FatLoaded = calloc(Vol->Bpb.BPB_FATSz16, 1);
+  Vol->Cache->Dirs = calloc(DIR_CACHE_SLOTS, sizeof(DIR_LIST *));
+  Vol->Cache->DirGens = calloc(DIR_CACHE_SLOTS, sizeof(DWORD));
+
+  if (Vol->Cache->Fat == NULL || Vol->Cache->FatLoaded == NULL ||
+      Vol->Cache->Dirs == NULL || Vol->Cache->DirGens == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_init(&Vol->Cache->FatLock, NULL);
+  for (i = 0; i < DIR_CACHE_LOCKS; i++) {
+    pthread_mutex_init(&Vol->Cache->DirLocks[i], NULL);
+  }
+
+  return Vol;
+}
+
+/* Releases a directory list and its names */
+static void dir_list_free(DIR_LIST *List)
+{
+  free(List->Names);
+  free(List->Text);
+  free(List);
+}
+
+/* Releases a volume opened by volume_open, its caches and its image file.
+ * No list of its directory cache may still be in use */
+void volume_close(VOLUME *Vol)
+{
+  CACHE_BUDGET *Budget = Vol->Cache->Budget;
+  DWORD i;
+
+  if (Budget != NULL) {
+    pthread_mutex_lock(&Budget->lock);
+    i = 0;
+    while (i < (DWORD) Budget->VolCnt && Budget->Vols[i] != Vol) {
+      i++;
+    }
+    if (i < (DWORD) Budget->VolCnt) {
+      Budget->Vols[i] = Budget->Vols[--Budget->VolCnt];
+    }
+    Budget->Bytes -= Vol->Cache->DirBytes;
+    pthread_mutex_unlock(&Budget->lock);
+  }
+
+  if (Vol->Overlay != NULL) {
+    overlay_close(Vol->Overlay);
+  }
+
+  for (i = 0; i < DIR_CACHE_SLOTS; i++) {
+    if (Vol->Cache->Dirs[i] != NULL) {
+      dir_list_free(Vol->Cache->Dirs[i]);
+    }
+  }
+  for (i = 0; i < DIR_CACHE_LOCKS; i++) {
+    pthread_mutex_destroy(&Vol->Cache->DirLocks[i]);
+  }
+  if (Vol->Cache->Usage != NULL) {
+    for (i = 0; i < DIR_CACHE_SLOTS; i++) {
+      free(Vol->Cache->Usage[i]);
+    }
+  }
+  pthread_mutex_destroy(&Vol->Cache->FatLock);
+  free(Vol->Cache->Usage);
+  free(Vol->Cache->DirGens);
+  free(Vol->Cache->Dirs);
+  free(Vol->Cache->FatLoaded);
+  free(Vol->Cache->Fat);
+  free(Vol->Cache);
+  pthread_mutex_destroy(&Vol->WriteLock);
+  sector_forget(Vol->fd);
+  fclose(Vol->fd);
+  free(Vol);
+}
+
+/* dir_iterate callback: counts the entries in use */
+static int count_entry(DIR_ENTRY *Entry, void *arg)
+{
+  (*(DWORD *) arg)++;
+  return 0;
+}
+
+/**
+ * Counts the free clusters and the free entries of the root directory. Done
+ * once, it reads the whole FAT; from then on fat_set and the creation and
+ * removal of files keep the counts up to date, so statfs never scans.
+ * ============================================================================
+ * Return
+ * There is no return in this funcion.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+**/
+void volume_count(VOLUME *Vol)
+{
+  DWORD ClusterN, Free = 0, Used = 0;
+
+  for (ClusterN = 2; ClusterN <= Vol->MaxCluster; ClusterN++) {
+    if (fat_entry_by_cluster(Vol, ClusterN) == 0) {
+      Free++;
+    }
+  }
+
+  /* Deleted entries are free, so are the never used ones past the last */
+  dir_iterate(Vol, 0, count_entry, &Used);
+
+  Vol->FreeClusters = Free;
+  Vol->FreeRootEntries = Used < Vol->Bpb.BPB_RootEntCnt ? Vol->Bpb.BPB_RootEntCnt - Used : 0;
+  __atomic_store_n(&Vol->Counted, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Opens a FAT16 image for the command line tools, which have nothing to do
+ * without it.
+ * ============================================================================
+ * Return
+ * @Vol: See volume_open. The process exits if the image cannot be opened.
+ * ============================================================================
+ * Parameters
+ * @ImagePath: Path of the FAT16 image file.
+**/
+VOLUME *pre_init_fat16(const char *ImagePath)
+{
+  VOLUME *Vol = volume_open(ImagePath);
+
+  if (Vol == NULL) {
+    if (errno != EINVAL) {
+      log_msg("Missing FAT16 image file!\n");
+    }
+    exit(EXIT_FAILURE);
+  }
+  return Vol;
+}
+
+/**
+ * Given a cluster N, this function gets its FAT entry. FAT sectors are read
+ * once and then served from the in-memory FAT.
+ * ============================================================================
+ * Return
+ * The entry in the FAT for the cluster N
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System (BPB,
+ * first sector number of the Data Region, number of sectors in the root
+ * directory and the first sector number of the Root Directory Region).
+ * @CusterN: the Nth cluster of the data section.
+**/
+WORD fat_entry_by_cluster(VOLUME *Vol, WORD ClusterN) {
+  VOLUME_CACHE *Cache = Vol->Cache;
+
+  /* FatSecIdx is the index, inside the first FAT, of the sector that contains
+   * the entry for cluster N */
+  DWORD FatSecIdx = ClusterN >> Vol->Geo.FatEntsShift;
+
+  if (FatSecIdx >= Vol->Bpb.BPB_FATSz16) {
+    return 0xffff;
+  }
+
+  /* The first time an entry of this sector is needed, the whole sector is
+   * copied into the in-memory FAT. It is read aside and copied in only if no
+   * other thread did first, as fat_set may already have changed it there */
+  int Miss = !__atomic_load_n(&Cache->FatLoaded[FatSecIdx], __ATOMIC_ACQUIRE);
+
+  if (Miss) {
+    BYTE Sector[4096];
+
+    sector_read(Vol->fd, Vol->Bpb.BPB_RsvdSecCnt + FatSecIdx, Vol->Geo.SectorShift, Sector);
+    pthread_mutex_lock(&Cache->FatLock);
+    if (!Cache->FatLoaded[FatSecIdx]) {
+      memcpy((BYTE *) Cache->Fat + ((size_t) FatSecIdx << Vol->Geo.SectorShift), Sector,
+             Vol->Geo.SectorSize);
+      __atomic_store_n(&Cache->FatLoaded[FatSecIdx], 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&Cache->FatLock);
+  }
+
+  PROBE3(fat_entry, ClusterN, Cache->Fat[ClusterN], Miss);
+  return Cache->Fat[ClusterN];
+}
+
+/* Characters other than letters and digits allowed in a FAT name */
+static int name_symbol(char c)
+{
+  return c == '$' || c == '%' || c == '\'' || c == '-' || c == '_' || c == '@' ||
+         c == '~' || c == '`' || c == '!' || c == '(' || c == ')' || c == '{' ||
+         c == '}' || c == '^' || c == '#' || c == '&';
+}
+
+/**
+ * Takes the next file name off a path and converts it to the format of FAT
+ * file names (8 name and 3 extension characters, upper case, space padded).
+ * Repeated, leading and trailing '/' are skipped. The path is not modified,
+ * so several threads may walk paths at the same time.
+ * ============================================================================
+ * Return
+ * 1 if a name was taken, 0 if the path has no more names, -1 if the name is
+ * not a valid FAT16 name (bad character, more than one dot, an empty name or
+ * extension, or a name or extension too long).
+ * ============================================================================
+ * Parameters
+ * @Path: Address of the rest of the path, moved past the name taken.
+ * @Name: Receives the 11 characters of the FAT name.
+**/
+int path_next_name(const char **Path, BYTE *Name)
+{
+  const char *p = *Path;
+  int NameLen = 0, ExtLen = 0, Dot = 0;
+
+  while (*p == '/') {
+    p++;
+  }
+  if (*p == '\0') {
+    *Path = p;
+    return 0;
+  }
+  memset(Name, ' ', 11);
+
+  /* "." and ".." are stored as such in subdirectories */
+  if (p[0] == '.' && (p[1] == '/' || p[1] == '\0')) {
+    Name[0] = '.';
+    *Path = p + 1;
+    return 1;
+  }
+  if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) {
+    Name[0] = Name[1] = '.';
+    *Path = p + 2;
+    return 1;
+  }
+
+  for (; *p != '/' && *p != '\0'; p++) {
+    char c = *p;
+
+    if (c == '.') {
+      if (Dot || NameLen == 0 || p[1] == '/' || p[1] == '\0') {
+        return -1;
+      }
+      Dot = 1;
+      continue;
+    }
+
+    /* Turns lower case characters into upper case characters */
+    if (c >= 'a' && c <= 'z') {
+      c -= 32;
+    } else if (!((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || name_symbol(c))) {
+      return -1;
+    }
+
+    if (Dot) {
+      if (ExtLen == 3) {
+        return -1;
+      }
+      Name[8 + ExtLen++] = c;
+    } else {
+      if (NameLen == 8) {
+        return -1;
+      }
+      Name[NameLen++] = c;
+    }
+  }
+
+  *Path = p;
+  return 1;
+}
+
+/**
+ * This function receieves a FAT file/directory name (DIR_Name) and decodes it
+ * to its original user input name.
+ * ==================================================================================
+ * Return
+ * @pathDecoded: FAT name decoded to its original input name
+ * ==================================================================================
+ * Parameters
+ * @path: DIR_Name string
+**/
+BYTE *path_decode(BYTE *path) {
+  BYTE *pathDecoded = malloc(13 * sizeof(BYTE));
+
+  if (pathDecoded == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  short_name(path, (char *) pathDecoded);
+  return pathDecoded;
+}
+
+/**
+ * Decodes a short (8.3) name the way it is shown: in lower case, without the
+ * padding and with a dot before a non-empty extension. "." and ".." are
+ * returned as they are.
+ * ============================================================================
+ * Return
+ * There is no return in this function.
+ * ============================================================================
+ * Parameters
+ * @DirName: The 11 characters of DIR_Name.
+ * @Name: Receives the name, 13 bytes at most with the terminator.
+**/
+void short_name(const BYTE *DirName, char *Name)
+{
+  int i, j = 0, Dot = 0;
+
+  /* If the name consists of "./" or "../", return them as the decoded path */
+  if (DirName[0] == '.') {
+    Name[j++] = '.';
+    if (DirName[1] == '.') {
+      Name[j++] = '.';
+    }
+    Name[j] = '\0';
+    return;
+  }
+
+  for (i = 0; i < 11; i++) {
+    BYTE c = DirName[i];
+
+    if (c == ' ') {
+      continue;
+    }
+    if (i >= 8 && !Dot) {
+      Name[j++] = '.';
+      Dot = 1;
+    }
+
+    /* Upper case letters are shown in lower case, like the mount always did */
+    Name[j++] = c >= 'A' && c <= 'Z' ? c + 32 : c;
+  }
+  Name[j] = '\0';
+}
+
+/**
+ * Tells whether a decoded name can be used as one component of a path: it is
+ * not empty, has no '/' and is neither "." nor "..". Names come from the
+ * image and are not trusted; whatever joins them into paths checks them here.
+ * ============================================================================
+ * Return
+ * 1 when the name can be used, 0 otherwise.
+ * ============================================================================
+ * Parameters
+ * @Name: Decoded name.
+**/
+int name_valid(const char *Name)
+{
+  return Name[0] != '\0' && strchr(Name, '/') == NULL &&
+         strcmp(Name, ".") != 0 && strcmp(Name, "..") != 0;
+}
+
+/* Checksum of a short name, stored in each entry of its long name */
+BYTE lfn_checksum(const BYTE *DirName)
+{
+  BYTE Sum = 0;
+  int i;
+
+  for (i = 0; i < 11; i++) {
+    Sum = ((Sum & 1) << 7) + (Sum >> 1) + DirName[i];
+  }
+  return Sum;
+}
+
+/* FNV-1a hash of a name with its ASCII letters in lower case, so names that
+ * only differ in case hash the same */
+DWORD name_hash(const char *Name, size_t Len)
+{
+  DWORD Hash = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < Len; i++) {
+    Hash = (Hash ^ (BYTE) tolower((unsigned char) Name[i])) * 16777619u;
+  }
+  return Hash;
+}
+
+/* Long name put together from the long name entries read so far */
+typedef struct {
+  WORD Units[LFN_MAX_ENTRIES * LFN_CHARS];
+  BYTE Count;
+  BYTE Expect;
+  BYTE Checksum;
+} LONG_NAME;
+
+/**
+ * Adds a long name entry to the name being put together. The entries of a
+ * name come last part first, the first one flagged with LFN_LAST; one out of
+ * order or with another checksum drops the name.
+ * ============================================================================
+ * Return
+ * There is no return in this function.
+ * ============================================================================
+ * Parameters
+ * @Long: Name being put together, Count is 0 when there is none.
+ * @Lfn: Long name entry.
+**/
+static void long_name_add(LONG_NAME *Long, const LFN_ENTRY *Lfn)
+{
+  BYTE Ord = Lfn->LDIR_Ord & LFN_ORD_MASK;
+  WORD *Units;
+
+  if (Ord == 0 || Ord > LFN_MAX_ENTRIES) {
+    Long->Count = 0;
+    return;
+  }
+  if (Lfn->LDIR_Ord & LFN_LAST) {
+    Long->Count = Ord;
+    Long->Checksum = Lfn->LDIR_Chksum;
+  } else if (Long->Count == 0 || Ord != Long->Expect || Lfn->LDIR_Chksum != Long->Checksum) {
+    Long->Count = 0;
+    return;
+  }
+  Long->Expect = Ord - 1;
+
+  Units = &Long->Units[(Ord - 1) * LFN_CHARS];
+  memcpy(Units, Lfn->LDIR_Name1, sizeof(Lfn->LDIR_Name1));
+  memcpy(Units + 5, Lfn->LDIR_Name2, sizeof(Lfn->LDIR_Name2));
+  memcpy(Units + 11, Lfn->LDIR_Name3, sizeof(Lfn->LDIR_Name3));
+}
+
+/**
+ * Converts the long name put together for a short entry from UTF-16 to
+ * UTF-8.
+ * ============================================================================
+ * Return
+ * 1 if Name received the long name, 0 if the entry has none: no complete
+ * long name was read right before it, its checksum is not the one of the
+ * short name, or the name is not valid (a lone surrogate, a '/', "." or
+ * "..", or longer than FAT_NAME_MAX bytes).
+ * ============================================================================
+ * Parameters
+ * @Long: Name put together from the entries before the short entry.
+ * @DirName: DIR_Name of the short entry.
+ * @Name: Receives the name, FAT_NAME_MAX + 1 bytes at most.
+**/
+static int long_name_decode(const LONG_NAME *Long, const BYTE *DirName, char *Name)
+{
+  DWORD n = Long->Count * LFN_CHARS, i, j = 0, c;
+
+  if (Long->Count == 0 || Long->Expect != 0 || Long->Checksum != lfn_checksum(DirName)) {
+    return 0;
+  }
+
+  for (i = 0; i < n && Long->Units[i] != 0; i++) {
+    c = Long->Units[i];
+
+    /* Characters past the first 65536 take two units */
+    if (c >= 0xd800 && c <= 0xdbff) {
+      if (i + 1 == n || Long->Units[i + 1] < 0xdc00 || Long->Units[i + 1] > 0xdfff) {
+        return 0;
+      }
+      c = 0x10000 + ((c - 0xd800) << 10) + (Long->Units[++i] - 0xdc00);
+    } else if (c >= 0xdc00 && c <= 0xdfff) {
+      return 0;
+    }
+
+    if (j + (c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4) > FAT_NAME_MAX) {
+      return 0;
+    }
+    if (c < 0x80) {
+      Name[j++] = c;
+    } else if (c < 0x800) {
+      Name[j++] = 0xc0 | (c >> 6);
+      Name[j++] = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+      Name[j++] = 0xe0 | (c >> 12);
+      Name[j++] = 0x80 | ((c >> 6) & 0x3f);
+      Name[j++] = 0x80 | (c & 0x3f);
+    } else {
+      Name[j++] = 0xf0 | (c >> 18);
+      Name[j++] = 0x80 | ((c >> 12) & 0x3f);
+      Name[j++] = 0x80 | ((c >> 6) & 0x3f);
+      Name[j++] = 0x80 | (c & 0x3f);
+    }
+  }
+  Name[j] = '\0';
+
+  return name_valid(Name);
+}
+
+/**
+ * Finds a name in a directory list, without regard to case (of ASCII
+ * letters, as FAT compares names). A long name costs the same as a short
+ * one: each entry costs a comparison of hashes, names are only compared when
+ * the hashes match.
+ * ============================================================================
+ * Return
+ * Index of the entry in the list, -1 if there is none.
+ * ============================================================================
+ * Parameters
+ * @List: Directory list, from dir_list.
+ * @Name: Name, not necessarily terminated.
+ * @Len: Length of the name.
+**/
+int dir_find(const DIR_LIST *List, const char *Name, size_t Len)
+{
+  DWORD Hash = name_hash(Name, Len), i;
+
+  for (i = 0; i < List->Count; i++) {
+    const char *Text = List->Text + List->Names[i].Off;
+
+    if (List->Names[i].Hash == Hash && strncasecmp(Text, Name, Len) == 0 &&
+        Text[Len] == '\0') {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Walks a path from a directory entry (see path_lookup_at), Name (if not
+ * NULL) receives the name of each entry found */
+static int lookup_walk(VOLUME *Vol, const DIR_ENTRY *Start, const char *Path,
+                       DIR_ENTRY *Dir, char *Name)
+{
+  BYTE Short[11];
+  DWORD i, Compared;
+  int Found;
+
+  *Dir = *Start;
+  while (1) {
+    while (*Path == '/') {
+      Path++;
+    }
+    if (*Path == '\0') {
+      return 0;
+    }
+
+    const char *Component = Path, *Alias = Path;
+    size_t Len = strcspn(Path, "/");
+
+    Path += Len;
+    if (!(Dir->DIR_Attr & ATTR_DIRECTORY)) {
+      return -ENOTDIR;
+    }
+    if (Len > FAT_NAME_MAX) {
+      return -ENAMETOOLONG;
+    }
+
+    /* '..' of a directory in the root points to cluster 0, the root itself */
+    DIR_LIST *List = dir_list(Vol, Dir->DIR_FstClusLO);
+
+    Found = dir_find(List, Component, Len);
+    Compared = Found >= 0 ? (DWORD) Found + 1 : List->Count;
+
+    /* A name with a long name can also be reached by its short name */
+    if (Found < 0 && path_next_name(&Alias, Short) == 1 && Alias == Path) {
+      i = 0;
+      while (i < List->Count && memcmp(List->Entries[i].DIR_Name, Short, 11) != 0) {
+        i++;
+      }
+      Compared += i < List->Count ? i + 1 : i;
+      Found = i < List->Count ? (int) i : -1;
+    }
+
+    /* Directory scanned for the component, and the entries compared */
+    PROBE3(lookup_component, Dir->DIR_FstClusLO, Compared, Found >= 0);
+    if (Found < 0) {
+      dir_release(List);
+      return -ENOENT;
+    }
+    *Dir = List->Entries[Found];
+    if (Name != NULL) {
+      strcpy(Name, List->Text + List->Names[Found].Off);
+    }
+    dir_release(List);
+  }
+}
+
+/**
+ * Looks a path up, from the root directory, through the directory cache.
+ * Names are compared without regard to case, against the long name of an
+ * entry and against its short name.
+ * ============================================================================
+ * Return
+ * 0 if the path was found, -ENOENT if it was not, -ENOTDIR if a name other
+ * than the last one is a file, -ENAMETOOLONG if a name is longer than
+ * FAT_NAME_MAX bytes.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Path: Path to look up, "/" or empty for the root directory.
+ * @Dir: Receives the directory entry (a directory entry with cluster 0 for
+ * the root directory).
+**/
+int path_lookup(VOLUME *Vol, const char *Path, DIR_ENTRY *Dir)
+{
+  return path_lookup_name(Vol, Path, Dir, NULL);
+}
+
+/* Looks a path up like path_lookup, Name (if not NULL) receives the name of
+ * the entry found as listed by its directory, "/" for the root directory */
+int path_lookup_name(VOLUME *Vol, const char *Path, DIR_ENTRY *Dir, char *Name)
+{
+  DIR_ENTRY Root;
+
+  memset(&Root, 0, sizeof(DIR_ENTRY));
+  memset(Root.DIR_Name, ' ', 11);
+  Root.DIR_Name[0] = '/';
+  Root.DIR_Attr = ATTR_DIRECTORY;
+  if (Name != NULL) {
+    strcpy(Name, "/");
+  }
+  return lookup_walk(Vol, &Root, Path, Dir, Name);
+}
+
+/**
+ * Looks a path up like path_lookup, but relative to a directory already
+ * looked up, so callers resolving many paths of one directory walk its
+ * parents only once.
+ * ============================================================================
+ * Return
+ * The same values as path_lookup.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Start: Directory entry the path starts from.
+ * @Path: Path to look up, empty for Start itself.
+ * @Dir: Receives the directory entry.
+**/
+int path_lookup_at(VOLUME *Vol, const DIR_ENTRY *Start, const char *Path,
+                   DIR_ENTRY *Dir)
+{
+  return lookup_walk(Vol, Start, Path, Dir, NULL);
+}
+
+/**
+ * Walks the entries of a directory, following its cluster chain, until the
+ * first never used entry. Deleted entries (0xE5) are skipped. A broken chain
+ * ends the walk at the last cluster that could be read.
+ * ============================================================================
+ * Return
+ * 0 when the whole directory was walked, or the non-zero value returned by fn.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @FirstCluster: First cluster of the directory, 0 for the root directory.
+ * @fn: Function called with each entry.
+ * @arg: Passed through to fn.
+**/
+int dir_iterate(VOLUME *Vol, WORD FirstCluster, dir_entry_fn fn, void *arg)
+{
+  BYTE buffer[MAX_BYTES_PER_SECTOR];
+  DIR_ENTRY Entry;
+  DWORD SectorN, SecCnt;
+  int EntriesPerSector = Vol->Geo.SectorSize / BYTES_PER_DIR;
+  int i, res;
+  CHAIN_WALK Walk;
+
+  if (FirstCluster == 0) {
+    /* The root directory is a fixed region right before the data region */
+    SectorN = Vol->FirstRootDirSecNum;
+    SecCnt = Vol->FirstDataSector - Vol->FirstRootDirSecNum;
+  } else {
+    if (chain_start(Vol, &Walk, FirstCluster) != 0) {
+      return 0;
+    }
+    SectorN = ((Walk.Cluster - 2) << Vol->Geo.SecPerClusShift) + Vol->FirstDataSector;
+    SecCnt = Vol->Bpb.BPB_SecPerClus;
+  }
+
+  for (;;) {
+    for (; SecCnt > 0; SecCnt--, SectorN++) {
+      sector_read(Vol->fd, SectorN, Vol->Geo.SectorShift, buffer);
+
+      for (i = 0; i < EntriesPerSector; i++) {
+        memcpy(&Entry, &buffer[i * BYTES_PER_DIR], BYTES_PER_DIR);
+
+        /* No more entries in this directory */
+        if (Entry.DIR_Name[0] == 0x00) {
+          return 0;
+        }
+        if (Entry.DIR_Name[0] == 0xE5) {
+          continue;
+        }
+
+        res = fn(&Entry, arg);
+        if (res != 0) {
+          return res;
+        }
+      }
+    }
+
+    /* The root directory does not continue in other clusters */
+    if (FirstCluster == 0) {
+      return 0;
+    }
+
+    if (chain_next(Vol, &Walk) != 1) {
+      return 0;
+    }
+    SectorN = ((Walk.Cluster - 2) << Vol->Geo.SecPerClusShift) + Vol->FirstDataSector;
+    SecCnt = Vol->Bpb.BPB_SecPerClus;
+  }
+}
+
+/* State of a dir_iterate_names walk */
+typedef struct {
+  dir_name_fn fn;
+  void *arg;
+  LONG_NAME Long;
+} NAME_WALK;
+
+/* dir_iterate callback: puts long names together and hands the files and
+ * directories on with their names */
+static int name_walk_entry(DIR_ENTRY *Entry, void *arg)
+{
+  NAME_WALK *Walk = arg;
+  char Name[FAT_NAME_MAX + 1];
+
+  if ((Entry->DIR_Attr & ATTR_LONG_NAME_MASK) == ATTR_LONG_NAME) {
+    long_name_add(&Walk->Long, (LFN_ENTRY *) Entry);
+    return 0;
+  }
+
+  /* The volume label is neither a file nor a directory */
+  if (!(Entry->DIR_Attr & ATTR_VOLUME_ID)) {
+    if (!long_name_decode(&Walk->Long, Entry->DIR_Name, Name)) {
+      short_name(Entry->DIR_Name, Name);
+    }
+    Walk->Long.Count = 0;
+    return Walk->fn(Entry, Name, Walk->arg);
+  }
+  Walk->Long.Count = 0;
+  return 0;
+}
+
+/**
+ * Walks the files and directories of a directory like dir_iterate, with the
+ * name each one is listed under: its long (VFAT) name when it has a valid
+ * one, in UTF-8, its short name otherwise. Long name entries and the volume
+ * label are left out.
+ * ============================================================================
+ * Return
+ * 0 when the whole directory was walked, or the non-zero value returned by fn.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @FirstCluster: First cluster of the directory, 0 for the root directory.
+ * @fn: Function called with each file and directory.
+ * @arg: Passed through to fn.
+**/
+int dir_iterate_names(VOLUME *Vol, WORD FirstCluster, dir_name_fn fn, void *arg)
+{
+  NAME_WALK Walk;
+
+  Walk.fn = fn;
+  Walk.arg = arg;
+  Walk.Long.Count = 0;
+  return dir_iterate(Vol, FirstCluster, name_walk_entry, &Walk);
+}
+
+/* Directory list being built by dir_list */
+typedef struct {
+  DIR_LIST *List;
+  DIR_NAME *Names;
+  char *Text;
+  size_t TextLen;
+  size_t TextCap;
+} DIR_BUILD;
+
+/* dir_iterate_names callback: appends an entry and its name to the list
+ * being built */
+static int dir_list_append(DIR_ENTRY *Entry, const char *Name, void *arg)
+{
+  DIR_BUILD *Build = arg;
+  DWORD Count = Build->List->Count;
+  size_t Len = strlen(Name);
+
+  /* The capacity doubles every time a power of two is reached */
+  if (Count >= 16 && (Count & (Count - 1)) == 0) {
+    Build->List = realloc(Build->List, sizeof(DIR_LIST) + 2 * Count * sizeof(DIR_ENTRY));
+    Build->Names = realloc(Build->Names, 2 * Count * sizeof(DIR_NAME));
+
+    if (Build->List == NULL || Build->Names == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (Build->TextLen + Len + 1 > Build->TextCap) {
+    Build->TextCap = 2 * (Build->TextLen + Len + 1);
+    Build->Text = realloc(Build->Text, Build->TextCap);
+
+    if (Build->Text == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  memcpy(Build->Text + Build->TextLen, Name, Len + 1);
+  Build->Names[Count].Hash = name_hash(Name, Len);
+  Build->Names[Count].Off = Build->TextLen;
+  Build->TextLen += Len + 1;
+  Build->List->Entries[Build->List->Count++] = *Entry;
+  return 0;
+}
+
+/* Takes a reference on the cached list of a directory, NULL if it is not
+ * cached */
+static DIR_LIST *dir_cache_get(VOLUME_CACHE *Cache, WORD FirstCluster)
+{
+  pthread_mutex_t *Lock = &Cache->DirLocks[FirstCluster % DIR_CACHE_LOCKS];
+  DIR_LIST *List;
+
+  pthread_mutex_lock(Lock);
+  List = Cache->Dirs[FirstCluster];
+  if (List != NULL) {
+    __atomic_add_fetch(&List->Refs, 1, __ATOMIC_RELAXED);
+    List->Used = 1;
+  }
+  pthread_mutex_unlock(Lock);
+  return List;
+}
+
+/**
+ * Evicts one directory of a volume from its cache, CLOCK style: the slots
+ * are swept from where the last sweep stopped, a directory used since then
+ * gets a second chance. Called with the budget lock held.
+ * ============================================================================
+ * Return
+ * Number of bytes given back, 0 if the volume caches no directory.
+ * ============================================================================
+ * Parameters
+ * @Vol: Volume to take a directory from.
+**/
+static size_t dir_cache_evict(VOLUME *Vol)
+{
+  VOLUME_CACHE *Cache = Vol->Cache;
+  DWORD Step, Slot;
+
+  for (Step = 0; Step < 2 * DIR_CACHE_SLOTS; Step++) {
+    Slot = Cache->Hand++ % DIR_CACHE_SLOTS;
+    if (__atomic_load_n(&Cache->Dirs[Slot], __ATOMIC_RELAXED) == NULL) {
+      continue;
+    }
+
+    pthread_mutex_t *Lock = &Cache->DirLocks[Slot % DIR_CACHE_LOCKS];
+    DIR_LIST *List;
+
+    pthread_mutex_lock(Lock);
+    List = Cache->Dirs[Slot];
+    if (List == NULL || List->Used) {
+      if (List != NULL) {
+        List->Used = 0;
+      }
+      pthread_mutex_unlock(Lock);
+      continue;
+    }
+    Cache->Dirs[Slot] = NULL;
+    pthread_mutex_unlock(Lock);
+
+    size_t Bytes = List->Bytes;
+
+    __atomic_sub_fetch(&Cache->DirBytes, Bytes, __ATOMIC_RELAXED);
+    dir_release(List);
+    return Bytes;
+  }
+  return 0;
+}
+
+/* Counts a newly cached directory against the budget of its volume, evicting
+ * from the volumes holding the most until the budget is met again */
+static void dir_cache_charge(VOLUME *Vol, size_t Bytes)
+{
+  CACHE_BUDGET *Budget = Vol->Cache->Budget;
+  int i;
+
+  if (Budget == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&Budget->lock);
+  Budget->Bytes += Bytes;
+  while (Budget->Limit > 0 && Budget->Bytes > Budget->Limit) {
+    VOLUME *Victim = NULL;
+    size_t Freed;
+
+    for (i = 0; i < Budget->VolCnt; i++) {
+      if (Victim == NULL || __atomic_load_n(&Budget->Vols[i]->Cache->DirBytes, __ATOMIC_RELAXED) >
+          __atomic_load_n(&Victim->Cache->DirBytes, __ATOMIC_RELAXED)) {
+        Victim = Budget->Vols[i];
+      }
+    }
+    if (Victim == NULL || (Freed = dir_cache_evict(Victim)) == 0) {
+      break;
+    }
+    Budget->Bytes -= Freed;
+    Budget->Evictions++;
+  }
+  pthread_mutex_unlock(&Budget->lock);
+}
+
+/**
+ * Gets the entries of a directory from the directory cache, reading the
+ * directory into it on the first use (or after it was evicted).
+ * ============================================================================
+ * Return
+ * The files and directories of the directory, in directory order, with
+ * their names (see dir_iterate_names). It must be handed back with
+ * dir_release.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @FirstCluster: First cluster of the directory, 0 for the root directory.
+**/
+DIR_LIST *dir_list(VOLUME *Vol, WORD FirstCluster)
+{
+  VOLUME_CACHE *Cache = Vol->Cache;
+  pthread_mutex_t *Lock = &Cache->DirLocks[FirstCluster % DIR_CACHE_LOCKS];
+  DIR_LIST *List = dir_cache_get(Cache, FirstCluster);
+  DIR_LIST *Cached;
+  DIR_BUILD Build;
+  DWORD Gen;
+
+  while (List == NULL) {
+    Build.List = malloc(sizeof(DIR_LIST) + 16 * sizeof(DIR_ENTRY));
+    Build.Names = malloc(16 * sizeof(DIR_NAME));
+    Build.TextCap = 256;
+    Build.TextLen = 0;
+    Build.Text = malloc(Build.TextCap);
+
+    if (Build.List == NULL || Build.Names == NULL || Build.Text == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    /* The names are decoded once here, readdir and lookups only copy and
+     * compare them */
+    Gen = __atomic_load_n(&Cache->DirGens[FirstCluster], __ATOMIC_ACQUIRE);
+    Build.List->Count = 0;
+    dir_iterate_names(Vol, FirstCluster, dir_list_append, &Build);
+    List = Build.List;
+    List->Names = Build.Names;
+    List->Text = Build.Text;
+    List->Bytes = sizeof(DIR_LIST) + List->Count * (sizeof(DIR_ENTRY) + sizeof(DIR_NAME)) +
+                  Build.TextLen;
+
+    /* Another thread may have read the same directory meanwhile, the first
+     * list published wins. A list read while the directory was changed may
+     * miss the change, it is read again. The cache holds one reference, the
+     * caller the other */
+    pthread_mutex_lock(Lock);
+    if (Cache->DirGens[FirstCluster] != Gen) {
+      pthread_mutex_unlock(Lock);
+      dir_list_free(List);
+      List = dir_cache_get(Cache, FirstCluster);
+      continue;
+    }
+    Cached = Cache->Dirs[FirstCluster];
+    if (Cached != NULL) {
+      __atomic_add_fetch(&Cached->Refs, 1, __ATOMIC_RELAXED);
+      Cached->Used = 1;
+      pthread_mutex_unlock(Lock);
+      dir_list_free(List);
+      return Cached;
+    }
+    List->Refs = 2;
+    List->Used = 1;
+    __atomic_store_n(&Cache->Dirs[FirstCluster], List, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(Lock);
+
+    __atomic_add_fetch(&Cache->DirBytes, List->Bytes, __ATOMIC_RELAXED);
+    dir_cache_charge(Vol, List->Bytes);
+  }
+  return List;
+}
+
+/* Hands back a list got from dir_list */
+void dir_release(DIR_LIST *List)
+{
+  if (__atomic_sub_fetch(&List->Refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    dir_list_free(List);
+  }
+}
+
+/* Drops a directory from the cache after it was modified, the next dir_list
+ * reads it again. Lists still in use keep the old entries */
+void dir_invalidate(VOLUME *Vol, WORD FirstCluster)
+{
+  VOLUME_CACHE *Cache = Vol->Cache;
+  pthread_mutex_t *Lock = &Cache->DirLocks[FirstCluster % DIR_CACHE_LOCKS];
+  DIR_LIST *List;
+
+  pthread_mutex_lock(Lock);
+  List = Cache->Dirs[FirstCluster];
+  Cache->Dirs[FirstCluster] = NULL;
+  __atomic_add_fetch(&Cache->DirGens[FirstCluster], 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(Lock);
+
+  if (List == NULL) {
+    return;
+  }
+
+  size_t Bytes = List->Bytes;
+
+  __atomic_sub_fetch(&Cache->DirBytes, Bytes, __ATOMIC_RELAXED);
+  if (Cache->Budget != NULL) {
+    pthread_mutex_lock(&Cache->Budget->lock);
+    Cache->Budget->Bytes -= Bytes;
+    pthread_mutex_unlock(&Cache->Budget->lock);
+  }
+  dir_release(List);
+}
+
+/* Whether the entries of a directory are already in the directory cache */
+int dir_cached(VOLUME *Vol, WORD FirstCluster)
+{
+  return __atomic_load_n(&Vol->Cache->Dirs[FirstCluster], __ATOMIC_ACQUIRE) != NULL;
+}
+
+/* Usage of a directory once it has been added up, NULL before */
+DIR_USAGE *dir_usage(VOLUME *Vol, WORD FirstCluster)
+{
+  DIR_USAGE **Usage = __atomic_load_n(&Vol->Cache->Usage, __ATOMIC_ACQUIRE);
+
+  return Usage != NULL ? __atomic_load_n(&Usage[FirstCluster], __ATOMIC_ACQUIRE) : NULL;
+}
+
+/**
+ * Counts a change to the files of a directory in its usage and in the usage
+ * of every directory above it, for those that have been added up. Called
+ * with the write lock of the volume taken.
+ * ============================================================================
+ * Return
+ * There is no return in this function.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @FirstCluster: First cluster of the directory, 0 for the root directory.
+ * @Size: Bytes the files of the directory grew by (negative if they shrank).
+ * @Files: Files added to the directory (negative if removed).
+**/
+void dir_usage_add(VOLUME *Vol, WORD FirstCluster, int64_t Size, int64_t Files)
+{
+  DIR_USAGE *Usage = dir_usage(Vol, FirstCluster);
+
+  while (Usage != NULL) {
+    __atomic_add_fetch(&Usage->Size, (uint64_t) Size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&Usage->Files, (uint64_t) Files, __ATOMIC_RELAXED);
+    if (Usage->Parent == FirstCluster) {
+      break;
+    }
+    FirstCluster = Usage->Parent;
+    Usage = dir_usage(Vol, FirstCluster);
+  }
+}
+
+/**
+ * Reads bytes of a file through the sector buffer, sector by sector.
+ * ============================================================================
+ * Return
+ * Number of bytes copied into the buffer, 0 if offset is at or beyond the end
+ * of the file or -EIO if the cluster chain ends or breaks before the range.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Dir: Directory entry of the file.
+ * @buffer: Where the bytes are copied to.
+ * @size: Number of bytes requested.
+ * @offset: Offset of the first requested byte in the file.
+**/
+int read_file(VOLUME *Vol, DIR_ENTRY *Dir, char *buffer, size_t size, off_t offset)
+{
+  size_t i;
+  int j;
+
+  /* Size is exactly the number of bytes requested or 0 if offset was at or
+   * beyond the end of file */
+  if (offset >= Dir->DIR_FileSize) {
+    return 0;
+  }
+  if (offset + size > Dir->DIR_FileSize) {
+    size = Dir->DIR_FileSize - offset;
+  }
+
+  /* Whole sectors are read, so round the buffer up to the next sector */
+  DWORD SectorSize = Vol->Geo.SectorSize;
+  size_t BufferSize = (size + offset + Vol->Geo.SectorMask) & ~(size_t) Vol->Geo.SectorMask;
+  BYTE *sector_buffer = malloc(BufferSize * sizeof(BYTE));
+
+  if (sector_buffer == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* We calculate the first cluster location of the file */
+  CHAIN_WALK Walk;
+
+  if (chain_start(Vol, &Walk, Dir->DIR_FstClusLO) != 0) {
+    free(sector_buffer);
+    return -EIO;
+  }
+  DWORD FirstSectorofCluster = ((Walk.Cluster - 2) << Vol->Geo.SecPerClusShift) +
+    Vol->FirstDataSector;
+
+  /* Read bytes from the given path into the buffer */
+  for (i = 0, j = 0; i < size + offset; i += SectorSize, j++) {
+    sector_read(Vol->fd, FirstSectorofCluster + j, Vol->Geo.SectorShift, sector_buffer + i);
+
+    /* End of cluster, fetches the next one if more bytes are needed */
+    if (j + 1 == Vol->Bpb.BPB_SecPerClus && i + SectorSize < size + offset) {
+      if (chain_next(Vol, &Walk) != 1) {
+        free(sector_buffer);
+        return -EIO;
+      }
+
+      /* Calculates its first sector */
+      FirstSectorofCluster = ((Walk.Cluster - 2) << Vol->Geo.SecPerClusShift) +
+        Vol->FirstDataSector;
+
+      j = -1;
+    }
+  }
+
+  memcpy(buffer, sector_buffer + offset, size);
+
+  free(sector_buffer);
+  return size;
+}
+
+/**
+ * Body of file_extents for clusters of 1 << ClusterShift bytes. It is always
+ * inlined, so the variants below get the shift as a constant.
+ * ============================================================================
+ * Return
+ * See file_extents.
+ * ============================================================================
+ * Parameters
+ * See file_extents.
+ * @ClusterShift: log2 of the cluster size in bytes.
+**/
+static inline __attribute__((always_inline))
+int extents_by_shift(VOLUME *Vol, DIR_ENTRY *Dir, off_t offset, size_t size,
+                     EXTENT *Extents, int MaxExtents, unsigned int ClusterShift)
+{
+  const DWORD ClusterSize = (DWORD) 1 << ClusterShift;
+  CHAIN_WALK Walk;
+  off_t Skipped;
+  int n = 0;
+
+  if (chain_start(Vol, &Walk, Dir->DIR_FstClusLO) != 0) {
+    return -1;
+  }
+
+  /* Skips the clusters that come before the offset */
+  for (Skipped = offset >> ClusterShift; Skipped > 0; Skipped--) {
+    if (chain_next(Vol, &Walk) != 1) {
+      return -1;
+    }
+  }
+
+  /* Part of the first cluster before the range */
+  size_t Skip = offset & (ClusterSize - 1);
+
+  while (size > 0) {
+    size_t Length = ClusterSize - Skip;
+    if (Length > size) {
+      Length = size;
+    }
+    off_t ImageOffset = Vol->Geo.DataOffset +
+      ((off_t) (Walk.Cluster - 2) << ClusterShift) + Skip;
+
+    /* Grows the last extent if this cluster follows it on the image */
+    if (n > 0 && Extents[n - 1].ImageOffset + Extents[n - 1].Length == ImageOffset) {
+      Extents[n - 1].Length += Length;
+    } else {
+      if (n == MaxExtents) {
+        return -1;
+      }
+      Extents[n].ImageOffset = ImageOffset;
+      Extents[n].Length = Length;
+      n++;
+    }
+
+    size -= Length;
+    Skip = 0;
+
+    if (size > 0 && chain_next(Vol, &Walk) != 1) {
+      return -1;
+    }
+  }
+
+  return n;
+}
+
+/* file_extents for one cluster size known at compile time */
+#define FILE_EXTENTS_VARIANT(Shift) \
+  static int file_extents_##Shift(VOLUME *Vol, DIR_ENTRY *Dir, off_t offset, size_t size, \
+                                  EXTENT *Extents, int MaxExtents) \
+  { \
+    return extents_by_shift(Vol, Dir, offset, size, Extents, MaxExtents, Shift); \
+  }
+
+/* 512 bytes per sector, 1 to 64 sectors per cluster */
+FILE_EXTENTS_VARIANT(9)
+FILE_EXTENTS_VARIANT(10)
+FILE_EXTENTS_VARIANT(11)
+FILE_EXTENTS_VARIANT(12)
+FILE_EXTENTS_VARIANT(13)
+FILE_EXTENTS_VARIANT(14)
+FILE_EXTENTS_VARIANT(15)
+
+/* Any other cluster size, the shift read from the geometry */
+static int file_extents_any(VOLUME *Vol, DIR_ENTRY *Dir, off_t offset, size_t size,
+                            EXTENT *Extents, int MaxExtents)
+{
+  return extents_by_shift(Vol, Dir, offset, size, Extents, MaxExtents,
+                          Vol->Geo.ClusterShift);
+}
+
+/**
+ * Maps a byte range of a file to the physically contiguous runs of the image
+ * that hold it. Adjacent clusters of the chain are merged into one extent.
+ * ============================================================================
+ * Return
+ * Number of extents filled, or -1 if the range needs more than MaxExtents
+ * extents or runs past the end of the cluster chain.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Dir: Directory entry of the file.
+ * @offset: Offset of the first byte of the range in the file.
+ * @size: Number of bytes in the range.
+ * @Extents: Array that receives the extents.
+ * @MaxExtents: Capacity of the Extents array.
+**/
+int file_extents(VOLUME *Vol, DIR_ENTRY *Dir, off_t offset, size_t size,
+                 EXTENT *Extents, int MaxExtents)
+{
+  return Vol->Geo.Extents(Vol, Dir, offset, size, Extents, MaxExtents);
+}
+
+/**
+ * Counts the physically contiguous runs of clusters that hold the data of a
+ * file, as file_extents would map the whole file, without filling them in.
+ * ============================================================================
+ * Return
+ * Number of runs, 0 for an empty file, or -1 if the cluster chain is shorter
+ * than the file or broken.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Dir: Directory entry of the file.
+**/
+int file_runs(VOLUME *Vol, DIR_ENTRY *Dir)
+{
+  DWORD Clusters = ((uint64_t) Dir->DIR_FileSize + Vol->Geo.ClusterSize - 1) >>
+                   Vol->Geo.ClusterShift;
+  CHAIN_WALK Walk;
+  WORD Prev;
+  int n = 1;
+
+  if (Clusters == 0) {
+    return 0;
+  }
+  if (chain_start(Vol, &Walk, Dir->DIR_FstClusLO) != 0) {
+    return -1;
+  }
+  while (--Clusters > 0) {
+    Prev = Walk.Cluster;
+    if (chain_next(Vol, &Walk) != 1) {
+      return -1;
+    }
+    if (Walk.Cluster != Prev + 1) {
+      n++;
+    }
+  }
+  return n;
+}
+
+/* Position of a power of two, -1 for anything else */
+static int log2_exact(DWORD Value)
+{
+  int Shift = 0;
+
+  if (Value == 0 || (Value & (Value - 1)) != 0) {
+    return -1;
+  }
+  while ((Value >> Shift) != 1) {
+    Shift++;
+  }
+  return Shift;
+}
+
+/**
+ * Fills the geometry of the volume from its BPB: shifts and masks of the
+ * sector and cluster sizes, and the file_extents variant for its cluster
+ * size. The data region offset is left to the caller.
+ * ============================================================================
+ * Return
+ * 0 on success, -1 if the sector size is not a power of two from 512 to 4096
+ * or the number of sectors per cluster is not a power of two.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System, with
+ * the BPB read.
+**/
+int geometry_init(VOLUME *Vol)
+{
+  static const file_extents_fn Variants[] = {
+    file_extents_9, file_extents_10, file_extents_11, file_extents_12,
+    file_extents_13, file_extents_14, file_extents_15
+  };
+  GEOMETRY *Geo = &Vol->Geo;
+  int SectorShift = log2_exact(Vol->Bpb.BPB_BytsPerSec);
+  int SecPerClusShift = log2_exact(Vol->Bpb.BPB_SecPerClus);
+
+  if (SectorShift < 9 || SectorShift > 12 || SecPerClusShift < 0) {
+    return -1;
+  }
+
+  Geo->SectorShift = SectorShift;
+  Geo->SectorSize = (DWORD) 1 << SectorShift;
+  Geo->SectorMask = Geo->SectorSize - 1;
+  Geo->SecPerClusShift = SecPerClusShift;
+  Geo->ClusterShift = SectorShift + SecPerClusShift;
+  Geo->ClusterSize = (DWORD) 1 << Geo->ClusterShift;
+  Geo->ClusterMask = Geo->ClusterSize - 1;
+  Geo->FatEntsShift = SectorShift - 1;
+  Geo->DataOffset = 0;
+
+  if (Geo->ClusterShift >= 9 && Geo->ClusterShift <= 15) {
+    Geo->Extents = Variants[Geo->ClusterShift - 9];
+  } else {
+    Geo->Extents = file_extents_any;
+  }
+  return 0;
+}
+
+/**
+ * Converts the FAT write date and time of a directory entry.
+ * ============================================================================
+ * Return
+ * The modification time, in local time as FAT stores it.
+ * ============================================================================
+ * Parameters
+ * @Dir: Directory entry.
+**/
+time_t dir_mtime(DIR_ENTRY *Dir)
+{
+  struct tm t;
+
+  memset((char *) &t, 0, sizeof(struct tm));
+  t.tm_sec = (Dir->DIR_WrtTime & ((1 << 5) - 1)) * 2;
+  t.tm_min = (Dir->DIR_WrtTime >> 5) & ((1 << 6) - 1);
+  t.tm_hour = Dir->DIR_WrtTime >> 11;
+  t.tm_mday = (Dir->DIR_WrtDate & ((1 << 5) - 1));
+  t.tm_mon = ((Dir->DIR_WrtDate >> 5) & ((1 << 4) - 1)) - 1;
+  t.tm_year = 80 + (Dir->DIR_WrtDate >> 9);
+  t.tm_isdst = -1;
+  return mktime(&t);
+}
+
+/**
+ * Highest cluster number that exists both in the data region and in the
+ * first FAT, never past the last number FAT16 gives to data clusters.
+ * ============================================================================
+ * Return
+ * The highest valid cluster number (below 2 when there is no data region).
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+**/
+DWORD fat_max_cluster(VOLUME *Vol)
+{
+  BPB_BS *Bpb = &Vol->Bpb;
+  DWORD TotSec = Bpb->BPB_TotSec16 != 0 ? Bpb->BPB_TotSec16 : Bpb->BPB_TotSec32;
+  DWORD FatEntries = Bpb->BPB_FATSz16 * Bpb->BPB_BytsPerSec / 2;
+  DWORD MaxCluster = 1;
+
+  if (Bpb->BPB_SecPerClus != 0 && TotSec > Vol->FirstDataSector) {
+    MaxCluster = (TotSec - Vol->FirstDataSector) / Bpb->BPB_SecPerClus + 1;
+  }
+  if (MaxCluster + 1 > FatEntries) {
+    MaxCluster = FatEntries > 0 ? FatEntries - 1 : 0;
+  }
+  if (MaxCluster > 0xfff6) {
+    MaxCluster = 0xfff6;
+  }
+  return MaxCluster;
+}
+
+/* Counts a walk given up on a broken chain, logging the first ones */
+static void chain_abort(VOLUME *Vol, WORD ClusterN, WORD Value)
+{
+  DWORD n = __atomic_add_fetch(&Vol->AbortedWalks, 1, __ATOMIC_RELAXED);
+
+  if (n <= CHAIN_ABORTS_LOGGED) {
+    log_msg("Broken cluster chain at cluster %u (FAT entry 0x%04x)\n", ClusterN, Value);
+  }
+}
+
+/**
+ * Starts a walk along a cluster chain.
+ * ============================================================================
+ * Return
+ * 0 if the first cluster is a data cluster, -1 (counted as an aborted walk)
+ * otherwise.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Walk: Walk to start, Walk->Cluster is the first cluster on success.
+ * @First: First cluster of the chain.
+**/
+int chain_start(VOLUME *Vol, CHAIN_WALK *Walk, WORD First)
+{
+  if (First < 2 || First > Vol->MaxCluster) {
+    chain_abort(Vol, First, First);
+    return -1;
+  }
+  Walk->Cluster = First;
+  Walk->Steps = 1;
+  return 0;
+}
+
+/**
+ * Moves a walk to the next cluster of its chain. Any end of chain value
+ * (0xFFF8 to 0xFFFF) ends the walk; a free, reserved or bad entry, or a
+ * cluster out of the data region, breaks it, and so does a walk longer than
+ * the volume has clusters, which can only be going round a cycle.
+ * ============================================================================
+ * Return
+ * 1 if Walk->Cluster is now the next cluster, 0 at the end of the chain, -1
+ * (counted as an aborted walk) if the chain is broken.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Walk: Walk started by chain_start.
+**/
+int chain_next(VOLUME *Vol, CHAIN_WALK *Walk)
+{
+  WORD Next = fat_entry_by_cluster(Vol, Walk->Cluster);
+
+  if (Next >= FAT_EOC) {
+    return 0;
+  }
+  if (Next < 2 || Next > Vol->MaxCluster || Walk->Steps >= Vol->MaxCluster - 1) {
+    chain_abort(Vol, Walk->Cluster, Next);
+    return -1;
+  }
+  Walk->Cluster = Next;
+  Walk->Steps++;
+  return 1;
+}
+
+/**
+ * Fills the attributes of a file or directory from its directory entry.
+ * ============================================================================
+ * Return
+ * There is no return in this funcion.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Dir: Directory entry of the file.
+ * @stbuf: Attributes with st_blksize already set.
+**/
+void dir_stat(VOLUME *Vol, DIR_ENTRY *Dir, struct stat *stbuf)
+{
+  /* FAT-like permissions */
+  if (Dir->DIR_Attr & ATTR_DIRECTORY) {
+    stbuf->st_mode = S_IFDIR | 0755;
+  } else {
+    stbuf->st_mode = S_IFREG | 0755;
+  }
+
+  /* Read-only entries have no write permission */
+  if (Dir->DIR_Attr & ATTR_READ_ONLY) {
+    stbuf->st_mode &= ~0222;
+  }
+  stbuf->st_size = Dir->DIR_FileSize;
+
+  /* Number of blocks */
+  if (stbuf->st_size % stbuf->st_blksize != 0) {
+    stbuf->st_blocks = (int) (stbuf->st_size / stbuf->st_blksize) + 1;
+  } else {
+    stbuf->st_blocks = (int) (stbuf->st_size / stbuf->st_blksize);
+  }
+
+  /* Implementing the required FAT Date/Time attributes */
+  stbuf->st_ctime = stbuf->st_atime = stbuf->st_mtime = dir_mtime(Dir);
+}
+
+/**
+ * Creates a memory budget for the directory caches of several volumes.
+ * ============================================================================
+ * Return
+ * The budget, with no volume attached yet.
+ * ============================================================================
+ * Parameters
+ * @Limit: Bytes the attached directory caches may hold together, 0 for no
+ * limit.
+**/
+CACHE_BUDGET *cache_budget_new(size_t Limit)
+{
+  CACHE_BUDGET *Budget = calloc(1, sizeof(CACHE_BUDGET));
+
+  if (Budget == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_init(&Budget->lock, NULL);
+  Budget->Limit = Limit;
+  return Budget;
+}
+
+/* Releases a budget whose volumes are all closed */
+void cache_budget_free(CACHE_BUDGET *Budget)
+{
+  pthread_mutex_destroy(&Budget->lock);
+  free(Budget->Vols);
+  free(Budget);
+}
+
+/* Counts the directory cache of a volume, before it caches anything, against
+ * a budget */
+void cache_budget_attach(CACHE_BUDGET *Budget, VOLUME *Vol)
+{
+  pthread_mutex_lock(&Budget->lock);
+  Budget->Vols = realloc(Budget->Vols, (Budget->VolCnt + 1) * sizeof(VOLUME *));
+
+  if (Budget->Vols == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  Budget->Vols[Budget->VolCnt++] = Vol;
+  Vol->Cache->Budget = Budget;
+  pthread_mutex_unlock(&Budget->lock);
+}
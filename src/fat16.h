@@ -1,15 +1,43 @@
 #ifndef FAT16_H
 #define FAT16_H
 
-#define BYTES_PER_SECTOR 512
-
+#include <pthread.h>
 #include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
 #include "sector.h"
 
+#define BYTES_PER_DIR 32
+#define MAX_BYTES_PER_SECTOR 4096
+#define ATTR_READ_ONLY 0x01
+#define ATTR_HIDDEN 0x02
+#define ATTR_SYSTEM 0x04
+#define ATTR_VOLUME_ID 0x08
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+#define ATTR_LONG_NAME 0x0f
+#define ATTR_LONG_NAME_MASK 0x3f
+
+/* Characters of a long name held by one long name entry, the most entries
+ * of one name, and the longest name given out (in UTF-8 bytes) */
+#define LFN_CHARS 13
+#define LFN_MAX_ENTRIES 20
+#define FAT_NAME_MAX 255
+
+/* FAT entry of a bad cluster, and the lowest of the end of chain values */
+#define FAT_BAD_CLUSTER 0xfff7
+#define FAT_EOC 0xfff8
+
+/* Broken chains logged one by one, the rest are only counted */
+#define CHAIN_ABORTS_LOGGED 16
+
 typedef uint8_t BYTE;
 typedef uint16_t WORD;
 typedef uint32_t DWORD;
 
+/* FAT16 BPB Structure */
 typedef struct {
   BYTE BS_jmpBoot[3];
   BYTE BS_OEMName[8];
@@ -35,6 +63,7 @@ typedef struct {
   WORD Signature_word;
 } __attribute__ ((packed)) BPB_BS;
 
+/* FAT Directory Structure */
 typedef struct {
   BYTE DIR_Name[11];
   BYTE DIR_Attr;
@@ -50,13 +79,200 @@ typedef struct {
   DWORD DIR_FileSize;
 } __attribute__ ((packed)) DIR_ENTRY;
 
+/* VFAT long name entry, stored right before the short entry it names, the
+ * last part of the name first */
+typedef struct {
+  BYTE LDIR_Ord;
+  BYTE LDIR_Name1[10];
+  BYTE LDIR_Attr;
+  BYTE LDIR_Type;
+  BYTE LDIR_Chksum;
+  BYTE LDIR_Name2[12];
+  WORD LDIR_FstClusLO;
+  BYTE LDIR_Name3[4];
+} __attribute__ ((packed)) LFN_ENTRY;
+
+/* Long name entry of the last part of a name, and the mask of its order */
+#define LFN_LAST 0x40
+#define LFN_ORD_MASK 0x1f
+
+/* Name of an entry of a directory list, decoded once when the directory is
+ * read: the long name if the entry has a valid one, the short name
+ * otherwise */
+typedef struct {
+  DWORD Hash;
+  DWORD Off;
+} DIR_NAME;
+
+/* Files and directories of a directory, in directory order, and their names
+ * (Text + Names[i].Off). A list handed out by dir_list stays valid until
+ * dir_release, even if it is evicted meanwhile */
+typedef struct {
+  DWORD Refs;
+  BYTE Used;
+  DWORD Count;
+  size_t Bytes;
+  DIR_NAME *Names;
+  char *Text;
+  DIR_ENTRY Entries[];
+} DIR_LIST;
+
+/* One directory cache slot per cluster number, the root directory uses 0 */
+#define DIR_CACHE_SLOTS 65536
+
+/* Directory cache slots are locked in stripes */
+#define DIR_CACHE_LOCKS 64
+
+struct VOLUME;
+
+/* Memory limit shared by the directory caches of several volumes. Over the
+ * limit, the volume holding the most gives back first */
 typedef struct {
+  pthread_mutex_t lock;
+  size_t Limit;
+  size_t Bytes;
+  uint64_t Evictions;
+  struct VOLUME **Vols;
+  int VolCnt;
+} CACHE_BUDGET;
+
+/* Size of the files of a directory and all its subdirectories, and their
+ * number. Parent is the directory it was found in, or the directory itself
+ * when that is not known (it was added up first, or it is the root) */
+typedef struct {
+  uint64_t Size;
+  uint64_t Files;
+  WORD Parent;
+} DIR_USAGE;
+
+/* Metadata read from the image. The FAT is kept for the lifetime of the
+ * volume, directories until the budget (if any) evicts them. A sector of the
+ * FAT is copied in once, under FatLock. DirGens counts the changes made to
+ * each directory, so a list read across a change is never cached. Usage,
+ * one slot per cluster number like Dirs, is only allocated once a directory
+ * usage is asked for; a directory there has all its subdirectories there too */
+typedef struct {
+  WORD *Fat;
+  BYTE *FatLoaded;
+  pthread_mutex_t FatLock;
+  DIR_LIST **Dirs;
+  DWORD *DirGens;
+  size_t DirBytes;
+  pthread_mutex_t DirLocks[DIR_CACHE_LOCKS];
+  DWORD Hand;
+  CACHE_BUDGET *Budget;
+  DIR_USAGE **Usage;
+} VOLUME_CACHE;
+
+/* Physically contiguous run of bytes of a file inside the image */
+typedef struct {
+  off_t ImageOffset;
+  size_t Length;
+} EXTENT;
+
+/* Maps a byte range of a file to extents (see file_extents) */
+typedef int (*file_extents_fn)(struct VOLUME *Vol, DIR_ENTRY *Dir, off_t offset,
+                               size_t size, EXTENT *Extents, int MaxExtents);
+
+/* Sector and cluster sizes as shifts and masks, so the hot paths never
+ * divide. Set once by volume_open, with the file_extents variant built
+ * for the cluster size of the volume */
+typedef struct {
+  DWORD SectorSize;
+  DWORD SectorMask;
+  BYTE SectorShift;
+  BYTE SecPerClusShift;
+  DWORD ClusterSize;
+  DWORD ClusterMask;
+  BYTE ClusterShift;
+  BYTE FatEntsShift;
+  off_t DataOffset;
+  file_extents_fn Extents;
+} GEOMETRY;
+
+struct OVERLAY;
+struct DELAYED;
+
+/* FAT16 volume data with a file handler of the FAT16 image file. Appends
+ * waiting for their clusters and the files open for writing (see modify.h)
+ * are under WriteLock */
+typedef struct VOLUME {
+  FILE *fd;
+  VOLUME_CACHE *Cache;
+  struct OVERLAY *Overlay;
+  pthread_mutex_t WriteLock;
+  struct DELAYED *Delayed;
+  size_t DelayedLimit;
+  size_t DelayedBytes;
+  DWORD DelayedClusters;
+  struct WRITERS *Writers;
   DWORD FirstRootDirSecNum;
   DWORD FirstDataSector;
+  DWORD MaxCluster;
+  DWORD AbortedWalks;
+  DWORD FreeClusters;
+  DWORD FreeRootEntries;
+  BYTE Counted;
+  GEOMETRY Geo;
   BPB_BS Bpb;
 } VOLUME;
 
-void find_root(FILE*, VOLUME, DIR_ENTRY, char**, int, int);
-void find_subdir(FILE*, VOLUME, DIR_ENTRY, char**, int, int, int);
+/* Byte offset of a data cluster in the image */
+static inline off_t cluster_offset(const VOLUME *Vol, WORD ClusterN)
+{
+  return Vol->Geo.DataOffset + ((off_t) (ClusterN - 2) << Vol->Geo.ClusterShift);
+}
+
+/* Position of a walk along a cluster chain (see chain_start and chain_next) */
+typedef struct {
+  WORD Cluster;
+  DWORD Steps;
+} CHAIN_WALK;
+
+/* Called for every entry of a directory, a non-zero return stops the walk */
+typedef int (*dir_entry_fn)(DIR_ENTRY *Entry, void *arg);
+
+/* Called for every file and directory of a directory with its name, a
+ * non-zero return stops the walk */
+typedef int (*dir_name_fn)(DIR_ENTRY *Entry, const char *Name, void *arg);
+
+/* Prototypes (documentation in the functions definitions) */
+VOLUME *volume_open(const char *ImagePath);
+void volume_close(VOLUME *Vol);
+void volume_count(VOLUME *Vol);
+VOLUME *pre_init_fat16(const char *ImagePath);
+int geometry_init(VOLUME *Vol);
+WORD fat_entry_by_cluster(VOLUME *Vol, WORD ClusterN);
+int path_next_name(const char **Path, BYTE *Name);
+BYTE *path_decode(BYTE *);
+void short_name(const BYTE *DirName, char *Name);
+int name_valid(const char *Name);
+BYTE lfn_checksum(const BYTE *DirName);
+DWORD name_hash(const char *Name, size_t Len);
+int path_lookup(VOLUME *Vol, const char *Path, DIR_ENTRY *Dir);
+int path_lookup_name(VOLUME *Vol, const char *Path, DIR_ENTRY *Dir, char *Name);
+int path_lookup_at(VOLUME *Vol, const DIR_ENTRY *Start, const char *Path,
+                   DIR_ENTRY *Dir);
+int dir_iterate(VOLUME *Vol, WORD FirstCluster, dir_entry_fn fn, void *arg);
+int dir_iterate_names(VOLUME *Vol, WORD FirstCluster, dir_name_fn fn, void *arg);
+DIR_LIST *dir_list(VOLUME *Vol, WORD FirstCluster);
+int dir_find(const DIR_LIST *List, const char *Name, size_t Len);
+void dir_release(DIR_LIST *List);
+void dir_invalidate(VOLUME *Vol, WORD FirstCluster);
+int dir_cached(VOLUME *Vol, WORD FirstCluster);
+DIR_USAGE *dir_usage(VOLUME *Vol, WORD FirstCluster);
+void dir_usage_add(VOLUME *Vol, WORD FirstCluster, int64_t Size, int64_t Files);
+int read_file(VOLUME *Vol, DIR_ENTRY *Dir, char *buffer, size_t size, off_t offset);
+int file_extents(VOLUME *Vol, DIR_ENTRY *Dir, off_t offset, size_t size,
+                 EXTENT *Extents, int MaxExtents);
+int file_runs(VOLUME *Vol, DIR_ENTRY *Dir);
+time_t dir_mtime(DIR_ENTRY *Dir);
+void dir_stat(VOLUME *Vol, DIR_ENTRY *Dir, struct stat *stbuf);
+DWORD fat_max_cluster(VOLUME *Vol);
+int chain_start(VOLUME *Vol, CHAIN_WALK *Walk, WORD First);
+int chain_next(VOLUME *Vol, CHAIN_WALK *Walk);
+CACHE_BUDGET *cache_budget_new(size_t Limit);
+void cache_budget_free(CACHE_BUDGET *Budget);
+void cache_budget_attach(CACHE_BUDGET *Budget, VOLUME *Vol);
 
 #endif
@@ -0,0 +1,90 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fat16list.h"
+
+/* Directory being listed and the records of the last call */
+struct FAT16LIST {
+  int fd;
+  uint32_t Next;
+  uint32_t Offset;
+  unsigned long Calls;
+  FAT16_LIST List;
+};
+
+FAT16LIST *fat16list_open(const char *Path)
+{
+  return fat16list_openat(AT_FDCWD, Path);
+}
+
+FAT16LIST *fat16list_openat(int DirFd, const char *Path)
+{
+  FAT16LIST *It = malloc(sizeof(FAT16LIST));
+
+  if (It == NULL) {
+    return NULL;
+  }
+  It->fd = openat(DirFd, Path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (It->fd < 0) {
+    free(It);
+    return NULL;
+  }
+  It->Next = 0;
+  It->Offset = 0;
+  It->Calls = 0;
+  It->List.Cursor = 0;
+  It->List.Count = 0;
+  It->List.Done = 0;
+  return It;
+}
+
+int fat16list_next(FAT16LIST *It, const FAT16_LIST_ENTRY **Entry)
+{
+  FAT16_LIST_ENTRY *Rec;
+
+  /* Records of the last call used up, the next call resumes at the cursor */
+  while (It->Next == It->List.Count) {
+    if (It->List.Done) {
+      return 0;
+    }
+    It->Calls++;
+    if (ioctl(It->fd, FAT16_IOC_LIST, &It->List) < 0) {
+      return -errno;
+    }
+    It->Next = 0;
+    It->Offset = 0;
+    if (It->List.Bytes > FAT16_LIST_DATA || (It->List.Count == 0 && !It->List.Done)) {
+      return -EIO;
+    }
+  }
+
+  Rec = (FAT16_LIST_ENTRY *) (It->List.Data + It->Offset);
+  if (It->Offset + sizeof(FAT16_LIST_ENTRY) > It->List.Bytes ||
+      Rec->RecLen < FAT16_LIST_RECLEN(Rec->NameLen) ||
+      It->Offset + Rec->RecLen > It->List.Bytes) {
+    return -EIO;
+  }
+  It->Offset += Rec->RecLen;
+  It->Next++;
+  *Entry = Rec;
+  return 1;
+}
+
+int fat16list_fd(const FAT16LIST *It)
+{
+  return It->fd;
+}
+
+unsigned long fat16list_calls(const FAT16LIST *It)
+{
+  return It->Calls;
+}
+
+void fat16list_close(FAT16LIST *It)
+{
+  close(It->fd);
+  free(It);
+}
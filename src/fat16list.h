@@ -0,0 +1,67 @@
+#ifndef FAT16LIST_H
+#define FAT16LIST_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/* Bytes of records a single FAT16_IOC_LIST call returns at most. The whole
+ * request has to fit in the 14 bit size of an ioctl number */
+#define FAT16_LIST_DATA (16 * 1024 - 32)
+
+/* A file or directory in the records of a listing, followed by its name (up
+ * to 255 bytes of UTF-8, terminated). Mode, Size and Mtime are what getattr
+ * answers; Extents is the number of contiguous runs of clusters holding the
+ * data of a file (0 for a directory, an empty file or a broken chain) */
+typedef struct {
+  uint16_t RecLen;
+  uint16_t NameLen;
+  uint32_t Mode;
+  uint64_t Size;
+  int64_t Mtime;
+  uint32_t FirstCluster;
+  uint32_t Extents;
+  char Name[];
+} __attribute__ ((packed)) FAT16_LIST_ENTRY;
+
+/* Bytes a record takes with a name of Len bytes, records start on 8 bytes */
+#define FAT16_LIST_RECLEN(Len) ((sizeof(FAT16_LIST_ENTRY) + (Len) + 1 + 7) & ~(size_t) 7)
+
+/* Argument of FAT16_IOC_LIST. Cursor is 0 to start from the first entry, and
+ * is handed back by every call to resume after the last entry returned; it
+ * still finds its place when entries were added or removed meanwhile. Done
+ * is set once the last entry of the directory has been returned */
+typedef struct {
+  uint64_t Cursor;
+  uint32_t Count;
+  uint32_t Bytes;
+  uint32_t Done;
+  uint32_t Reserved;
+  char Data[FAT16_LIST_DATA];
+} __attribute__ ((packed)) FAT16_LIST;
+
+/* Lists a directory of a mount_fat16 mount with the attributes of every
+ * entry, on a file descriptor of the directory */
+#define FAT16_IOC_LIST _IOWR(0xfa, 1, FAT16_LIST)
+
+/* Iterator over the listing of a directory (libfat16list) */
+typedef struct FAT16LIST FAT16LIST;
+
+/* Opens a directory of a mount for listing, Path relative to DirFd as with
+ * openat. NULL with errno set on failure */
+FAT16LIST *fat16list_open(const char *Path);
+FAT16LIST *fat16list_openat(int DirFd, const char *Path);
+
+/* Moves to the next entry: 1 with Entry set, 0 at the end or a negative
+ * errno value (ENOTTY when the directory is not on a mount_fat16 mount). The
+ * entry stays valid until the next call */
+int fat16list_next(FAT16LIST *It, const FAT16_LIST_ENTRY **Entry);
+
+/* File descriptor of the directory, for openat of its entries */
+int fat16list_fd(const FAT16LIST *It);
+
+/* Number of FAT16_IOC_LIST calls made so far */
+unsigned long fat16list_calls(const FAT16LIST *It);
+
+void fat16list_close(FAT16LIST *It);
+
+#endif
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "check.h"
+#include "fat16.h"
+
+int main(int argc, char *argv[])
+{
+  int threads = CHECK_THREADS;
+
+  if (argc != 2 && argc != 3) {
+    printf("Usage: ./fsck_fat16 <FAT16 image> [<threads>]\n");
+    exit(EXIT_FAILURE);
+  }
+  if (argc == 3) {
+    threads = atoi(argv[2]);
+  }
+
+  /* Initializing a FAT16 volume */
+  VOLUME *Vol = pre_init_fat16(argv[1]);
+
+  /* The report goes to stdout, the exit status tells whether it is clean */
+  int Problems = check_volume(Vol, threads, stdout);
+
+  volume_close(Vol);
+  return Problems == 0 ? 0 : EXIT_FAILURE;
+}
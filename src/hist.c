@@ -0,0 +1,70 @@
+#include "hist.h"
+
+/* Histogram bucket of a latency (us) */
+static int hist_bucket(uint64_t us)
+{
+  int p, i;
+
+  if (us < 16) {
+    return us;
+  }
+  p = 63 - __builtin_clzll(us);
+  i = 16 + (p - 4) * 8 + ((us >> (p - 3)) & 7);
+  return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+/* Largest latency (us) counted in a bucket */
+static uint64_t hist_upper(int i)
+{
+  int p;
+
+  if (i < 16) {
+    return i;
+  }
+  p = 4 + (i - 16) / 8;
+  return ((uint64_t) (8 + (i - 16) % 8 + 1) << (p - 3)) - 1;
+}
+
+/* Counts an operation that took 'us' microseconds */
+void hist_add(LAT_HIST *Hist, uint64_t us)
+{
+  Hist->Count++;
+  Hist->TotalUs += us;
+  if (us > Hist->MaxUs) {
+    Hist->MaxUs = us;
+  }
+  Hist->Buckets[hist_bucket(us)]++;
+}
+
+/* Adds the operations counted in From to Into */
+void hist_merge(LAT_HIST *Into, const LAT_HIST *From)
+{
+  int i;
+
+  Into->Count += From->Count;
+  Into->TotalUs += From->TotalUs;
+  if (From->MaxUs > Into->MaxUs) {
+    Into->MaxUs = From->MaxUs;
+  }
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    Into->Buckets[i] += From->Buckets[i];
+  }
+}
+
+/* Latency (us) under which a fraction q of the operations finished */
+uint64_t hist_percentile(const LAT_HIST *Hist, double q)
+{
+  uint64_t Want = (uint64_t) (q * Hist->Count + 0.999999), Seen = 0;
+  int i;
+
+  if (Hist->Count == 0) {
+    return 0;
+  }
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    Seen += Hist->Buckets[i];
+    if (Seen >= Want) {
+      return hist_upper(i) < Hist->MaxUs ? hist_upper(i) : Hist->MaxUs;
+    }
+  }
+  return Hist->MaxUs;
+}
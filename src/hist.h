@@ -0,0 +1,22 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+
+/* Latency histogram buckets: exact below 16us, then 8 per power of two */
+#define HIST_BUCKETS 320
+
+/* Latency distribution, in microseconds */
+typedef struct {
+  uint64_t Count;
+  uint64_t MaxUs;
+  uint64_t TotalUs;
+  uint64_t Buckets[HIST_BUCKETS];
+} LAT_HIST;
+
+/* Prototypes (documentation in the functions definitions) */
+void hist_add(LAT_HIST *Hist, uint64_t us);
+void hist_merge(LAT_HIST *Into, const LAT_HIST *From);
+uint64_t hist_percentile(const LAT_HIST *Hist, double q);
+
+#endif
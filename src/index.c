@@ -0,0 +1,502 @@
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "index.h"
+#include "log.h"
+
+/* File or directory found while walking the image */
+typedef struct {
+  char *Path;
+  DIR_ENTRY Dir;
+  DWORD FirstChild;
+  DWORD ChildCnt;
+  DWORD Sorted;
+} WALK_NODE;
+
+/* State of the walk over the whole directory tree */
+typedef struct {
+  WALK_NODE *Nodes;
+  DWORD Cnt;
+  DWORD Cap;
+  DWORD Parent;
+} WALK;
+
+/* Image identity the index is keyed by */
+static int image_identity(VOLUME *Vol, uint64_t *Size, int64_t *Mtime)
+{
+  struct stat st;
+
+  if (fstat(fileno(Vol->fd), &st) != 0) {
+    return -1;
+  }
+  *Size = st.st_size;
+  *Mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  return 0;
+}
+
+/* dir_iterate_names callback: appends the files and directories of a
+ * directory */
+static int walk_collect(DIR_ENTRY *Entry, const char *Name, void *arg)
+{
+  WALK *Walk = arg;
+  WALK_NODE *Node;
+  char *ParentPath;
+
+  if (Entry->DIR_Name[0] == '.') {
+    return 0;
+  }
+
+  /* Such a name could not be looked up by its path */
+  if (!name_valid(Name)) {
+    log_msg("%s%s%s: invalid name, not indexed\n", Walk->Nodes[Walk->Parent].Path,
+            Walk->Parent == 0 ? "" : "/", Name);
+    return 0;
+  }
+
+  if (Walk->Cnt == Walk->Cap) {
+    Walk->Cap *= 2;
+    Walk->Nodes = realloc(Walk->Nodes, Walk->Cap * sizeof(WALK_NODE));
+
+    if (Walk->Nodes == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  ParentPath = Walk->Nodes[Walk->Parent].Path;
+  Node = &Walk->Nodes[Walk->Cnt++];
+  Node->Path = malloc(strlen(ParentPath) + strlen(Name) + 2);
+
+  if (Node->Path == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* The root path already ends with '/' */
+  sprintf(Node->Path, "%s%s%s", ParentPath, Walk->Parent == 0 ? "" : "/", Name);
+  Node->Dir = *Entry;
+  Node->FirstChild = 0;
+  Node->ChildCnt = 0;
+  return 0;
+}
+
+/* Paths keep the case of their names and are sorted without regard to it,
+ * the order index_lookup searches them in */
+static int walk_node_cmp(const void *a, const void *b)
+{
+  return strcasecmp((*(WALK_NODE **) a)->Path, (*(WALK_NODE **) b)->Path);
+}
+
+/**
+ * Walks the whole directory tree of the volume once and writes the index
+ * file: the entries sorted by path, the children of every directory in
+ * directory order, the cluster runs of every file and the path strings.
+ * ============================================================================
+ * Return
+ * 0 on success, -1 if the index file could not be written.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @IndexPath: Path of the index file to create.
+**/
+int index_build(VOLUME *Vol, const char *IndexPath)
+{
+  DWORD ClusterSize = Vol->Geo.ClusterSize;
+  INDEX_HEADER Header;
+  uint64_t ImageSize;
+  int64_t ImageMtime;
+  WALK Walk;
+  DWORD i, j, k;
+  BYTE *Walked;
+
+  if (image_identity(Vol, &ImageSize, &ImageMtime) != 0) {
+    return -1;
+  }
+
+  Walk.Cap = 1024;
+  Walk.Cnt = 1;
+  Walk.Nodes = malloc(Walk.Cap * sizeof(WALK_NODE));
+
+  /* One bit per cluster, a directory reached twice is not walked again */
+  Walked = calloc(65536 / 8, 1);
+
+  if (Walk.Nodes == NULL || Walked == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* The root directory */
+  memset(&Walk.Nodes[0], 0, sizeof(WALK_NODE));
+  Walk.Nodes[0].Path = strdup("/");
+  Walk.Nodes[0].Dir.DIR_Attr = ATTR_DIRECTORY;
+
+  /* Breadth first: the children of a directory are contiguous in Nodes */
+  for (i = 0; i < Walk.Cnt; i++) {
+    WORD ClusterN = Walk.Nodes[i].Dir.DIR_FstClusLO;
+
+    if (!(Walk.Nodes[i].Dir.DIR_Attr & ATTR_DIRECTORY)) {
+      continue;
+    }
+    if (i != 0 && (ClusterN < 2 || Walked[ClusterN / 8] & (1 << (ClusterN % 8)))) {
+      continue;
+    }
+    Walked[ClusterN / 8] |= 1 << (ClusterN % 8);
+
+    Walk.Parent = i;
+    Walk.Nodes[i].FirstChild = Walk.Cnt;
+    dir_iterate_names(Vol, i == 0 ? 0 : ClusterN, walk_collect, &Walk);
+    Walk.Nodes[i].ChildCnt = Walk.Cnt - Walk.Nodes[i].FirstChild;
+  }
+  free(Walked);
+
+  /* Sorting by path */
+  WALK_NODE **Order = malloc(Walk.Cnt * sizeof(WALK_NODE *));
+
+  if (Order == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < Walk.Cnt; i++) {
+    Order[i] = &Walk.Nodes[i];
+  }
+  qsort(Order, Walk.Cnt, sizeof(WALK_NODE *), walk_node_cmp);
+  for (i = 0; i < Walk.Cnt; i++) {
+    Order[i]->Sorted = i;
+  }
+
+  /* Sizing the tables */
+  memset(&Header, 0, sizeof(Header));
+  memcpy(Header.Magic, INDEX_MAGIC, sizeof(Header.Magic));
+  Header.Version = INDEX_VERSION;
+  Header.VollID = Vol->Bpb.BS_VollID;
+  Header.ImageSize = ImageSize;
+  Header.ImageMtime = ImageMtime;
+  Header.EntryCnt = Walk.Cnt;
+  Header.ChildCnt = Walk.Cnt - 1;
+  for (i = 0; i < Walk.Cnt; i++) {
+    Header.NamesSize += strlen(Walk.Nodes[i].Path) + 1;
+  }
+
+  INDEX_ENTRY *Entries = calloc(Walk.Cnt, sizeof(INDEX_ENTRY));
+  DWORD *Children = malloc((Header.ChildCnt + 1) * sizeof(DWORD));
+  char *Names = malloc(Header.NamesSize);
+  DWORD ExtentCap = 1024;
+  INDEX_EXTENT *Extents = malloc(ExtentCap * sizeof(INDEX_EXTENT));
+
+  if (Entries == NULL || Children == NULL || Names == NULL || Extents == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  DWORD NamesOff = 0, ChildOff = 0;
+
+  for (i = 0; i < Walk.Cnt; i++) {
+    WALK_NODE *Node = Order[i];
+    INDEX_ENTRY *Entry = &Entries[i];
+
+    Entry->Dir = Node->Dir;
+    Entry->PathOff = NamesOff;
+    strcpy(Names + NamesOff, Node->Path);
+    NamesOff += strlen(Node->Path) + 1;
+
+    /* Children, in the order they have in the directory */
+    Entry->ChildIdx = ChildOff;
+    Entry->ChildCnt = Node->ChildCnt;
+    for (j = 0; j < Node->ChildCnt; j++) {
+      Children[ChildOff++] = Walk.Nodes[Node->FirstChild + j].Sorted;
+    }
+
+    /* Cluster runs of the file, as many clusters as its size needs */
+    Entry->ExtentIdx = Header.ExtentCnt;
+    if (!(Node->Dir.DIR_Attr & ATTR_DIRECTORY) && Node->Dir.DIR_FileSize > 0) {
+      DWORD Clusters = (Node->Dir.DIR_FileSize + ClusterSize - 1) / ClusterSize;
+      CHAIN_WALK ChainWalk;
+      int More = chain_start(Vol, &ChainWalk, Node->Dir.DIR_FstClusLO) == 0;
+
+      for (k = 0; k < Clusters && More; k++) {
+        WORD ClusterN = ChainWalk.Cluster;
+
+        if (Entry->ExtentCnt > 0 &&
+            Extents[Header.ExtentCnt - 1].Cluster + Extents[Header.ExtentCnt - 1].Count == ClusterN) {
+          Extents[Header.ExtentCnt - 1].Count++;
+        } else {
+          if (Header.ExtentCnt == ExtentCap) {
+            ExtentCap *= 2;
+            Extents = realloc(Extents, ExtentCap * sizeof(INDEX_EXTENT));
+
+            if (Extents == NULL) {
+              log_msg("Out of memory!\n");
+              exit(EXIT_FAILURE);
+            }
+          }
+          Extents[Header.ExtentCnt].Cluster = ClusterN;
+          Extents[Header.ExtentCnt].Count = 1;
+          Header.ExtentCnt++;
+          Entry->ExtentCnt++;
+        }
+        More = k + 1 < Clusters && chain_next(Vol, &ChainWalk) == 1;
+      }
+    }
+  }
+
+  Header.EntriesOff = sizeof(INDEX_HEADER);
+  Header.ChildrenOff = Header.EntriesOff + (uint64_t) Header.EntryCnt * sizeof(INDEX_ENTRY);
+  Header.ExtentsOff = Header.ChildrenOff + (uint64_t) Header.ChildCnt * sizeof(DWORD);
+  Header.NamesOff = Header.ExtentsOff + (uint64_t) Header.ExtentCnt * sizeof(INDEX_EXTENT);
+
+  /* Written aside and renamed, a mount never maps a half written index */
+  char *TmpPath = malloc(strlen(IndexPath) + 5);
+
+  if (TmpPath == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  sprintf(TmpPath, "%s.tmp", IndexPath);
+  FILE *out = fopen(TmpPath, "wb");
+  int res = -1;
+
+  if (out != NULL) {
+    if (fwrite(&Header, sizeof(Header), 1, out) == 1 &&
+        fwrite(Entries, sizeof(INDEX_ENTRY), Header.EntryCnt, out) == Header.EntryCnt &&
+        fwrite(Children, sizeof(DWORD), Header.ChildCnt, out) == Header.ChildCnt &&
+        fwrite(Extents, sizeof(INDEX_EXTENT), Header.ExtentCnt, out) == Header.ExtentCnt &&
+        fwrite(Names, 1, Header.NamesSize, out) == Header.NamesSize) {
+      res = 0;
+    }
+    if (fclose(out) != 0) {
+      res = -1;
+    }
+    if (res == 0 && rename(TmpPath, IndexPath) != 0) {
+      res = -1;
+    }
+    if (res != 0) {
+      unlink(TmpPath);
+    }
+  }
+
+  for (i = 0; i < Walk.Cnt; i++) {
+    free(Walk.Nodes[i].Path);
+  }
+  free(Walk.Nodes);
+  free(Order);
+  free(Entries);
+  free(Children);
+  free(Names);
+  free(Extents);
+  free(TmpPath);
+  return res;
+}
+
+/**
+ * Maps an index file and checks that it belongs to the mounted image.
+ * ============================================================================
+ * Return
+ * The mapped index, or NULL if it is missing, malformed or stale (built for
+ * another volume ID, image size or modification time).
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @IndexPath: Path of the index file.
+**/
+INDEX *index_open(VOLUME *Vol, const char *IndexPath)
+{
+  struct stat st;
+  uint64_t ImageSize;
+  int64_t ImageMtime;
+  int fd = open(IndexPath, O_RDONLY);
+
+  if (fd < 0) {
+    log_msg("Index %s: cannot be opened\n", IndexPath);
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(INDEX_HEADER)) {
+    log_msg("Index %s: truncated\n", IndexPath);
+    close(fd);
+    return NULL;
+  }
+
+  void *Map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (Map == MAP_FAILED) {
+    log_msg("Index %s: cannot be mapped\n", IndexPath);
+    return NULL;
+  }
+
+  INDEX_HEADER *Header = Map;
+  uint64_t End = Header->NamesOff + Header->NamesSize;
+
+  if (memcmp(Header->Magic, INDEX_MAGIC, sizeof(Header->Magic)) != 0 ||
+      Header->Version != INDEX_VERSION || End > (uint64_t) st.st_size ||
+      Header->EntryCnt == 0 || Header->NamesSize == 0 ||
+      Header->ChildrenOff != Header->EntriesOff + (uint64_t) Header->EntryCnt * sizeof(INDEX_ENTRY) ||
+      Header->ExtentsOff != Header->ChildrenOff + (uint64_t) Header->ChildCnt * sizeof(DWORD) ||
+      Header->NamesOff != Header->ExtentsOff + (uint64_t) Header->ExtentCnt * sizeof(INDEX_EXTENT)) {
+    log_msg("Index %s: malformed\n", IndexPath);
+    munmap(Map, st.st_size);
+    return NULL;
+  }
+
+  if (image_identity(Vol, &ImageSize, &ImageMtime) != 0 ||
+      Header->VollID != Vol->Bpb.BS_VollID || Header->ImageSize != ImageSize ||
+      Header->ImageMtime != ImageMtime) {
+    log_msg("Index %s: stale, built for another image\n", IndexPath);
+    munmap(Map, st.st_size);
+    return NULL;
+  }
+
+  INDEX *Index = malloc(sizeof(INDEX));
+
+  if (Index == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  Index->Map = Map;
+  Index->MapSize = st.st_size;
+  Index->Header = Header;
+  Index->Entries = (INDEX_ENTRY *) ((char *) Map + Header->EntriesOff);
+  Index->Children = (DWORD *) ((char *) Map + Header->ChildrenOff);
+  Index->Extents = (INDEX_EXTENT *) ((char *) Map + Header->ExtentsOff);
+  Index->Names = (char *) Map + Header->NamesOff;
+
+  /* The names table must end with a path terminator */
+  if (Index->Names[Header->NamesSize - 1] != '\0') {
+    log_msg("Index %s: malformed\n", IndexPath);
+    index_close(Index);
+    return NULL;
+  }
+  return Index;
+}
+
+void index_close(INDEX *Index)
+{
+  munmap(Index->Map, Index->MapSize);
+  free(Index);
+}
+
+/**
+ * Binary search of a path among the index entries. The lookup is case
+ * insensitive, like FAT names are, and relies on the entries being in the
+ * strcasecmp order of their whole paths (see INDEX_ENTRY), the order
+ * index_build sorts them in.
+ * ============================================================================
+ * Return
+ * The entry of the path, or NULL if there is none.
+ * ============================================================================
+ * Parameters
+ * @Index: Mapped index.
+ * @path: Absolute path, as handed by FUSE.
+**/
+INDEX_ENTRY *index_lookup(INDEX *Index, const char *path)
+{
+  char Key[4096];
+  size_t len = strlen(path);
+  DWORD lo = 0, hi = Index->Header->EntryCnt;
+
+  if (len == 0 || len >= sizeof(Key)) {
+    return NULL;
+  }
+
+  /* Paths are indexed without a trailing '/' */
+  memcpy(Key, path, len);
+  while (len > 1 && Key[len - 1] == '/') {
+    len--;
+  }
+  Key[len] = '\0';
+
+  while (lo < hi) {
+    DWORD mid = lo + (hi - lo) / 2;
+    DWORD PathOff = Index->Entries[mid].PathOff;
+    int cmp;
+
+    if (PathOff >= Index->Header->NamesSize) {
+      return NULL;
+    }
+    cmp = strcasecmp(Key, Index->Names + PathOff);
+    if (cmp == 0) {
+      return &Index->Entries[mid];
+    }
+    if (cmp < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return NULL;
+}
+
+/* Last component of the path of an entry */
+const char *index_name(INDEX *Index, INDEX_ENTRY *Entry)
+{
+  const char *Path = Index->Names + Entry->PathOff;
+  const char *Slash = strrchr(Path, '/');
+
+  return Slash != NULL ? Slash + 1 : Path;
+}
+
+/**
+ * Same as file_extents, but from the cluster runs stored in the index, so no
+ * FAT sector is read.
+ * ============================================================================
+ * Return
+ * Number of extents filled, or -1 if the range needs more than MaxExtents
+ * extents or runs past the indexed clusters.
+ * ============================================================================
+ * Parameters
+ * @Index: Mapped index.
+ * @Vol: Structure that contains essential data about the File System.
+ * @Entry: Index entry of the file.
+ * @offset: Offset of the first byte of the range in the file.
+ * @size: Number of bytes in the range.
+ * @Extents: Array that receives the extents.
+ * @MaxExtents: Capacity of the Extents array.
+**/
+int index_extents(INDEX *Index, VOLUME *Vol, INDEX_ENTRY *Entry, off_t offset,
+                  size_t size, EXTENT *Extents, int MaxExtents)
+{
+  DWORD ClusterSize = Vol->Geo.ClusterSize;
+  off_t RunStart = 0;
+  DWORD i;
+  int n = 0;
+
+  if (Entry->ExtentIdx + (uint64_t) Entry->ExtentCnt > Index->Header->ExtentCnt) {
+    return -1;
+  }
+
+  for (i = 0; i < Entry->ExtentCnt && size > 0; i++) {
+    INDEX_EXTENT *Run = &Index->Extents[Entry->ExtentIdx + i];
+    off_t RunLength = (off_t) Run->Count * ClusterSize;
+
+    if (Run->Cluster < 2 || Run->Cluster + (uint64_t) Run->Count - 1 > Vol->MaxCluster) {
+      return -1;
+    }
+
+    if (RunStart + RunLength > offset) {
+      off_t Skip = offset - RunStart;
+      size_t Length = RunLength - Skip;
+
+      if (Length > size) {
+        Length = size;
+      }
+      if (n == MaxExtents) {
+        return -1;
+      }
+      Extents[n].ImageOffset = cluster_offset(Vol, Run->Cluster) + Skip;
+      Extents[n].Length = Length;
+      n++;
+
+      offset += Length;
+      size -= Length;
+    }
+    RunStart += RunLength;
+  }
+
+  return size > 0 ? -1 : n;
+}
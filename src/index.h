@@ -0,0 +1,68 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "fat16.h"
+
+#define INDEX_MAGIC "FAT16IDX"
+#define INDEX_VERSION 2
+
+/* Index file header. The index belongs to the image with the same volume ID,
+ * size and modification time, any other image gets it rejected */
+typedef struct {
+  BYTE Magic[8];
+  DWORD Version;
+  DWORD VollID;
+  uint64_t ImageSize;
+  int64_t ImageMtime;
+  DWORD EntryCnt;
+  DWORD ChildCnt;
+  DWORD ExtentCnt;
+  DWORD NamesSize;
+  uint64_t EntriesOff;
+  uint64_t ChildrenOff;
+  uint64_t ExtentsOff;
+  uint64_t NamesOff;
+} __attribute__ ((packed)) INDEX_HEADER;
+
+/* A file or directory. Entries are sorted by whole path in strcasecmp order
+ * (bytes of the paths with ASCII letters lowered), the root ("/") first; it
+ * is the order index_lookup searches and must not change without a new
+ * INDEX_VERSION. The entries of one directory are not always next to each
+ * other ("/a-b" sorts between "/a" and "/a/x"), its children are the
+ * ChildCnt entries listed from ChildIdx */
+typedef struct {
+  DWORD PathOff;
+  DWORD ExtentIdx;
+  DWORD ExtentCnt;
+  DWORD ChildIdx;
+  DWORD ChildCnt;
+  DIR_ENTRY Dir;
+} __attribute__ ((packed)) INDEX_ENTRY;
+
+/* Run of contiguous clusters of a file */
+typedef struct {
+  DWORD Cluster;
+  DWORD Count;
+} __attribute__ ((packed)) INDEX_EXTENT;
+
+/* Index mapped in memory */
+typedef struct {
+  void *Map;
+  size_t MapSize;
+  INDEX_HEADER *Header;
+  INDEX_ENTRY *Entries;
+  DWORD *Children;
+  INDEX_EXTENT *Extents;
+  char *Names;
+} INDEX;
+
+/* Prototypes (documentation in the functions definitions) */
+int index_build(VOLUME *Vol, const char *IndexPath);
+INDEX *index_open(VOLUME *Vol, const char *IndexPath);
+void index_close(INDEX *Index);
+INDEX_ENTRY *index_lookup(INDEX *Index, const char *path);
+const char *index_name(INDEX *Index, INDEX_ENTRY *Entry);
+int index_extents(INDEX *Index, VOLUME *Vol, INDEX_ENTRY *Entry, off_t offset,
+                  size_t size, EXTENT *Extents, int MaxExtents);
+
+#endif
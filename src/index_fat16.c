@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fat16.h"
+#include "index.h"
+
+int main(int argc, char *argv[])
+{
+  if (argc != 3) {
+    printf("Usage: ./index_fat16 <FAT16 image> <index file>\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Initializing a FAT16 volume */
+  VOLUME *Vol = pre_init_fat16(argv[1]);
+
+  if (index_build(Vol, argv[2]) != 0) {
+    printf("%s: could not write the index\n", argv[2]);
+    exit(EXIT_FAILURE);
+  }
+
+  volume_close(Vol);
+  return 0;
+}
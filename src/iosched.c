@@ -0,0 +1,472 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hist.h"
+#include "iosched.h"
+#include "sector.h"
+#include "log.h"
+
+/* A read waiting in the scheduler, lives on the caller's stack */
+typedef struct IOSCHED_REQ {
+  FILE *fd;
+  void *buffer;
+  size_t size;
+  off_t offset;
+  int Lane;
+  ssize_t Result;
+  uint64_t Arrival;
+  int Done;
+  pthread_cond_t done;
+  struct IOSCHED_REQ *next;
+} IOSCHED_REQ;
+
+/* Requests served by a single read of an image, linked in offset order */
+typedef struct {
+  FILE *fd;
+  off_t Start;
+  off_t End;
+  IOSCHED_REQ *Reqs;
+} IOSCHED_GROUP;
+
+/* Queue of one class of reads and its statistics */
+typedef struct {
+  /* Requests not yet in a batch, in arrival order */
+  IOSCHED_REQ *Head, *Tail;
+  int PendingCnt;
+
+  /* Current batch: its merged reads, handed out to the dispatchers in order */
+  IOSCHED_GROUP *Groups;
+  int GroupCnt, GroupNext;
+  IOSCHED_REQ **Sorted;
+  int Cap;
+  int Forming;
+
+  /* Requests in the last batch, and where its last read ended (the elevator
+   * keeps going up from there) */
+  int LastBatch;
+  off_t Pos;
+
+  uint64_t Reads, Late;
+  LAT_HIST Latency;
+} IOSCHED_LANE;
+
+static const char *lane_names[IOSCHED_LANES] = { "meta", "data" };
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+static int running, stopping;
+static unsigned int window_us, meta_weight;
+static uint64_t deadline_ns;
+static IOSCHED_LANE lanes[IOSCHED_LANES];
+
+/* Metadata reads served in a row while data was waiting */
+static unsigned int meta_run;
+
+/* Lane and time of the batch being sorted */
+static IOSCHED_LANE *sort_lane;
+static uint64_t sort_now;
+
+/* Lane of the metadata reads of this thread, -1 for the metadata lane */
+static __thread int thread_lane = -1;
+
+static pthread_t *threads;
+static int nthreads;
+
+/* Monotonic clock in nanoseconds */
+static uint64_t iosched_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int req_late(const IOSCHED_REQ *Req)
+{
+  return sort_now - Req->Arrival >= deadline_ns;
+}
+
+/* Late requests first, then image by image one sweep up from the lane
+ * position, then the requests behind it, each in offset order */
+static int req_cmp(const void *a, const void *b)
+{
+  const IOSCHED_REQ *A = *(IOSCHED_REQ * const *) a;
+  const IOSCHED_REQ *B = *(IOSCHED_REQ * const *) b;
+  int LateA = req_late(A), LateB = req_late(B);
+  int WrapA = A->offset < sort_lane->Pos, WrapB = B->offset < sort_lane->Pos;
+
+  if (LateA != LateB) {
+    return LateB - LateA;
+  }
+  if (A->fd != B->fd) {
+    return fileno(A->fd) < fileno(B->fd) ? -1 : 1;
+  }
+  if (WrapA != WrapB) {
+    return WrapA - WrapB;
+  }
+  if (A->offset != B->offset) {
+    return A->offset < B->offset ? -1 : 1;
+  }
+  return 0;
+}
+
+/* Turns every pending request of a lane into its next batch. Called with the
+ * lock held */
+static void batch_form(IOSCHED_LANE *L)
+{
+  IOSCHED_REQ *Req, *Tail = NULL;
+  int i, n = 0;
+
+  if (L->PendingCnt > L->Cap) {
+    L->Cap = L->PendingCnt * 2;
+    L->Sorted = realloc(L->Sorted, L->Cap * sizeof(IOSCHED_REQ *));
+    L->Groups = realloc(L->Groups, L->Cap * sizeof(IOSCHED_GROUP));
+
+    if (L->Sorted == NULL || L->Groups == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (Req = L->Head; Req != NULL; Req = Req->next) {
+    L->Sorted[n++] = Req;
+  }
+  L->Head = L->Tail = NULL;
+  L->PendingCnt = 0;
+
+  sort_lane = L;
+  sort_now = iosched_now();
+  qsort(L->Sorted, n, sizeof(IOSCHED_REQ *), req_cmp);
+
+  /* Neighbours in the sweep share a read when they overlap or are close */
+  L->GroupCnt = 0;
+  L->GroupNext = 0;
+  for (i = 0; i < n; i++) {
+    IOSCHED_GROUP *G = L->GroupCnt > 0 ? &L->Groups[L->GroupCnt - 1] : NULL;
+    off_t End;
+
+    Req = L->Sorted[i];
+    Req->next = NULL;
+    End = Req->offset + Req->size;
+    if (req_late(Req)) {
+      L->Late++;
+    }
+
+    if (G != NULL && Req->fd == G->fd && Req->offset >= G->Start &&
+        Req->offset <= G->End + IOSCHED_MERGE_GAP &&
+        (End > G->End ? End : G->End) - G->Start <= IOSCHED_MAX_MERGE) {
+      if (End > G->End) {
+        G->End = End;
+      }
+      Tail->next = Req;
+    } else {
+      G = &L->Groups[L->GroupCnt++];
+      G->fd = Req->fd;
+      G->Start = Req->offset;
+      G->End = End;
+      G->Reqs = Req;
+    }
+    Tail = Req;
+  }
+
+  if (L->GroupCnt > 0) {
+    L->Pos = L->Groups[L->GroupCnt - 1].End;
+  }
+  L->LastBatch = n;
+  L->Reads += L->GroupCnt;
+}
+
+/* Hands the result to a request and wakes its caller */
+static void req_complete(IOSCHED_REQ *Req, ssize_t Result)
+{
+  uint64_t us = (iosched_now() - Req->Arrival) / 1000;
+  IOSCHED_LANE *L = &lanes[Req->Lane];
+
+  pthread_mutex_lock(&sched_lock);
+  hist_add(&L->Latency, us);
+  Req->Result = Result;
+  Req->Done = 1;
+  pthread_cond_signal(&Req->done);
+  pthread_mutex_unlock(&sched_lock);
+}
+
+/**
+ * Issues the read of a group and copies every request's part of it.
+ * ============================================================================
+ * Return
+ * There is no return in this function.
+ * ============================================================================
+ * Parameters
+ * @G: Group to read.
+ * @Merge: Buffer of IOSCHED_MAX_MERGE bytes for groups of several requests.
+**/
+static void group_dispatch(IOSCHED_GROUP *G, char *Merge)
+{
+  IOSCHED_REQ *Req = G->Reqs, *next;
+  ssize_t Result;
+
+  /* Alone in its read: straight into the caller's buffer */
+  if (Req->next == NULL) {
+    req_complete(Req, sector_pread(G->fd, Req->buffer, Req->size, Req->offset));
+    return;
+  }
+
+  Result = sector_pread(G->fd, Merge, G->End - G->Start, G->Start);
+  for (; Req != NULL; Req = next) {
+    off_t Skip = Req->offset - G->Start;
+    ssize_t Got = Result;
+
+    /* The caller may be gone as soon as it is completed */
+    next = Req->next;
+    if (Result >= 0) {
+      Got = Result > Skip ? Result - Skip : 0;
+      if (Got > (ssize_t) Req->size) {
+        Got = Req->size;
+      }
+      memcpy(Req->buffer, Merge + Skip, Got);
+    }
+    req_complete(Req, Got);
+  }
+}
+
+/* Waits up to the window for the data readers of the last batch to queue
+ * their next requests. Metadata arriving cuts it short. Called with the lock
+ * held */
+static void data_window(IOSCHED_LANE *Data, IOSCHED_LANE *Meta)
+{
+  struct timespec until;
+
+  if (Data->LastBatch <= 1 || window_us == 0) {
+    return;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_nsec += (long) window_us * 1000;
+  until.tv_sec += until.tv_nsec / 1000000000;
+  until.tv_nsec %= 1000000000;
+  while (Data->PendingCnt < Data->LastBatch && Meta->Head == NULL && !stopping) {
+    if (pthread_cond_timedwait(&sched_cond, &sched_lock, &until) == ETIMEDOUT) {
+      break;
+    }
+  }
+}
+
+/* Dispatcher loop: metadata reads first, with every meta_weight-th read
+ * going to waiting data; batches are formed when a lane's current one is
+ * handed out */
+static void *iosched_dispatcher(void *unused)
+{
+  IOSCHED_LANE *Meta = &lanes[IOSCHED_META], *Data = &lanes[IOSCHED_DATA];
+  char *Merge = malloc(IOSCHED_MAX_MERGE);
+  IOSCHED_GROUP G;
+
+  if (Merge == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_lock(&sched_lock);
+  for (;;) {
+    int MetaWork = Meta->GroupNext < Meta->GroupCnt || Meta->Head != NULL;
+    int DataWork = Data->GroupNext < Data->GroupCnt || Data->Head != NULL;
+    int DataTurn = !MetaWork || meta_run >= meta_weight;
+
+    if (Data->GroupNext < Data->GroupCnt && DataTurn) {
+      G = Data->Groups[Data->GroupNext++];
+      meta_run = 0;
+    } else if (Data->Head != NULL && Data->GroupNext == Data->GroupCnt &&
+               !Data->Forming && DataTurn && MetaWork) {
+      /* Data's turn while metadata keeps coming: no window */
+      batch_form(Data);
+      pthread_cond_broadcast(&sched_cond);
+      continue;
+    } else if (Meta->GroupNext < Meta->GroupCnt) {
+      G = Meta->Groups[Meta->GroupNext++];
+      if (DataWork) {
+        meta_run++;
+      }
+    } else if (Meta->Head != NULL) {
+      batch_form(Meta);
+      pthread_cond_broadcast(&sched_cond);
+      continue;
+    } else if (Data->Head != NULL && Data->GroupNext == Data->GroupCnt && !Data->Forming) {
+      /* Several readers were active: give them the window to line up their
+       * next requests, so they are sorted together */
+      Data->Forming = 1;
+      data_window(Data, Meta);
+      batch_form(Data);
+      Data->Forming = 0;
+      pthread_cond_broadcast(&sched_cond);
+      continue;
+    } else {
+      if (!MetaWork && !DataWork && stopping) {
+        break;
+      }
+      pthread_cond_wait(&sched_cond, &sched_lock);
+      continue;
+    }
+
+    pthread_mutex_unlock(&sched_lock);
+    group_dispatch(&G, Merge);
+    pthread_mutex_lock(&sched_lock);
+  }
+  pthread_mutex_unlock(&sched_lock);
+
+  free(Merge);
+  return NULL;
+}
+
+/* sector_read goes through here while the scheduler runs */
+static ssize_t iosched_meta_pread(FILE *fd, void *buffer, size_t size, off_t offset)
+{
+  return iosched_pread(fd, buffer, size, offset,
+                       thread_lane >= 0 ? thread_lane : IOSCHED_META);
+}
+
+void iosched_start(int depth, unsigned int window, unsigned int deadline,
+                   unsigned int weight)
+{
+  int i;
+
+  if (depth <= 0) {
+    return;
+  }
+
+  threads = malloc(depth * sizeof(pthread_t));
+
+  if (threads == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  window_us = window;
+  deadline_ns = (uint64_t) deadline * 1000;
+  meta_weight = weight;
+  stopping = 0;
+  for (i = 0; i < depth; i++) {
+    if (pthread_create(&threads[i], NULL, iosched_dispatcher, NULL) != 0) {
+      break;
+    }
+  }
+  nthreads = i;
+  __atomic_store_n(&running, nthreads > 0, __ATOMIC_RELEASE);
+  if (nthreads > 0) {
+    sector_set_reader(iosched_meta_pread);
+  }
+}
+
+void iosched_stop(void)
+{
+  int i;
+
+  if (nthreads == 0) {
+    return;
+  }
+
+  /* New reads go straight to the image, queued ones are still served */
+  sector_set_reader(NULL);
+  pthread_mutex_lock(&sched_lock);
+  __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+  stopping = 1;
+  pthread_cond_broadcast(&sched_cond);
+  pthread_mutex_unlock(&sched_lock);
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  threads = NULL;
+  nthreads = 0;
+
+  for (i = 0; i < IOSCHED_LANES; i++) {
+    IOSCHED_LANE *L = &lanes[i];
+
+    log_msg("I/O scheduler %s: %llu requests in %llu reads, %llu past their "
+            "deadline, latency p50 %lluus p99 %lluus max %lluus\n", lane_names[i],
+            (unsigned long long) L->Latency.Count, (unsigned long long) L->Reads,
+            (unsigned long long) L->Late,
+            (unsigned long long) hist_percentile(&L->Latency, 0.50),
+            (unsigned long long) hist_percentile(&L->Latency, 0.99),
+            (unsigned long long) L->Latency.MaxUs);
+    free(L->Groups);
+    free(L->Sorted);
+    L->Groups = NULL;
+    L->Sorted = NULL;
+    L->Cap = L->GroupCnt = L->GroupNext = 0;
+  }
+}
+
+ssize_t iosched_pread(FILE *fd, void *buffer, size_t size, off_t offset, int Lane)
+{
+  IOSCHED_LANE *L;
+  IOSCHED_REQ Req;
+
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    return sector_pread(fd, buffer, size, offset);
+  }
+
+  Req.fd = fd;
+  Req.buffer = buffer;
+  Req.size = size;
+  Req.offset = offset;
+  Req.Lane = Lane;
+  Req.Done = 0;
+  Req.next = NULL;
+  Req.Arrival = iosched_now();
+  pthread_cond_init(&Req.done, NULL);
+
+  pthread_mutex_lock(&sched_lock);
+  if (!running) {
+    pthread_mutex_unlock(&sched_lock);
+    pthread_cond_destroy(&Req.done);
+    return sector_pread(fd, buffer, size, offset);
+  }
+  L = &lanes[Lane];
+  if (L->Tail == NULL) {
+    L->Head = &Req;
+  } else {
+    L->Tail->next = &Req;
+  }
+  L->Tail = &Req;
+  L->PendingCnt++;
+  pthread_cond_broadcast(&sched_cond);
+
+  while (!Req.Done) {
+    pthread_cond_wait(&Req.done, &sched_lock);
+  }
+  pthread_mutex_unlock(&sched_lock);
+
+  pthread_cond_destroy(&Req.done);
+  return Req.Result;
+}
+
+void iosched_thread_lane(int Lane)
+{
+  thread_lane = Lane;
+}
+
+int iosched_report(char *buffer, size_t size)
+{
+  int i, Length;
+  size_t Used = 0;
+
+  pthread_mutex_lock(&sched_lock);
+  Length = snprintf(buffer, size, "lane requests reads late p50_us p99_us max_us\n");
+  for (i = 0; i < IOSCHED_LANES; i++) {
+    IOSCHED_LANE *L = &lanes[i];
+
+    Used = (size_t) Length < size ? (size_t) Length : size;
+    Length += snprintf(buffer + Used, size - Used, "%s %llu %llu %llu %llu %llu %llu\n",
+                       lane_names[i], (unsigned long long) L->Latency.Count,
+                       (unsigned long long) L->Reads, (unsigned long long) L->Late,
+                       (unsigned long long) hist_percentile(&L->Latency, 0.50),
+                       (unsigned long long) hist_percentile(&L->Latency, 0.99),
+                       (unsigned long long) L->Latency.MaxUs);
+  }
+  pthread_mutex_unlock(&sched_lock);
+  return Length;
+}
@@ -0,0 +1,52 @@
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/* Default time (us) the scheduler waits for more data requests before
+ * dispatching a batch, only while several readers are active */
+#define IOSCHED_WINDOW_US 200
+
+/* Default age (us) past which a request is served before the sorted ones */
+#define IOSCHED_DEADLINE_US 20000
+
+/* Default number of metadata reads served in a row before bulk data, when
+ * both are waiting, gets a read */
+#define IOSCHED_META_WEIGHT 8
+
+/* Largest read (bytes) requests are merged into */
+#define IOSCHED_MAX_MERGE (1024 * 1024)
+
+/* Largest hole (bytes) between two requests that are still merged */
+#define IOSCHED_MERGE_GAP (32 * 1024)
+
+/* Lanes: directory and FAT sectors, and file data */
+#define IOSCHED_META 0
+#define IOSCHED_DATA 1
+#define IOSCHED_LANES 2
+
+/* Starts the scheduler with 'depth' dispatching threads. Reads of the images
+ * are gathered for 'window' us, sorted by image and offset and merged, the
+ * metadata lane ahead of the data lane. sector_read goes through the
+ * metadata lane while it runs */
+void iosched_start(int depth, unsigned int window, unsigned int deadline,
+                   unsigned int meta_weight);
+
+/* Serves the requests still queued, stops and joins the dispatchers */
+void iosched_stop(void);
+
+/* Reads 'size' bytes at 'offset' of the image through a lane of the
+ * scheduler, or directly when it is not running. Same result as
+ * sector_pread */
+ssize_t iosched_pread(FILE *fd, void *buffer, size_t size, off_t offset, int Lane);
+
+/* Puts the metadata reads of the calling thread in another lane, for
+ * background work that must not get ahead of the data */
+void iosched_thread_lane(int Lane);
+
+/* Writes the per-lane request counts and latencies as text. Returns the
+ * length of the whole report, which is cut at 'size' bytes */
+int iosched_report(char *buffer, size_t size);
+
+#endif
@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <string.h>
+
+#include "fat16.h"
+#include "libfat16.h"
+#include "log.h"
+
+/* Position of an iteration over a cached directory */
+struct LIBFAT16_DIR {
+  LIBFAT16 *Fs;
+  DIR_LIST *List;
+  DWORD Next;
+};
+
+/* Fills a node from its directory entry and the name it is listed under */
+static void node_fill(LIBFAT16_NODE *Node, DIR_ENTRY *Dir, const char *Name)
+{
+  strcpy(Node->Name, Name);
+  Node->Attr = Dir->DIR_Attr;
+  Node->FirstCluster = Dir->DIR_FstClusLO;
+  Node->Size = Dir->DIR_FileSize;
+  Node->Mtime = Dir->DIR_Name[0] == '/' ? 0 : dir_mtime(Dir);
+}
+
+LIBFAT16 *libfat16_open_image(const char *ImagePath)
+{
+  return volume_open(ImagePath);
+}
+
+void libfat16_close_image(LIBFAT16 *Fs)
+{
+  volume_close(Fs);
+}
+
+int libfat16_lookup(LIBFAT16 *Fs, const char *Path, LIBFAT16_NODE *Node)
+{
+  DIR_ENTRY Dir;
+  char Name[FAT_NAME_MAX + 1];
+  int res = path_lookup_name(Fs, Path, &Dir, Name);
+
+  if (res == 0) {
+    node_fill(Node, &Dir, Name);
+  }
+  return res;
+}
+
+int libfat16_is_dir(const LIBFAT16_NODE *Node)
+{
+  return (Node->Attr & ATTR_DIRECTORY) != 0;
+}
+
+int libfat16_stat(LIBFAT16 *Fs, const char *Path, struct stat *st)
+{
+  DIR_ENTRY Dir;
+  int res = path_lookup(Fs, Path, &Dir);
+
+  if (res != 0) {
+    return res;
+  }
+
+  memset(st, 0, sizeof(struct stat));
+  st->st_dev = Fs->Bpb.BS_VollID;
+  st->st_blksize = Fs->Geo.ClusterSize;
+
+  /* The root directory has no entry of its own */
+  if (Dir.DIR_Name[0] == '/') {
+    st->st_mode = S_IFDIR | 0755;
+    return 0;
+  }
+  dir_stat(Fs, &Dir, st);
+  return 0;
+}
+
+LIBFAT16_DIR *libfat16_opendir(LIBFAT16 *Fs, const char *Path)
+{
+  DIR_ENTRY Dir;
+  int res = path_lookup(Fs, Path, &Dir);
+
+  if (res != 0) {
+    errno = -res;
+    return NULL;
+  }
+  if (!(Dir.DIR_Attr & ATTR_DIRECTORY)) {
+    errno = ENOTDIR;
+    return NULL;
+  }
+
+  LIBFAT16_DIR *It = malloc(sizeof(LIBFAT16_DIR));
+
+  if (It == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  It->Fs = Fs;
+  It->List = dir_list(Fs, Dir.DIR_FstClusLO);
+  It->Next = 0;
+  return It;
+}
+
+int libfat16_readdir(LIBFAT16_DIR *It, LIBFAT16_NODE *Node)
+{
+  while (It->Next < It->List->Count) {
+    DWORD i = It->Next++;
+    DIR_ENTRY *Entry = &It->List->Entries[i];
+
+    if (Entry->DIR_Name[0] != '.') {
+      node_fill(Node, Entry, It->List->Text + It->List->Names[i].Off);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void libfat16_closedir(LIBFAT16_DIR *It)
+{
+  dir_release(It->List);
+  free(It);
+}
+
+/**
+ * Reads a byte range of a file straight into the caller's buffer, one read of
+ * the image per physically contiguous extent.
+ * ============================================================================
+ * Return
+ * Number of bytes read, 0 if offset is at or beyond the end of the file,
+ * -EISDIR for a directory, -EINVAL for a negative offset or -EIO if the
+ * cluster chain is broken or the image could not be read.
+ * ============================================================================
+ * Parameters
+ * @Fs: Opened image.
+ * @Node: File, from libfat16_lookup or libfat16_readdir.
+ * @buffer: Where the bytes are copied to.
+ * @size: Number of bytes requested.
+ * @offset: Offset of the first requested byte in the file.
+**/
+ssize_t libfat16_pread(LIBFAT16 *Fs, const LIBFAT16_NODE *Node, void *buffer,
+                       size_t size, off_t offset)
+{
+  DIR_ENTRY Dir;
+  size_t done = 0;
+  int i, n;
+
+  if (Node->Attr & ATTR_DIRECTORY) {
+    return -EISDIR;
+  }
+  if (offset < 0) {
+    return -EINVAL;
+  }
+  if (offset >= Node->Size) {
+    return 0;
+  }
+  if (offset + size > Node->Size) {
+    size = Node->Size - offset;
+  }
+
+  memset(&Dir, 0, sizeof(DIR_ENTRY));
+  Dir.DIR_Attr = Node->Attr;
+  Dir.DIR_FstClusLO = Node->FirstCluster;
+  Dir.DIR_FileSize = Node->Size;
+
+  /* A range never touches more than one extent per cluster */
+  int MaxExtents = (size >> Fs->Geo.ClusterShift) + 2;
+  EXTENT *Extents = malloc(MaxExtents * sizeof(EXTENT));
+
+  if (Extents == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  n = file_extents(Fs, &Dir, offset, size, Extents, MaxExtents);
+  for (i = 0; i < n; i++) {
+    if (sector_pread(Fs->fd, (char *) buffer + done, Extents[i].Length,
+                     Extents[i].ImageOffset) != (ssize_t) Extents[i].Length) {
+      break;
+    }
+    done += Extents[i].Length;
+  }
+
+  free(Extents);
+  return n < 0 || i < n ? -EIO : (ssize_t) size;
+}
@@ -0,0 +1,57 @@
+#ifndef LIBFAT16_H
+#define LIBFAT16_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* An opened FAT16 image. Opaque: only the calls below look inside it */
+typedef struct VOLUME LIBFAT16;
+
+/* A file or directory of the image, as found by libfat16_lookup and
+ * libfat16_readdir. Name is its long name in UTF-8 (up to 255 bytes) when it
+ * has one, its short name otherwise */
+typedef struct {
+  char Name[256];
+  uint8_t Attr;
+  uint16_t FirstCluster;
+  uint32_t Size;
+  time_t Mtime;
+} LIBFAT16_NODE;
+
+/* Iterator over the entries of a directory */
+typedef struct LIBFAT16_DIR LIBFAT16_DIR;
+
+/* Every call may be made from several threads on the same handle. Calls
+ * returning int or ssize_t return a negative errno value on failure, calls
+ * returning a pointer return NULL and set errno */
+
+/* Opens a FAT16 image, read-only */
+LIBFAT16 *libfat16_open_image(const char *ImagePath);
+
+/* Closes an image and releases everything read from it */
+void libfat16_close_image(LIBFAT16 *Fs);
+
+/* Finds a file or directory by its absolute path ("/" is the root), without
+ * regard to case */
+int libfat16_lookup(LIBFAT16 *Fs, const char *Path, LIBFAT16_NODE *Node);
+
+/* Whether a node is a directory */
+int libfat16_is_dir(const LIBFAT16_NODE *Node);
+
+/* Attributes of a file or directory, as a mount of the image shows them */
+int libfat16_stat(LIBFAT16 *Fs, const char *Path, struct stat *st);
+
+/* Iterates over the files and directories of a directory ("." and ".."
+ * are left out). libfat16_readdir returns 1 with Node filled, 0 at the end */
+LIBFAT16_DIR *libfat16_opendir(LIBFAT16 *Fs, const char *Path);
+int libfat16_readdir(LIBFAT16_DIR *Dir, LIBFAT16_NODE *Node);
+void libfat16_closedir(LIBFAT16_DIR *Dir);
+
+/* Reads up to 'size' bytes of a file at 'offset' into the caller's buffer.
+ * Returns the number of bytes read, 0 at or past the end of the file */
+ssize_t libfat16_pread(LIBFAT16 *Fs, const LIBFAT16_NODE *Node, void *buffer,
+                       size_t size, off_t offset);
+
+#endif
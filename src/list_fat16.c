@@ -0,0 +1,107 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fat16list.h"
+
+/* Whether subdirectories are listed too (-r) */
+static int Recursive;
+
+/* Directories listed and FAT16_IOC_LIST calls made, for -s */
+static unsigned long Dirs, Calls;
+
+static void usage(void)
+{
+  printf("Usage: ./list_fat16 [-r] [-s] <directory of a mount_fat16 mount>...\n");
+  printf("  -r   list subdirectories too\n");
+  printf("  -s   print the directories listed and the calls made\n");
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * Prints one line per entry of a directory: mode, size, modification time,
+ * first cluster, extents and path. Subdirectories are opened relative to
+ * the directory, so their path is never resolved from the root again.
+ * ============================================================================
+ * Return
+ * 0, or -1 if any directory could not be listed (reported on stderr).
+ * ============================================================================
+ * Parameters
+ * @DirFd: Directory Path is relative to.
+ * @Path: Directory to list.
+ * @Shown: How its entries are prefixed in the output.
+**/
+static int list_dir(int DirFd, const char *Path, const char *Shown)
+{
+  FAT16LIST *It = fat16list_openat(DirFd, Path);
+  const FAT16_LIST_ENTRY *Entry;
+  size_t ShownLen = strlen(Shown);
+  int Slash = ShownLen > 0 && Shown[ShownLen - 1] == '/';
+  int res, failed = 0;
+
+  if (It == NULL) {
+    fprintf(stderr, "%s: %s\n", Shown, strerror(errno));
+    return -1;
+  }
+
+  while ((res = fat16list_next(It, &Entry)) == 1) {
+    size_t Len = ShownLen + Entry->NameLen + 2;
+    char *Child = malloc(Len);
+
+    if (Child == NULL) {
+      fprintf(stderr, "Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    snprintf(Child, Len, "%s%s%s", Shown, Slash ? "" : "/", Entry->Name);
+    printf("%06o %10llu %11lld %5u %4u %s\n", Entry->Mode, (unsigned long long) Entry->Size,
+           (long long) Entry->Mtime, Entry->FirstCluster, Entry->Extents, Child);
+
+    if (Recursive && S_ISDIR(Entry->Mode) && list_dir(fat16list_fd(It), Entry->Name, Child) != 0) {
+      failed = 1;
+    }
+    free(Child);
+  }
+  if (res < 0) {
+    fprintf(stderr, "%s: %s\n", Shown, res == -ENOTTY ?
+            "not a directory of a mount_fat16 mount" : strerror(-res));
+    failed = 1;
+  }
+
+  Dirs++;
+  Calls += fat16list_calls(It);
+  fat16list_close(It);
+  return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int Summary = 0, failed = 0, c;
+
+  while ((c = getopt(argc, argv, "rs")) != -1) {
+    if (c == 'r') {
+      Recursive = 1;
+    } else if (c == 's') {
+      Summary = 1;
+    } else {
+      usage();
+    }
+  }
+  if (optind == argc) {
+    usage();
+  }
+
+  for (; optind < argc; optind++) {
+    if (list_dir(AT_FDCWD, argv[optind], argv[optind]) != 0) {
+      failed = 1;
+    }
+  }
+
+  if (Summary) {
+    fprintf(stderr, "%lu directories, %lu calls\n", Dirs, Calls);
+  }
+  return failed ? EXIT_FAILURE : 0;
+}
@@ -28,5 +28,8 @@ void log_msg(const char *format, ...)
 {
   va_list ap;
   va_start(ap, format);
-  vfprintf(logfile, format, ap);
+
+  /* Tools that never open the log file report on stderr */
+  vfprintf(logfile != NULL ? logfile : stderr, format, ap);
+  va_end(ap);
 }
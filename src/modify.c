@@ -0,0 +1,1224 @@
+#include <errno.h>
+#include <string.h>
+
+#include "modify.h"
+#include "overlay.h"
+#include "log.h"
+
+/* Bytes of zeros written at a time when a file grows past its end */
+#define ZERO_CHUNK (64 * 1024)
+
+static const BYTE zeros[ZERO_CHUNK];
+
+/* Called for each 32-byte slot of a directory with its image offset, a
+ * non-zero return stops the walk */
+typedef int (*dir_slot_fn)(DIR_ENTRY *Entry, off_t Offset, void *arg);
+
+/* What a slot walk looks for, and the long name entries found right before
+ * the entry (all of them have the checksum LongSum) */
+typedef struct {
+  const BYTE *Name;
+  DIR_ENTRY *Dir;
+  off_t Offset;
+  off_t Long[LFN_MAX_ENTRIES];
+  int LongCnt;
+  BYTE LongSum;
+} SLOT_SEARCH;
+
+/* Writes bytes of the image through the overlay */
+static int image_write(VOLUME *Vol, const void *buffer, size_t size, off_t offset)
+{
+  return overlay_write(Vol->Overlay, buffer, size, offset);
+}
+
+/**
+ * Sets the FAT entry of a cluster, in the in-memory FAT and in every FAT of
+ * the image.
+ * ============================================================================
+ * Return
+ * 0, or -EIO if the FAT sectors could not be written.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @ClusterN: Cluster whose entry is set.
+ * @Value: Next cluster, 0 for a free cluster or FAT_EOC_MARK.
+**/
+int fat_set(VOLUME *Vol, WORD ClusterN, WORD Value)
+{
+  DWORD FatSecIdx = ClusterN >> Vol->Geo.FatEntsShift;
+  BYTE *Sector = (BYTE *) Vol->Cache->Fat + ((size_t) FatSecIdx << Vol->Geo.SectorShift);
+  int i, res = 0;
+
+  /* The sector has to be in memory before one of its entries changes */
+  WORD Old = fat_entry_by_cluster(Vol, ClusterN);
+
+  __atomic_store_n(&Vol->Cache->Fat[ClusterN], Value, __ATOMIC_RELAXED);
+  if (__atomic_load_n(&Vol->Counted, __ATOMIC_ACQUIRE) && (Old == 0) != (Value == 0)) {
+    __atomic_add_fetch(&Vol->FreeClusters, Value == 0 ? 1 : -1, __ATOMIC_RELAXED);
+  }
+
+  for (i = 0; i < Vol->Bpb.BPB_NumFATS; i++) {
+    DWORD SectorN = Vol->Bpb.BPB_RsvdSecCnt + i * Vol->Bpb.BPB_FATSz16 + FatSecIdx;
+
+    if (image_write(Vol, Sector, Vol->Geo.SectorSize,
+                    (off_t) SectorN << Vol->Geo.SectorShift) != 0) {
+      res = -EIO;
+    }
+  }
+  return res;
+}
+
+/* Sets the write date and time of a directory entry (local time, 2 second
+ * resolution, nothing before 1980) */
+void fat_time_encode(time_t t, DIR_ENTRY *Dir)
+{
+  struct tm tm;
+
+  localtime_r(&t, &tm);
+  if (tm.tm_year < 80) {
+    Dir->DIR_WrtDate = (1 << 5) | 1;
+    Dir->DIR_WrtTime = 0;
+    return;
+  }
+  Dir->DIR_WrtDate = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+  Dir->DIR_WrtTime = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+}
+
+/**
+ * Finds free clusters in a row for a chain growing by Want clusters: the
+ * first run that long at or after Hint (wrapping around), or else the
+ * longest run of the volume. Runs never wrap around.
+ * ============================================================================
+ * Return
+ * 0, or -ENOSPC if no cluster is free.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Hint: Where the search starts, right after the end of the chain.
+ * @Want: Number of clusters wanted.
+ * @First: Receives the first cluster of the run.
+ * @Length: Receives the number of clusters of the run, at most Want.
+**/
+static int cluster_run(VOLUME *Vol, DWORD Hint, DWORD Want, WORD *First, DWORD *Length)
+{
+  DWORD i, Count = Vol->MaxCluster - 1, Run = 0, Best = 0;
+
+  if (Vol->MaxCluster < 2) {
+    return -ENOSPC;
+  }
+  if (Hint < 2 || Hint > Vol->MaxCluster) {
+    Hint = 2;
+  }
+  for (i = 0; i < Count && Best < Want; i++) {
+    DWORD c = Hint + i;
+
+    if (c > Vol->MaxCluster) {
+      c -= Count;
+    }
+    if (c == 2) {
+      Run = 0;
+    }
+    if (fat_entry_by_cluster(Vol, c) != 0) {
+      Run = 0;
+      continue;
+    }
+    if (++Run > Best) {
+      Best = Run;
+      *First = c - Run + 1;
+    }
+  }
+
+  *Length = Best;
+  return Best > 0 ? 0 : -ENOSPC;
+}
+
+/* Clusters of a chain, in order, in a malloc'ed array. Returns their number,
+ * or -EIO if the chain is broken */
+static int chain_clusters(VOLUME *Vol, WORD First, WORD **Clusters)
+{
+  CHAIN_WALK Walk;
+  DWORD Count = 0, Cap = 16;
+  int res;
+
+  *Clusters = malloc(Cap * sizeof(WORD));
+
+  if (*Clusters == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  if (First == 0) {
+    return 0;
+  }
+  if (chain_start(Vol, &Walk, First) != 0) {
+    return -EIO;
+  }
+
+  do {
+    if (Count == Cap) {
+      Cap *= 2;
+      *Clusters = realloc(*Clusters, Cap * sizeof(WORD));
+
+      if (*Clusters == NULL) {
+        log_msg("Out of memory!\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    (*Clusters)[Count++] = Walk.Cluster;
+  } while ((res = chain_next(Vol, &Walk)) == 1);
+
+  return res < 0 ? -EIO : (int) Count;
+}
+
+/**
+ * Makes the cluster chain of a file Want clusters long. The growth is
+ * allocated a run at a time, as few runs as the free space allows, starting
+ * right after the last cluster: a file grown once to its final size comes
+ * out as contiguous as an offline tool would lay it down. The clusters held
+ * for delayed appends count as used: they are never handed to another file.
+ * ============================================================================
+ * Return
+ * 0, -ENOSPC if the volume has fewer free clusters than the growth needs
+ * (nothing is added then) or -EIO (the clusters already added are kept).
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Dir: Directory entry of the file, its first cluster is updated.
+ * @Want: Number of clusters the chain must have.
+ * @Shrink: Whether a longer chain is cut down to Want clusters.
+**/
+static int chain_resize(VOLUME *Vol, DIR_ENTRY *Dir, DWORD Want, int Shrink)
+{
+  WORD *Clusters, Last, Run;
+  int Count = chain_clusters(Vol, Dir->DIR_FstClusLO, &Clusters);
+  DWORD Need, Length, i;
+  int res = 0;
+
+  if (Count < 0) {
+    free(Clusters);
+    return Count;
+  }
+
+  if (Want < (DWORD) Count && Shrink) {
+    if (Want == 0) {
+      Dir->DIR_FstClusLO = 0;
+    } else {
+      res = fat_set(Vol, Clusters[Want - 1], FAT_EOC_MARK);
+    }
+    for (i = Want; i < (DWORD) Count && res == 0; i++) {
+      res = fat_set(Vol, Clusters[i], 0);
+    }
+  }
+
+  Last = Count > 0 ? Clusters[Count - 1] : 0;
+  Need = Want > (DWORD) Count ? Want - Count : 0;
+  if (Need > 0 && res == 0 && __atomic_load_n(&Vol->Counted, __ATOMIC_ACQUIRE) &&
+      Need + __atomic_load_n(&Vol->DelayedClusters, __ATOMIC_RELAXED) > Vol->FreeClusters) {
+    res = -ENOSPC;
+  }
+  while (Need > 0 && res == 0) {
+    res = cluster_run(Vol, Last != 0 ? Last + 1 : 2, Need, &Run, &Length);
+
+    /* The run is chained first, then hung at the end of the chain */
+    for (i = 0; i < Length && res == 0; i++) {
+      res = fat_set(Vol, Run + i, i + 1 < Length ? Run + i + 1 : FAT_EOC_MARK);
+    }
+    if (res == 0) {
+      if (Last != 0) {
+        res = fat_set(Vol, Last, Run);
+      } else {
+        Dir->DIR_FstClusLO = Run;
+      }
+      Last = Run + Length - 1;
+      Need -= Length;
+    }
+  }
+
+  free(Clusters);
+  return res;
+}
+
+/* Clusters a file of Size bytes takes */
+static DWORD size_clusters(VOLUME *Vol, off_t Size)
+{
+  return (Size + Vol->Geo.ClusterMask) >> Vol->Geo.ClusterShift;
+}
+
+/**
+ * Writes a byte range of a file, which its chain already covers, extent by
+ * extent. A NULL buffer writes zeros.
+ * ============================================================================
+ * Return
+ * 0, or -EIO.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Dir: Directory entry of the file, with the size the range is in.
+ * @buffer: Bytes to write, NULL for zeros.
+ * @size: Number of bytes to write.
+ * @offset: Offset of the first byte in the file.
+**/
+static int range_write(VOLUME *Vol, DIR_ENTRY *Dir, const char *buffer, size_t size,
+                       off_t offset)
+{
+  int MaxExtents = (size >> Vol->Geo.ClusterShift) + 2;
+  EXTENT *Extents;
+  size_t done = 0, chunk;
+  int i, n, res = 0;
+
+  if (size == 0) {
+    return 0;
+  }
+
+  Extents = malloc(MaxExtents * sizeof(EXTENT));
+
+  if (Extents == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  n = file_extents(Vol, Dir, offset, size, Extents, MaxExtents);
+  if (n < 0) {
+    res = -EIO;
+  }
+  for (i = 0; i < n && res == 0; i++) {
+    if (buffer != NULL) {
+      res = image_write(Vol, buffer + done, Extents[i].Length, Extents[i].ImageOffset);
+      done += Extents[i].Length;
+      continue;
+    }
+    for (done = 0; done < Extents[i].Length && res == 0; done += chunk) {
+      chunk = Extents[i].Length - done < ZERO_CHUNK ? Extents[i].Length - done : ZERO_CHUNK;
+      res = image_write(Vol, zeros, chunk, Extents[i].ImageOffset + done);
+    }
+  }
+
+  free(Extents);
+  return res;
+}
+
+/**
+ * Walks every 32-byte slot of a directory, free and deleted ones included,
+ * up to the end of its entries.
+ * ============================================================================
+ * Return
+ * The non-zero value fn stopped the walk with, 0 at the end of the directory
+ * or -EIO if it could not be read.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @DirCluster: First cluster of the directory, 0 for the root directory.
+ * @fn: Function called with each slot.
+ * @arg: Passed through to fn.
+**/
+static int dir_slots(VOLUME *Vol, WORD DirCluster, dir_slot_fn fn, void *arg)
+{
+  DWORD Size = DirCluster == 0 ?
+    (Vol->FirstDataSector - Vol->FirstRootDirSecNum) << Vol->Geo.SectorShift :
+    Vol->Geo.ClusterSize;
+  BYTE *buffer = malloc(Size);
+  off_t Start;
+  CHAIN_WALK Walk;
+  DWORD i;
+  int res = 0, next = 1;
+
+  if (buffer == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (DirCluster == 0) {
+    Start = (off_t) Vol->FirstRootDirSecNum << Vol->Geo.SectorShift;
+  } else if (chain_start(Vol, &Walk, DirCluster) == 0) {
+    Start = cluster_offset(Vol, Walk.Cluster);
+  } else {
+    free(buffer);
+    return -EIO;
+  }
+
+  while (res == 0 && next == 1) {
+    if (sector_pread(Vol->fd, buffer, Size, Start) != (ssize_t) Size) {
+      res = -EIO;
+      break;
+    }
+    for (i = 0; i < Size && res == 0; i += BYTES_PER_DIR) {
+      res = fn((DIR_ENTRY *) (buffer + i), Start + i, arg);
+    }
+    if (DirCluster == 0) {
+      break;
+    }
+    next = chain_next(Vol, &Walk);
+    if (next < 0 && res == 0) {
+      res = -EIO;
+    }
+    Start = cluster_offset(Vol, Walk.Cluster);
+  }
+
+  free(buffer);
+  return res;
+}
+
+/* dir_slots callback: finds the file or directory named Search->Name (a
+ * short name) */
+static int slot_match(DIR_ENTRY *Entry, off_t Offset, void *arg)
+{
+  SLOT_SEARCH *Search = arg;
+
+  if (Entry->DIR_Name[0] == 0) {
+    return 2;
+  }
+  if (Entry->DIR_Name[0] != DIR_DELETED &&
+      (Entry->DIR_Attr & ATTR_LONG_NAME_MASK) == ATTR_LONG_NAME) {
+    LFN_ENTRY *Lfn = (LFN_ENTRY *) Entry;
+
+    if (Lfn->LDIR_Ord & LFN_LAST) {
+      Search->LongCnt = 0;
+      Search->LongSum = Lfn->LDIR_Chksum;
+    } else if (Search->LongCnt == 0 || Lfn->LDIR_Chksum != Search->LongSum) {
+      Search->LongCnt = 0;
+      return 0;
+    }
+    if (Search->LongCnt < LFN_MAX_ENTRIES) {
+      Search->Long[Search->LongCnt++] = Offset;
+    }
+    return 0;
+  }
+  if (Entry->DIR_Name[0] != DIR_DELETED && memcmp(Entry->DIR_Name, Search->Name, 11) == 0 &&
+      !(Entry->DIR_Attr & ATTR_VOLUME_ID)) {
+    if (Search->LongCnt > 0 && Search->LongSum != lfn_checksum(Entry->DIR_Name)) {
+      Search->LongCnt = 0;
+    }
+    *Search->Dir = *Entry;
+    Search->Offset = Offset;
+    return 1;
+  }
+  Search->LongCnt = 0;
+  return 0;
+}
+
+/* dir_slots callback: finds the first free or deleted slot */
+static int slot_free(DIR_ENTRY *Entry, off_t Offset, void *arg)
+{
+  SLOT_SEARCH *Search = arg;
+
+  if (Entry->DIR_Name[0] == 0 || Entry->DIR_Name[0] == DIR_DELETED) {
+    Search->Offset = Offset;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Splits a path into its parent directory, which is looked up, and the FAT
+ * name of its last component: the short name of the entry listed under that
+ * name (a long name, or a name in another case) if there is one, the
+ * component made into a short name otherwise.
+ * ============================================================================
+ * Return
+ * 0, -ENOENT or -ENOTDIR for the parent, -EINVAL for a name that is in the
+ * directory and is not a valid FAT16 short name, or -EISDIR for the root
+ * directory.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Path: Absolute path.
+ * @Parent: Receives the directory entry of the parent.
+ * @Name: Receives the 11 characters of the last name.
+**/
+static int path_parent(VOLUME *Vol, const char *Path, DIR_ENTRY *Parent, BYTE *Name)
+{
+  const char *Last = strrchr(Path, '/');
+  BYTE Extra[11];
+  char *ParentPath;
+  int res;
+
+  if (Last == NULL || Last[1] == '\0') {
+    return strspn(Path, "/") == strlen(Path) ? -EISDIR : -EINVAL;
+  }
+
+  ParentPath = strndup(Path, Last - Path);
+
+  if (ParentPath == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  res = path_lookup(Vol, ParentPath, Parent);
+  free(ParentPath);
+  if (res != 0) {
+    return res;
+  }
+  if (!(Parent->DIR_Attr & ATTR_DIRECTORY)) {
+    return -ENOTDIR;
+  }
+
+  Last++;
+  DIR_LIST *List = dir_list(Vol, Parent->DIR_FstClusLO);
+  int Found = dir_find(List, Last, strlen(Last));
+
+  if (Found >= 0) {
+    memcpy(Name, List->Entries[Found].DIR_Name, 11);
+  }
+  dir_release(List);
+  if (Found < 0 && (path_next_name(&Last, Name) != 1 || path_next_name(&Last, Extra) != 0)) {
+    return -EINVAL;
+  }
+  return Name[0] == '.' ? -EINVAL : 0;
+}
+
+/**
+ * Finds the directory entry of a path and where it sits in the image.
+ * ============================================================================
+ * Return
+ * 0, -ENOENT, -ENOTDIR, -EINVAL (see path_parent), -EISDIR for the root
+ * directory or -EIO.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Path: Absolute path.
+ * @Dir: Receives the directory entry.
+ * @Slot: Receives its place.
+**/
+int entry_locate(VOLUME *Vol, const char *Path, DIR_ENTRY *Dir, DIR_SLOT *Slot)
+{
+  DIR_ENTRY Parent;
+  BYTE Name[11];
+  SLOT_SEARCH Search;
+  int res = path_parent(Vol, Path, &Parent, Name);
+
+  if (res != 0) {
+    return res;
+  }
+
+  Search.Name = Name;
+  Search.Dir = Dir;
+  Search.LongCnt = 0;
+  res = dir_slots(Vol, Parent.DIR_FstClusLO, slot_match, &Search);
+  if (res < 0) {
+    return res;
+  }
+  if (res != 1) {
+    return -ENOENT;
+  }
+  Slot->Offset = Search.Offset;
+  Slot->DirCluster = Parent.DIR_FstClusLO;
+  return 0;
+}
+
+/* Whether a directory entry is a file counted in the usage of its directory */
+static int entry_is_file(const DIR_ENTRY *Dir)
+{
+  return Dir->DIR_Name[0] != 0 && Dir->DIR_Name[0] != DIR_DELETED &&
+         (Dir->DIR_Attr & ATTR_LONG_NAME_MASK) != ATTR_LONG_NAME &&
+         !(Dir->DIR_Attr & (ATTR_DIRECTORY | ATTR_VOLUME_ID));
+}
+
+/* Writes a directory entry back to its place and drops its directory from
+ * the cache. Taking or freeing a slot of the root directory is counted, and
+ * so is the change of the files of the directory in its usage, once it has
+ * been added up (the entry it replaces is read back first) */
+static int entry_store(VOLUME *Vol, DIR_SLOT *Slot, DIR_ENTRY *Dir, int Taken)
+{
+  DIR_ENTRY Old;
+  int Usage = dir_usage(Vol, Slot->DirCluster) != NULL &&
+              sector_pread(Vol->fd, &Old, sizeof(DIR_ENTRY), Slot->Offset) == sizeof(DIR_ENTRY);
+  int res = image_write(Vol, Dir, sizeof(DIR_ENTRY), Slot->Offset);
+
+  if (res == 0 && Taken != 0 && Slot->DirCluster == 0 &&
+      __atomic_load_n(&Vol->Counted, __ATOMIC_ACQUIRE)) {
+    __atomic_add_fetch(&Vol->FreeRootEntries, -Taken, __ATOMIC_RELAXED);
+  }
+  if (res == 0 && Usage) {
+    dir_usage_add(Vol, Slot->DirCluster,
+                  (entry_is_file(Dir) ? (int64_t) Dir->DIR_FileSize : 0) -
+                  (entry_is_file(&Old) ? (int64_t) Old.DIR_FileSize : 0),
+                  entry_is_file(Dir) - entry_is_file(&Old));
+  }
+
+  dir_invalidate(Vol, Slot->DirCluster);
+  return res;
+}
+
+/* Looks up a file for a modification, with the write lock taken */
+static int file_begin(VOLUME *Vol, const char *Path, DIR_ENTRY *Dir, DIR_SLOT *Slot)
+{
+  int res;
+
+  if (Vol->Overlay == NULL) {
+    return -EROFS;
+  }
+
+  pthread_mutex_lock(&Vol->WriteLock);
+  res = entry_locate(Vol, Path, Dir, Slot);
+  if (res == 0 && (Dir->DIR_Attr & ATTR_DIRECTORY)) {
+    res = -EISDIR;
+  }
+  if (res != 0) {
+    pthread_mutex_unlock(&Vol->WriteLock);
+  }
+  return res;
+}
+
+/**
+ * Resizes a file to NewSize bytes: the chain is grown or cut to match and
+ * the bytes from the old end up to Fill are zeroed.
+ * ============================================================================
+ * Return
+ * 0, -EFBIG, -ENOSPC or -EIO.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Dir: Directory entry of the file, updated (not stored).
+ * @NewSize: Size of the file.
+ * @Fill: End of the zeroed bytes, the caller writes the rest of a growth.
+ * @Shrink: Whether clusters past the new size are freed.
+**/
+static int file_resize(VOLUME *Vol, DIR_ENTRY *Dir, off_t NewSize, off_t Fill,
+                       int Shrink)
+{
+  off_t OldSize = Dir->DIR_FileSize;
+  int res;
+
+  if (NewSize > 0xffffffffLL) {
+    return -EFBIG;
+  }
+
+  res = chain_resize(Vol, Dir, size_clusters(Vol, NewSize), Shrink);
+  if (res != 0) {
+    return res;
+  }
+
+  Dir->DIR_FileSize = NewSize;
+  if (Fill > OldSize) {
+    res = range_write(Vol, Dir, NULL, Fill - OldSize, OldSize);
+  }
+  fat_time_encode(time(NULL), Dir);
+  Dir->DIR_LstAccDate = Dir->DIR_WrtDate;
+  return res;
+}
+
+/* Appends waiting for a file, NULL if there are none */
+static DELAYED *delayed_find(VOLUME *Vol, WORD DirCluster, const BYTE *Name)
+{
+  DELAYED *D = Vol->Delayed;
+
+  while (D != NULL && (D->Slot.DirCluster != DirCluster || memcmp(D->Name, Name, 11) != 0)) {
+    D = D->Next;
+  }
+  return D;
+}
+
+/* Forgets the appends waiting for a file */
+static void delayed_drop(VOLUME *Vol, DELAYED *D)
+{
+  DELAYED **Link = &Vol->Delayed;
+
+  while (*Link != D) {
+    Link = &(*Link)->Next;
+  }
+  __atomic_store_n(Link, D->Next, __ATOMIC_RELEASE);
+  Vol->DelayedBytes -= D->Length;
+  __atomic_sub_fetch(&Vol->DelayedClusters, D->Clusters, __ATOMIC_RELAXED);
+  free(D->buffer);
+  free(D);
+}
+
+/* Open file descriptions that can write to a file, NULL if there are none */
+static WRITERS *writers_find(VOLUME *Vol, WORD DirCluster, const BYTE *Name)
+{
+  WRITERS *W = Vol->Writers;
+
+  while (W != NULL && (W->DirCluster != DirCluster || memcmp(W->Name, Name, 11) != 0)) {
+    W = W->Next;
+  }
+  return W;
+}
+
+/* Forgets the writers of a file */
+static void writers_drop(VOLUME *Vol, WRITERS *W)
+{
+  WRITERS **Link = &Vol->Writers;
+
+  while (*Link != W) {
+    Link = &(*Link)->Next;
+  }
+  *Link = W->Next;
+  free(W);
+}
+
+/* Writes the appends waiting for a file: its chain grows to the final size
+ * at once, taking the clusters held for them, then the bytes go in. Dir is
+ * updated (not stored). The appends are dropped once written; if they could
+ * not be, they are kept and Dir keeps its old size, with the chain it got */
+static int delayed_write(VOLUME *Vol, DELAYED *D, DIR_ENTRY *Dir)
+{
+  int res;
+
+  __atomic_sub_fetch(&Vol->DelayedClusters, D->Clusters, __ATOMIC_RELAXED);
+  res = file_resize(Vol, Dir, (off_t) D->Start + D->Length, D->Start, 0);
+  if (res == 0) {
+    res = range_write(Vol, Dir, D->buffer, D->Length, D->Start);
+  }
+  if (res != 0) {
+    Dir->DIR_FileSize = D->Start;
+    __atomic_add_fetch(&Vol->DelayedClusters, D->Clusters, __ATOMIC_RELAXED);
+    return res;
+  }
+  D->Clusters = 0;
+  delayed_drop(Vol, D);
+  return 0;
+}
+
+/* Writes the appends waiting for a file, if any, and stores its entry. Any
+ * change to the file other than an append starts here. On an error the file
+ * still holds its appends, and its entry is stored all the same so that a
+ * chain the write started is not lost */
+static int delayed_settle(VOLUME *Vol, DIR_ENTRY *Dir, DIR_SLOT *Slot)
+{
+  DELAYED *D = delayed_find(Vol, Slot->DirCluster, Dir->DIR_Name);
+  int res, err;
+
+  if (D == NULL) {
+    return 0;
+  }
+  res = delayed_write(Vol, D, Dir);
+  err = entry_store(Vol, Slot, Dir, 0);
+  return res != 0 ? res : err;
+}
+
+/**
+ * Holds a write to a file in memory if it appends to the file, the memory
+ * limit allows it and the volume has room for it: the clusters it will take
+ * are held for it (see chain_resize), so a write that was taken is never
+ * lost to a full volume. Anything else first writes what the file holds.
+ * ============================================================================
+ * Return
+ * 1 if the write is held, 0 if the caller has to write it, or a negative
+ * errno value if what the file held could not be written.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Dir: Directory entry of the file, updated if what it held is written.
+ * @Slot: Where the entry sits.
+ * @buffer: Bytes to write.
+ * @size: Number of bytes to write.
+ * @offset: Offset of the first byte in the file.
+**/
+static int delayed_append(VOLUME *Vol, DIR_ENTRY *Dir, DIR_SLOT *Slot,
+                          const char *buffer, size_t size, off_t offset)
+{
+  DELAYED *D = delayed_find(Vol, Slot->DirCluster, Dir->DIR_Name);
+  off_t End = D != NULL ? (off_t) D->Start + D->Length : Dir->DIR_FileSize;
+  DWORD Clusters;
+  int res;
+
+  if (offset != End || End + (off_t) size > 0xffffffffLL || size > Vol->DelayedLimit) {
+    return delayed_settle(Vol, Dir, Slot);
+  }
+
+  /* Over the limit, the file writes what it holds and starts over, as long
+   * as it held anything */
+  if (Vol->DelayedBytes + size > Vol->DelayedLimit) {
+    if (D == NULL) {
+      return 0;
+    }
+    res = delayed_settle(Vol, Dir, Slot);
+    if (res != 0 || Vol->DelayedBytes + size > Vol->DelayedLimit) {
+      return res;
+    }
+    D = NULL;
+  }
+
+  Clusters = size_clusters(Vol, End + size) - size_clusters(Vol, End);
+  if (!__atomic_load_n(&Vol->Counted, __ATOMIC_ACQUIRE) ||
+      Vol->DelayedClusters + Clusters > Vol->FreeClusters) {
+    return delayed_settle(Vol, Dir, Slot);
+  }
+
+  if (D == NULL) {
+    D = calloc(1, sizeof(DELAYED));
+
+    if (D == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    D->Slot = *Slot;
+    memcpy(D->Name, Dir->DIR_Name, 11);
+    D->Start = Dir->DIR_FileSize;
+    D->Next = Vol->Delayed;
+    __atomic_store_n(&Vol->Delayed, D, __ATOMIC_RELEASE);
+  }
+  if (D->Length + size > D->Cap) {
+    D->Cap = D->Length + size > 2 * D->Cap ? D->Length + size : 2 * D->Cap;
+    D->buffer = realloc(D->buffer, D->Cap);
+
+    if (D->buffer == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  memcpy(D->buffer + D->Length, buffer, size);
+  D->Length += size;
+  D->Clusters += Clusters;
+  Vol->DelayedBytes += size;
+  __atomic_add_fetch(&Vol->DelayedClusters, Clusters, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/* Marks the long name entries of an entry deleted, before the entry itself
+ * is. Freed slots of the root directory are counted */
+static int long_name_remove(VOLUME *Vol, DIR_SLOT *Slot, DIR_ENTRY *Dir)
+{
+  BYTE Deleted = DIR_DELETED;
+  DIR_ENTRY Found;
+  SLOT_SEARCH Search;
+  int i, res;
+
+  Search.Name = Dir->DIR_Name;
+  Search.Dir = &Found;
+  Search.LongCnt = 0;
+  res = dir_slots(Vol, Slot->DirCluster, slot_match, &Search);
+  if (res != 1 || Search.Offset != Slot->Offset) {
+    return res < 0 ? res : 0;
+  }
+
+  res = 0;
+  for (i = 0; i < Search.LongCnt && res == 0; i++) {
+    res = image_write(Vol, &Deleted, 1, Search.Long[i]);
+  }
+  if (res == 0 && Slot->DirCluster == 0 && __atomic_load_n(&Vol->Counted, __ATOMIC_ACQUIRE)) {
+    __atomic_add_fetch(&Vol->FreeRootEntries, Search.LongCnt, __ATOMIC_RELAXED);
+  }
+  return res;
+}
+
+/**
+ * Writes bytes to a file, growing it (and its chain) as needed.
+ * ============================================================================
+ * Return
+ * Number of bytes written, or a negative errno value (-EROFS, -ENOENT,
+ * -EISDIR, -EFBIG, -ENOSPC, -EIO).
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Path: Absolute path of the file.
+ * @buffer: Bytes to write.
+ * @size: Number of bytes to write.
+ * @offset: Offset of the first byte in the file.
+**/
+int file_write(VOLUME *Vol, const char *Path, const char *buffer, size_t size,
+               off_t offset)
+{
+  DIR_ENTRY Dir;
+  DIR_SLOT Slot;
+  int res = file_begin(Vol, Path, &Dir, &Slot);
+
+  if (res != 0) {
+    return res;
+  }
+
+  /* Appends are held back while memory allows, so their clusters are chosen
+   * once the file is complete */
+  if (Vol->DelayedLimit > 0) {
+    res = delayed_append(Vol, &Dir, &Slot, buffer, size, offset);
+    if (res != 0) {
+      pthread_mutex_unlock(&Vol->WriteLock);
+      return res == 1 ? (int) size : res;
+    }
+  }
+
+  if (offset + (off_t) size > Dir.DIR_FileSize) {
+    res = file_resize(Vol, &Dir, offset + size, offset, 0);
+  } else {
+    fat_time_encode(time(NULL), &Dir);
+  }
+  if (res == 0) {
+    res = range_write(Vol, &Dir, buffer, size, offset);
+  }
+  if (res == 0) {
+    res = entry_store(Vol, &Slot, &Dir, 0);
+  }
+
+  pthread_mutex_unlock(&Vol->WriteLock);
+  return res == 0 ? (int) size : res;
+}
+
+/* Sets the size of a file, see file_write for the return values */
+int file_truncate(VOLUME *Vol, const char *Path, off_t Size)
+{
+  DIR_ENTRY Dir;
+  DIR_SLOT Slot;
+  int res = file_begin(Vol, Path, &Dir, &Slot);
+
+  if (res != 0) {
+    return res;
+  }
+
+  res = delayed_settle(Vol, &Dir, &Slot);
+  if (res == 0) {
+    res = file_resize(Vol, &Dir, Size, Size, 1);
+  }
+  if (res == 0) {
+    res = entry_store(Vol, &Slot, &Dir, 0);
+  }
+
+  pthread_mutex_unlock(&Vol->WriteLock);
+  return res;
+}
+
+/* Removes a file and frees its clusters, see file_write for the return
+ * values */
+int file_unlink(VOLUME *Vol, const char *Path)
+{
+  DIR_ENTRY Dir;
+  DIR_SLOT Slot;
+  int res = file_begin(Vol, Path, &Dir, &Slot);
+
+  if (res != 0) {
+    return res;
+  }
+
+  /* Appends it held are never written, and a file created later under
+   * the same name starts without writers */
+  DELAYED *D = delayed_find(Vol, Slot.DirCluster, Dir.DIR_Name);
+  WRITERS *W = writers_find(Vol, Slot.DirCluster, Dir.DIR_Name);
+
+  if (D != NULL) {
+    delayed_drop(Vol, D);
+  }
+  if (W != NULL) {
+    writers_drop(Vol, W);
+  }
+
+  res = chain_resize(Vol, &Dir, 0, 1);
+  if (res == 0) {
+    res = long_name_remove(Vol, &Slot, &Dir);
+  }
+  Dir.DIR_Name[0] = DIR_DELETED;
+  if (res == 0) {
+    res = entry_store(Vol, &Slot, &Dir, -1);
+  }
+
+  pthread_mutex_unlock(&Vol->WriteLock);
+  return res;
+}
+
+/* Sets the modification time of a file, see file_write for the return
+ * values */
+int file_touch(VOLUME *Vol, const char *Path, time_t Mtime)
+{
+  DIR_ENTRY Dir;
+  DIR_SLOT Slot;
+  int res = file_begin(Vol, Path, &Dir, &Slot);
+
+  if (res != 0) {
+    return res;
+  }
+
+  res = delayed_settle(Vol, &Dir, &Slot);
+  if (res == 0) {
+    fat_time_encode(Mtime, &Dir);
+    res = entry_store(Vol, &Slot, &Dir, 0);
+  }
+
+  pthread_mutex_unlock(&Vol->WriteLock);
+  return res;
+}
+
+/**
+ * Creates an empty file. A subdirectory without a free slot gets one more
+ * cluster; the root directory has a fixed number of entries.
+ * ============================================================================
+ * Return
+ * 0, or a negative errno value (-EROFS, -EEXIST, -ENOENT, -ENOTDIR, -EINVAL,
+ * -ENOSPC, -EIO).
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Path: Absolute path of the new file.
+**/
+int file_create(VOLUME *Vol, const char *Path)
+{
+  DIR_ENTRY Parent, Dir;
+  DIR_SLOT Slot;
+  BYTE Name[11];
+  SLOT_SEARCH Search;
+  int res;
+
+  if (Vol->Overlay == NULL) {
+    return -EROFS;
+  }
+
+  pthread_mutex_lock(&Vol->WriteLock);
+  res = path_parent(Vol, Path, &Parent, Name);
+  if (res == 0) {
+    Search.Name = Name;
+    Search.Dir = &Dir;
+    Search.LongCnt = 0;
+    res = dir_slots(Vol, Parent.DIR_FstClusLO, slot_match, &Search);
+    res = res == 1 ? -EEXIST : res < 0 ? res : 0;
+  }
+
+  /* A free slot, or the first one of a new cluster of the directory */
+  if (res == 0) {
+    res = dir_slots(Vol, Parent.DIR_FstClusLO, slot_free, &Search);
+    if (res == 0 && Parent.DIR_FstClusLO == 0) {
+      res = -ENOSPC;
+    } else if (res == 0) {
+      WORD *Clusters;
+      int Count = chain_clusters(Vol, Parent.DIR_FstClusLO, &Clusters);
+
+      free(Clusters);
+      res = Count < 0 ? Count : chain_resize(Vol, &Parent, Count + 1, 0);
+      if (res == 0) {
+        res = chain_clusters(Vol, Parent.DIR_FstClusLO, &Clusters);
+        if (res > 0) {
+          Search.Offset = cluster_offset(Vol, Clusters[res - 1]);
+          res = image_write(Vol, zeros, Vol->Geo.ClusterSize, Search.Offset);
+        }
+        free(Clusters);
+      }
+    } else if (res == 1) {
+      res = 0;
+    }
+  }
+
+  if (res == 0) {
+    memset(&Dir, 0, sizeof(DIR_ENTRY));
+    memcpy(Dir.DIR_Name, Name, 11);
+    Dir.DIR_Attr = ATTR_ARCHIVE;
+    fat_time_encode(time(NULL), &Dir);
+    Dir.DIR_CrtDate = Dir.DIR_LstAccDate = Dir.DIR_WrtDate;
+    Dir.DIR_CrtTime = Dir.DIR_WrtTime;
+    Slot.Offset = Search.Offset;
+    Slot.DirCluster = Parent.DIR_FstClusLO;
+    res = entry_store(Vol, &Slot, &Dir, 1);
+  }
+
+  pthread_mutex_unlock(&Vol->WriteLock);
+  return res;
+}
+
+/**
+ * Allocates the clusters of a byte range of a file (fallocate). The range is
+ * zeroed and becomes part of the file, or with KeepSize the chain only grows
+ * past the end of the file until it is released (see file_release).
+ * Clusters are taken as one run whenever the volume has one that long.
+ * ============================================================================
+ * Return
+ * 0, or a negative errno value (-EROFS, -ENOENT, -EISDIR, -EINVAL, -EFBIG,
+ * -ENOSPC, -EIO).
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Path: Absolute path of the file.
+ * @offset: Offset of the first byte of the range.
+ * @length: Number of bytes of the range.
+ * @KeepSize: Whether the size of the file stays as it is.
+**/
+int file_allocate(VOLUME *Vol, const char *Path, off_t offset, off_t length,
+                  int KeepSize)
+{
+  DIR_ENTRY Dir;
+  DIR_SLOT Slot;
+  off_t End = offset + length;
+  WORD First;
+  int res;
+
+  if (offset < 0 || length <= 0) {
+    return -EINVAL;
+  }
+  if (End > 0xffffffffLL) {
+    return -EFBIG;
+  }
+  res = file_begin(Vol, Path, &Dir, &Slot);
+  if (res != 0) {
+    return res;
+  }
+
+  res = delayed_settle(Vol, &Dir, &Slot);
+  First = Dir.DIR_FstClusLO;
+  if (res == 0 && KeepSize) {
+    res = chain_resize(Vol, &Dir, size_clusters(Vol, End), 0);
+    if (res == 0 && Dir.DIR_FstClusLO != First) {
+      res = entry_store(Vol, &Slot, &Dir, 0);
+    }
+  } else if (res == 0 && End > Dir.DIR_FileSize) {
+    res = file_resize(Vol, &Dir, End, End, 0);
+    if (res == 0) {
+      res = entry_store(Vol, &Slot, &Dir, 0);
+    }
+  }
+
+  pthread_mutex_unlock(&Vol->WriteLock);
+  return res;
+}
+
+/* Size of a file counting the appends it holds. Returns 1 with Size set if
+ * it holds any, 0 otherwise */
+int file_pending(VOLUME *Vol, const char *Path, off_t *Size)
+{
+  DIR_ENTRY Parent;
+  BYTE Name[11];
+
+  if (__atomic_load_n(&Vol->Delayed, __ATOMIC_ACQUIRE) == NULL ||
+      path_parent(Vol, Path, &Parent, Name) != 0) {
+    return 0;
+  }
+  return file_pending_in(Vol, Parent.DIR_FstClusLO, Name, Size);
+}
+
+/* file_pending for the file with the 8.3 name Name in the directory starting
+ * at DirCluster, for callers that already hold its entry */
+int file_pending_in(VOLUME *Vol, WORD DirCluster, const BYTE *Name, off_t *Size)
+{
+  DELAYED *D;
+  int res = 0;
+
+  if (__atomic_load_n(&Vol->Delayed, __ATOMIC_ACQUIRE) == NULL) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&Vol->WriteLock);
+  D = delayed_find(Vol, DirCluster, Name);
+  if (D != NULL) {
+    *Size = (off_t) D->Start + D->Length;
+    res = 1;
+  }
+  pthread_mutex_unlock(&Vol->WriteLock);
+  return res;
+}
+
+/* Writes the appends a file holds, see file_write for the return values */
+int file_flush(VOLUME *Vol, const char *Path)
+{
+  DIR_ENTRY Dir;
+  DIR_SLOT Slot;
+  off_t Size;
+  int res;
+
+  if (file_pending(Vol, Path, &Size) == 0) {
+    return 0;
+  }
+  res = file_begin(Vol, Path, &Dir, &Slot);
+  if (res != 0) {
+    return res;
+  }
+
+  res = delayed_settle(Vol, &Dir, &Slot);
+
+  pthread_mutex_unlock(&Vol->WriteLock);
+  return res;
+}
+
+/**
+ * Counts one more open file description that can write to a file (an open
+ * or a create), so that file_release leaves the file alone until the last
+ * of them is closed.
+ * ============================================================================
+ * Return
+ * 0, or a negative errno value (-EROFS, -ENOENT, -EISDIR, -EIO).
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Path: Absolute path of the file.
+**/
+int file_open(VOLUME *Vol, const char *Path)
+{
+  DIR_ENTRY Dir;
+  DIR_SLOT Slot;
+  WRITERS *W;
+  int res = file_begin(Vol, Path, &Dir, &Slot);
+
+  if (res != 0) {
+    return res;
+  }
+
+  W = writers_find(Vol, Slot.DirCluster, Dir.DIR_Name);
+  if (W == NULL) {
+    W = calloc(1, sizeof(WRITERS));
+
+    if (W == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    W->DirCluster = Slot.DirCluster;
+    memcpy(W->Name, Dir.DIR_Name, 11);
+    W->Next = Vol->Writers;
+    Vol->Writers = W;
+  }
+  W->Count++;
+
+  pthread_mutex_unlock(&Vol->WriteLock);
+  return 0;
+}
+
+/* Counts one writer of a file less (see file_open). When it was the last
+ * one, or none was counted, the appends the file holds are written and the
+ * clusters allocated past its end are freed. See file_write for the return
+ * values */
+int file_release(VOLUME *Vol, const char *Path)
+{
+  DIR_ENTRY Dir;
+  DIR_SLOT Slot;
+  WRITERS *W;
+  WORD First;
+  int res = file_begin(Vol, Path, &Dir, &Slot);
+
+  if (res != 0) {
+    return res;
+  }
+
+  W = writers_find(Vol, Slot.DirCluster, Dir.DIR_Name);
+  if (W != NULL && --W->Count > 0) {
+    pthread_mutex_unlock(&Vol->WriteLock);
+    return 0;
+  }
+  if (W != NULL) {
+    writers_drop(Vol, W);
+  }
+
+  res = delayed_settle(Vol, &Dir, &Slot);
+  First = Dir.DIR_FstClusLO;
+  if (res == 0) {
+    res = chain_resize(Vol, &Dir, size_clusters(Vol, Dir.DIR_FileSize), 1);
+  }
+  if (res == 0 && Dir.DIR_FstClusLO != First) {
+    res = entry_store(Vol, &Slot, &Dir, 0);
+  }
+
+  pthread_mutex_unlock(&Vol->WriteLock);
+  return res;
+}
+
+/* Writes the appends every file holds, before the volume is closed. Returns
+ * 0, or the first error (the appends that failed are lost, nothing is left
+ * to retry them) */
+int file_flush_all(VOLUME *Vol)
+{
+  int res = 0;
+
+  pthread_mutex_lock(&Vol->WriteLock);
+  while (Vol->Delayed != NULL) {
+    DELAYED *D = Vol->Delayed;
+    DIR_SLOT Slot = D->Slot;
+    DIR_ENTRY Dir;
+    int err = -EIO;
+
+    if (sector_pread(Vol->fd, &Dir, sizeof(DIR_ENTRY), Slot.Offset) == sizeof(DIR_ENTRY)) {
+      int stored;
+
+      err = delayed_write(Vol, D, &Dir);
+      stored = entry_store(Vol, &Slot, &Dir, 0);
+      err = err != 0 ? err : stored;
+    }
+    if (err != 0) {
+      delayed_drop(Vol, D);
+    }
+    if (res == 0) {
+      res = err;
+    }
+  }
+  pthread_mutex_unlock(&Vol->WriteLock);
+  return res;
+}
@@ -0,0 +1,67 @@
+#ifndef MODIFY_H
+#define MODIFY_H
+
+#include "fat16.h"
+
+/* FAT entry ending a chain written by the mount */
+#define FAT_EOC_MARK 0xffff
+
+/* First byte of the name of a deleted directory entry */
+#define DIR_DELETED 0xe5
+
+/* Where a directory entry sits in the image */
+typedef struct {
+  off_t Offset;
+  WORD DirCluster;
+} DIR_SLOT;
+
+/* Default memory for the appends held back, of a writable mount and of a
+ * replay with an overlay */
+#define DELAYED_MEM (16 * 1024 * 1024)
+
+/* Bytes appended at the end of a file and not written yet (delayed
+ * allocation): its clusters are only chosen, all at once, when the file is
+ * flushed or released, or when another change to it needs them. Up to
+ * Vol->DelayedLimit bytes are held for all files, 0 turns it off */
+typedef struct DELAYED {
+  DIR_SLOT Slot;
+  BYTE Name[11];
+  DWORD Start;
+  char *buffer;
+  size_t Length;
+  size_t Cap;
+  DWORD Clusters;
+  struct DELAYED *Next;
+} DELAYED;
+
+/* Open file descriptions of a file that can write to it (see file_open).
+ * The entry goes away when the last one is released */
+typedef struct WRITERS {
+  WORD DirCluster;
+  BYTE Name[11];
+  DWORD Count;
+  struct WRITERS *Next;
+} WRITERS;
+
+/* Prototypes (documentation in the functions definitions). Every call
+ * returns a negative errno value on failure, -EROFS for a volume without an
+ * overlay */
+int fat_set(VOLUME *Vol, WORD ClusterN, WORD Value);
+void fat_time_encode(time_t t, DIR_ENTRY *Dir);
+int entry_locate(VOLUME *Vol, const char *Path, DIR_ENTRY *Dir, DIR_SLOT *Slot);
+int file_write(VOLUME *Vol, const char *Path, const char *buffer, size_t size,
+               off_t offset);
+int file_truncate(VOLUME *Vol, const char *Path, off_t Size);
+int file_create(VOLUME *Vol, const char *Path);
+int file_unlink(VOLUME *Vol, const char *Path);
+int file_touch(VOLUME *Vol, const char *Path, time_t Mtime);
+int file_allocate(VOLUME *Vol, const char *Path, off_t offset, off_t length,
+                  int KeepSize);
+int file_pending(VOLUME *Vol, const char *Path, off_t *Size);
+int file_pending_in(VOLUME *Vol, WORD DirCluster, const BYTE *Name, off_t *Size);
+int file_flush(VOLUME *Vol, const char *Path);
+int file_open(VOLUME *Vol, const char *Path);
+int file_release(VOLUME *Vol, const char *Path);
+int file_flush_all(VOLUME *Vol);
+
+#endif
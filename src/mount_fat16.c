@@ -1,82 +1,225 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdint.h>
 
+#include <pthread.h>
+#include <time.h>
+#include <linux/falloc.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 
-#include "sector.h"
+#include "backend.h"
+#include "check.h"
+#include "fat16.h"
+#include "fat16list.h"
+#include "index.h"
+#include "libfat16.h"
+#include "iosched.h"
 #include "log.h"
+#include "modify.h"
+#include "overlay.h"
+#include "pool.h"
+#include "probe.h"
+#include "trace.h"
+#include "usage.h"
+#include "watch.h"
 
-#define BYTES_PER_DIR 32
-#define ATTR_DIRECTORY 0x10
-#define ATTR_ARCHIVE 0x20
+/* Most extents a single read_buf reply is spliced from, more than that and the
+ * read is copied into a memory buffer */
+#define SPLICE_MAX_EXTENTS 16
 
-typedef uint8_t BYTE;
-typedef uint16_t WORD;
-typedef uint32_t DWORD;
+/* Default number of threads fetching the extents of one read in parallel */
+#define READ_WORKERS 4
 
-/* FAT16 BPB Structure */
+/* Default smallest read (bytes) whose extents are fetched in parallel */
+#define FANOUT_MIN_SIZE (64 * 1024)
+
+/* Default memory (bytes) the warm-up may fill the directory cache with */
+#define WARMUP_MEM (64 * 1024 * 1024)
+
+/* The warm-up only runs after this long (ns) without a FUSE request */
+#define WARMUP_QUIET_NS 2000000
+
+/* Kernel cache timeouts (seconds) used when the image is mounted immutable */
+#define IMMUTABLE_TIMEOUT 86400
+
+/* Preferred size of a single read request handed to us by the kernel */
+#define IMMUTABLE_READ_SIZE (128 * 1024)
+
+/* Default number of threads issuing the reads sorted by the I/O scheduler */
+#define SCHED_DEPTH 1
+
+/* Extended attribute of the root directory holding the I/O scheduler
+ * statistics */
+#define SCHED_XATTR "user.fat16.sched"
+
+/* Extended attribute of the root directory holding the number of cluster
+ * chain walks given up on a broken chain */
+#define WALKS_XATTR "user.fat16.aborted_walks"
+
+/* Extended attribute of the root directory holding the directory cache usage
+ * of every image */
+#define CACHE_XATTR "user.fat16.cache"
+
+/* Extended attribute of the root directory holding the reads and delays of
+ * the throttled backend */
+#define BACKEND_XATTR "user.fat16.backend"
+
+/* Extended attribute of the root directory of each image holding the number
+ * of times the watcher reloaded it */
+#define GENERATION_XATTR "user.fat16.generation"
+
+/* Extended attributes of every directory holding the size and the number
+ * of the files under it, subdirectories included */
+#define RSIZE_XATTR "user.fat16.rsize"
+#define RFILES_XATTR "user.fat16.rfiles"
+
+/* Longest line of an image manifest (-o images=FILE) */
+#define MANIFEST_LINE 4096
+
+/* What a rewrite or a replacement of an image file changes */
+typedef struct {
+  dev_t Dev;
+  ino_t Ino;
+  off_t Size;
+  struct timespec Mtime;
+  DWORD VollID;
+} IMAGE_SIGNATURE;
+
+/* An image served by the mount, at the root of the mountpoint or, when
+ * several are served, in its own subdirectory. With -o watch, requests hold
+ * the lock for reading and the watcher swaps Vol and Index under it */
 typedef struct {
-  BYTE BS_jmpBoot[3];
-  BYTE BS_OEMName[8];
-  WORD BPB_BytsPerSec;
-  BYTE BPB_SecPerClus;
-  WORD BPB_RsvdSecCnt;
-  BYTE BPB_NumFATS;
-  WORD BPB_RootEntCnt;
-  WORD BPB_TotSec16;
-  BYTE BPB_Media;
-  WORD BPB_FATSz16;
-  WORD BPB_SecPerTrk;
-  WORD BPB_NumHeads;
-  DWORD BPB_HiddSec;
-  DWORD BPB_TotSec32;
-  BYTE BS_DrvNum;
-  BYTE BS_Reserved1;
-  BYTE BS_BootSig;
-  DWORD BS_VollID;
-  BYTE BS_VollLab[11];
-  BYTE BS_FilSysType[8];
-  BYTE Reserved2[448];
-  WORD Signature_word;
-} __attribute__ ((packed)) BPB_BS;
-
-/* FAT Directory Structure */
+  char *Name;
+  char *Path;
+  char *IndexPath;
+  VOLUME *Vol;
+  INDEX *Index;
+  pthread_rwlock_t lock;
+  DWORD Generation;
+  IMAGE_SIGNATURE Signature;
+} IMAGE;
+
+/* Directory listed by FAT16_IOC_LIST: the images at the root of a mount
+ * serving several (Img NULL), the children of an index entry, or the cached
+ * list of the directory starting at Cluster */
 typedef struct {
-  BYTE DIR_Name[11];
-  BYTE DIR_Attr;
-  BYTE DIR_NTRes;
-  BYTE DIR_CrtTimeTenth;
-  WORD DIR_CrtTime;
-  WORD DIR_CrtDate;
-  WORD DIR_LstAccDate;
-  WORD DIR_FstClusHI;
-  WORD DIR_WrtTime;
-  WORD DIR_WrtDate;
-  WORD DIR_FstClusLO;
-  DWORD DIR_FileSize;
-} __attribute__ ((packed)) DIR_ENTRY;
-
-/* FAT16 volume data with a file handler of the FAT16 image file */
+  IMAGE *Img;
+  INDEX_ENTRY *Entry;
+  DIR_LIST *List;
+  WORD Cluster;
+  DWORD Count;
+} LISTING;
+
+/* Extent of a read request fetched by a pool worker */
 typedef struct {
   FILE *fd;
-  DWORD FirstRootDirSecNum;
-  DWORD FirstDataSector;
-  BPB_BS Bpb;
-} VOLUME;
+  char *buffer;
+  EXTENT Extent;
+  ssize_t Result;
+  POOL_JOB Job;
+} EXTENT_READ;
+
+/* Mount options given with -o */
+struct fat16_options {
+  int immutable;
+  unsigned int read_workers;
+  unsigned int fanout_min;
+  char *index;
+  int warmup;
+  unsigned int warmup_mem;
+  int sched;
+  unsigned int sched_depth;
+  unsigned int sched_window;
+  unsigned int sched_deadline;
+  unsigned int sched_meta_weight;
+  int check;
+  unsigned int check_threads;
+  char *images;
+  unsigned int cache_mem;
+  char *overlay;
+  unsigned int delalloc;
+  int watch;
+  unsigned int watch_interval;
+  char *backend;
+  char *throttle;
+  unsigned int throttle_latency;
+  unsigned int throttle_seek;
+  unsigned int throttle_bw;
+  char *trace;
+};
+
+static struct fat16_options options;
+
+/* Images served, a single one at the root unless -o images=FILE is given */
+static IMAGE *Images;
+static int ImageCnt;
+static int MultiImage;
+
+/* Memory limit shared by the directory caches of all images (-o cache_mem) */
+static CACHE_BUDGET *Budget;
+
+/* Whether read_buf may hand image file ranges to libfuse to splice: only
+ * when the image file is all there is between the reply and the storage */
+static int Splice;
+
+/* Whether reads go through the throttled backend (-o throttle) */
+static int Throttled;
+
+/* Background warm-up of the caches (-o warmup) */
+static pthread_t warmup_tid;
+static int warmup_running;
+static int warmup_stop;
+
+/* Time (ns) the last FUSE request arrived, the warm-up yields to them */
+static uint64_t last_request;
+
+static const struct fuse_opt fat16_opts[] = {
+  { "immutable", offsetof(struct fat16_options, immutable), 1 },
+  { "read_workers=%u", offsetof(struct fat16_options, read_workers), 0 },
+  { "fanout_min=%u", offsetof(struct fat16_options, fanout_min), 0 },
+  { "index=%s", offsetof(struct fat16_options, index), 0 },
+  { "warmup", offsetof(struct fat16_options, warmup), 1 },
+  { "warmup_mem=%u", offsetof(struct fat16_options, warmup_mem), 0 },
+  { "sched", offsetof(struct fat16_options, sched), 1 },
+  { "sched_depth=%u", offsetof(struct fat16_options, sched_depth), 0 },
+  { "sched_window=%u", offsetof(struct fat16_options, sched_window), 0 },
+  { "sched_deadline=%u", offsetof(struct fat16_options, sched_deadline), 0 },
+  { "sched_meta_weight=%u", offsetof(struct fat16_options, sched_meta_weight), 0 },
+  { "check", offsetof(struct fat16_options, check), 1 },
+  { "check_threads=%u", offsetof(struct fat16_options, check_threads), 0 },
+  { "images=%s", offsetof(struct fat16_options, images), 0 },
+  { "cache_mem=%u", offsetof(struct fat16_options, cache_mem), 0 },
+  { "overlay=%s", offsetof(struct fat16_options, overlay), 0 },
+  { "delalloc=%u", offsetof(struct fat16_options, delalloc), 0 },
+  { "watch", offsetof(struct fat16_options, watch), 1 },
+  { "watch_interval=%u", offsetof(struct fat16_options, watch_interval), 0 },
+  { "backend=%s", offsetof(struct fat16_options, backend), 0 },
+  { "throttle=%s", offsetof(struct fat16_options, throttle), 0 },
+  { "throttle_latency=%u", offsetof(struct fat16_options, throttle_latency), 0 },
+  { "throttle_seek=%u", offsetof(struct fat16_options, throttle_seek), 0 },
+  { "throttle_bw=%u", offsetof(struct fat16_options, throttle_bw), 0 },
+  { "trace=%s", offsetof(struct fat16_options, trace), 0 },
+  FUSE_OPT_END
+};
 
 /* Prototypes (documentation in the functions definitions) */
-int find_root(VOLUME, DIR_ENTRY *Root, char **path, int pathSize, int pathDepth);
-int find_subdir(VOLUME, DIR_ENTRY *Dir, char **path, int pathSize, int pathDepth);
-char **path_treatment(char *pathInput, int *pathSz);
-VOLUME *pre_init_fat16(void);
-WORD fat_entry_by_cluster(VOLUME Vol, WORD ClusterN);
-BYTE *path_decode(BYTE *);
+DWORD immutable_read_size(void);
+IMAGE *image_of(const char *path, const char **Sub);
+int images_load(const char *Manifest);
+int lookup_path(IMAGE *Img, const char *path, DIR_ENTRY *Dir, INDEX_ENTRY **Entry);
+int map_extents(IMAGE *Img, DIR_ENTRY *Dir, INDEX_ENTRY *Entry, off_t offset,
+                size_t size, EXTENT *Extents, int MaxExtents);
 
 void *fat16_init(struct fuse_conn_info *conn);
 void fat16_destroy(void *data);
@@ -84,475 +227,590 @@ int fat16_getattr(const char *path, struct stat *stbuf);
 int fat16_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
                   off_t offset, struct fuse_file_info *fi);
 int fat16_open(const char *path, struct fuse_file_info *fi);
+int fat16_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                unsigned int flags, void *data);
 int fat16_read(const char *path, char *buffer, size_t size, off_t offset,
                struct fuse_file_info *fi);
+int fat16_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                   off_t offset, struct fuse_file_info *fi);
+int fat16_getxattr(const char *path, const char *name, char *value, size_t size);
+int fat16_statfs(const char *path, struct statvfs *stbuf);
+int fat16_write(const char *path, const char *buffer, size_t size, off_t offset,
+                struct fuse_file_info *fi);
+int fat16_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+int fat16_truncate(const char *path, off_t size);
+int fat16_unlink(const char *path);
+int fat16_utimens(const char *path, const struct timespec tv[2]);
+int fat16_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+int fat16_fallocate(const char *path, int mode, off_t offset, off_t length,
+                    struct fuse_file_info *fi);
+int fat16_flush(const char *path, struct fuse_file_info *fi);
+int fat16_release(const char *path, struct fuse_file_info *fi);
+int read_range(IMAGE *Img, DIR_ENTRY *Dir, INDEX_ENTRY *Entry, char *buffer,
+               size_t size, off_t offset);
+void *warmup_thread(void *data);
 
 /**
- * Reads BPB, calculates the first sector of the root and data sections.
+ * Largest read size that is a whole number of clusters of every image and
+ * does not exceed IMMUTABLE_READ_SIZE, so kernel reads and readahead never
+ * split a cluster. Cluster sizes are powers of two, a multiple of the largest
+ * is a multiple of all of them.
  * ============================================================================
  * Return
- * @Vol: Structure that contains essential data about the File System (BPB,
- * first sector number of the Data Region, number of sectors in the root
- * directory and the first sector number of the Root Directory Region).
-* =============================================================================
+ * The read size in bytes (at least one cluster).
+ * ============================================================================
+ * Parameters
+ * There are no parameters in this function.
 **/
-VOLUME *pre_init_fat16(void)
+DWORD immutable_read_size(void)
 {
-  /* Opening the FAT16 image file */
-  FILE *fd = fopen("fat16.img", "rb");
+  DWORD ClusterSize = 0;
+  int i;
 
-  if (fd == NULL) {
-    log_msg("Missing FAT16 image file!\n");
-    exit(EXIT_FAILURE);
+  for (i = 0; i < ImageCnt; i++) {
+    if (Images[i].Vol->Geo.ClusterSize > ClusterSize) {
+      ClusterSize = Images[i].Vol->Geo.ClusterSize;
+    }
   }
 
-  VOLUME *Vol = malloc(sizeof(VOLUME));
-
-  if (Vol == NULL) {
-    log_msg("Out of memory!\n");
-    exit(EXIT_FAILURE);
+  if (ClusterSize >= IMMUTABLE_READ_SIZE) {
+    return ClusterSize;
   }
-
-  Vol->fd = fd;
-
-  /* Reads the BPB */
-  sector_read(Vol->fd, 0, &Vol->Bpb);
-
-  /* First sector of the root directory */
-  Vol->FirstRootDirSecNum = Vol->Bpb.BPB_RsvdSecCnt
-    + (Vol->Bpb.BPB_FATSz16 * Vol->Bpb.BPB_NumFATS);
-
-  /* Number of sectors in the root directory */
-  DWORD RootDirSectors = ((Vol->Bpb.BPB_RootEntCnt * 32) +
-    (Vol->Bpb.BPB_BytsPerSec - 1)) / Vol->Bpb.BPB_BytsPerSec;
-
-  /* First sector of the data region (cluster #2) */
-  Vol->FirstDataSector = Vol->Bpb.BPB_RsvdSecCnt + (Vol->Bpb.BPB_NumFATS *
-    Vol->Bpb.BPB_FATSz16) + RootDirSectors;
-
-  return Vol;
+  return (IMMUTABLE_READ_SIZE / ClusterSize) * ClusterSize;
 }
 
-/**
- * Given a cluster N, this function gets its FAT entry.
- * ============================================================================
- * Return
- * The entry in the FAT for the cluster N
- * ============================================================================
- * Parameters
- * @Vol: Structure that contains essential data about the File System (BPB,
- * first sector number of the Data Region, number of sectors in the root
- * directory and the first sector number of the Root Directory Region).
- * @CusterN: the Nth cluster of the data section.
-**/
-WORD fat_entry_by_cluster(VOLUME Vol, WORD ClusterN) {
-  /* Buffer to store bytes from the image file and the FAT16 offset */
-  BYTE sector_buffer[BYTES_PER_SECTOR];
-  WORD FATOffset = ClusterN * 2;
-
-  /* FatSecNum is the sector number of the FAT sector that contains the entry
-   * for cluster N in the first FAT */
-  WORD FatSecNum = Vol.Bpb.BPB_RsvdSecCnt + (FATOffset / Vol.Bpb.BPB_BytsPerSec);
-  WORD FatEntOffset = FATOffset % Vol.Bpb.BPB_BytsPerSec;
-
-  /* Reads the sector and extract the FAT entry contained on it */
-  sector_read(Vol.fd, FatSecNum, &sector_buffer);
-  return *((WORD *) &sector_buffer[FatEntOffset]);
-}
 
 /**
- * This function receieves the string given by input and divides it into an
- * array of strings, with the format of a FAT file/directory name.
+ * Finds the image a path of the mount belongs to.
  * ============================================================================
  * Return
- * @pathFormatted: array of string, each string references a file of the path,
- * in a given depth. It also presents the format of FAT file names.
+ * The image, or NULL for the root of a mount serving several images (Sub is
+ * "/") and for a name that is no image (Sub is NULL).
  * ============================================================================
  * Parameters
- * @pathInput: User input string, the path of files to go trough.
- * @pathSz: Address of the variable that will keep the number of files in the
- * path.
+ * @path: Absolute path, as handed by FUSE.
+ * @Sub: Receives the path inside the image.
 **/
-char **path_treatment(char *pathInput, int *pathSz) {
-  int pathSize = 1;
-  int i, j;
+IMAGE *image_of(const char *path, const char **Sub)
+{
+  const char *Rest;
+  size_t Length;
+  int i;
 
-  /* Counting number of files */
-  for (i = 2; pathInput[i + 1] != '\0'; i++) {
-    if (pathInput[i] == '/') {
-      pathSize++;
-    }
+  if (!MultiImage) {
+    *Sub = path;
+    return &Images[0];
   }
 
-  char **path = malloc(pathSize * sizeof(char *));
-
-  if (path == NULL) {
-    log_msg("Out of memory!\n");
-    exit(EXIT_FAILURE);
+  path += strspn(path, "/");
+  if (*path == '\0') {
+    *Sub = "/";
+    return NULL;
   }
 
-  const char token[] = "/";
-  char *slice;
-
-  i = 0;
-
-  /* Dividing the path into separated strings of file names */
-  slice = strtok(pathInput, token);
-  while (i < pathSize) {
-    path[i++] = slice;
-    slice = strtok(NULL, token);
+  Rest = strchr(path, '/');
+  Length = Rest == NULL ? strlen(path) : (size_t) (Rest - path);
+  for (i = 0; i < ImageCnt; i++) {
+    if (strlen(Images[i].Name) == Length && strncmp(Images[i].Name, path, Length) == 0) {
+      *Sub = Rest == NULL ? "/" : Rest;
+      return &Images[i];
+    }
   }
+  *Sub = NULL;
+  return NULL;
+}
 
-  char **pathFormatted = malloc(pathSize * sizeof(char *));
-
-  if (pathFormatted == NULL) {
-    log_msg("Out of memory!\n");
-    exit(EXIT_FAILURE);
+/* Keeps the volume and index of an image from being swapped by the watcher
+ * until image_put */
+static void image_hold(IMAGE *Img)
+{
+  if (options.watch) {
+    pthread_rwlock_rdlock(&Img->lock);
   }
+}
 
-  for (i = 0; i < pathSize; i++) {
-    pathFormatted[i] = malloc(11 * sizeof(char));
-
-    if (pathFormatted[i] == NULL) {
-      log_msg("Out of memory!\n");
-      exit(EXIT_FAILURE);
-    }
+/* Releases an image held by image_hold or image_get (NULL is ignored) */
+static void image_put(IMAGE *Img)
+{
+  if (Img != NULL && options.watch) {
+    pthread_rwlock_unlock(&Img->lock);
   }
+}
 
-  int k;
-  int dotFlag = 0;
-
-  /* Verifies if each file of the path is a valid input, and then formats it */
-  for (i = 0; i < pathSize; i++) {
-    for (j = 0, k = 0; ; j++, k++) {
-
-      /* Here, a '.' (dot) character is analysed */
-      if (path[i][j] == '.') {
-
-        /* Verifies if it is a "./" */
-        if (j == 0 && path[i][j + 1] == '\0') {
-          pathFormatted[i][0] = '.';
-
-          for (k = 1; k < 11; k++) {
-            pathFormatted[i][k] = ' ';
-          }
-          break;
-        }
-
-        /* Verifies if it's a "../" */
-        if (j == 0 && path[i][j + 1] == '.' && path[i][j + 2] == '\0') {
-          pathFormatted[i][0] = '.';
-          pathFormatted[i][1] = '.';
-
-          for (k = 2; k < 11; k++) {
-            pathFormatted[i][k] = ' ';
-          }
-          break;
-        }
-
-        /* Check if there wasn't any other past occurrence of the '.' character */
-        if (!dotFlag) {
-          /* Marks the occurrence of the '.' character */
-          dotFlag = 1;
+/* image_of, the image found held until image_put */
+static IMAGE *image_get(const char *path, const char **Sub)
+{
+  IMAGE *Img = image_of(path, Sub);
 
-          /* Fills with space ' ' character the name field leftover */
-          for (; k < 8; k++) {
-            pathFormatted[i][k] = ' ';
-          }
-          k = 7;
-        }
-      }
+  if (Img != NULL) {
+    image_hold(Img);
+  }
+  return Img;
+}
 
-      /* End of the file name, fills with ' ' character the rest of the file
-       * name and the file extension fields */
-      else if (path[i][j] == '\0') {
-        for (; k < 11; k++) {
-          pathFormatted[i][k] = ' ';
-        }
-        break;
-      }
+/* Reads what identifies the current contents of an image file. Returns 0,
+ * or -1 if it cannot be read */
+static int image_signature(const char *Path, IMAGE_SIGNATURE *Signature)
+{
+  struct stat st;
+  BPB_BS Bpb;
+  FILE *fd = fopen(Path, "rb");
+  int res = -1;
 
-      /* Turns lower case characters into upper case characters */
-      else if (path[i][j] >= 'a' && path[i][j] <= 'z') {
-        pathFormatted[i][k] = path[i][j] - 32;
-      }
-      /* Other character accepted in the file name */
-      else if ((path[i][j] >= 'A' && path[i][j] <= 'Z') || (path[i][j] >= '0' &&
-                path[i][j] <= '9') || path[i][j] == '$' || path[i][j] == '%' ||
-                path[i][j] == '\'' || path[i][j] == '-' || path[i][j] == '_' ||
-                path[i][j] == '@' || path[i][j] == '~' || path[i][j] == '`' ||
-                path[i][j] == '!' || path[i][j] == '(' || path[i][j] == ')' ||
-                path[i][j] == '{' || path[i][j] == '}' || path[i][j] == '^' ||
-                path[i][j] == '#' || path[i][j] == '&') {
-        pathFormatted[i][k] = path[i][j];
-      }
-    }
-    pathFormatted[i][11] = '\0';
+  if (fd == NULL) {
+    return -1;
   }
-
-  *pathSz = pathSize;
-  free(path);
-  return pathFormatted;
+  if (fstat(fileno(fd), &st) == 0 &&
+      sector_pread_file(fd, &Bpb, sizeof(BPB_BS), 0) == sizeof(BPB_BS)) {
+    memset(Signature, 0, sizeof(IMAGE_SIGNATURE));
+    Signature->Dev = st.st_dev;
+    Signature->Ino = st.st_ino;
+    Signature->Size = st.st_size;
+    Signature->Mtime = st.st_mtim;
+    Signature->VollID = Bpb.BS_VollID;
+    res = 0;
+  }
+  sector_forget(fd);
+  fclose(fd);
+  return res;
 }
 
 /**
- * This function receieves a FAT file/directory name (DIR_Name) and decodes it
- * to its original user input name.
- * ==================================================================================
+ * Watcher callback: reloads an image whose file was rewritten or replaced.
+ * The new volume is opened (and checked with -o check) aside, then swapped
+ * in while no request holds the image, so the FAT, directory cache, index
+ * and geometry all move to the new contents at once and the generation of
+ * the image goes up. An image that cannot be opened keeps being served from
+ * the old volume, and is tried again at the next change or sweep.
+ * ============================================================================
  * Return
- * @pathDecoded: FAT name decoded to its original input name
- * ==================================================================================
+ * There is no return in this funcion.
+ * ============================================================================
  * Parameters
- * @path: DIR_Name string
+ * @Index: Position of the image in Images.
 **/
-BYTE *path_decode(BYTE *path) {
-  int i, j = 0;
-  BYTE *pathDecoded = malloc(11 * sizeof(BYTE));
-
-  if (pathDecoded == NULL) {
-    log_msg("Out of memory!\n");
-    exit(EXIT_FAILURE);
+static void image_changed(int Index)
+{
+  IMAGE *Img = &Images[Index];
+  IMAGE_SIGNATURE Signature;
+  VOLUME *Vol, *Old;
+  INDEX *OldIndex;
+
+  if (image_signature(Img->Path, &Signature) != 0 ||
+      memcmp(&Signature, &Img->Signature, sizeof(IMAGE_SIGNATURE)) == 0) {
+    return;
   }
 
-  /* If the name consists of "./" or "../", return them as the decoded path */
-  if (path[0] == '.' && path[1] == '.') {
-    pathDecoded[j++] = '.';
-    pathDecoded[j++] = '.';
-    pathDecoded[j] = '\0';
-    return pathDecoded;
-  }
-  if (path[0] == '.') {
-    pathDecoded[j++] = '.';
-    pathDecoded[j] = '\0';
-    return pathDecoded;
-  }
-
-  /* Decoding from uppercase letters to lowercase letters, removing spaces,
-   * inserting 'dots' in between them and verifying if they are legal */
-  for (i = 0; i < 11; i++) {
-    if (path[i] != ' ') {
-      if (i != 8) {
-        if ((path[i] >= '0' && path[i] <= '9') || path[i] == '$' ||
-            path[i] == '%' || path[i] == '\'' || path[i] == '-' ||
-            path[i] == '_' || path[i] == '@' || path[i] == '~' ||
-            path[i] == '`' || path[i] == '!' || path[i] == '(' ||
-            path[i] == ')' || path[i] == '{' || path[i] == '}' ||
-            path[i] == '^' || path[i] == '#' || path[i] == '&') {
-          pathDecoded[j++] = path[i];
-        } else {
-          pathDecoded[j++] = path[i] + 32;
-        }
-      } else {
-        pathDecoded[j++] = '.';
-        if ((path[i] >= '0' && path[i] <= '9') || path[i] == '$' ||
-            path[i] == '%' || path[i] == '\'' || path[i] == '-' ||
-            path[i] == '_' || path[i] == '@' || path[i] == '~' ||
-            path[i] == '`' || path[i] == '!' || path[i] == '(' ||
-            path[i] == ')' || path[i] == '{' || path[i] == '}' ||
-            path[i] == '^' || path[i] == '#' || path[i] == '&') {
-          pathDecoded[j++] = path[i];
-        } else {
-          pathDecoded[j++] = path[i] + 32;
-        }
-      }
-    }
+  Vol = libfat16_open_image(Img->Path);
+  if (Vol == NULL) {
+    log_msg("%s: changed, but cannot be opened: %s\n", Img->Path, strerror(errno));
+    return;
+  }
+  if (options.check && check_volume(Vol, options.check_threads, NULL) != 0) {
+    log_msg("%s: changed, but has problems, still serving the old contents\n", Img->Path);
+    Img->Signature = Signature;
+    libfat16_close_image(Vol);
+    return;
+  }
+  cache_budget_attach(Budget, Vol);
+  volume_count(Vol);
+
+  pthread_rwlock_wrlock(&Img->lock);
+  Old = Img->Vol;
+  OldIndex = Img->Index;
+  Img->Vol = Vol;
+  Img->Index = Img->IndexPath != NULL ? index_open(Vol, Img->IndexPath) : NULL;
+  Img->Signature = Signature;
+  __atomic_add_fetch(&Img->Generation, 1, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&Img->lock);
+
+  log_msg("%s: changed (volume ID %08x), generation %u%s\n", Img->Path,
+          Signature.VollID, Img->Generation,
+          Img->IndexPath != NULL && Img->Index == NULL ? ", index is stale" : "");
+  if (OldIndex != NULL) {
+    index_close(OldIndex);
   }
-  pathDecoded[j] = '\0';
-  return pathDecoded;
+  libfat16_close_image(Old);
 }
 
 /**
- * Browse directory entries in root directory.
- * ==================================================================================
+ * Opens the images listed in a manifest, one per line: the name of its
+ * subdirectory, the path of the image file and optionally the path of its
+ * index. Empty lines and lines starting with '#' are skipped.
+ * ============================================================================
  * Return
- * 0, if we did find a file corresponding to the given path or 1 if we did not
- * ==================================================================================
+ * 0 if every image was opened, -1 otherwise (the reason is printed).
+ * ============================================================================
  * Parameters
- * @Vol: Structure that contains essential data about the File System (BPB, first
- * sector number of the Data Region, number of sectors in the root directory and the
- * first sector number of the Root Directory Region).
- * @Root: Variable that will store directory entries in root.
- * @path: Path organized in an array of files names.
- * @pathSize: Number of files in the path.
- * @pathDepth: Depth, or index, o the current file of the path.
+ * @Manifest: Path of the manifest.
 **/
-int find_root(VOLUME Vol, DIR_ENTRY *Root, char **path, int pathSize, int pathDepth)
+int images_load(const char *Manifest)
 {
-  int i, j;
-  int RootDirCnt = 1, cmpstring = 1;
-  BYTE buffer[BYTES_PER_SECTOR];
+  char Line[MANIFEST_LINE];
+  FILE *In = fopen(Manifest, "r");
+  int LineN = 0, i;
 
-  sector_read(Vol.fd, Vol.FirstRootDirSecNum, buffer);
+  if (In == NULL) {
+    fprintf(stderr, "%s: %s\n", Manifest, strerror(errno));
+    return -1;
+  }
 
-  /* We search for the path in the root directory first */
-  for (i = 1; i <= Vol.Bpb.BPB_RootEntCnt; i++) {
-    memcpy(Root, &buffer[((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR], BYTES_PER_DIR);
+  while (fgets(Line, sizeof(Line), In) != NULL) {
+    char *Save, *Name, *Path, *IndexPath;
 
-    /* If the directory entry is free, all the next directory entries are also
-     * free. So this file/directory could not be found */
-    if (Root->DIR_Name[0] == 0x00) {
-      return 1;
+    LineN++;
+    Name = strtok_r(Line, " \t\r\n", &Save);
+    if (Name == NULL || Name[0] == '#') {
+      continue;
     }
-
-    /* Comparing strings character by character */
-    cmpstring = 1;
-    for (j = 0; j < 11; j++) {
-      if (Root->DIR_Name[j] != path[pathDepth][j]) {
-        cmpstring = 0;
-        break;
+    Path = strtok_r(NULL, " \t\r\n", &Save);
+    IndexPath = strtok_r(NULL, " \t\r\n", &Save);
+    if (Path == NULL || strchr(Name, '/') != NULL || strcmp(Name, ".") == 0 ||
+        strcmp(Name, "..") == 0) {
+      fprintf(stderr, "%s:%d: expected <name> <image> [<index>]\n", Manifest, LineN);
+      fclose(In);
+      return -1;
+    }
+    for (i = 0; i < ImageCnt; i++) {
+      if (strcmp(Images[i].Name, Name) == 0) {
+        fprintf(stderr, "%s:%d: image %s listed twice\n", Manifest, LineN, Name);
+        fclose(In);
+        return -1;
       }
     }
 
-    /* If the path is only one file (ATTR_ARCHIVE) and it is located in the
-     * root directory, stop searching */
-    if (cmpstring && Root->DIR_Attr == ATTR_ARCHIVE) {
-      return 0;
-    }
+    Images = realloc(Images, (ImageCnt + 1) * sizeof(IMAGE));
 
-    /* If the path is only one directory (ATTR_DIRECTORY) and it is located in
-     * the root directory, stop searching */
-    if (cmpstring && Root->DIR_Attr == ATTR_DIRECTORY && pathSize == pathDepth + 1) {
-      return 0;
+    if (Images == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
     }
 
-    /* If the first level of the path is a directory, continue searching
-     * in the root's sub-directories */
-    if (cmpstring && Root->DIR_Attr == ATTR_DIRECTORY) {
-      return find_subdir(Vol, Root, path, pathSize, pathDepth + 1);
+    IMAGE *Img = &Images[ImageCnt];
+
+    Img->Name = strdup(Name);
+    Img->Path = strdup(Path);
+    Img->IndexPath = IndexPath != NULL ? strdup(IndexPath) : NULL;
+    Img->Index = NULL;
+    Img->Vol = libfat16_open_image(Path);
+    if (Img->Vol == NULL) {
+      fprintf(stderr, "%s: %s\n", Path, errno == EINVAL ?
+              "not a valid FAT16 image" : strerror(errno));
+      fclose(In);
+      return -1;
     }
+    ImageCnt++;
 
-    /* End of bytes for this sector (1 sector == 512 bytes == 16 DIR entries)
-     * Read next sector */
-    if (i % 16 == 0 && i != Vol.Bpb.BPB_RootEntCnt) {
-      sector_read(Vol.fd, Vol.FirstRootDirSecNum + RootDirCnt, buffer);
-      RootDirCnt++;
+    if (IndexPath != NULL) {
+      Img->Index = index_open(Img->Vol, IndexPath);
+      if (Img->Index != NULL) {
+        log_msg("%s: using index %s\n", Name, IndexPath);
+      }
     }
   }
 
-  /* We did not find anything */
-  return 1;
+  fclose(In);
+  if (ImageCnt == 0) {
+    fprintf(stderr, "%s: no image listed\n", Manifest);
+    return -1;
+  }
+  return 0;
 }
 
 /**
- * Browse directory entries in a subdirectory.
- * ==================================================================================
+ * Finds the directory entry of a path. With an index the answer comes from
+ * it and no directory sector is read.
+ * ============================================================================
  * Return
- * There is no return in this funcion.
- * ==================================================================================
+ * 0, if we did find a file corresponding to the given path or 1 if we did not
+ * ============================================================================
  * Parameters
- * @Vol: Structure that contains essential data about the File System (BPB, first
- * sector number of the Data Region, number of sectors in the root directory and the
- * first sector number of the Root Directory Region).
- * @Dir: Variable that will store directory entries the subdirectory.
- * @path: Path organized in an array of files names.
- * @pathSize: Number of files in the path.
- * @pathDepth: Depth, or index, o the current file of the path.
+ * @Img: Image the path belongs to.
+ * @path: Absolute path inside the image.
+ * @Dir: Receives the directory entry.
+ * @Entry: Receives the index entry, NULL when the image has no index.
 **/
-int find_subdir(VOLUME Vol, DIR_ENTRY *Dir, char **path, int pathSize, int pathDepth)
+int lookup_path(IMAGE *Img, const char *path, DIR_ENTRY *Dir, INDEX_ENTRY **Entry)
 {
-  int i, j, DirSecCnt = 1, cmpstring;
-  BYTE buffer[BYTES_PER_SECTOR];
+  *Entry = NULL;
 
-  /* Calculating the first cluster sector for the given path */
-  WORD ClusterN = Dir->DIR_FstClusLO;
-  WORD FatClusEntryVal = fat_entry_by_cluster(Vol, ClusterN);
-  WORD FirstSectorofCluster = ((ClusterN - 2) *Vol.Bpb.BPB_SecPerClus) + Vol.FirstDataSector;
+  if (Img->Index != NULL) {
+    *Entry = index_lookup(Img->Index, path);
+    if (*Entry == NULL) {
+      return 1;
+    }
+    *Dir = (*Entry)->Dir;
+    return 0;
+  }
 
-  sector_read(Vol.fd, FirstSectorofCluster, buffer);
+  return path_lookup(Img->Vol, path, Dir) == 0 ? 0 : 1;
+}
 
-  /* Searching for the given path in all directory entries of Dir */
-  for (i = 1; Dir->DIR_Name[0] != 0x00; i++) {
-    memcpy(Dir, &buffer[((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR], BYTES_PER_DIR);
+/* file_extents, from the index when the file was looked up in it */
+int map_extents(IMAGE *Img, DIR_ENTRY *Dir, INDEX_ENTRY *Entry, off_t offset,
+                size_t size, EXTENT *Extents, int MaxExtents)
+{
+  if (Entry != NULL) {
+    return index_extents(Img->Index, Img->Vol, Entry, offset, size, Extents, MaxExtents);
+  }
+  return file_extents(Img->Vol, Dir, offset, size, Extents, MaxExtents);
+}
 
-    /* Comparing strings */
-    cmpstring = 1;
-    for (j = 0; j < 11; j++) {
-      if (Dir->DIR_Name[j] != path[pathDepth][j]) {
-        cmpstring = 0;
-        break;
-      }
-    }
+/* Monotonic clock in nanoseconds */
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
 
-    /* Stop searching if the last file of the path is located in this
-     * directory */
-    if ((cmpstring && Dir->DIR_Attr == ATTR_ARCHIVE && pathDepth + 1 == pathSize) ||
-        (cmpstring && Dir->DIR_Attr == ATTR_DIRECTORY && pathDepth + 1 == pathSize)) {
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Marks the arrival of a FUSE request */
+static void request_arrived(void)
+{
+  __atomic_store_n(&last_request, now_ns(), __ATOMIC_RELAXED);
+}
+
+/* Sleeps while FUSE requests keep arriving. Returns 1 if the mount is going
+ * away */
+static int warmup_yield(void)
+{
+  while (!__atomic_load_n(&warmup_stop, __ATOMIC_RELAXED)) {
+    if (now_ns() - __atomic_load_n(&last_request, __ATOMIC_RELAXED) >= WARMUP_QUIET_NS) {
       return 0;
     }
+    usleep(1000);
+  }
+  return 1;
+}
+
+/* Whether the directory caches may take more from the warm-up */
+static int warmup_room(VOLUME *Vol)
+{
+  if (__atomic_load_n(&Vol->Cache->DirBytes, __ATOMIC_RELAXED) >= options.warmup_mem) {
+    return 0;
+  }
 
-    /* Recursively keep searching if the directory has been found and it isn't
-     * the last file */
-    if (cmpstring && Dir->DIR_Attr == ATTR_DIRECTORY) {
-      return find_subdir(Vol, Dir, path, pathSize, pathDepth + 1);
+  /* Filling a shared budget would only evict what the readers use, each
+   * image warms up to its share */
+  return Budget->Limit == 0 ||
+         __atomic_load_n(&Vol->Cache->DirBytes, __ATOMIC_RELAXED) < Budget->Limit / ImageCnt;
+}
+
+/**
+ * Warms up one image: loads the whole FAT, then reads the directory tree
+ * breadth first into the directory cache.
+ * ============================================================================
+ * Return
+ * 1 if the mount is going away, 0 otherwise.
+ * ============================================================================
+ * Parameters
+ * @Vol: The volume to warm up.
+**/
+static int warmup_volume(VOLUME *Vol)
+{
+  DWORD EntsPerSec = (DWORD) 1 << Vol->Geo.FatEntsShift;
+  DWORD FatEntries = Vol->Bpb.BPB_FATSz16 * EntsPerSec;
+  DWORD head = 0, tail = 0, Dirs = 0, i, c;
+  uint64_t start = now_ns();
+  int stop = 0;
+
+  /* One FAT sector at a time */
+  for (c = 0; c < FatEntries && c <= 0xffff; c += EntsPerSec) {
+    if (warmup_yield()) {
+      return 1;
     }
+    fat_entry_by_cluster(Vol, c);
+  }
+
+  /* Breadth first walk, each directory enqueued once by its first cluster */
+  WORD *Queue = malloc(DIR_CACHE_SLOTS * sizeof(WORD));
+  BYTE *Queued = calloc(DIR_CACHE_SLOTS / 8, 1);
 
-    /* A sector needs to be readed 16 times by the buffer to reach the end. */
-    if (i % 16 == 0) {
-      /* If there are still sector to be read in the cluster, read the next sector. */
-      if (DirSecCnt < Vol.Bpb.BPB_SecPerClus) {
-        sector_read(Vol.fd, FirstSectorofCluster + DirSecCnt, buffer);
-        DirSecCnt++;
-      } else { /* Reaches the end of the cluster */
+  if (Queue == NULL || Queued == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
 
-        /* Not strictly necessary, but here we reach the end of the clusters of
-         * this directory entry. */
-        if (FatClusEntryVal == 0xffff) {
-          return 1;
-        }
+  Queue[tail++] = 0;
+  Queued[0] = 1;
 
-        /* Next cluster */
-        ClusterN = FatClusEntryVal;
+  while (head < tail) {
+    if (!warmup_room(Vol)) {
+      log_msg("Warm-up: memory budget reached\n");
+      break;
+    }
+    if (warmup_yield()) {
+      stop = 1;
+      break;
+    }
 
-        /* Updates the fat entry for the above cluster */
-        FatClusEntryVal = fat_entry_by_cluster(Vol, ClusterN);
+    DIR_LIST *List = dir_list(Vol, Queue[head++]);
+    Dirs++;
 
-        /* Calculates the first sector of the cluster */
-        FirstSectorofCluster = ((ClusterN - 2) * Vol.Bpb.BPB_SecPerClus) + Vol.FirstDataSector;
+    for (i = 0; i < List->Count; i++) {
+      WORD ClusterN = List->Entries[i].DIR_FstClusLO;
 
-        /* Read it, and then continue */
-        sector_read(Vol.fd, FirstSectorofCluster, buffer);
-        i = 0;
-        DirSecCnt = 1;
+      if (!(List->Entries[i].DIR_Attr & ATTR_DIRECTORY) || List->Entries[i].DIR_Name[0] == '.' ||
+          ClusterN < 2 || Queued[ClusterN / 8] & (1 << (ClusterN % 8))) {
+        continue;
       }
+      Queued[ClusterN / 8] |= 1 << (ClusterN % 8);
+      Queue[tail++] = ClusterN;
     }
+    dir_release(List);
   }
 
-  /* We did not find the given path */
-  return 1;
+  log_msg("Warm-up: %u directories, %zu bytes cached in %llu ms\n", Dirs,
+          __atomic_load_n(&Vol->Cache->DirBytes, __ATOMIC_RELAXED),
+          (unsigned long long) (now_ns() - start) / 1000000);
+
+  free(Queue);
+  free(Queued);
+  return stop;
+}
+
+/**
+ * Warm-up worker: warms up every image in turn while the mount is already
+ * serving. It runs at the lowest CPU and I/O priority, steps aside whenever
+ * FUSE requests are arriving and stops filling the directory cache of an
+ * image once it holds warmup_mem bytes (or its share of cache_mem).
+ * ============================================================================
+ * Return
+ * NULL
+ * ============================================================================
+ * Parameters
+ * @data: Unused.
+**/
+void *warmup_thread(void *data)
+{
+  int i, stop;
+
+  /* Idle scheduling class for CPU and disk (ioprio class 3 is IDLE) */
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+  syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+
+  /* Queued behind the data of the readers, not with their metadata */
+  iosched_thread_lane(IOSCHED_DATA);
+
+  /* A reload of the image being warmed up waits for its warm-up to end */
+  for (i = 0; i < ImageCnt; i++) {
+    image_hold(&Images[i]);
+    stop = warmup_volume(Images[i].Vol);
+    image_put(&Images[i]);
+    if (stop) {
+      break;
+    }
+  }
+  return NULL;
 }
 
 //------------------------------------------------------------------------------
 
 void *fat16_init(struct fuse_conn_info *conn)
 {
-  struct fuse_context *context;
-  context = fuse_get_context();
+  /* read_buf replies with image file descriptors, let libfuse splice them */
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+  /* The image never changes under an immutable mount, so let the kernel read
+   * ahead whole clusters and issue reads asynchronously */
+  if (options.immutable) {
+    DWORD ReadSize = immutable_read_size();
+
+    conn->async_read = 1;
+    conn->want |= FUSE_CAP_ASYNC_READ;
+    if (conn->max_readahead > ReadSize) {
+      conn->max_readahead = ReadSize;
+    }
+  }
+
+  pool_start(options.read_workers);
+
+  /* Reads of all FUSE threads and workers are sorted and merged, directory
+   * and FAT sectors ahead of file data, whatever image they are on */
+  if (options.sched) {
+    iosched_start(options.sched_depth, options.sched_window,
+                  options.sched_deadline, options.sched_meta_weight);
+  }
+
+  /* Started here, after fuse_main is done daemonizing */
+  if (options.warmup) {
+    warmup_running = pthread_create(&warmup_tid, NULL, warmup_thread, NULL) == 0;
+  }
+  if (options.watch) {
+    const char **Paths = malloc(ImageCnt * sizeof(char *));
+    int i;
+
+    if (Paths == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < ImageCnt; i++) {
+      Paths[i] = Images[i].Path;
+    }
+    if (watch_start(Paths, ImageCnt, options.watch_interval, image_changed) != 0) {
+      log_msg("Watcher: could not be started, image changes go unnoticed\n");
+    }
+    free(Paths);
+  }
 
-  return context->private_data;
+  return NULL;
 }
 
 void fat16_destroy(void *data)
 {
-  free(data);
+  int i;
+
+  if (options.watch) {
+    watch_stop();
+  }
+  if (warmup_running) {
+    __atomic_store_n(&warmup_stop, 1, __ATOMIC_RELAXED);
+    pthread_join(warmup_tid, NULL);
+  }
+  pool_stop();
+  iosched_stop();
+  for (i = 0; i < ImageCnt; i++) {
+    IMAGE *Img = &Images[i];
+
+    if (file_flush_all(Img->Vol) != 0) {
+      log_msg("%s: appends held back could not all be written\n", Img->Path);
+    }
+    if (Img->Vol->AbortedWalks > 0) {
+      log_msg("%s: aborted cluster chain walks: %u\n", Img->Path, Img->Vol->AbortedWalks);
+    }
+    if (Img->Index != NULL) {
+      index_close(Img->Index);
+    }
+    libfat16_close_image(Img->Vol);
+    if (options.watch) {
+      pthread_rwlock_destroy(&Img->lock);
+    }
+    free(Img->Name);
+    free(Img->Path);
+    free(Img->IndexPath);
+  }
+  log_msg("Directory cache evictions: %llu\n", (unsigned long long) Budget->Evictions);
+  if (Throttled) {
+    char Report[512];
+
+    backend_report(Report, sizeof(Report));
+    log_msg("Throttled backend:\n%s", Report);
+  }
+  cache_budget_free(Budget);
+  free(Images);
+  trace_close();
 }
 
-int fat16_getattr(const char *path, struct stat *stbuf)
+/* getattr of a path inside an image, with the image held */
+static int image_getattr(IMAGE *Img, const char *Sub, struct stat *stbuf)
 {
-  VOLUME *Vol;
-
-  /* Gets volume data supplied in the context during the fat16_init function */
-  struct fuse_context *context;
-  context = fuse_get_context();
-  Vol = (VOLUME *) context->private_data;
+  VOLUME *Vol = Img->Vol;
 
-  /* stbuf: setting file/directory attributes */
-  memset(stbuf, 0, sizeof(struct stat));
   stbuf->st_dev = Vol->Bpb.BS_VollID;
-  stbuf->st_blksize = BYTES_PER_SECTOR * Vol->Bpb.BPB_SecPerClus;
-  stbuf->st_uid = getuid();
-  stbuf->st_gid = getgid();
+  stbuf->st_blksize = Vol->Geo.ClusterSize;
 
-  if (strcmp(path, "/") == 0) {
+  if (strcmp(Sub, "/") == 0) {
 
     /* Root directory attributes */
     stbuf->st_mode = S_IFDIR | S_IRWXU;
@@ -563,207 +821,1074 @@ int fat16_getattr(const char *path, struct stat *stbuf)
 
     /* File/Directory attributes */
     DIR_ENTRY Dir;
-    int pathSize;
-    char **pathFormatted = path_treatment((char *) path, &pathSize);
-    int res = find_root(*Vol, &Dir, pathFormatted, pathSize, 0);
+    INDEX_ENTRY *Entry;
 
-    if (res == 0) {
-
-      /* FAT-like permissions */
-      if (Dir.DIR_Attr == ATTR_DIRECTORY) {
-        stbuf->st_mode = S_IFDIR | 0755;
-      } else {
-        stbuf->st_mode = S_IFREG | 0755;
-      }
-      stbuf->st_size = Dir.DIR_FileSize;
+    off_t Size;
 
-      /* Number of blocks */
-      if (stbuf->st_size % stbuf->st_blksize != 0) {
-        stbuf->st_blocks = (int) (stbuf->st_size / stbuf->st_blksize) + 1;
-      } else {
-        stbuf->st_blocks = (int) (stbuf->st_size / stbuf->st_blksize);
-      }
+    if (lookup_path(Img, Sub, &Dir, &Entry) != 0) {
+      /* Lets the kernel cache the miss (negative_timeout) */
+      return -ENOENT;
+    }
+    dir_stat(Vol, &Dir, stbuf);
 
-      /* Implementing the required FAT Date/Time attributes */
-      struct tm t;
-      memset((char *) &t, 0, sizeof(struct tm));
-      t.tm_sec = Dir.DIR_WrtTime & ((1 << 5) - 1);
-      t.tm_min = (Dir.DIR_WrtTime >> 5) & ((1 << 6) - 1);
-      t.tm_hour = Dir.DIR_WrtTime >> 11;
-      t.tm_mday = (Dir.DIR_WrtDate & ((1 << 5) - 1));
-      t.tm_mon = (Dir.DIR_WrtDate >> 5) & ((1 << 4) - 1);
-      t.tm_year = 80 + (Dir.DIR_WrtDate >> 9);
-      stbuf->st_ctime = stbuf->st_atime = stbuf->st_mtime = mktime(&t);
+    /* Appends held back count in the size, not yet in the blocks */
+    if (file_pending(Vol, Sub, &Size)) {
+      stbuf->st_size = Size;
     }
   }
+
+  /* FAT times have a 2 second resolution, the nanoseconds carry the
+   * generation of the image so auto_cache drops the pages of a replaced
+   * image even when its files keep their size and time */
+  stbuf->st_mtim.tv_nsec = Img->Generation % 1000000000;
   return 0;
 }
 
-int fat16_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
-                  off_t offset, struct fuse_file_info *fi)
+int fat16_getattr(const char *path, struct stat *stbuf)
 {
-  VOLUME *Vol;
-  BYTE sector_buffer[BYTES_PER_SECTOR];
-  int RootDirCnt = 1, DirSecCnt = 1, i;
-
-  /* Gets volume data supplied in the context during the fat16_init function */
-  struct fuse_context *context;
-  context = fuse_get_context();
-  Vol = (VOLUME *) context->private_data;
+  const char *Sub;
+  IMAGE *Img;
+  int res;
 
-  sector_read(Vol->fd, Vol->FirstRootDirSecNum, sector_buffer);
-
-  if (strcmp(path, "/") == 0) {
-    DIR_ENTRY Root;
-
-    /* Starts filling the requested directory entries into the buffer */
-    for (i = 1; i <= Vol->Bpb.BPB_RootEntCnt; i++) {
-      memcpy(&Root, &sector_buffer[((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR], BYTES_PER_DIR);
-
-      /* No more files to fill */
-      if (Root.DIR_Name[0] == 0x00) {
-        return 0;
-      }
+  request_arrived();
+  PROBE1(getattr_entry, path);
 
-      /* If we find a file or a directory, fill it into the buffer */
-      if (Root.DIR_Attr == ATTR_ARCHIVE || Root.DIR_Attr == ATTR_DIRECTORY) {
-        const char *filename = (const char *) path_decode(Root.DIR_Name);
-        filler(buffer, filename, NULL, 0);
-      }
+  /* stbuf: setting file/directory attributes */
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_uid = getuid();
+  stbuf->st_gid = getgid();
 
-      /* End of bytes for this sector (1 sector == 512 bytes == 16 DIR entries)
-       * Read next sector */
-      if (i % 16 == 0 && i != Vol->Bpb.BPB_RootEntCnt) {
-        sector_read(Vol->fd, Vol->FirstRootDirSecNum + RootDirCnt, sector_buffer);
-        RootDirCnt++;
-      }
-    }
+  Img = image_get(path, &Sub);
+  if (Img != NULL) {
+    res = image_getattr(Img, Sub, stbuf);
+    image_put(Img);
+  } else if (Sub != NULL) {
+    /* Root of a mount serving several images: one subdirectory each */
+    stbuf->st_mode = S_IFDIR | S_IRWXU;
+    res = 0;
   } else {
-    DIR_ENTRY Dir;
-    int pathSize;
-
-    /* Formats the given path into the FAT format name */
-    char **pathFormatted = path_treatment((char *) path, &pathSize);
+    res = -ENOENT;
+  }
 
-    /* Finds the first corresponding directory entry in the root directory and
-     * store the result in the directory entry Dir */
-    find_root(*Vol, &Dir, pathFormatted, pathSize, 0);
+  PROBE2(getattr_return, path, res);
+  return res;
+}
 
-    /* Calculating the first cluster sector for the given path */
-    WORD ClusterN = Dir.DIR_FstClusLO;
-    WORD FatClusEntryVal = fat_entry_by_cluster(*Vol, ClusterN);
-    WORD FirstSectorofCluster = ((ClusterN - 2) * Vol->Bpb.BPB_SecPerClus) + Vol->FirstDataSector;
+/* readdir of a directory inside an image, with the image held */
+static int image_readdir(IMAGE *Img, const char *path, const char *Sub, void *buffer,
+                         fuse_fill_dir_t filler)
+{
+  /* The index holds the children of every directory */
+  INDEX *Index = Img->Index;
 
-    sector_read(Vol->fd, FirstSectorofCluster, sector_buffer);
+  if (Index != NULL) {
+    INDEX_ENTRY *Entry = index_lookup(Index, Sub);
+    DWORD Child;
 
-    /* Start searching the root's sub-directories starting from Dir */
-    for (i = 1; Dir.DIR_Name[0] != 0x00; i++) {
-      memcpy(&Dir, &sector_buffer[((i - 1) * BYTES_PER_DIR) % BYTES_PER_SECTOR], BYTES_PER_DIR);
+    if (Entry == NULL || !(Entry->Dir.DIR_Attr & ATTR_DIRECTORY) ||
+        Entry->ChildIdx + (uint64_t) Entry->ChildCnt > Index->Header->ChildCnt) {
+      return -ENOENT;
+    }
+    if (strcmp(path, "/") != 0) {
+      filler(buffer, ".", NULL, 0);
+      filler(buffer, "..", NULL, 0);
+    }
+    for (Child = 0; Child < Entry->ChildCnt; Child++) {
+      DWORD ChildN = Index->Children[Entry->ChildIdx + Child];
 
-      /* If the last file of the path is located in this directory, stop
-       * searching */
-      if (Dir.DIR_Attr == ATTR_ARCHIVE || Dir.DIR_Attr == ATTR_DIRECTORY) {
-        const char *filename = (const char *) path_decode(Dir.DIR_Name);
-        filler(buffer, filename, NULL, 0);
+      if (ChildN < Index->Header->EntryCnt) {
+        filler(buffer, index_name(Index, &Index->Entries[ChildN]), NULL, 0);
       }
+    }
+    return 0;
+  }
 
-      /* End of bytes for this sector (1 sector == 512 bytes == 16 DIR entries) */
-      if (i % 16 == 0) {
-
-        /* If there are still sector to be read in the cluster, read the next sector. */
-        if (DirSecCnt < Vol->Bpb.BPB_SecPerClus) {
-          sector_read(Vol->fd, FirstSectorofCluster + DirSecCnt, sector_buffer);
-          DirSecCnt++;
-
-        /* Else, read the next sector */
-        } else {
-
-          /* Not strictly necessary, but here we reach the end of the clusters
-           * of this directory entry. */
-          if (FatClusEntryVal == 0xffff) {
-            return 0;
-          }
-
-          /* Next cluster */
-          ClusterN = FatClusEntryVal;
-
-          /* Updates its fat entry */
-          FatClusEntryVal = fat_entry_by_cluster(*Vol, ClusterN);
-
-          /* Calculates its first sector */
-          FirstSectorofCluster = ((ClusterN - 2) * Vol->Bpb.BPB_SecPerClus) + Vol->FirstDataSector;
+  /* Entries of the directory, from the directory cache */
+  LIBFAT16_DIR *It = libfat16_opendir(Img->Vol, Sub);
+  LIBFAT16_NODE Node;
 
-          /* Reads it, and then continue */
-          sector_read(Vol->fd, FirstSectorofCluster, sector_buffer);
-          i = 0;
-          DirSecCnt = 1;
-        }
-      }
-    }
+  if (It == NULL) {
+    return -ENOENT;
+  }
+  if (strcmp(path, "/") != 0) {
+    filler(buffer, ".", NULL, 0);
+    filler(buffer, "..", NULL, 0);
   }
+  while (libfat16_readdir(It, &Node)) {
+    filler(buffer, Node.Name, NULL, 0);
+  }
+  libfat16_closedir(It);
 
   /* No more files */
   return 0;
 }
 
-int fat16_read(const char *path, char *buffer, size_t size, off_t offset,
-               struct fuse_file_info *fi)
+int fat16_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
+                  off_t offset, struct fuse_file_info *fi)
 {
-  int i, j;
-  BYTE *sector_buffer = malloc((size + offset) * sizeof(BYTE));
-
-  if (sector_buffer == NULL) {
-    log_msg("Out of memory!\n");
-    exit(EXIT_FAILURE);
+  const char *Sub;
+  IMAGE *Img;
+  int i, res;
+
+  request_arrived();
+  PROBE1(readdir_entry, path);
+
+  Img = image_get(path, &Sub);
+  if (Img != NULL) {
+    res = image_readdir(Img, path, Sub, buffer, filler);
+    image_put(Img);
+  } else if (Sub != NULL) {
+    for (i = 0; i < ImageCnt; i++) {
+      filler(buffer, Images[i].Name, NULL, 0);
+    }
+    res = 0;
+  } else {
+    res = -ENOENT;
   }
 
-  /* Gets volume data supplied in the context during the fat16_init function */
-  VOLUME *Vol;
-  struct fuse_context *context;
-  context = fuse_get_context();
-  Vol = (VOLUME *) context->private_data;
+  PROBE2(readdir_return, path, res);
+  return res;
+}
 
-  /* Searches for the given path */
-  DIR_ENTRY Dir;
-  int pathSize;
-  char **pathFormatted = path_treatment((char *) path, &pathSize);
-  find_root(*Vol, &Dir, pathFormatted, pathSize, 0);
+/* Name of the i-th entry of a listing, NULL for one left out ("." and "..") */
+static const char *listing_name(LISTING *L, DWORD i)
+{
+  if (L->Img == NULL) {
+    return Images[i].Name;
+  }
+  if (L->Entry != NULL) {
+    INDEX *Index = L->Img->Index;
+    DWORD ChildN = Index->Children[L->Entry->ChildIdx + i];
 
-  /* Found it, so we calculate its first cluster location */
-  WORD ClusterN = Dir.DIR_FstClusLO;
-  WORD FatClusEntryVal = fat_entry_by_cluster(*Vol, ClusterN);
-  WORD FirstSectorofCluster = ((ClusterN - 2) * Vol->Bpb.BPB_SecPerClus) + Vol->FirstDataSector;
+    return ChildN < Index->Header->EntryCnt ? index_name(Index, &Index->Entries[ChildN]) : NULL;
+  }
+  if (L->List->Entries[i].DIR_Name[0] == '.') {
+    return NULL;
+  }
+  return L->List->Text + L->List->Names[i].Off;
+}
 
-  /* Read bytes from the given path into the buffer */
-  for (i = 0, j = 0; i < size + offset; i += BYTES_PER_SECTOR, j++) {
-    sector_read(Vol->fd, FirstSectorofCluster + j, sector_buffer + i);
+/* Attributes of the i-th entry of a listing, as getattr answers them */
+static void listing_attr(LISTING *L, DWORD i, FAT16_LIST_ENTRY *Rec)
+{
+  VOLUME *Vol;
+  DIR_ENTRY *Dir;
+  struct stat st;
+  off_t Size;
+  int Runs;
+
+  if (L->Img == NULL) {
+    Rec->Mode = S_IFDIR | S_IRWXU;
+    return;
+  }
 
-    /* End of cluster, fetches the next one */
-    if ((j + 1) % Vol->Bpb.BPB_SecPerClus == 0) {
+  Vol = L->Img->Vol;
+  if (L->Entry != NULL) {
+    INDEX_ENTRY *Child = &L->Img->Index->Entries[L->Img->Index->Children[L->Entry->ChildIdx + i]];
 
-      /* Updates the cluster number */
-      ClusterN = FatClusEntryVal;
+    Dir = &Child->Dir;
+    Runs = Child->ExtentCnt;
+  } else {
+    Dir = &L->List->Entries[i];
+    Runs = Dir->DIR_Attr & ATTR_DIRECTORY ? 0 : file_runs(Vol, Dir);
+  }
 
-      /* Updates its fat entry */
-      FatClusEntryVal = fat_entry_by_cluster(*Vol, ClusterN);
+  st.st_blksize = Vol->Geo.ClusterSize;
+  dir_stat(Vol, Dir, &st);
+  Rec->Mode = st.st_mode;
+  Rec->Size = st.st_size;
+  Rec->Mtime = st.st_mtime;
+  Rec->FirstCluster = Dir->DIR_FstClusLO;
+  Rec->Extents = (Dir->DIR_Attr & ATTR_DIRECTORY) || Runs < 0 ? 0 : Runs;
+
+  /* Appends held back count in the size */
+  if (L->List != NULL && file_pending_in(Vol, L->Cluster, Dir->DIR_Name, &Size)) {
+    Rec->Size = Size;
+  }
+}
 
-      /* Calculates its first sector */
-      FirstSectorofCluster = ((ClusterN - 2) * Vol->Bpb.BPB_SecPerClus) + Vol->FirstDataSector;
+/**
+ * Entry a listing resumes at. The cursor holds the position after the last
+ * entry returned and the hash of its name; when the name found there is
+ * another one (entries were added or removed), the entry is looked for by
+ * its hash and the listing resumes after it.
+ * ============================================================================
+ * Return
+ * Position of the entry to list first.
+ * ============================================================================
+ * Parameters
+ * @L: Directory listed.
+ * @Cursor: Cursor handed back by the last call, 0 to start.
+**/
+static DWORD listing_resume(LISTING *L, uint64_t Cursor)
+{
+  DWORD Next = Cursor & 0xffffffff, Hash = Cursor >> 32, i;
+  const char *Name;
 
-      j = -1;
+  if (Next == 0) {
+    return 0;
+  }
+  if (Next <= L->Count && (Name = listing_name(L, Next - 1)) != NULL &&
+      name_hash(Name, strlen(Name)) == Hash) {
+    return Next;
+  }
+  for (i = 0; i < L->Count; i++) {
+    Name = listing_name(L, i);
+    if (Name != NULL && name_hash(Name, strlen(Name)) == Hash) {
+      return i + 1;
     }
   }
+  return Next < L->Count ? Next : L->Count;
+}
+
+/* Fills the records of a FAT16_IOC_LIST call, from where its cursor
+ * points to as many entries as fit */
+static void listing_fill(LISTING *L, FAT16_LIST *Out)
+{
+  DWORD i = listing_resume(L, Out->Cursor);
 
-  /* Size is exactly the number of bytes requested or 0 if offset was at or
-   * beyond the end of file */
-  if (offset < Dir.DIR_FileSize) {
-    memcpy(buffer, sector_buffer + offset, size);
+  Out->Count = 0;
+  Out->Bytes = 0;
+  while (i < L->Count) {
+    const char *Name = listing_name(L, i);
+
+    if (Name != NULL) {
+      size_t Len = strlen(Name);
+      FAT16_LIST_ENTRY *Rec = (FAT16_LIST_ENTRY *) (Out->Data + Out->Bytes);
+
+      if (Out->Bytes + FAT16_LIST_RECLEN(Len) > FAT16_LIST_DATA) {
+        break;
+      }
+      memset(Rec, 0, FAT16_LIST_RECLEN(Len));
+      Rec->RecLen = FAT16_LIST_RECLEN(Len);
+      Rec->NameLen = Len;
+      memcpy(Rec->Name, Name, Len);
+      listing_attr(L, i, Rec);
+
+      Out->Bytes += Rec->RecLen;
+      Out->Count++;
+      Out->Cursor = (uint64_t) name_hash(Name, Len) << 32 | (i + 1);
+    }
+    i++;
+  }
+  Out->Done = i >= L->Count;
+}
+
+/* FAT16_IOC_LIST on a directory inside an image, with the image held */
+static int image_list(IMAGE *Img, const char *Sub, FAT16_LIST *Out)
+{
+  LISTING L = { Img, NULL, NULL, 0, 0 };
+  INDEX *Index = Img->Index;
+  DIR_ENTRY Dir;
+  int res;
+
+  if (Index != NULL) {
+    L.Entry = index_lookup(Index, Sub);
+    if (L.Entry == NULL ||
+        L.Entry->ChildIdx + (uint64_t) L.Entry->ChildCnt > Index->Header->ChildCnt) {
+      return -ENOENT;
+    }
+    if (!(L.Entry->Dir.DIR_Attr & ATTR_DIRECTORY)) {
+      return -ENOTDIR;
+    }
+    L.Count = L.Entry->ChildCnt;
+    listing_fill(&L, Out);
+    return 0;
+  }
+
+  res = path_lookup(Img->Vol, Sub, &Dir);
+  if (res != 0) {
+    return res;
+  }
+  if (!(Dir.DIR_Attr & ATTR_DIRECTORY)) {
+    return -ENOTDIR;
+  }
+  L.Cluster = Dir.DIR_FstClusLO;
+  L.List = dir_list(Img->Vol, L.Cluster);
+  L.Count = L.List->Count;
+  listing_fill(&L, Out);
+  dir_release(L.List);
+  return 0;
+}
+
+/**
+ * ioctl on a file or directory. FAT16_IOC_LIST on a directory returns its
+ * entries with their attributes (fat16list.h), as many as fit in one call,
+ * so listing and stat'ing a whole directory costs one call instead of a
+ * getattr and a path lookup per entry.
+ * ============================================================================
+ * Return
+ * 0, -ENOTTY for any other command, -ENOTDIR on a file, or -ENOENT.
+ * ============================================================================
+ * Parameters
+ * @path: Path of the file or directory.
+ * @cmd: Command.
+ * @arg: Address of the argument in the caller (unused).
+ * @fi: Open file or directory.
+ * @flags: FUSE_IOCTL_DIR on a directory.
+ * @data: The argument, copied in and out by the kernel.
+**/
+int fat16_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                unsigned int flags, void *data)
+{
+  LISTING L = { NULL, NULL, NULL, 0, 0 };
+  const char *Sub;
+  IMAGE *Img;
+  int res;
+
+  (void) arg;
+  (void) fi;
+  request_arrived();
+
+  if ((unsigned int) cmd != FAT16_IOC_LIST) {
+    return -ENOTTY;
+  }
+  if (!(flags & FUSE_IOCTL_DIR)) {
+    return -ENOTDIR;
+  }
+
+  Img = image_get(path, &Sub);
+  if (Img != NULL) {
+    res = image_list(Img, Sub, data);
+    image_put(Img);
+  } else if (Sub != NULL) {
+    /* Root of a mount serving several images: one subdirectory each */
+    L.Count = ImageCnt;
+    listing_fill(&L, data);
+    res = 0;
   } else {
+    res = -ENOENT;
+  }
+  return res;
+}
+
+
+/* Pool job: reads one extent straight into its slice of the reply buffer */
+static void extent_read(void *arg)
+{
+  EXTENT_READ *Read = arg;
+
+  Read->Result = iosched_pread(Read->fd, Read->buffer, Read->Extent.Length,
+                               Read->Extent.ImageOffset, IOSCHED_DATA);
+}
+
+/**
+ * Reads bytes of a file extent by extent, directly into the buffer. Requests
+ * of at least fanout_min bytes spanning several extents have their extents
+ * fetched in parallel by the worker pool, smaller ones stay on the caller's
+ * thread.
+ * ============================================================================
+ * Return
+ * Number of bytes copied into the buffer, 0 if offset is at or beyond the end
+ * of the file or -EIO if the image could not be read.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @Dir: Directory entry of the file.
+ * @Entry: Index entry of the file, NULL when it was not looked up in an index.
+ * @buffer: Where the bytes are copied to.
+ * @size: Number of bytes requested.
+ * @offset: Offset of the first requested byte in the file.
+**/
+int read_range(IMAGE *Img, DIR_ENTRY *Dir, INDEX_ENTRY *Entry, char *buffer,
+               size_t size, off_t offset)
+{
+  VOLUME *Vol = Img->Vol;
+  DWORD ClusterSize = Vol->Geo.ClusterSize;
+  POOL_BATCH Batch;
+  size_t done = 0;
+  int i, n, parallel, res;
+
+  if (offset >= Dir->DIR_FileSize) {
+    return 0;
+  }
+  if (offset + size > Dir->DIR_FileSize) {
+    size = Dir->DIR_FileSize - offset;
+  }
+
+  /* A range never touches more than one extent per cluster */
+  int MaxExtents = size / ClusterSize + 2;
+  EXTENT *Extents = malloc(MaxExtents * sizeof(EXTENT));
+  EXTENT_READ *Reads = malloc(MaxExtents * sizeof(EXTENT_READ));
+
+  if (Extents == NULL || Reads == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* The cluster chain is shorter than the file size says or broken, there
+   * is nothing valid to read */
+  n = map_extents(Img, Dir, Entry, offset, size, Extents, MaxExtents);
+  if (n < 0) {
+    free(Extents);
+    free(Reads);
+    return -EIO;
+  }
+
+  /* Every extent gets its own disjoint slice of the buffer */
+  for (i = 0; i < n; i++) {
+    Reads[i].fd = Vol->fd;
+    Reads[i].buffer = buffer + done;
+    Reads[i].Extent = Extents[i];
+    done += Extents[i].Length;
+  }
+
+  /* The caller reads the first extent itself while the workers fetch the
+   * others */
+  parallel = n > 1 && size >= options.fanout_min && pool_workers() > 0;
+  pool_batch_init(&Batch);
+  for (i = 1; i < n; i++) {
+    if (parallel) {
+      pool_batch_add(&Batch, &Reads[i].Job, extent_read, &Reads[i]);
+    } else {
+      extent_read(&Reads[i]);
+    }
+  }
+  if (n > 0) {
+    extent_read(&Reads[0]);
+  }
+  pool_batch_wait(&Batch);
+
+  res = size;
+  for (i = 0; i < n; i++) {
+    if (Reads[i].Result != (ssize_t) Reads[i].Extent.Length) {
+      res = -EIO;
+    }
+  }
+
+  free(Extents);
+  free(Reads);
+  return res;
+}
+
+int fat16_read(const char *path, char *buffer, size_t size, off_t offset,
+               struct fuse_file_info *fi)
+{
+  const char *Sub;
+  IMAGE *Img;
+  int res = -ENOENT;
+
+  request_arrived();
+  PROBE3(read_entry, path, size, offset);
+
+  /* Searches for the given path */
+  DIR_ENTRY Dir;
+  INDEX_ENTRY *Entry;
+
+  /* Appends held back are written before they are read, an error writing
+   * them is the error of the read */
+  Img = image_get(path, &Sub);
+  if (Img != NULL && (res = file_flush(Img->Vol, Sub)) == 0) {
+    res = lookup_path(Img, Sub, &Dir, &Entry) == 0 ?
+      read_range(Img, &Dir, Entry, buffer, size, offset) : -ENOENT;
+  }
+  image_put(Img);
+  PROBE2(read_return, path, res);
+  return res;
+}
+
+int fat16_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                   off_t offset, struct fuse_file_info *fi)
+{
+  struct fuse_bufvec *bufv;
+  EXTENT Extents[SPLICE_MAX_EXTENTS];
+  int i, n = -1;
+
+  request_arrived();
+  PROBE3(read_entry, path, size, offset);
+
+  /* Searches for the given path */
+  const char *Sub;
+  IMAGE *Img = image_get(path, &Sub);
+  DIR_ENTRY Dir;
+  INDEX_ENTRY *Entry;
+  int res = Img == NULL ? -ENOENT : file_flush(Img->Vol, Sub);
+
+  if (res == 0 && lookup_path(Img, Sub, &Dir, &Entry) != 0) {
+    res = -ENOENT;
+  }
+  if (res != 0) {
+    image_put(Img);
+    PROBE2(read_return, path, res);
+    return res;
+  }
+
+  VOLUME *Vol = Img->Vol;
+
+  if (offset >= Dir.DIR_FileSize) {
     size = 0;
+  } else if (offset + size > Dir.DIR_FileSize) {
+    size = Dir.DIR_FileSize - offset;
+  }
+
+  /* Only sector aligned ranges (or ranges ending at the end of the file) of
+   * a few extents are spliced, the rest goes through the sector buffer.
+   * Spliced data is read by libfuse itself, straight from the image file and
+   * after the image is released, so unless Splice says so every read takes
+   * the buffer path, and so does any extent with sectors in the overlay */
+  if (size > 0 && Splice && (offset & Vol->Geo.SectorMask) == 0 &&
+      (((offset + size) & Vol->Geo.SectorMask) == 0 ||
+       offset + size == Dir.DIR_FileSize)) {
+    n = map_extents(Img, &Dir, Entry, offset, size, Extents, SPLICE_MAX_EXTENTS);
   }
+  for (i = 0; i < n && Vol->Overlay != NULL; i++) {
+    if (overlay_touches(Vol->Overlay, Extents[i].ImageOffset, Extents[i].Length)) {
+      n = -1;
+    }
+  }
+
+  if (n > 0) {
+    /* One file descriptor buffer per extent, libfuse splices them from the
+     * image straight into the reply */
+    bufv = malloc(sizeof(struct fuse_bufvec) + (n - 1) * sizeof(struct fuse_buf));
 
-  free(sector_buffer);
-  return size;
+    if (bufv == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = n;
+    for (i = 0; i < n; i++) {
+      bufv->buf[i].size = Extents[i].Length;
+      bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+      bufv->buf[i].mem = NULL;
+      bufv->buf[i].fd = fileno(Vol->fd);
+      bufv->buf[i].pos = Extents[i].ImageOffset;
+    }
+  } else {
+    /* Fragmented or unaligned: fetch the extents into a memory buffer */
+    bufv = malloc(sizeof(struct fuse_bufvec));
+
+    if (bufv == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    *bufv = FUSE_BUFVEC_INIT(size);
+    bufv->buf[0].mem = malloc(size > 0 ? size : 1);
+
+    if (bufv->buf[0].mem == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    res = read_range(Img, &Dir, Entry, bufv->buf[0].mem, size, offset);
+
+    if (res < 0) {
+      free(bufv->buf[0].mem);
+      free(bufv);
+      image_put(Img);
+      PROBE2(read_return, path, res);
+      return res;
+    }
+    bufv->buf[0].size = res;
+  }
+
+  image_put(Img);
+  *bufp = bufv;
+  PROBE2(read_return, path, n > 0 ? size : bufv->buf[0].size);
+  return 0;
+}
+
+/* Writes the directory cache usage of every image, in a malloc'ed buffer.
+ * Returns the length of the report */
+static int cache_report(char **Report)
+{
+  size_t Size;
+  FILE *Out = open_memstream(Report, &Size);
+  int i;
+
+  if (Out == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_lock(&Budget->lock);
+  fprintf(Out, "limit %zu\nused %zu\nevictions %llu\n", Budget->Limit,
+          Budget->Bytes, (unsigned long long) Budget->Evictions);
+  pthread_mutex_unlock(&Budget->lock);
+  for (i = 0; i < ImageCnt; i++) {
+    image_hold(&Images[i]);
+    fprintf(Out, "%s %zu\n", Images[i].Name != NULL ? Images[i].Name : Images[i].Path,
+            __atomic_load_n(&Images[i].Vol->Cache->DirBytes, __ATOMIC_RELAXED));
+    image_put(&Images[i]);
+  }
+  fclose(Out);
+  return Size;
+}
+
+/* RSIZE_XATTR or RFILES_XATTR of a path inside an image, with the image
+ * held. Returns the length of the value, -ENODATA for a file */
+static int image_usage(IMAGE *Img, const char *Sub, const char *name, char *Buffer,
+                       size_t Size)
+{
+  DIR_ENTRY Dir;
+  INDEX_ENTRY *Entry;
+  uint64_t Bytes, Files;
+
+  if (lookup_path(Img, Sub, &Dir, &Entry) != 0) {
+    return -ENOENT;
+  }
+  if (!(Dir.DIR_Attr & ATTR_DIRECTORY)) {
+    return -ENODATA;
+  }
+  usage_get(Img->Vol, Dir.DIR_FstClusLO, &Bytes, &Files);
+  return snprintf(Buffer, Size, "%llu\n", (unsigned long long)
+                  (strcmp(name, RSIZE_XATTR) == 0 ? Bytes : Files));
+}
+
+/**
+ * Extended attributes. The root of the mount has SCHED_XATTR, the request
+ * counts and latency percentiles of each I/O scheduler lane, while the
+ * scheduler runs, and CACHE_XATTR, the directory cache bytes of each image.
+ * The root directory of each image has WALKS_XATTR, the number of aborted
+ * chain walks, and GENERATION_XATTR, the number of times it was reloaded.
+ * Every directory of an image has RSIZE_XATTR and RFILES_XATTR, added up
+ * the first time one of them is asked for and kept up to date afterwards.
+ * ============================================================================
+ * Return
+ * Length of the value, -ERANGE if it does not fit in size bytes (size 0 only
+ * asks for the length), -ENODATA if there is no such attribute or -ENOENT
+ * for a path that does not exist.
+ * ============================================================================
+ * Parameters
+ * @path: Path of the file or directory.
+ * @name: Name of the attribute.
+ * @value: Receives the value.
+ * @size: Size of value.
+**/
+int fat16_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+  char Buffer[1024];
+  char *Report = Buffer;
+  const char *Sub;
+  IMAGE *Img;
+  int Length;
+
+  request_arrived();
+
+  Img = image_of(path, &Sub);
+  if (strcmp(path, "/") == 0 && strcmp(name, SCHED_XATTR) == 0 && options.sched) {
+    Length = iosched_report(Buffer, sizeof(Buffer));
+  } else if (strcmp(path, "/") == 0 && strcmp(name, BACKEND_XATTR) == 0 && Throttled) {
+    Length = backend_report(Buffer, sizeof(Buffer));
+  } else if (strcmp(path, "/") == 0 && strcmp(name, CACHE_XATTR) == 0) {
+    Length = cache_report(&Report);
+  } else if (Img != NULL && strcmp(Sub, "/") == 0 && strcmp(name, WALKS_XATTR) == 0) {
+    image_hold(Img);
+    Length = snprintf(Buffer, sizeof(Buffer), "%u\n",
+                      __atomic_load_n(&Img->Vol->AbortedWalks, __ATOMIC_RELAXED));
+    image_put(Img);
+  } else if (Img != NULL && strcmp(Sub, "/") == 0 && strcmp(name, GENERATION_XATTR) == 0) {
+    Length = snprintf(Buffer, sizeof(Buffer), "%u\n",
+                      __atomic_load_n(&Img->Generation, __ATOMIC_RELAXED));
+  } else if (Img != NULL && (strcmp(name, RSIZE_XATTR) == 0 || strcmp(name, RFILES_XATTR) == 0)) {
+    image_hold(Img);
+    Length = image_usage(Img, Sub, name, Buffer, sizeof(Buffer));
+    image_put(Img);
+    if (Length < 0) {
+      return Length;
+    }
+  } else {
+    return -ENODATA;
+  }
+
+  if (size != 0 && (size_t) Length > size) {
+    Length = -ERANGE;
+  } else if (size != 0) {
+    memcpy(value, Report, Length);
+  }
+  if (Report != Buffer) {
+    free(Report);
+  }
+  return Length;
+}
+
+/**
+ * File system statistics, from the counts volume_count took at mount time and
+ * the modifications keep up to date, so it never reads the FAT. Blocks are
+ * clusters; files are the entries of the root directory, the only directory
+ * with a fixed size. The root of a mount serving several images adds up all
+ * of them, in 512 byte blocks.
+ * ============================================================================
+ * Return
+ * 0, or -ENOENT for a name that is no image.
+ * ============================================================================
+ * Parameters
+ * @path: Any path of the mount.
+ * @stbuf: Receives the statistics.
+**/
+int fat16_statfs(const char *path, struct statvfs *stbuf)
+{
+  const char *Sub;
+  IMAGE *Img;
+  int i, First = 0, Last = ImageCnt;
+
+  request_arrived();
+
+  memset(stbuf, 0, sizeof(struct statvfs));
+  stbuf->f_namemax = 255;
+
+  Img = image_of(path, &Sub);
+  if (Img == NULL && Sub == NULL) {
+    return -ENOENT;
+  }
+  if (Img != NULL) {
+    First = Img - Images;
+    Last = First + 1;
+  }
+
+  stbuf->f_bsize = stbuf->f_frsize = 512;
+  for (i = First; i < Last; i++) {
+    image_hold(&Images[i]);
+
+    VOLUME *Vol = Images[i].Vol;
+
+    if (Img != NULL) {
+      stbuf->f_bsize = stbuf->f_frsize = Vol->Geo.ClusterSize;
+    }
+
+    DWORD Scale = Vol->Geo.ClusterSize / stbuf->f_frsize;
+
+    stbuf->f_blocks += (fsblkcnt_t) (Vol->MaxCluster > 1 ? Vol->MaxCluster - 1 : 0) * Scale;
+    /* Clusters appends held back will take are already counted as used */
+    DWORD Free = __atomic_load_n(&Vol->FreeClusters, __ATOMIC_RELAXED);
+    DWORD Delayed = __atomic_load_n(&Vol->DelayedClusters, __ATOMIC_RELAXED);
+
+    stbuf->f_bfree += (fsblkcnt_t) (Free > Delayed ? Free - Delayed : 0) * Scale;
+    stbuf->f_files += Vol->Bpb.BPB_RootEntCnt;
+    stbuf->f_ffree += __atomic_load_n(&Vol->FreeRootEntries, __ATOMIC_RELAXED);
+    image_put(&Images[i]);
+  }
+  stbuf->f_bavail = stbuf->f_bfree;
+  stbuf->f_favail = stbuf->f_ffree;
+  return 0;
+}
+
+/* Image a path to modify belongs to, held until image_put, NULL outside of
+ * any image. The modifications themselves answer -EROFS without an
+ * overlay */
+static IMAGE *image_to_modify(const char *path, const char **Sub)
+{
+  request_arrived();
+
+  return image_get(path, Sub);
+}
+
+int fat16_write(const char *path, const char *buffer, size_t size, off_t offset,
+                struct fuse_file_info *fi)
+{
+  const char *Sub;
+  IMAGE *Img = image_to_modify(path, &Sub);
+
+  int res = Img == NULL ? -EROFS : file_write(Img->Vol, Sub, buffer, size, offset);
+
+  image_put(Img);
+  return res;
+}
+
+/* The new file is open for writing, see fat16_open */
+int fat16_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+  const char *Sub;
+  IMAGE *Img = image_to_modify(path, &Sub);
+
+  int res = Img == NULL ? -EROFS : file_create(Img->Vol, Sub);
+
+  if (res == 0) {
+    res = file_open(Img->Vol, Sub);
+  }
+
+  image_put(Img);
+  return res;
+}
+
+int fat16_truncate(const char *path, off_t size)
+{
+  const char *Sub;
+  IMAGE *Img = image_to_modify(path, &Sub);
+
+  int res = Img == NULL ? -EROFS : file_truncate(Img->Vol, Sub, size);
+
+  image_put(Img);
+  return res;
+}
+
+int fat16_unlink(const char *path)
+{
+  const char *Sub;
+  IMAGE *Img = image_to_modify(path, &Sub);
+
+  int res = Img == NULL ? -EROFS : file_unlink(Img->Vol, Sub);
+
+  image_put(Img);
+  return res;
+}
+
+int fat16_utimens(const char *path, const struct timespec tv[2])
+{
+  const char *Sub;
+  IMAGE *Img = image_to_modify(path, &Sub);
+
+  int res = Img == NULL ? -EROFS : file_touch(Img->Vol, Sub, tv[1].tv_sec);
+
+  image_put(Img);
+  return res;
+}
+
+/* Every write of the overlay is made durable at once, whatever the file */
+int fat16_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  const char *Sub;
+  IMAGE *Img = image_to_modify(path, &Sub);
+
+  int res = Img == NULL ? 0 : file_flush(Img->Vol, Sub);
+
+  if (res == 0 && Img != NULL && Img->Vol->Overlay != NULL &&
+      overlay_sync(Img->Vol->Overlay) != 0) {
+    res = -EIO;
+  }
+  image_put(Img);
+  return res;
+}
+
+/* Only a plain or size keeping allocation, FAT has no holes */
+int fat16_fallocate(const char *path, int mode, off_t offset, off_t length,
+                    struct fuse_file_info *fi)
+{
+  const char *Sub;
+  IMAGE *Img;
+  int res;
+
+  if ((mode & ~FALLOC_FL_KEEP_SIZE) != 0) {
+    return -EOPNOTSUPP;
+  }
+
+  Img = image_to_modify(path, &Sub);
+  res = Img == NULL ? -EROFS :
+    file_allocate(Img->Vol, Sub, offset, length, mode & FALLOC_FL_KEEP_SIZE);
+  image_put(Img);
+  return res;
+}
+
+/* close(2) of a file: the appends held back for it are written, so errors
+ * reach the writer */
+int fat16_flush(const char *path, struct fuse_file_info *fi)
+{
+  const char *Sub;
+  IMAGE *Img = image_to_modify(path, &Sub);
+
+  int res = Img == NULL ? 0 : file_flush(Img->Vol, Sub);
+
+  image_put(Img);
+  return res;
+}
+
+/* Open file descriptions that can write to a file are counted, so that
+ * fat16_release knows which close is the last one. Opens without an overlay
+ * succeed as before, their writes fail with EROFS */
+int fat16_open(const char *path, struct fuse_file_info *fi)
+{
+  const char *Sub;
+  IMAGE *Img;
+  int res = 0;
+
+  if ((fi->flags & O_ACCMODE) == O_RDONLY) {
+    return 0;
+  }
+
+  Img = image_to_modify(path, &Sub);
+  if (Img != NULL && Img->Vol->Overlay != NULL) {
+    res = file_open(Img->Vol, Sub);
+  }
+  image_put(Img);
+  return res;
+}
+
+/* Close of a file opened for writing. FUSE calls it once per open file
+ * description; only the last one of a file gives back the clusters
+ * allocated past its end (fallocate with FALLOC_FL_KEEP_SIZE) */
+int fat16_release(const char *path, struct fuse_file_info *fi)
+{
+  const char *Sub;
+  IMAGE *Img;
+
+  if ((fi->flags & O_ACCMODE) == O_RDONLY) {
+    return 0;
+  }
+
+  Img = image_to_modify(path, &Sub);
+  if (Img != NULL && Img->Vol->Overlay != NULL) {
+    file_release(Img->Vol, Sub);
+  }
+  image_put(Img);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+
+/* Operations recorded to the trace (-o trace=FILE), installed in place of
+ * the plain ones so a mount without a trace pays nothing */
+
+static int traced_getattr(const char *path, struct stat *stbuf)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_getattr(path, stbuf);
+
+  trace_record(TRACE_GETATTR, 0, path, NULL, 0, 0, Start, res);
+  return res;
+}
+
+static int traced_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
+                          off_t offset, struct fuse_file_info *fi)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_readdir(path, buffer, filler, offset, fi);
+
+  trace_record(TRACE_READDIR, 0, path, NULL, offset, 0, Start, res);
+  return res;
+}
+
+static int traced_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                        unsigned int flags, void *data)
+{
+  uint64_t Start = trace_clock();
+  uint64_t Cursor = (unsigned int) cmd == FAT16_IOC_LIST ? ((FAT16_LIST *) data)->Cursor : 0;
+  int res = fat16_ioctl(path, cmd, arg, fi, flags, data);
+
+  trace_record(TRACE_IOCTL, 0, path, NULL, Cursor, cmd, Start, res);
+  return res;
+}
+
+static int traced_read(const char *path, char *buffer, size_t size, off_t offset,
+                       struct fuse_file_info *fi)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_read(path, buffer, size, offset, fi);
+
+  trace_record(TRACE_READ, 0, path, NULL, offset, size, Start, res);
+  return res;
+}
+
+static int traced_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                           off_t offset, struct fuse_file_info *fi)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_read_buf(path, bufp, size, offset, fi);
+
+  trace_record(TRACE_READ_BUF, 0, path, NULL, offset, size, Start, res);
+  return res;
+}
+
+static int traced_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_getxattr(path, name, value, size);
+
+  trace_record(TRACE_GETXATTR, 0, path, name, 0, size, Start, res);
+  return res;
+}
+
+static int traced_statfs(const char *path, struct statvfs *stbuf)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_statfs(path, stbuf);
+
+  trace_record(TRACE_STATFS, 0, path, NULL, 0, 0, Start, res);
+  return res;
+}
+
+static int traced_write(const char *path, const char *buffer, size_t size, off_t offset,
+                        struct fuse_file_info *fi)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_write(path, buffer, size, offset, fi);
+
+  trace_record(TRACE_WRITE, 0, path, NULL, offset, size, Start, res);
+  return res;
+}
+
+static int traced_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_create(path, mode, fi);
+
+  trace_record(TRACE_CREATE, 0, path, NULL, mode, 0, Start, res);
+  return res;
+}
+
+static int traced_truncate(const char *path, off_t size)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_truncate(path, size);
+
+  trace_record(TRACE_TRUNCATE, 0, path, NULL, size, 0, Start, res);
+  return res;
+}
+
+static int traced_unlink(const char *path)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_unlink(path);
+
+  trace_record(TRACE_UNLINK, 0, path, NULL, 0, 0, Start, res);
+  return res;
+}
+
+static int traced_utimens(const char *path, const struct timespec tv[2])
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_utimens(path, tv);
+
+  trace_record(TRACE_UTIMENS, 0, path, NULL, tv[1].tv_sec, 0, Start, res);
+  return res;
+}
+
+static int traced_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_fsync(path, datasync, fi);
+
+  trace_record(TRACE_FSYNC, 0, path, NULL, datasync, 0, Start, res);
+  return res;
+}
+
+static int traced_fallocate(const char *path, int mode, off_t offset, off_t length,
+                            struct fuse_file_info *fi)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_fallocate(path, mode, offset, length, fi);
+
+  trace_record(TRACE_FALLOCATE, mode, path, NULL, offset, length, Start, res);
+  return res;
+}
+
+static int traced_flush(const char *path, struct fuse_file_info *fi)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_flush(path, fi);
+
+  trace_record(TRACE_FLUSH, 0, path, NULL, 0, 0, Start, res);
+  return res;
+}
+
+static int traced_open(const char *path, struct fuse_file_info *fi)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_open(path, fi);
+
+  trace_record(TRACE_OPEN, 0, path, NULL, fi->flags, 0, Start, res);
+  return res;
+}
+
+static int traced_release(const char *path, struct fuse_file_info *fi)
+{
+  uint64_t Start = trace_clock();
+  int res = fat16_release(path, fi);
+
+  trace_record(TRACE_RELEASE, 0, path, NULL, fi->flags, 0, Start, res);
+  return res;
 }
 
 //------------------------------------------------------------------------------
@@ -773,21 +1898,221 @@ struct fuse_operations fat16_oper = {
   .destroy    = fat16_destroy,
   .getattr    = fat16_getattr,
   .readdir    = fat16_readdir,
-  .read       = fat16_read
+  .open       = fat16_open,
+  .ioctl      = fat16_ioctl,
+  .read       = fat16_read,
+  .read_buf   = fat16_read_buf,
+  .getxattr   = fat16_getxattr,
+  .statfs     = fat16_statfs,
+  .write      = fat16_write,
+  .create     = fat16_create,
+  .truncate   = fat16_truncate,
+  .unlink     = fat16_unlink,
+  .utimens    = fat16_utimens,
+  .fsync      = fat16_fsync,
+  .fallocate  = fat16_fallocate,
+  .flush      = fat16_flush,
+  .release    = fat16_release
 };
 
 //------------------------------------------------------------------------------
 
 int main(int argc, char *argv[])
 {
-  int ret;
+  int ret, i;
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+  options.read_workers = READ_WORKERS;
+  options.fanout_min = FANOUT_MIN_SIZE;
+  options.warmup_mem = WARMUP_MEM;
+  options.sched_depth = SCHED_DEPTH;
+  options.sched_window = IOSCHED_WINDOW_US;
+  options.sched_deadline = IOSCHED_DEADLINE_US;
+  options.sched_meta_weight = IOSCHED_META_WEIGHT;
+  options.check_threads = CHECK_THREADS;
+  options.delalloc = DELAYED_MEM;
+  options.throttle_latency = options.throttle_seek = options.throttle_bw = UINT_MAX;
+  if (fuse_opt_parse(&args, &options, fat16_opts, NULL) == -1) {
+    return EXIT_FAILURE;
+  }
 
   log_open();
 
-  /* Starting a pre-initialization of the FAT16 volume */
-  VOLUME *Vol = pre_init_fat16();
+  /* Storage the images are read from, possibly slowed down to look like
+   * another device: a preset, then the values given one by one */
+  const SECTOR_BACKEND *Backend = &sector_backend_pread;
+  THROTTLE Throttle = { 0, 0, 0 };
+
+  if (options.backend != NULL && (Backend = backend_by_name(options.backend)) == NULL) {
+    fprintf(stderr, "backend: expected pread or mmap\n");
+    return EXIT_FAILURE;
+  }
+  if (options.throttle != NULL && backend_preset(options.throttle, &Throttle) != 0) {
+    fprintf(stderr, "throttle: expected hdd, sd or net\n");
+    return EXIT_FAILURE;
+  }
+  if (options.throttle_latency != UINT_MAX) {
+    Throttle.Latency = options.throttle_latency;
+  }
+  if (options.throttle_seek != UINT_MAX) {
+    Throttle.Seek = options.throttle_seek;
+  }
+  if (options.throttle_bw != UINT_MAX) {
+    Throttle.Bandwidth = options.throttle_bw;
+  }
+  Throttled = options.throttle != NULL || Throttle.Latency != 0 || Throttle.Seek != 0 ||
+              Throttle.Bandwidth != 0;
+  if (Backend == &backend_mmap && options.watch) {
+    fprintf(stderr, "backend=mmap cannot be combined with watch\n");
+    return EXIT_FAILURE;
+  }
+  sector_set_backend(Throttled ? backend_throttled(Backend, &Throttle) : Backend);
+  Splice = !options.sched && !options.watch && !Throttled && Backend == &sector_backend_pread;
+
+  /* Writes go to one overlay, kept for a single image whose kernel caches
+   * must follow it */
+  if (options.overlay != NULL && (options.images != NULL || options.immutable)) {
+    fprintf(stderr, "overlay cannot be combined with images or immutable\n");
+    return EXIT_FAILURE;
+  }
+
+  /* An immutable image never changes, and an overlay only applies to the
+   * contents it was written over */
+  if (options.watch && (options.immutable || options.overlay != NULL)) {
+    fprintf(stderr, "watch cannot be combined with immutable or overlay\n");
+    return EXIT_FAILURE;
+  }
+
+  /* One image at the root, or every image of the manifest in its own
+   * subdirectory */
+  if (options.images != NULL) {
+    MultiImage = 1;
+    if (images_load(options.images) != 0) {
+      return EXIT_FAILURE;
+    }
+  } else {
+    Images = calloc(1, sizeof(IMAGE));
+
+    if (Images == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    Images[0].Path = strdup("fat16.img");
+    Images[0].Vol = libfat16_open_image("fat16.img");
+    if (Images[0].Vol == NULL) {
+      fprintf(stderr, "fat16.img: %s\n", errno == EINVAL ?
+              "not a valid FAT16 image" : strerror(errno));
+      return EXIT_FAILURE;
+    }
+    ImageCnt = 1;
+
+    /* Writes go to the overlay, the image itself is never modified */
+    if (options.overlay != NULL) {
+      if (overlay_open(Images[0].Vol, options.overlay) == NULL) {
+        fprintf(stderr, "%s: cannot be used as the overlay of fat16.img\n",
+                options.overlay);
+        return EXIT_FAILURE;
+      }
+      log_msg("Writing to overlay %s\n", options.overlay);
+      Images[0].Vol->DelayedLimit = options.delalloc;
+    }
+
+    /* A valid index answers metadata without reading directory sectors, a
+     * stale one is left aside, and so is any index once the files can
+     * change */
+    if (options.index != NULL && options.overlay == NULL) {
+      Images[0].IndexPath = strdup(options.index);
+      Images[0].Index = index_open(Images[0].Vol, options.index);
+      if (Images[0].Index != NULL) {
+        log_msg("Using index %s\n", options.index);
+      }
+    }
+  }
+
+  /* The directory caches of all images share one memory limit */
+  Budget = cache_budget_new(options.cache_mem);
+  for (i = 0; i < ImageCnt; i++) {
+    cache_budget_attach(Budget, Images[i].Vol);
+  }
+
+  /* Free space counts for statfs, kept up to date from here on */
+  for (i = 0; i < ImageCnt; i++) {
+    volume_count(Images[i].Vol);
+  }
+
+  /* What each image looks like now, the watcher reloads it once that
+   * changes */
+  for (i = 0; i < ImageCnt && options.watch; i++) {
+    pthread_rwlock_init(&Images[i].lock, NULL);
+    if (image_signature(Images[i].Path, &Images[i].Signature) != 0) {
+      fprintf(stderr, "%s: %s\n", Images[i].Path, strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* An inconsistent image is not mounted: a cyclic chain would hang lookups
+   * and reads */
+  for (i = 0; i < ImageCnt && options.check; i++) {
+    int Problems = check_volume(Images[i].Vol, options.check_threads, NULL);
+
+    if (Problems != 0) {
+      log_msg("%s: %d problems found, not mounting\n", Images[i].Path, Problems);
+      fprintf(stderr, "%s: %d problems found, not mounting "
+              "(see ./fsck_fat16 %s)\n", Images[i].Path, Problems, Images[i].Path);
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* Nothing changes the image while it is mounted immutable: cached pages,
+   * entries, attributes and misses stay valid for the whole mount */
+  if (options.immutable) {
+    char kernelOpts[256];
+
+    snprintf(kernelOpts, sizeof(kernelOpts), "-oro,kernel_cache,"
+             "entry_timeout=%d,attr_timeout=%d,negative_timeout=%d,max_read=%u",
+             IMMUTABLE_TIMEOUT, IMMUTABLE_TIMEOUT, IMMUTABLE_TIMEOUT,
+             immutable_read_size());
+    fuse_opt_add_arg(&args, kernelOpts);
+  }
+
+  /* The high-level API of libfuse 2 cannot push invalidations to the kernel:
+   * entries and attributes expire on their own timeouts, and auto_cache
+   * drops the cached pages of a file whose time or size changed, which a
+   * reload always does (see image_getattr) */
+  if (options.watch) {
+    fuse_opt_add_arg(&args, "-oauto_cache");
+  }
+
+  /* Opened before fuse_main changes directory, the header goes out before
+   * it forks */
+  if (options.trace != NULL) {
+    if (trace_open(options.trace) != 0) {
+      fprintf(stderr, "%s: %s\n", options.trace, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    log_msg("Recording a trace to %s\n", options.trace);
+    fat16_oper.getattr = traced_getattr;
+    fat16_oper.readdir = traced_readdir;
+    fat16_oper.open = traced_open;
+    fat16_oper.ioctl = traced_ioctl;
+    fat16_oper.read = traced_read;
+    fat16_oper.read_buf = traced_read_buf;
+    fat16_oper.getxattr = traced_getxattr;
+    fat16_oper.statfs = traced_statfs;
+    fat16_oper.write = traced_write;
+    fat16_oper.create = traced_create;
+    fat16_oper.truncate = traced_truncate;
+    fat16_oper.unlink = traced_unlink;
+    fat16_oper.utimens = traced_utimens;
+    fat16_oper.fsync = traced_fsync;
+    fat16_oper.fallocate = traced_fallocate;
+    fat16_oper.flush = traced_flush;
+    fat16_oper.release = traced_release;
+  }
 
-  ret = fuse_main(argc, argv, &fat16_oper, Vol);
+  ret = fuse_main(args.argc, args.argv, &fat16_oper, NULL);
 
+  fuse_opt_free_args(&args);
   return ret;
 }
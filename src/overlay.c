@@ -0,0 +1,468 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "overlay.h"
+#include "log.h"
+
+/* Size of a slot of the overlay file: record header and sector */
+#define SLOT_SIZE(Ov) (sizeof(OVERLAY_RECORD) + (Ov)->SectorSize)
+
+/* Offset in the overlay file of the sector stored in a slot (1 based) */
+static off_t slot_offset(OVERLAY *Ov, DWORD Slot)
+{
+  return sizeof(OVERLAY_HEADER) + (off_t) (Slot - 1) * SLOT_SIZE(Ov) +
+         sizeof(OVERLAY_RECORD);
+}
+
+/* pread that only comes back short at the end of the file */
+static ssize_t full_pread(int fd, void *buffer, size_t size, off_t offset)
+{
+  size_t done = 0;
+  ssize_t res;
+
+  while (done < size) {
+    res = pread(fd, (char *) buffer + done, size - done, offset + done);
+    if (res <= 0) {
+      return done > 0 ? (ssize_t) done : res;
+    }
+    done += res;
+  }
+  return done;
+}
+
+/* pwrite of the whole buffer. Returns 0, or -1 with errno set */
+static int full_pwrite(int fd, const void *buffer, size_t size, off_t offset)
+{
+  size_t done = 0;
+  ssize_t res;
+
+  while (done < size) {
+    res = pwrite(fd, (const char *) buffer + done, size - done, offset + done);
+    if (res < 0) {
+      return -1;
+    }
+    done += res;
+  }
+  return 0;
+}
+
+/* Header an overlay of the volume starts with */
+static void header_fill(VOLUME *Vol, OVERLAY_HEADER *Header)
+{
+  BPB_BS *Bpb = &Vol->Bpb;
+
+  memset(Header, 0, sizeof(OVERLAY_HEADER));
+  memcpy(Header->Magic, OVERLAY_MAGIC, sizeof(Header->Magic));
+  Header->Version = OVERLAY_VERSION;
+  Header->VollID = Bpb->BS_VollID;
+  Header->SectorSize = Vol->Geo.SectorSize;
+  Header->SectorCnt = Bpb->BPB_TotSec16 != 0 ? Bpb->BPB_TotSec16 : Bpb->BPB_TotSec32;
+}
+
+/**
+ * Opens the overlay of an image, creating an empty one if the file does not
+ * exist, and puts it under every read of the image: from then on the volume
+ * reads the sectors written to the overlay instead of those of the image.
+ * An empty overlay is set up in constant time, an existing one is read
+ * record by record to rebuild the sector map.
+ * ============================================================================
+ * Return
+ * The overlay, also set as Vol->Overlay, or NULL with errno set if the file
+ * cannot be opened, belongs to another image (EINVAL) or too many images have
+ * an overlay already (EMFILE).
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @OverlayPath: Path of the overlay file.
+**/
+OVERLAY *overlay_open(VOLUME *Vol, const char *OverlayPath)
+{
+  OVERLAY_HEADER Header, Expected;
+  OVERLAY_RECORD Record;
+  struct stat st;
+  DWORD Slot, SlotCnt;
+  int fd = open(OverlayPath, O_RDWR | O_CREAT, 0644);
+
+  if (fd < 0) {
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  header_fill(Vol, &Expected);
+  if (st.st_size == 0) {
+    if (full_pwrite(fd, &Expected, sizeof(OVERLAY_HEADER), 0) != 0) {
+      close(fd);
+      return NULL;
+    }
+    st.st_size = sizeof(OVERLAY_HEADER);
+  } else if (full_pread(fd, &Header, sizeof(OVERLAY_HEADER), 0) != sizeof(OVERLAY_HEADER) ||
+             memcmp(&Header, &Expected, sizeof(OVERLAY_HEADER)) != 0) {
+    log_msg("%s is not an overlay of this image\n", OverlayPath);
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  OVERLAY *Ov = malloc(sizeof(OVERLAY));
+
+  if (Ov == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  Ov->fd = fd;
+  Ov->Image = Vol->fd;
+  Ov->SectorShift = Vol->Geo.SectorShift;
+  Ov->SectorSize = Vol->Geo.SectorSize;
+  Ov->SectorCnt = Expected.SectorCnt;
+
+  /* Zeroed pages are only touched as sectors get written */
+  Ov->Map = calloc(Ov->SectorCnt, sizeof(DWORD));
+
+  if (Ov->Map == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* A torn slot at the end, from a crash, is dropped */
+  SlotCnt = (st.st_size - sizeof(OVERLAY_HEADER)) / SLOT_SIZE(Ov);
+  for (Slot = 1; Slot <= SlotCnt; Slot++) {
+    off_t RecordOff = slot_offset(Ov, Slot) - sizeof(OVERLAY_RECORD);
+
+    if (full_pread(fd, &Record, sizeof(OVERLAY_RECORD), RecordOff) == sizeof(OVERLAY_RECORD) &&
+        Record.Check == ~Record.SectorN && Record.SectorN < Ov->SectorCnt) {
+      Ov->Map[Record.SectorN] = Slot;
+    }
+  }
+  Ov->SlotCnt = SlotCnt;
+  if (ftruncate(fd, sizeof(OVERLAY_HEADER) + (off_t) SlotCnt * SLOT_SIZE(Ov)) != 0) {
+    log_msg("Could not truncate %s\n", OverlayPath);
+  }
+
+  pthread_rwlock_init(&Ov->lock, NULL);
+  if (sector_set_source(Vol->fd, overlay_pread, Ov) != 0) {
+    log_msg("Too many images with an overlay, %s is not opened\n", OverlayPath);
+    pthread_rwlock_destroy(&Ov->lock);
+    free(Ov->Map);
+    free(Ov);
+    close(fd);
+    errno = EMFILE;
+    return NULL;
+  }
+  Vol->Overlay = Ov;
+  return Ov;
+}
+
+/* Takes the overlay from under the image, flushes and closes it */
+void overlay_close(OVERLAY *Ov)
+{
+  sector_set_source(Ov->Image, NULL, NULL);
+  fsync(Ov->fd);
+  close(Ov->fd);
+  pthread_rwlock_destroy(&Ov->lock);
+  free(Ov->Map);
+  free(Ov);
+}
+
+/* Whether a sector is in the overlay */
+static DWORD sector_slot(OVERLAY *Ov, DWORD SectorN)
+{
+  return SectorN < Ov->SectorCnt ? Ov->Map[SectorN] : 0;
+}
+
+/* overlay_pread with the lock held */
+static ssize_t overlay_pread_locked(OVERLAY *Ov, void *buffer, size_t size, off_t offset)
+{
+  DWORD Mask = Ov->SectorSize - 1;
+  size_t done = 0, chunk;
+  ssize_t res;
+
+  if (Ov->SlotCnt == 0) {
+    return sector_pread_file(Ov->Image, buffer, size, offset);
+  }
+
+  while (done < size) {
+    off_t pos = offset + done;
+    DWORD SectorN = pos >> Ov->SectorShift;
+    DWORD Slot = sector_slot(Ov, SectorN);
+
+    chunk = Ov->SectorSize - (pos & Mask);
+    if (chunk > size - done) {
+      chunk = size - done;
+    }
+
+    if (Slot != 0) {
+      res = full_pread(Ov->fd, (char *) buffer + done, chunk,
+                       slot_offset(Ov, Slot) + (pos & Mask));
+    } else {
+      /* The image sectors up to the next overlay sector in one read */
+      while (done + chunk < size && sector_slot(Ov, ++SectorN) == 0) {
+        chunk += size - done - chunk < Ov->SectorSize ? size - done - chunk : Ov->SectorSize;
+      }
+      res = sector_pread_file(Ov->Image, (char *) buffer + done, chunk, pos);
+    }
+
+    if (res <= 0) {
+      return done > 0 ? (ssize_t) done : res;
+    }
+    done += res;
+    if ((size_t) res < chunk) {
+      break;
+    }
+  }
+  return done;
+}
+
+/**
+ * Reads bytes of the image as written so far: overlay sectors from the
+ * overlay file, the others from the image. Every sector_pread of the image
+ * comes here while the overlay is open.
+ * ============================================================================
+ * Return
+ * Number of bytes read (short only at the end of the image), or -1.
+ * ============================================================================
+ * Parameters
+ * @arg: The overlay.
+ * @buffer: Where the bytes are copied to.
+ * @size: Number of bytes to read.
+ * @offset: Offset in the image of the first byte.
+**/
+ssize_t overlay_pread(void *arg, void *buffer, size_t size, off_t offset)
+{
+  OVERLAY *Ov = arg;
+  ssize_t res;
+
+  pthread_rwlock_rdlock(&Ov->lock);
+  res = overlay_pread_locked(Ov, buffer, size, offset);
+  pthread_rwlock_unlock(&Ov->lock);
+  return res;
+}
+
+/**
+ * Writes bytes of the image into the overlay. A sector written for the first
+ * time gets a new slot, filled with its current bytes where the write only
+ * covers part of it.
+ * ============================================================================
+ * Return
+ * 0, or -EIO if the overlay or the image could not be accessed.
+ * ============================================================================
+ * Parameters
+ * @Ov: The overlay.
+ * @buffer: Bytes to write.
+ * @size: Number of bytes to write.
+ * @offset: Offset in the image of the first byte.
+**/
+int overlay_write(OVERLAY *Ov, const void *buffer, size_t size, off_t offset)
+{
+  BYTE Slot[sizeof(OVERLAY_RECORD) + MAX_BYTES_PER_SECTOR];
+  OVERLAY_RECORD *Record = (OVERLAY_RECORD *) Slot;
+  BYTE *Data = Slot + sizeof(OVERLAY_RECORD);
+  DWORD Mask = Ov->SectorSize - 1;
+  size_t done = 0, chunk;
+  int res = 0;
+
+  pthread_rwlock_wrlock(&Ov->lock);
+  while (done < size && res == 0) {
+    off_t pos = offset + done;
+    DWORD SectorN = pos >> Ov->SectorShift;
+    DWORD SlotN = sector_slot(Ov, SectorN);
+
+    chunk = Ov->SectorSize - (pos & Mask);
+    if (chunk > size - done) {
+      chunk = size - done;
+    }
+
+    if (SectorN >= Ov->SectorCnt) {
+      res = -EIO;
+    } else if (SlotN != 0) {
+      if (full_pwrite(Ov->fd, (const char *) buffer + done, chunk,
+                      slot_offset(Ov, SlotN) + (pos & Mask)) != 0) {
+        res = -EIO;
+      }
+    } else {
+      /* New slot: the whole sector, with its record header, in one write */
+      if (chunk < Ov->SectorSize &&
+          sector_pread_file(Ov->Image, Data, Ov->SectorSize,
+                            (off_t) SectorN << Ov->SectorShift) != (ssize_t) Ov->SectorSize) {
+        memset(Data, 0, Ov->SectorSize);
+      }
+      memcpy(Data + (pos & Mask), (const char *) buffer + done, chunk);
+      Record->SectorN = SectorN;
+      Record->Check = ~SectorN;
+      SlotN = Ov->SlotCnt + 1;
+      if (full_pwrite(Ov->fd, Slot, SLOT_SIZE(Ov),
+                      slot_offset(Ov, SlotN) - sizeof(OVERLAY_RECORD)) != 0) {
+        res = -EIO;
+      } else {
+        Ov->SlotCnt = SlotN;
+        Ov->Map[SectorN] = SlotN;
+      }
+    }
+    done += chunk;
+  }
+  pthread_rwlock_unlock(&Ov->lock);
+  return res;
+}
+
+/* Whether any byte of a range of the image is in the overlay */
+int overlay_touches(OVERLAY *Ov, off_t offset, size_t size)
+{
+  DWORD SectorN, Last;
+  int res = 0;
+
+  if (size == 0 || __atomic_load_n(&Ov->SlotCnt, __ATOMIC_RELAXED) == 0) {
+    return 0;
+  }
+
+  pthread_rwlock_rdlock(&Ov->lock);
+  Last = (offset + size - 1) >> Ov->SectorShift;
+  for (SectorN = offset >> Ov->SectorShift; SectorN <= Last && !res; SectorN++) {
+    res = sector_slot(Ov, SectorN) != 0;
+  }
+  pthread_rwlock_unlock(&Ov->lock);
+  return res;
+}
+
+/* Flushes the overlay file to disk. Returns 0 or -EIO */
+int overlay_sync(OVERLAY *Ov)
+{
+  return fsync(Ov->fd) == 0 ? 0 : -EIO;
+}
+
+/**
+ * Writes every overlay sector into the image, then empties the overlay. The
+ * image must not be in use by anything else meanwhile.
+ * ============================================================================
+ * Return
+ * Number of sectors written to the image, or -1 with errno set.
+ * ============================================================================
+ * Parameters
+ * @Ov: The overlay.
+ * @ImagePath: Path of the image, opened for writing.
+**/
+int overlay_commit(OVERLAY *Ov, const char *ImagePath)
+{
+  BYTE Data[MAX_BYTES_PER_SECTOR];
+  DWORD SectorN;
+  int Written = 0;
+  int fd = open(ImagePath, O_WRONLY);
+
+  if (fd < 0) {
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&Ov->lock);
+  for (SectorN = 0; SectorN < Ov->SectorCnt; SectorN++) {
+    if (Ov->Map[SectorN] == 0) {
+      continue;
+    }
+    if (full_pread(Ov->fd, Data, Ov->SectorSize, slot_offset(Ov, Ov->Map[SectorN])) !=
+        (ssize_t) Ov->SectorSize ||
+        full_pwrite(fd, Data, Ov->SectorSize, (off_t) SectorN << Ov->SectorShift) != 0) {
+      Written = -1;
+      break;
+    }
+    Written++;
+  }
+
+  /* The overlay is only emptied once the image has it all on disk */
+  if (Written >= 0 && fsync(fd) == 0 &&
+      ftruncate(Ov->fd, sizeof(OVERLAY_HEADER)) == 0 && fsync(Ov->fd) == 0) {
+    memset(Ov->Map, 0, Ov->SectorCnt * sizeof(DWORD));
+    Ov->SlotCnt = 0;
+  } else {
+    Written = -1;
+  }
+  pthread_rwlock_unlock(&Ov->lock);
+
+  close(fd);
+  return Written;
+}
+
+/**
+ * Rewrites the overlay file with only the sectors that differ from the
+ * image, one slot each, in sector order.
+ * ============================================================================
+ * Return
+ * Number of sectors kept, or -1 with errno set (the overlay is left as it
+ * was).
+ * ============================================================================
+ * Parameters
+ * @Ov: The overlay.
+ * @OverlayPath: Path of the overlay file, replaced by the compacted one.
+**/
+int overlay_compact(OVERLAY *Ov, const char *OverlayPath)
+{
+  BYTE Slot[sizeof(OVERLAY_RECORD) + MAX_BYTES_PER_SECTOR];
+  BYTE Base[MAX_BYTES_PER_SECTOR];
+  OVERLAY_RECORD *Record = (OVERLAY_RECORD *) Slot;
+  BYTE *Data = Slot + sizeof(OVERLAY_RECORD);
+  OVERLAY_HEADER Header;
+  DWORD SectorN, Kept = 0;
+  DWORD *Map = calloc(Ov->SectorCnt, sizeof(DWORD));
+  char *TmpPath = malloc(strlen(OverlayPath) + 5);
+  int fd, res = 0;
+
+  if (Map == NULL || TmpPath == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  sprintf(TmpPath, "%s.tmp", OverlayPath);
+
+  pthread_rwlock_wrlock(&Ov->lock);
+  fd = open(TmpPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || full_pread(Ov->fd, &Header, sizeof(OVERLAY_HEADER), 0) != sizeof(OVERLAY_HEADER) ||
+      full_pwrite(fd, &Header, sizeof(OVERLAY_HEADER), 0) != 0) {
+    res = -1;
+  }
+
+  for (SectorN = 0; SectorN < Ov->SectorCnt && res == 0; SectorN++) {
+    if (Ov->Map[SectorN] == 0) {
+      continue;
+    }
+    if (full_pread(Ov->fd, Data, Ov->SectorSize, slot_offset(Ov, Ov->Map[SectorN])) !=
+        (ssize_t) Ov->SectorSize) {
+      res = -1;
+      break;
+    }
+
+    /* Written back with the bytes the image already has */
+    if (sector_pread_file(Ov->Image, Base, Ov->SectorSize,
+                          (off_t) SectorN << Ov->SectorShift) == (ssize_t) Ov->SectorSize &&
+        memcmp(Base, Data, Ov->SectorSize) == 0) {
+      continue;
+    }
+
+    Record->SectorN = SectorN;
+    Record->Check = ~SectorN;
+    Map[SectorN] = ++Kept;
+    if (full_pwrite(fd, Slot, SLOT_SIZE(Ov), slot_offset(Ov, Kept) - sizeof(OVERLAY_RECORD)) != 0) {
+      res = -1;
+    }
+  }
+
+  if (res == 0 && fsync(fd) == 0 && rename(TmpPath, OverlayPath) == 0) {
+    close(Ov->fd);
+    Ov->fd = fd;
+    free(Ov->Map);
+    Ov->Map = Map;
+    Ov->SlotCnt = Kept;
+  } else {
+    res = -1;
+    if (fd >= 0) {
+      close(fd);
+      unlink(TmpPath);
+    }
+    free(Map);
+  }
+  pthread_rwlock_unlock(&Ov->lock);
+
+  free(TmpPath);
+  return res == 0 ? (int) Kept : -1;
+}
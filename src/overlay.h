@@ -0,0 +1,52 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <pthread.h>
+
+#include "fat16.h"
+
+#define OVERLAY_MAGIC "FAT16OVL"
+#define OVERLAY_VERSION 1
+
+/* Overlay file header. The overlay belongs to the image with the same volume
+ * ID, sector size and sector count */
+typedef struct {
+  BYTE Magic[8];
+  DWORD Version;
+  DWORD VollID;
+  DWORD SectorSize;
+  DWORD SectorCnt;
+} __attribute__ ((packed)) OVERLAY_HEADER;
+
+/* Header of every sector stored in the overlay, followed by its bytes.
+ * Check is ~SectorN, a record without it is not used */
+typedef struct {
+  DWORD SectorN;
+  DWORD Check;
+} __attribute__ ((packed)) OVERLAY_RECORD;
+
+/* Sectors of an image written since the overlay was created. The image is
+ * never written, each modified sector gets a slot in the overlay file the
+ * first time it is written and is read from there from then on */
+typedef struct OVERLAY {
+  int fd;
+  FILE *Image;
+  BYTE SectorShift;
+  DWORD SectorSize;
+  DWORD SectorCnt;
+  DWORD *Map;
+  DWORD SlotCnt;
+  pthread_rwlock_t lock;
+} OVERLAY;
+
+/* Prototypes (documentation in the functions definitions) */
+OVERLAY *overlay_open(VOLUME *Vol, const char *OverlayPath);
+void overlay_close(OVERLAY *Ov);
+ssize_t overlay_pread(void *arg, void *buffer, size_t size, off_t offset);
+int overlay_write(OVERLAY *Ov, const void *buffer, size_t size, off_t offset);
+int overlay_touches(OVERLAY *Ov, off_t offset, size_t size);
+int overlay_sync(OVERLAY *Ov);
+int overlay_commit(OVERLAY *Ov, const char *ImagePath);
+int overlay_compact(OVERLAY *Ov, const char *OverlayPath);
+
+#endif
@@ -0,0 +1,54 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fat16.h"
+#include "overlay.h"
+
+int main(int argc, char *argv[])
+{
+  OVERLAY *Ov;
+  DWORD Sectors = 0, SectorN;
+  int res;
+
+  if ((argc != 3 && argc != 4) ||
+      (argc == 4 && strcmp(argv[3], "commit") != 0 && strcmp(argv[3], "compact") != 0)) {
+    printf("Usage: ./overlay_fat16 <FAT16 image> <overlay> [commit|compact]\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Initializing a FAT16 volume */
+  VOLUME *Vol = pre_init_fat16(argv[1]);
+
+  Ov = overlay_open(Vol, argv[2]);
+  if (Ov == NULL) {
+    printf("%s: not an overlay of %s\n", argv[2], argv[1]);
+    exit(EXIT_FAILURE);
+  }
+
+  if (argc == 3) {
+    for (SectorN = 0; SectorN < Ov->SectorCnt; SectorN++) {
+      Sectors += Ov->Map[SectorN] != 0;
+    }
+    printf("%u sectors modified (%llu bytes), %u slots used\n", Sectors,
+           (unsigned long long) Sectors * Ov->SectorSize, Ov->SlotCnt);
+  } else if (strcmp(argv[3], "commit") == 0) {
+    res = overlay_commit(Ov, argv[1]);
+    if (res < 0) {
+      printf("%s: could not write the image: %s\n", argv[1], strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    printf("%d sectors written to %s\n", res, argv[1]);
+  } else {
+    res = overlay_compact(Ov, argv[2]);
+    if (res < 0) {
+      printf("%s: could not compact the overlay: %s\n", argv[2], strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    printf("%d sectors kept\n", res);
+  }
+
+  volume_close(Vol);
+  return 0;
+}
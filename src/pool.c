@@ -0,0 +1,134 @@
+#include <stdlib.h>
+
+#include "pool.h"
+#include "log.h"
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static POOL_JOB *queue_head, *queue_tail;
+static pthread_t *threads;
+static int nthreads;
+static int stopping;
+
+/* Worker loop: pops jobs until the pool is stopped and drained */
+static void *pool_worker(void *unused)
+{
+  POOL_JOB *Job;
+
+  for (;;) {
+    pthread_mutex_lock(&pool_lock);
+    while (queue_head == NULL && !stopping) {
+      pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+    if (queue_head == NULL) {
+      pthread_mutex_unlock(&pool_lock);
+      return NULL;
+    }
+    Job = queue_head;
+    queue_head = Job->next;
+    if (queue_head == NULL) {
+      queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    Job->fn(Job->arg);
+
+    pthread_mutex_lock(&Job->Batch->lock);
+    if (--Job->Batch->pending == 0) {
+      pthread_cond_signal(&Job->Batch->done);
+    }
+    pthread_mutex_unlock(&Job->Batch->lock);
+  }
+}
+
+void pool_start(int workers)
+{
+  int i;
+
+  if (workers <= 0) {
+    return;
+  }
+
+  threads = malloc(workers * sizeof(pthread_t));
+
+  if (threads == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  stopping = 0;
+  for (i = 0; i < workers; i++) {
+    if (pthread_create(&threads[i], NULL, pool_worker, NULL) != 0) {
+      break;
+    }
+  }
+  nthreads = i;
+}
+
+void pool_stop(void)
+{
+  int i;
+
+  pthread_mutex_lock(&pool_lock);
+  stopping = 1;
+  pthread_cond_broadcast(&pool_cond);
+  pthread_mutex_unlock(&pool_lock);
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  threads = NULL;
+  nthreads = 0;
+}
+
+int pool_workers(void)
+{
+  return nthreads;
+}
+
+void pool_batch_init(POOL_BATCH *Batch)
+{
+  pthread_mutex_init(&Batch->lock, NULL);
+  pthread_cond_init(&Batch->done, NULL);
+  Batch->pending = 0;
+}
+
+void pool_batch_add(POOL_BATCH *Batch, POOL_JOB *Job, pool_fn fn, void *arg)
+{
+  if (nthreads == 0) {
+    fn(arg);
+    return;
+  }
+
+  Job->fn = fn;
+  Job->arg = arg;
+  Job->Batch = Batch;
+  Job->next = NULL;
+
+  pthread_mutex_lock(&Batch->lock);
+  Batch->pending++;
+  pthread_mutex_unlock(&Batch->lock);
+
+  pthread_mutex_lock(&pool_lock);
+  if (queue_tail != NULL) {
+    queue_tail->next = Job;
+  } else {
+    queue_head = Job;
+  }
+  queue_tail = Job;
+  pthread_cond_signal(&pool_cond);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void pool_batch_wait(POOL_BATCH *Batch)
+{
+  pthread_mutex_lock(&Batch->lock);
+  while (Batch->pending > 0) {
+    pthread_cond_wait(&Batch->done, &Batch->lock);
+  }
+  pthread_mutex_unlock(&Batch->lock);
+
+  pthread_mutex_destroy(&Batch->lock);
+  pthread_cond_destroy(&Batch->done);
+}
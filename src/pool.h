@@ -0,0 +1,42 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+/* Work done by a pool worker */
+typedef void (*pool_fn)(void *arg);
+
+/* A queued unit of work, linked in the pool queue */
+typedef struct POOL_JOB {
+  pool_fn fn;
+  void *arg;
+  struct POOL_BATCH *Batch;
+  struct POOL_JOB *next;
+} POOL_JOB;
+
+/* Group of jobs a caller waits on as a whole */
+typedef struct POOL_BATCH {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int pending;
+} POOL_BATCH;
+
+/* Starts 'workers' threads (no-op when 0) */
+void pool_start(int workers);
+
+/* Stops and joins the workers */
+void pool_stop(void);
+
+/* Number of running workers */
+int pool_workers(void);
+
+void pool_batch_init(POOL_BATCH *Batch);
+
+/* Queues fn(arg) as part of Batch, runs it inline when there are no workers.
+ * Job must stay valid until the batch is waited on */
+void pool_batch_add(POOL_BATCH *Batch, POOL_JOB *Job, pool_fn fn, void *arg);
+
+/* Blocks until every job of Batch has run */
+void pool_batch_wait(POOL_BATCH *Batch);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+/* Static tracepoints (USDT) of the provider "fat16", listed in
+ * scripts/bpftrace. With <sys/sdt.h> (systemtap-sdt-dev) each probe is a nop
+ * instruction and a note in the binary that perf and bpftrace attach to at
+ * run time; without it, or with -DNO_SDT, they are left out and their
+ * arguments are never evaluated, so these must have no side effects */
+
+#if !defined(NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SDT 1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(fat16, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(fat16, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(fat16, name, a, b, c)
+#else
+#define PROBE1(name, a) do { (void) sizeof(a); } while (0)
+#define PROBE2(name, a, b) do { (void) sizeof(a); (void) sizeof(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void) sizeof(a); (void) sizeof(b); (void) sizeof(c); } while (0)
+#endif
+
+#endif
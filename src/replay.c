@@ -0,0 +1,396 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/falloc.h>
+
+#include "libfat16.h"
+#include "log.h"
+#include "modify.h"
+#include "overlay.h"
+#include "replay.h"
+
+/* Result of an operation the replay cannot make */
+#define REPLAY_SKIPPED INT_MIN
+
+/* A replay thread and the operations it replays, in trace order */
+typedef struct {
+  pthread_t tid;
+  VOLUME *Vol;
+  const TRACE_OP *Ops;
+  size_t *Mine;
+  size_t Count;
+  const REPLAY_OPTIONS *Options;
+  uint64_t Begin;
+  uint64_t First;
+  char *buffer;
+  size_t BufferSize;
+  LAT_HIST Replayed[TRACE_OPS];
+  uint64_t Skipped[TRACE_OPS];
+  uint64_t Mismatches[TRACE_OPS];
+  uint64_t Behind;
+} REPLAY_THREAD;
+
+/* Path of an operation inside the replayed image, NULL if it is on another
+ * image (or on the root of a multi-image mount) */
+static const char *replay_path(const REPLAY_OPTIONS *Options, const char *Path)
+{
+  size_t Length;
+
+  if (Options->Image == NULL) {
+    return Path;
+  }
+
+  Path += strspn(Path, "/");
+  Length = strlen(Options->Image);
+  if (strncmp(Path, Options->Image, Length) != 0) {
+    return NULL;
+  }
+  if (Path[Length] == '\0') {
+    return "/";
+  }
+  return Path[Length] == '/' ? Path + Length : NULL;
+}
+
+/* Buffer of at least 'size' bytes for the reads and writes of a thread */
+static char *replay_buffer(REPLAY_THREAD *T, size_t size)
+{
+  if (size > T->BufferSize) {
+    free(T->buffer);
+    T->buffer = calloc(1, size);
+    if (T->buffer == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    T->BufferSize = size;
+  }
+  return T->buffer;
+}
+
+/**
+ * Makes an operation of the trace on the volume, the way the mount serves
+ * it. Changes are only replayed on a volume with an overlay, extended
+ * attributes describe the mount rather than the image and are not replayed,
+ * nor are ioctls, which libfat16 has no equivalent of.
+ * ============================================================================
+ * Return
+ * What the mount would return, or REPLAY_SKIPPED.
+ * ============================================================================
+ * Parameters
+ * @T: Replay thread.
+ * @Op: Recorded operation.
+ * @Path: Its path inside the image.
+**/
+static int replay_op(REPLAY_THREAD *T, const TRACE_OP *Op, const char *Path)
+{
+  const TRACE_RECORD *Rec = &Op->Rec;
+  VOLUME *Vol = T->Vol;
+  int res;
+
+  if (Rec->Op == TRACE_GETATTR) {
+    struct stat st;
+
+    return libfat16_stat(Vol, Path, &st);
+  }
+
+  if (Rec->Op == TRACE_READDIR) {
+    LIBFAT16_DIR *Dir = libfat16_opendir(Vol, Path);
+    LIBFAT16_NODE Node;
+
+    if (Dir == NULL) {
+      return -errno;
+    }
+    while (libfat16_readdir(Dir, &Node) == 1) {
+      continue;
+    }
+    libfat16_closedir(Dir);
+    return 0;
+  }
+
+  if (Rec->Op == TRACE_READ || Rec->Op == TRACE_READ_BUF) {
+    LIBFAT16_NODE Node;
+
+    res = file_flush(Vol, Path);
+    if (res == 0) {
+      res = libfat16_lookup(Vol, Path, &Node);
+    }
+
+    if (res != 0) {
+      return res;
+    }
+    res = libfat16_pread(Vol, &Node, replay_buffer(T, Rec->Size), Rec->Size, Rec->Offset);
+
+    /* read_buf replies with the data and returns 0 */
+    return Rec->Op == TRACE_READ_BUF && res >= 0 ? 0 : res;
+  }
+
+  if (Rec->Op == TRACE_STATFS) {
+    return Vol->Counted ? 0 : -EIO;
+  }
+
+  if (Rec->Op == TRACE_GETXATTR || Rec->Op == TRACE_IOCTL || Vol->Overlay == NULL) {
+    return REPLAY_SKIPPED;
+  }
+
+  if (Rec->Op == TRACE_WRITE) {
+    return file_write(Vol, Path, replay_buffer(T, Rec->Size), Rec->Size, Rec->Offset);
+  }
+  if (Rec->Op == TRACE_CREATE) {
+    res = file_create(Vol, Path);
+    return res == 0 ? file_open(Vol, Path) : res;
+  }
+  if (Rec->Op == TRACE_OPEN) {
+    return (Rec->Offset & O_ACCMODE) == O_RDONLY ? 0 : file_open(Vol, Path);
+  }
+  if (Rec->Op == TRACE_TRUNCATE) {
+    return file_truncate(Vol, Path, Rec->Offset);
+  }
+  if (Rec->Op == TRACE_UNLINK) {
+    return file_unlink(Vol, Path);
+  }
+  if (Rec->Op == TRACE_UTIMENS) {
+    return file_touch(Vol, Path, Rec->Offset);
+  }
+  if (Rec->Op == TRACE_FALLOCATE) {
+    return file_allocate(Vol, Path, Rec->Offset, Rec->Size, Rec->Flags & FALLOC_FL_KEEP_SIZE);
+  }
+  if (Rec->Op == TRACE_FLUSH) {
+    return file_flush(Vol, Path);
+  }
+
+  /* Release answers 0 whatever happens, files only read are left alone */
+  if (Rec->Op == TRACE_RELEASE) {
+    if ((Rec->Offset & O_ACCMODE) != O_RDONLY) {
+      file_release(Vol, Path);
+    }
+    return 0;
+  }
+  res = file_flush(Vol, Path);
+  return res == 0 && overlay_sync(Vol->Overlay) != 0 ? -EIO : res;
+}
+
+/* Sleeps until a time of the monotonic clock (ns) */
+static void replay_sleep(uint64_t Until)
+{
+  struct timespec ts;
+
+  ts.tv_sec = Until / 1000000000;
+  ts.tv_nsec = Until % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    continue;
+  }
+}
+
+/* Replays the operations of one thread */
+static void *replay_thread(void *data)
+{
+  REPLAY_THREAD *T = data;
+  double Speed = T->Options->Speed;
+  size_t i;
+
+  for (i = 0; i < T->Count; i++) {
+    const TRACE_OP *Op = &T->Ops[T->Mine[i]];
+    const char *Path = replay_path(T->Options, Op->Path);
+    uint64_t Start;
+    int res;
+
+    /* At the original timing (or a multiple), an operation starts as long
+     * after the first one as it did in the trace, or as soon as the previous
+     * one is done if that is already late */
+    if (Speed > 0) {
+      uint64_t Due = T->Begin + (uint64_t) ((Op->Rec.Start - T->First) / Speed);
+
+      Start = trace_clock();
+      if (Start < Due) {
+        replay_sleep(Due);
+      } else if (Start - Due > REPLAY_LATE_NS) {
+        T->Behind++;
+      }
+    }
+
+    Start = trace_clock();
+    res = replay_op(T, Op, Path);
+    if (res == REPLAY_SKIPPED) {
+      T->Skipped[Op->Rec.Op]++;
+      continue;
+    }
+    hist_add(&T->Replayed[Op->Rec.Op], (trace_clock() - Start) / 1000);
+
+    /* The same failure, or the same number of bytes read */
+    if (res != Op->Rec.Result && (res < 0 || Op->Rec.Result < 0 || Op->Rec.Op == TRACE_READ)) {
+      T->Mismatches[Op->Rec.Op]++;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Replays a trace on a volume, straight through the engine: no kernel and no
+ * FUSE between the operations and the image. The operations of each
+ * recorded thread are spread over the replay threads round-robin, in order
+ * of first appearance. Operations on other images or on the root of a
+ * multi-image mount are left out.
+ * ============================================================================
+ * Return
+ * 0 on success, -1 if threads could not be started.
+ * ============================================================================
+ * Parameters
+ * @Vol: Volume replayed on (with an overlay, changes are replayed too).
+ * @Ops: Operations of the trace, from trace_load.
+ * @Count: Number of operations.
+ * @Options: Threads, timing and image.
+ * @Stats: Filled with the latencies recorded and replayed.
+**/
+int replay_run(VOLUME *Vol, const TRACE_OP *Ops, size_t Count,
+               const REPLAY_OPTIONS *Options, REPLAY_STATS *Stats)
+{
+  int Threads = Options->Threads, Started = 0, i, j;
+  DWORD *Recorded = malloc(sizeof(DWORD) * (Count + 1));
+  int *Owner = malloc(sizeof(int) * (Count + 1));
+  REPLAY_THREAD *T = calloc(Threads, sizeof(REPLAY_THREAD));
+  int Distinct = 0, Last = -1;
+  uint64_t First = UINT64_MAX, End = 0;
+  size_t n;
+
+  if (Recorded == NULL || Owner == NULL || T == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(Stats, 0, sizeof(REPLAY_STATS));
+
+  /* Recorded threads get replay threads in the order they first appear */
+  for (n = 0; n < Count; n++) {
+    const TRACE_RECORD *Rec = &Ops[n].Rec;
+
+    Owner[n] = -1;
+    if (replay_path(Options, Ops[n].Path) == NULL) {
+      continue;
+    }
+    hist_add(&Stats->Recorded[Rec->Op], Rec->Latency / 1000);
+    if (Rec->Start < First) {
+      First = Rec->Start;
+    }
+    if (Rec->Start + Rec->Latency > End) {
+      End = Rec->Start + Rec->Latency;
+    }
+
+    if (Last < 0 || Recorded[Last] != Rec->Thread) {
+      Last = 0;
+      while (Last < Distinct && Recorded[Last] != Rec->Thread) {
+        Last++;
+      }
+      if (Last == Distinct) {
+        Recorded[Distinct++] = Rec->Thread;
+      }
+    }
+    Owner[n] = Last % Threads;
+    T[Owner[n]].Count++;
+  }
+
+  Stats->TraceNs = End > First ? End - First : 0;
+
+  for (i = 0; i < Threads; i++) {
+    T[i].Mine = malloc(sizeof(size_t) * (T[i].Count + 1));
+    if (T[i].Mine == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    T[i].Count = 0;
+  }
+  for (n = 0; n < Count; n++) {
+    if (Owner[n] >= 0) {
+      T[Owner[n]].Mine[T[Owner[n]].Count++] = n;
+    }
+  }
+
+  uint64_t Begin = trace_clock();
+
+  for (i = 0; i < Threads; i++) {
+    T[i].Vol = Vol;
+    T[i].Ops = Ops;
+    T[i].Options = Options;
+    T[i].Begin = Begin;
+    T[i].First = First;
+    if (pthread_create(&T[i].tid, NULL, replay_thread, &T[i]) != 0) {
+      break;
+    }
+    Started++;
+  }
+  for (i = 0; i < Started; i++) {
+    pthread_join(T[i].tid, NULL);
+  }
+  Stats->ElapsedNs = trace_clock() - Begin;
+
+  for (i = 0; i < Threads; i++) {
+    for (j = 0; j < TRACE_OPS; j++) {
+      hist_merge(&Stats->Replayed[j], &T[i].Replayed[j]);
+      Stats->Skipped[j] += T[i].Skipped[j];
+      Stats->Mismatches[j] += T[i].Mismatches[j];
+    }
+    Stats->Behind += T[i].Behind;
+    free(T[i].Mine);
+    free(T[i].buffer);
+  }
+  free(T);
+  free(Owner);
+  free(Recorded);
+  return Started == Threads ? 0 : -1;
+}
+
+/* Prints one latency distribution of the report */
+static void replay_hist(FILE *Out, const char *Label, const LAT_HIST *Hist)
+{
+  fprintf(Out, "  %-9s %10llu %9llu %9llu %9llu %9llu %9llu\n", Label,
+          (unsigned long long) Hist->Count,
+          (unsigned long long) (Hist->Count > 0 ? Hist->TotalUs / Hist->Count : 0),
+          (unsigned long long) hist_percentile(Hist, 0.50),
+          (unsigned long long) hist_percentile(Hist, 0.90),
+          (unsigned long long) hist_percentile(Hist, 0.99),
+          (unsigned long long) Hist->MaxUs);
+}
+
+/**
+ * Prints the latency distribution of every kind of operation, as recorded
+ * by the mount and as replayed, with the operations skipped and those whose
+ * result differs from the trace.
+ * ============================================================================
+ * Return
+ * There is no return in this function.
+ * ============================================================================
+ * Parameters
+ * @Stats: From replay_run.
+ * @Out: Where the report is written.
+**/
+void replay_report(const REPLAY_STATS *Stats, FILE *Out)
+{
+  uint64_t Replayed = 0;
+  int i;
+
+  fprintf(Out, "%-11s %10s %9s %9s %9s %9s %9s\n", "op (us)", "count", "mean",
+          "p50", "p90", "p99", "max");
+  for (i = 0; i < TRACE_OPS; i++) {
+    if (Stats->Recorded[i].Count == 0) {
+      continue;
+    }
+    fprintf(Out, "%s\n", trace_op_names[i]);
+    replay_hist(Out, "recorded", &Stats->Recorded[i]);
+    replay_hist(Out, "replayed", &Stats->Replayed[i]);
+    if (Stats->Skipped[i] > 0 || Stats->Mismatches[i] > 0) {
+      fprintf(Out, "  skipped %llu, results differing from the trace %llu\n",
+              (unsigned long long) Stats->Skipped[i],
+              (unsigned long long) Stats->Mismatches[i]);
+    }
+    Replayed += Stats->Replayed[i].Count;
+  }
+
+  fprintf(Out, "Replayed %llu operations in %.3f s (trace: %.3f s), %.0f op/s\n",
+          (unsigned long long) Replayed, Stats->ElapsedNs / 1e9, Stats->TraceNs / 1e9,
+          Stats->ElapsedNs > 0 ? Replayed * 1e9 / Stats->ElapsedNs : 0.0);
+  if (Stats->Behind > 0) {
+    fprintf(Out, "Operations started behind schedule: %llu\n",
+            (unsigned long long) Stats->Behind);
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+
+#include "fat16.h"
+#include "hist.h"
+#include "trace.h"
+
+/* Most replay threads */
+#define REPLAY_MAX_THREADS 256
+
+/* Operations that start this late (ns) at the original timing are counted
+ * as behind schedule */
+#define REPLAY_LATE_NS 1000000
+
+/* How a trace is replayed */
+typedef struct {
+  int Threads;        /* the operations of one recorded thread all go to
+                       * the same replay thread, in their order */
+  double Speed;       /* 1 for the original timing, 2 for twice as fast,
+                       * 0 for as fast as possible */
+  const char *Image;  /* only the operations on this image of a
+                       * multi-image mount, NULL for a single image */
+} REPLAY_OPTIONS;
+
+/* What a replay measured, next to what the trace recorded */
+typedef struct {
+  LAT_HIST Recorded[TRACE_OPS];
+  LAT_HIST Replayed[TRACE_OPS];
+  uint64_t Skipped[TRACE_OPS];
+  uint64_t Mismatches[TRACE_OPS];
+  uint64_t Behind;
+  uint64_t ElapsedNs;
+  uint64_t TraceNs;
+} REPLAY_STATS;
+
+/* Prototypes (documentation in the functions definitions) */
+int replay_run(VOLUME *Vol, const TRACE_OP *Ops, size_t Count,
+               const REPLAY_OPTIONS *Options, REPLAY_STATS *Stats);
+void replay_report(const REPLAY_STATS *Stats, FILE *Out);
+
+#endif
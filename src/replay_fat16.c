@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "fat16.h"
+#include "libfat16.h"
+#include "modify.h"
+#include "overlay.h"
+#include "replay.h"
+#include "trace.h"
+
+static void usage(void)
+{
+  printf("Usage: ./replay_fat16 [options] <FAT16 image> <trace>\n");
+  printf("  -t <threads>   replay threads (default 4)\n");
+  printf("  -s <speed>     1 for the original timing, 2 for twice as fast...\n");
+  printf("                 (default 0, as fast as possible)\n");
+  printf("  -i <name>      image of a multi-image mount the trace is replayed for\n");
+  printf("  -o <overlay>   replay changes too, into this overlay\n");
+  printf("  -d <bytes>     memory for appends held back (default 16 MiB, 0 for none)\n");
+  printf("  -m <bytes>     memory limit of the directory cache (default none)\n");
+  printf("  -b <backend>   pread or mmap (default pread)\n");
+  printf("  -T <preset>    throttle reads as hdd, sd or net\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  REPLAY_OPTIONS Options = { 4, 0, NULL };
+  const SECTOR_BACKEND *Backend = &sector_backend_pread;
+  const char *OverlayPath = NULL, *Preset = NULL;
+  size_t CacheMem = 0, Delayed = DELAYED_MEM, Count;
+  REPLAY_STATS *Stats;
+  int c;
+
+  while ((c = getopt(argc, argv, "t:s:i:o:d:m:b:T:")) != -1) {
+    if (c == 't') {
+      Options.Threads = atoi(optarg);
+    } else if (c == 's') {
+      Options.Speed = atof(optarg);
+    } else if (c == 'i') {
+      Options.Image = optarg;
+    } else if (c == 'o') {
+      OverlayPath = optarg;
+    } else if (c == 'd') {
+      Delayed = strtoull(optarg, NULL, 10);
+    } else if (c == 'm') {
+      CacheMem = strtoull(optarg, NULL, 10);
+    } else if (c == 'b') {
+      if ((Backend = backend_by_name(optarg)) == NULL) {
+        usage();
+      }
+    } else if (c == 'T') {
+      Preset = optarg;
+    } else {
+      usage();
+    }
+  }
+  if (argc - optind != 2 || Options.Threads < 1 || Options.Threads > REPLAY_MAX_THREADS ||
+      Options.Speed < 0) {
+    usage();
+  }
+
+  /* Reads of the image go through the same backends as the mount's */
+  if (Preset != NULL) {
+    THROTTLE Throttle;
+
+    if (backend_preset(Preset, &Throttle) != 0) {
+      usage();
+    }
+    Backend = backend_throttled(Backend, &Throttle);
+  }
+  sector_set_backend(Backend);
+
+  TRACE_OP *Ops = trace_load(argv[optind + 1], &Count);
+  if (Ops == NULL) {
+    fprintf(stderr, "%s: %s\n", argv[optind + 1], errno == EINVAL ?
+            "not a trace of mount_fat16" : strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  VOLUME *Vol = libfat16_open_image(argv[optind]);
+  if (Vol == NULL) {
+    fprintf(stderr, "%s: %s\n", argv[optind], errno == EINVAL ?
+            "not a valid FAT16 image" : strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (OverlayPath != NULL && overlay_open(Vol, OverlayPath) == NULL) {
+    fprintf(stderr, "%s: cannot be used as the overlay of %s\n", OverlayPath, argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+  Vol->DelayedLimit = OverlayPath != NULL ? Delayed : 0;
+
+  /* The volume is set up as the mount sets it up */
+  CACHE_BUDGET *Budget = cache_budget_new(CacheMem);
+  cache_budget_attach(Budget, Vol);
+  volume_count(Vol);
+
+  Stats = malloc(sizeof(REPLAY_STATS));
+  if (Stats == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  if (replay_run(Vol, Ops, Count, &Options, Stats) != 0) {
+    fprintf(stderr, "Replay threads could not all be started\n");
+    exit(EXIT_FAILURE);
+  }
+  replay_report(Stats, stdout);
+  if (Preset != NULL) {
+    char Report[512];
+
+    backend_report(Report, sizeof(Report));
+    printf("Throttled backend:\n%s", Report);
+  }
+
+  free(Stats);
+  trace_free(Ops, Count);
+  file_flush_all(Vol);
+  libfat16_close_image(Vol);
+  cache_budget_free(Budget);
+  return 0;
+}
@@ -1,8 +1,112 @@
+#include <unistd.h>
+
+#include "probe.h"
 #include "sector.h"
 
-/* Read the sector 'secnum' from the image to the buffer */
-void sector_read(FILE *fd, unsigned int secnum, void *buffer)
+/* Directory and FAT sectors go through it, the mount points it at its I/O
+ * scheduler */
+static sector_pread_fn sector_reader = sector_pread;
+
+/* Most images with a source of their own */
+#define SECTOR_SOURCES 16
+
+static struct {
+  FILE *fd;
+  sector_source_fn fn;
+  void *arg;
+} sources[SECTOR_SOURCES];
+static int source_cnt;
+
+/* Backend every image file is read from */
+static const SECTOR_BACKEND *backend = &sector_backend_pread;
+
+int sector_set_source(FILE *fd, sector_source_fn fn, void *arg)
+{
+  int i = 0;
+
+  while (i < source_cnt && sources[i].fd != fd) {
+    i++;
+  }
+  if (fn == NULL) {
+    if (i < source_cnt) {
+      sources[i] = sources[--source_cnt];
+    }
+    return 0;
+  }
+  if (i == SECTOR_SOURCES) {
+    return -1;
+  }
+  sources[i].fd = fd;
+  sources[i].fn = fn;
+  sources[i].arg = arg;
+  if (i == source_cnt) {
+    source_cnt++;
+  }
+  return 0;
+}
+
+void sector_set_reader(sector_pread_fn fn)
+{
+  __atomic_store_n(&sector_reader, fn != NULL ? fn : sector_pread, __ATOMIC_RELEASE);
+}
+
+/* Read the sector 'secnum', of 1 << 'shift' bytes, from the image to the
+ * buffer */
+void sector_read(FILE *fd, unsigned int secnum, unsigned int shift, void *buffer)
+{
+  sector_pread_fn fn = __atomic_load_n(&sector_reader, __ATOMIC_ACQUIRE);
+  ssize_t res;
+
+  PROBE2(sector_read_entry, secnum, (size_t) 1 << shift);
+  res = fn(fd, buffer, (size_t) 1 << shift, (off_t) secnum << shift);
+  PROBE2(sector_read_return, secnum, res);
+}
+
+/* Read 'size' bytes at byte 'offset' of the image to the buffer. Does not move
+ * the stream position, so it is safe to call from several threads */
+ssize_t sector_pread(FILE *fd, void *buffer, size_t size, off_t offset)
+{
+  int i;
+
+  for (i = 0; i < source_cnt; i++) {
+    if (sources[i].fd == fd) {
+      return sources[i].fn(sources[i].arg, buffer, size, offset);
+    }
+  }
+  return sector_pread_file(fd, buffer, size, offset);
+}
+
+ssize_t sector_pread_file(FILE *fd, void *buffer, size_t size, off_t offset)
+{
+  return backend->pread(fd, buffer, size, offset);
+}
+
+/* Backend pread: the whole range, short only at the end of the file */
+static ssize_t file_pread(FILE *fd, void *buffer, size_t size, off_t offset)
+{
+  size_t done = 0;
+  ssize_t res;
+
+  while (done < size) {
+    res = pread(fileno(fd), (char *) buffer + done, size - done, offset + done);
+    if (res <= 0) {
+      return done > 0 ? (ssize_t) done : res;
+    }
+    done += res;
+  }
+  return done;
+}
+
+const SECTOR_BACKEND sector_backend_pread = { "pread", file_pread, NULL };
+
+void sector_set_backend(const SECTOR_BACKEND *Backend)
+{
+  backend = Backend != NULL ? Backend : &sector_backend_pread;
+}
+
+void sector_forget(FILE *fd)
 {
-  fseek(fd, BYTES_PER_SECTOR * secnum, SEEK_SET);
-  fread(buffer, BYTES_PER_SECTOR, 1, fd);
+  if (backend->forget != NULL) {
+    backend->forget(fd);
+  }
 }
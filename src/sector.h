@@ -3,10 +3,50 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
-#define BYTES_PER_SECTOR 512
+/* Read the sector 'secnum', of 1 << 'shift' bytes, from the image to the
+ * buffer */
+void sector_read(FILE *fd, unsigned int secnum, unsigned int shift, void *buffer);
 
-/* Read the sector 'secnum' from the image to the buffer */
-void sector_read(FILE *fd, unsigned int secnum, void *buffer);
+/* Read 'size' bytes at byte 'offset' of the image to the buffer */
+ssize_t sector_pread(FILE *fd, void *buffer, size_t size, off_t offset);
+
+/* Reads behind sector_read, sector_pread unless replaced */
+typedef ssize_t (*sector_pread_fn)(FILE *fd, void *buffer, size_t size, off_t offset);
+
+/* Replaces the reads behind sector_read, NULL restores sector_pread */
+void sector_set_reader(sector_pread_fn fn);
+
+/* Where the bytes of one image really come from (its overlay, for a
+ * writable mount), read with 'arg' */
+typedef ssize_t (*sector_source_fn)(void *arg, void *buffer, size_t size, off_t offset);
+
+/* Makes sector_pread of fd read through fn, NULL detaches it. Sources are
+ * set before the image is shared between threads. -1 if fn cannot be set,
+ * too many images having a source already */
+int sector_set_source(FILE *fd, sector_source_fn fn, void *arg);
+
+/* Reads the image file itself, whatever source it has, through the backend */
+ssize_t sector_pread_file(FILE *fd, void *buffer, size_t size, off_t offset);
+
+/* Storage the image files are read from. forget (may be NULL) is told when
+ * an image file is about to be closed */
+typedef struct {
+  const char *Name;
+  ssize_t (*pread)(FILE *fd, void *buffer, size_t size, off_t offset);
+  void (*forget)(FILE *fd);
+} SECTOR_BACKEND;
+
+/* pread(2) on the image file, the default backend */
+extern const SECTOR_BACKEND sector_backend_pread;
+
+/* Reads every image file through Backend, NULL restores
+ * sector_backend_pread. Set before any image is shared between threads */
+void sector_set_backend(const SECTOR_BACKEND *Backend);
+
+/* Lets the backend drop what it keeps about an image file before it is
+ * closed */
+void sector_forget(FILE *fd);
 
 #endif
@@ -0,0 +1,193 @@
+#define _XOPEN_SOURCE 700
+
+#include <ftw.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image.h"
+
+/* Offset of a cluster in the image */
+static size_t cluster_at(const TEST_IMAGE *Img, WORD ClusterN)
+{
+  return (size_t) (Img->FirstData + ClusterN - 2) * IMAGE_BPS;
+}
+
+/**
+ * Formats an empty FAT16 volume in memory. Files are given clusters from the
+ * start of the data area, Stride clusters apart (1 unless a test changes it
+ * to lay out fragmented files).
+ * ============================================================================
+ * Return
+ * There is no return in this function.
+ * ============================================================================
+ * Parameters
+ * @Img: Image to set up.
+ * @Clusters: Number of data clusters of the volume.
+**/
+void image_init(TEST_IMAGE *Img, DWORD Clusters)
+{
+  BPB_BS *Bpb;
+  DWORD RootSectors = IMAGE_ROOT_ENTRIES * BYTES_PER_DIR / IMAGE_BPS;
+
+  Img->Clusters = Clusters;
+  Img->FatSectors = ((Clusters + 2) * 2 + IMAGE_BPS - 1) / IMAGE_BPS;
+  Img->FirstData = IMAGE_RSVD + 2 * Img->FatSectors + RootSectors;
+  Img->Size = (size_t) (Img->FirstData + Clusters) * IMAGE_BPS;
+  Img->Data = calloc(1, Img->Size);
+  Img->Next = 2;
+  Img->Stride = 1;
+  CHECK(Img->Data != NULL);
+
+  Bpb = (BPB_BS *) Img->Data;
+  memcpy(Bpb->BS_jmpBoot, "\xeb\x3c\x90", 3);
+  memcpy(Bpb->BS_OEMName, "TESTFAT ", 8);
+  Bpb->BPB_BytsPerSec = IMAGE_BPS;
+  Bpb->BPB_SecPerClus = 1;
+  Bpb->BPB_RsvdSecCnt = IMAGE_RSVD;
+  Bpb->BPB_NumFATS = 2;
+  Bpb->BPB_RootEntCnt = IMAGE_ROOT_ENTRIES;
+  Bpb->BPB_TotSec16 = Img->FirstData + Clusters;
+  Bpb->BPB_Media = 0xf8;
+  Bpb->BPB_FATSz16 = Img->FatSectors;
+  Bpb->BS_BootSig = 0x29;
+  memcpy(Bpb->BS_VollLab, "TEST       ", 11);
+  memcpy(Bpb->BS_FilSysType, "FAT16   ", 8);
+  Bpb->Signature_word = 0xaa55;
+
+  image_fat(Img, 0, 0xfff8);
+  image_fat(Img, 1, 0xffff);
+}
+
+void image_free(TEST_IMAGE *Img)
+{
+  free(Img->Data);
+}
+
+/* Sets a FAT entry in both FATs, chains can be broken on purpose this way */
+void image_fat(TEST_IMAGE *Img, WORD ClusterN, WORD Value)
+{
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    WORD *Fat = (WORD *) (Img->Data + (IMAGE_RSVD + i * Img->FatSectors) * IMAGE_BPS);
+
+    Fat[ClusterN] = Value;
+  }
+}
+
+WORD image_fat_get(const TEST_IMAGE *Img, WORD ClusterN)
+{
+  return ((WORD *) (Img->Data + IMAGE_RSVD * IMAGE_BPS))[ClusterN];
+}
+
+/**
+ * Adds a directory entry in the first free slot of a directory. The name is
+ * stored as given, so that tests can write names no tool would.
+ * ============================================================================
+ * Return
+ * There is no return in this function.
+ * ============================================================================
+ * Parameters
+ * @Img: Image being built.
+ * @Dir: First cluster of the directory, 0 for the root directory.
+ * @Name: The 11 bytes of DIR_Name.
+ * @Attr: DIR_Attr of the entry.
+ * @FirstCluster: First cluster of the file, 0 if it has none.
+ * @Size: Size of the file.
+**/
+void image_entry(TEST_IMAGE *Img, WORD Dir, const char *Name, BYTE Attr,
+                 WORD FirstCluster, DWORD Size)
+{
+  DIR_ENTRY *Entry;
+  DWORD i, Count;
+
+  if (Dir == 0) {
+    Entry = (DIR_ENTRY *) (Img->Data + (IMAGE_RSVD + 2 * Img->FatSectors) * IMAGE_BPS);
+    Count = IMAGE_ROOT_ENTRIES;
+  } else {
+    Entry = (DIR_ENTRY *) (Img->Data + cluster_at(Img, Dir));
+    Count = IMAGE_BPS / BYTES_PER_DIR;
+  }
+  for (i = 0; i < Count && Entry[i].DIR_Name[0] != 0; i++) {
+  }
+  CHECK(i < Count);
+
+  memset(&Entry[i], 0, sizeof(DIR_ENTRY));
+  memcpy(Entry[i].DIR_Name, Name, 11);
+  Entry[i].DIR_Attr = Attr;
+  Entry[i].DIR_WrtDate = ((2020 - 1980) << 9) | (6 << 5) | 7;
+  Entry[i].DIR_FstClusLO = FirstCluster;
+  Entry[i].DIR_FileSize = Size;
+}
+
+/* Gives a file its clusters, links them and copies its data */
+WORD image_file(TEST_IMAGE *Img, WORD Dir, const char *Name, const void *Data,
+                DWORD Size)
+{
+  DWORD n = (Size + IMAGE_BPS - 1) / IMAGE_BPS, i;
+  WORD First = n == 0 ? 0 : Img->Next, Prev = 0;
+
+  for (i = 0; i < n; i++) {
+    WORD c = Img->Next;
+    DWORD Piece = Size - i * IMAGE_BPS < IMAGE_BPS ? Size - i * IMAGE_BPS : IMAGE_BPS;
+
+    CHECK(c < Img->Clusters + 2);
+    memcpy(Img->Data + cluster_at(Img, c), (const BYTE *) Data + i * IMAGE_BPS, Piece);
+    if (Prev != 0) {
+      image_fat(Img, Prev, c);
+    }
+    Prev = c;
+    Img->Next += Img->Stride;
+  }
+  if (Prev != 0) {
+    image_fat(Img, Prev, 0xffff);
+  }
+  image_entry(Img, Dir, Name, ATTR_ARCHIVE, First, Size);
+  return First;
+}
+
+/* Adds a directory of one cluster, with its "." and ".." entries */
+WORD image_dir(TEST_IMAGE *Img, WORD Dir, const char *Name)
+{
+  WORD c = Img->Next;
+
+  CHECK(c < Img->Clusters + 2);
+  Img->Next += Img->Stride;
+  image_fat(Img, c, 0xffff);
+  image_entry(Img, c, ".          ", ATTR_DIRECTORY, c, 0);
+  image_entry(Img, c, "..         ", ATTR_DIRECTORY, Dir, 0);
+  image_entry(Img, Dir, Name, ATTR_DIRECTORY, c, 0);
+  return c;
+}
+
+void image_save(const TEST_IMAGE *Img, const char *Path)
+{
+  FILE *f = fopen(Path, "wb");
+
+  CHECK(f != NULL);
+  CHECK(fwrite(Img->Data, 1, Img->Size, f) == Img->Size);
+  CHECK(fclose(f) == 0);
+}
+
+/* Creates an empty directory for the files of one test */
+char *test_dir(void)
+{
+  char Template[] = "/tmp/fat16_test.XXXXXX";
+  char *Dir = mkdtemp(Template);
+
+  CHECK(Dir != NULL);
+  Dir = strdup(Dir);
+  CHECK(Dir != NULL);
+  return Dir;
+}
+
+static int remove_one(const char *Path, const struct stat *st, int Flag, struct FTW *Ftw)
+{
+  return remove(Path);
+}
+
+void test_dir_remove(const char *Dir)
+{
+  nftw(Dir, remove_one, 16, FTW_DEPTH | FTW_PHYS);
+}
@@ -0,0 +1,48 @@
+#ifndef TEST_IMAGE_H
+#define TEST_IMAGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fat16.h"
+
+/* Geometry of the images built by the tests: 512 byte sectors, one sector
+ * per cluster, two FATs and a root directory of 512 entries */
+#define IMAGE_BPS 512
+#define IMAGE_RSVD 1
+#define IMAGE_ROOT_ENTRIES 512
+
+/* Image being put together in memory */
+typedef struct {
+  BYTE *Data;
+  size_t Size;
+  DWORD Clusters;
+  DWORD FatSectors;
+  DWORD FirstData;
+  WORD Next;
+  WORD Stride;
+} TEST_IMAGE;
+
+/* Fails the test with the line of the check that did not hold */
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      exit(EXIT_FAILURE); \
+    } \
+  } while (0)
+
+/* Prototypes (documentation in the functions definitions) */
+void image_init(TEST_IMAGE *Img, DWORD Clusters);
+void image_free(TEST_IMAGE *Img);
+void image_fat(TEST_IMAGE *Img, WORD ClusterN, WORD Value);
+WORD image_fat_get(const TEST_IMAGE *Img, WORD ClusterN);
+void image_entry(TEST_IMAGE *Img, WORD Dir, const char *Name, BYTE Attr,
+                 WORD FirstCluster, DWORD Size);
+WORD image_file(TEST_IMAGE *Img, WORD Dir, const char *Name, const void *Data,
+                DWORD Size);
+WORD image_dir(TEST_IMAGE *Img, WORD Dir, const char *Name);
+void image_save(const TEST_IMAGE *Img, const char *Path);
+char *test_dir(void);
+void test_dir_remove(const char *Dir);
+
+#endif
@@ -0,0 +1,88 @@
+#include <string.h>
+
+#include "check.h"
+#include "image.h"
+
+/* Checks an image and returns the number of problems, with the JSON report
+ * in Report */
+static int check_image(TEST_IMAGE *Img, const char *Dir, int threads, char *Report,
+                       size_t Size)
+{
+  char Path[512];
+  VOLUME *Vol;
+  FILE *Out = tmpfile();
+  size_t n;
+  int Problems;
+
+  snprintf(Path, sizeof(Path), "%s/check.img", Dir);
+  image_save(Img, Path);
+  Vol = volume_open(Path);
+  CHECK(Vol != NULL && Out != NULL);
+  Problems = check_volume(Vol, threads, Out);
+  volume_close(Vol);
+
+  rewind(Out);
+  n = fread(Report, 1, Size - 1, Out);
+  Report[n] = '\0';
+  fclose(Out);
+  return Problems;
+}
+
+/* A small tree: files of one to four clusters in the root and in two
+ * levels of subdirectories */
+static void image_tree(TEST_IMAGE *Img, WORD *A, WORD *B, WORD *Sub)
+{
+  static char Data[4 * IMAGE_BPS];
+  WORD Deep;
+
+  memset(Data, 'x', sizeof(Data));
+  image_init(Img, 128);
+  *A = image_file(Img, 0, "A       BIN", Data, 3 * IMAGE_BPS);
+  *B = image_file(Img, 0, "B       BIN", Data, 3 * IMAGE_BPS);
+  *Sub = image_dir(Img, 0, "SUB        ");
+  image_file(Img, *Sub, "C       TXT", Data, 100);
+  Deep = image_dir(Img, *Sub, "DEEP       ");
+  image_file(Img, Deep, "D       TXT", Data, 4 * IMAGE_BPS);
+}
+
+int main(void)
+{
+  TEST_IMAGE Img;
+  char *Dir = test_dir(), Report[8192];
+  WORD A, B, Sub;
+  int threads;
+
+  for (threads = 1; threads <= 4; threads += 3) {
+    image_tree(&Img, &A, &B, &Sub);
+    CHECK(check_image(&Img, Dir, threads, Report, sizeof(Report)) == 0);
+    CHECK(strstr(Report, "\"files\": 4") != NULL);
+    CHECK(strstr(Report, "\"directories\": 2") != NULL);
+
+    /* The last cluster of A points back to its first */
+    image_fat(&Img, A + 2, A);
+    CHECK(check_image(&Img, Dir, threads, Report, sizeof(Report)) == 1);
+    CHECK(strstr(Report, "\"cycle\": 1") != NULL);
+    CHECK(strstr(Report, "{\"kind\": \"cycle\", \"path\": \"/a.bin\"") != NULL);
+    image_free(&Img);
+
+    /* B goes on into the chain of A after its first cluster: same length,
+     * but the last two clusters belong to both */
+    image_tree(&Img, &A, &B, &Sub);
+    image_fat(&Img, B, A + 1);
+    CHECK(check_image(&Img, Dir, threads, Report, sizeof(Report)) == 1);
+    CHECK(strstr(Report, "\"cross_link\": 1") != NULL);
+    CHECK(strstr(Report, "\"lost_clusters\": 2") != NULL);
+
+    /* A cycle inside a directory chain stops the walk of that directory */
+    image_fat(&Img, B, B + 1);
+    image_fat(&Img, Sub, Sub);
+    CHECK(check_image(&Img, Dir, threads, Report, sizeof(Report)) > 0);
+    CHECK(strstr(Report, "\"cycle\": 1") != NULL);
+    image_free(&Img);
+  }
+
+  test_dir_remove(Dir);
+  free(Dir);
+  printf("test_check: ok\n");
+  return 0;
+}
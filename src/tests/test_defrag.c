@@ -0,0 +1,122 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "defrag.h"
+#include "extract.h"
+#include "image.h"
+
+/* Files of the image: where they are extracted to and their size */
+static const struct {
+  const char *Path;
+  DWORD Size;
+} Files[] = {
+  { "one.txt", 1 }, { "sector.bin", IMAGE_BPS }, { "empty.txt", 0 },
+  { "sub/odd.bin", IMAGE_BPS + 1 }, { "sub/deep/big.bin", 9000 },
+  { "sub/deep/mid.bin", 3000 }
+};
+
+#define FILE_CNT (sizeof(Files) / sizeof(Files[0]))
+
+/* Contents of the i-th file, different for every file */
+static void file_data(DWORD i, char *Data)
+{
+  DWORD j;
+
+  for (j = 0; j < Files[i].Size; j++) {
+    Data[j] = (j * 13 + i * 71) ^ (j >> 7);
+  }
+}
+
+/* Checks that an extracted file holds exactly the bytes it was given */
+static void file_compare(const char *Dir, DWORD i)
+{
+  static char Data[16384], Back[16384];
+  char Path[512];
+  ssize_t n;
+  int fd;
+
+  snprintf(Path, sizeof(Path), "%s/%s", Dir, Files[i].Path);
+  fd = open(Path, O_RDONLY);
+  CHECK(fd >= 0);
+  n = read(fd, Back, sizeof(Back));
+  close(fd);
+  file_data(i, Data);
+  CHECK(n == (ssize_t) Files[i].Size && memcmp(Data, Back, n) == 0);
+}
+
+/* Fragmentation report of a volume */
+static void analyze(VOLUME *Vol, char *Text, size_t Size)
+{
+  FILE *Report = tmpfile();
+  size_t n;
+
+  CHECK(Report != NULL && defrag_analyze(Vol, Report) == 0);
+  rewind(Report);
+  n = fread(Text, 1, Size - 1, Report);
+  Text[n] = '\0';
+  fclose(Report);
+}
+
+/* A fragmented image defragments into one that checks clean and extracts
+ * to the same bytes */
+int main(void)
+{
+  static char Data[16384];
+  TEST_IMAGE Img;
+  char *Dir = test_dir(), Path[512], Out[512];
+  WORD Sub, Deep;
+  VOLUME *Vol;
+  char Text[65536];
+  DWORD i;
+
+  /* Every cluster given out leaves a free one behind: nothing is contiguous */
+  image_init(&Img, 256);
+  Img.Stride = 2;
+  file_data(0, Data);
+  image_file(&Img, 0, "ONE     TXT", Data, Files[0].Size);
+  file_data(1, Data);
+  image_file(&Img, 0, "SECTOR  BIN", Data, Files[1].Size);
+  image_file(&Img, 0, "EMPTY   TXT", Data, 0);
+  Sub = image_dir(&Img, 0, "SUB        ");
+  file_data(3, Data);
+  image_file(&Img, Sub, "ODD     BIN", Data, Files[3].Size);
+  Deep = image_dir(&Img, Sub, "DEEP       ");
+  file_data(4, Data);
+  image_file(&Img, Deep, "BIG     BIN", Data, Files[4].Size);
+  file_data(5, Data);
+  image_file(&Img, Deep, "MID     BIN", Data, Files[5].Size);
+  snprintf(Path, sizeof(Path), "%s/frag.img", Dir);
+  image_save(&Img, Path);
+  image_free(&Img);
+
+  Vol = volume_open(Path);
+  CHECK(Vol != NULL);
+  CHECK(check_volume(Vol, 2, NULL) == 0);
+  analyze(Vol, Text, sizeof(Text));
+  CHECK(strstr(Text, "(0 fragmented)") == NULL);
+  snprintf(Out, sizeof(Out), "%s/defrag.img", Dir);
+  CHECK(defrag_write(Vol, Out) == 0);
+  volume_close(Vol);
+
+  Vol = volume_open(Out);
+  CHECK(Vol != NULL);
+  CHECK(check_volume(Vol, 2, NULL) == 0);
+
+  analyze(Vol, Text, sizeof(Text));
+  CHECK(strstr(Text, "(0 fragmented)") != NULL);
+  CHECK(strstr(Text, "Fragmentation score: 0.0%") != NULL);
+
+  snprintf(Path, sizeof(Path), "%s/out", Dir);
+  CHECK(extract_dir(Vol, Path) == 0);
+  for (i = 0; i < FILE_CNT; i++) {
+    file_compare(Path, i);
+  }
+
+  volume_close(Vol);
+  test_dir_remove(Dir);
+  free(Dir);
+  printf("test_defrag: ok\n");
+  return 0;
+}
@@ -0,0 +1,67 @@
+#include <errno.h>
+#include <string.h>
+
+#include "image.h"
+#include "modify.h"
+#include "overlay.h"
+
+/* Appends held in memory keep the clusters they will take: a fallocate that
+ * would need them fails with ENOSPC, and the appends are written when the
+ * file is flushed */
+int main(void)
+{
+  TEST_IMAGE Img;
+  char *Dir = test_dir(), Path[512], Data[5120], Back[5120];
+  DIR_ENTRY Entry;
+  VOLUME *Vol;
+  off_t Size;
+  DWORD Free;
+  int i;
+
+  image_init(&Img, 128);
+  image_file(&Img, 0, "LOG     TXT", NULL, 0);
+  image_file(&Img, 0, "FILL    BIN", NULL, 0);
+  snprintf(Path, sizeof(Path), "%s/delayed.img", Dir);
+  image_save(&Img, Path);
+  image_free(&Img);
+
+  Vol = volume_open(Path);
+  CHECK(Vol != NULL);
+  snprintf(Path, sizeof(Path), "%s/delayed.ovl", Dir);
+  CHECK(overlay_open(Vol, Path) != NULL);
+  Vol->DelayedLimit = DELAYED_MEM;
+  volume_count(Vol);
+  Free = Vol->FreeClusters;
+
+  for (i = 0; i < (int) sizeof(Data); i++) {
+    Data[i] = i * 7 + (i >> 8);
+  }
+  CHECK(file_write(Vol, "/log.txt", Data, sizeof(Data), 0) == sizeof(Data));
+  CHECK(file_pending(Vol, "/log.txt", &Size) == 1 && Size == sizeof(Data));
+  CHECK(Vol->DelayedClusters == sizeof(Data) / IMAGE_BPS);
+
+  /* Every free cluster is more than another file may take */
+  CHECK(file_allocate(Vol, "/fill.bin", 0, (off_t) Free * IMAGE_BPS, 0) == -ENOSPC);
+  CHECK(file_allocate(Vol, "/fill.bin", 0, (off_t) Free * IMAGE_BPS, 1) == -ENOSPC);
+  CHECK(Vol->FreeClusters == Free);
+  CHECK(file_allocate(Vol, "/fill.bin", 0, (off_t) (Free - 10) * IMAGE_BPS, 0) == 0);
+  CHECK(file_write(Vol, "/fill.bin", Data, 1, (off_t) (Free - 10) * IMAGE_BPS) == -ENOSPC);
+
+  CHECK(file_flush(Vol, "/log.txt") == 0);
+  CHECK(file_pending(Vol, "/log.txt", &Size) == 0);
+  CHECK(Vol->FreeClusters == 0 && Vol->DelayedClusters == 0);
+  CHECK(path_lookup(Vol, "/log.txt", &Entry) == 0 && Entry.DIR_FileSize == sizeof(Data));
+  CHECK(read_file(Vol, &Entry, Back, sizeof(Back), 0) == sizeof(Back));
+  CHECK(memcmp(Data, Back, sizeof(Data)) == 0);
+
+  /* Without room, an append is written at once and fails there */
+  CHECK(file_write(Vol, "/log.txt", Data, 1, sizeof(Data)) == -ENOSPC);
+  CHECK(file_pending(Vol, "/log.txt", &Size) == 0);
+
+  CHECK(file_flush_all(Vol) == 0);
+  volume_close(Vol);
+  test_dir_remove(Dir);
+  free(Dir);
+  printf("test_delayed: ok\n");
+  return 0;
+}
@@ -0,0 +1,79 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extract.h"
+#include "image.h"
+
+/* Reads a whole file of the output, NULL if it is not there */
+static char *slurp(const char *Path, size_t *Size)
+{
+  static char buffer[65536];
+  int fd = open(Path, O_RDONLY);
+  ssize_t n;
+
+  if (fd < 0) {
+    return NULL;
+  }
+  n = read(fd, buffer, sizeof(buffer));
+  close(fd);
+  CHECK(n >= 0);
+  *Size = n;
+  return buffer;
+}
+
+/* Names stored in the image are not trusted: one that would leave the output
+ * directory is left out and the extraction fails, the other files are still
+ * extracted */
+int main(void)
+{
+  TEST_IMAGE Img;
+  char *Dir = test_dir(), Path[512], *Data;
+  size_t Size;
+  VOLUME *Vol;
+  FILE *Tar;
+
+  image_init(&Img, 64);
+  image_file(&Img, 0, "OK      TXT", "hello", 5);
+  image_dir(&Img, 0, "A          ");
+  image_file(&Img, 0, "A/../../XYZ", "evil", 4);
+  image_file(&Img, 0, "..         ", "dots", 4);
+  snprintf(Path, sizeof(Path), "%s/hostile.img", Dir);
+  image_save(&Img, Path);
+  image_free(&Img);
+
+  Vol = volume_open(Path);
+  CHECK(Vol != NULL);
+
+  /* The escape would land in out/.xyz, next to the output directory */
+  snprintf(Path, sizeof(Path), "%s/out", Dir);
+  CHECK(mkdir(Path, 0755) == 0);
+  snprintf(Path, sizeof(Path), "%s/out/x", Dir);
+  CHECK(extract_dir(Vol, Path) != 0);
+
+  snprintf(Path, sizeof(Path), "%s/out/x/ok.txt", Dir);
+  Data = slurp(Path, &Size);
+  CHECK(Data != NULL && Size == 5 && memcmp(Data, "hello", 5) == 0);
+  snprintf(Path, sizeof(Path), "%s/out/.xyz", Dir);
+  CHECK(access(Path, F_OK) != 0);
+  snprintf(Path, sizeof(Path), "%s/.xyz", Dir);
+  CHECK(access(Path, F_OK) != 0);
+
+  /* The same names are kept out of the headers of a tar archive */
+  snprintf(Path, sizeof(Path), "%s/out.tar", Dir);
+  Tar = fopen(Path, "w+b");
+  CHECK(Tar != NULL);
+  CHECK(extract_tar(Vol, Tar) != 0);
+  fclose(Tar);
+  Data = slurp(Path, &Size);
+  CHECK(Data != NULL && memmem(Data, Size, "ok.txt", 6) != NULL);
+  CHECK(memmem(Data, Size, "..", 2) == NULL);
+
+  volume_close(Vol);
+  test_dir_remove(Dir);
+  free(Dir);
+  printf("test_extract: ok\n");
+  return 0;
+}
@@ -0,0 +1,50 @@
+#include <string.h>
+
+#include "image.h"
+#include "modify.h"
+#include "overlay.h"
+
+/* Clusters reserved past the end of a file (fallocate with KEEP_SIZE) stay
+ * until the last writer of the file closes it */
+int main(void)
+{
+  TEST_IMAGE Img;
+  char *Dir = test_dir(), Path[512];
+  VOLUME *Vol;
+  DWORD Free;
+
+  image_init(&Img, 64);
+  image_file(&Img, 0, "DATA    BIN", "abc", 3);
+  snprintf(Path, sizeof(Path), "%s/release.img", Dir);
+  image_save(&Img, Path);
+  image_free(&Img);
+
+  Vol = volume_open(Path);
+  CHECK(Vol != NULL);
+  snprintf(Path, sizeof(Path), "%s/release.ovl", Dir);
+  CHECK(overlay_open(Vol, Path) != NULL);
+  volume_count(Vol);
+  Free = Vol->FreeClusters;
+
+  CHECK(file_open(Vol, "/data.bin") == 0);
+  CHECK(file_open(Vol, "/data.bin") == 0);
+  CHECK(file_allocate(Vol, "/data.bin", 0, 10 * IMAGE_BPS, 1) == 0);
+  CHECK(Vol->FreeClusters == Free - 9);
+
+  CHECK(file_release(Vol, "/data.bin") == 0);
+  CHECK(Vol->FreeClusters == Free - 9);
+  CHECK(file_release(Vol, "/data.bin") == 0);
+  CHECK(Vol->FreeClusters == Free);
+
+  /* A release no open was counted for (a trace recorded without opens)
+   * trims at once */
+  CHECK(file_allocate(Vol, "/data.bin", 0, 4 * IMAGE_BPS, 1) == 0);
+  CHECK(file_release(Vol, "/data.bin") == 0);
+  CHECK(Vol->FreeClusters == Free);
+
+  volume_close(Vol);
+  test_dir_remove(Dir);
+  free(Dir);
+  printf("test_release: ok\n");
+  return 0;
+}
@@ -0,0 +1,225 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "trace.h"
+
+const char *const trace_op_names[TRACE_OPS] = {
+  "getattr", "readdir", "read", "read_buf", "getxattr", "statfs",
+  "write", "create", "truncate", "unlink", "utimens", "fsync", "fallocate",
+  "flush", "release", "ioctl", "open"
+};
+
+/* Trace being recorded, and when it began (trace_clock) */
+static FILE *Trace;
+static uint64_t TraceStart;
+
+/* Kernel id of the calling thread, looked up once per thread */
+static __thread DWORD TraceThread;
+
+/* Monotonic clock in nanoseconds */
+uint64_t trace_clock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Starts recording a trace, replacing any file at Path.
+ * ============================================================================
+ * Return
+ * 0 on success, -1 with errno set if the file could not be written.
+ * ============================================================================
+ * Parameters
+ * @Path: Trace file.
+**/
+int trace_open(const char *Path)
+{
+  TRACE_HEADER Header;
+  struct timespec ts;
+
+  Trace = fopen(Path, "wb");
+  if (Trace == NULL) {
+    return -1;
+  }
+  setvbuf(Trace, NULL, _IOFBF, TRACE_BUFFER);
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  memset(&Header, 0, sizeof(TRACE_HEADER));
+  memcpy(Header.Magic, TRACE_MAGIC, sizeof(Header.Magic));
+  Header.Version = TRACE_VERSION;
+  Header.Realtime = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  TraceStart = trace_clock();
+
+  /* Written out at once, a process forking meanwhile never has it twice */
+  if (fwrite(&Header, sizeof(TRACE_HEADER), 1, Trace) != 1 || fflush(Trace) != 0) {
+    fclose(Trace);
+    Trace = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Appends an operation that just finished to the trace. The record is
+ * written with a single call into the buffer of the file, so records of
+ * concurrent threads never interleave, and reaches the disk with the buffer.
+ * ============================================================================
+ * Return
+ * There is no return in this function.
+ * ============================================================================
+ * Parameters
+ * @Op: Operation (TRACE_GETATTR...).
+ * @Flags: Mode of a fallocate, 0 otherwise.
+ * @Path: Path the operation was made on.
+ * @Name: Attribute name of a getxattr, NULL otherwise.
+ * @Offset: Offset of the request.
+ * @Size: Size of the request.
+ * @Start: trace_clock when the operation began.
+ * @Result: What the operation returned.
+**/
+void trace_record(BYTE Op, BYTE Flags, const char *Path, const char *Name,
+                  uint64_t Offset, DWORD Size, uint64_t Start, int Result)
+{
+  char buffer[sizeof(TRACE_RECORD) + 2 * PATH_MAX];
+  TRACE_RECORD *Rec = (TRACE_RECORD *) buffer;
+  uint64_t Latency = trace_clock() - Start;
+  size_t PathLen = strnlen(Path, PATH_MAX);
+  size_t NameLen = Name != NULL ? strnlen(Name, PATH_MAX) : 0;
+
+  if (TraceThread == 0) {
+    TraceThread = syscall(SYS_gettid);
+  }
+
+  Rec->Op = Op;
+  Rec->Flags = Flags;
+  Rec->PathLen = PathLen;
+  Rec->Thread = TraceThread;
+  Rec->Start = Start > TraceStart ? Start - TraceStart : 0;
+  Rec->Latency = Latency > UINT32_MAX ? UINT32_MAX : Latency;
+  Rec->Result = Result;
+  Rec->Offset = Name != NULL ? NameLen : Offset;
+  Rec->Size = Size;
+  memcpy(buffer + sizeof(TRACE_RECORD), Path, PathLen);
+  if (Name != NULL) {
+    memcpy(buffer + sizeof(TRACE_RECORD) + PathLen, Name, NameLen);
+  }
+
+  fwrite(buffer, sizeof(TRACE_RECORD) + PathLen + NameLen, 1, Trace);
+}
+
+/* Writes out what is left of the trace and stops recording */
+void trace_close(void)
+{
+  if (Trace != NULL) {
+    fclose(Trace);
+    Trace = NULL;
+  }
+}
+
+/* Reads a string of Len bytes of a trace file */
+static char *trace_string(FILE *fd, size_t Len)
+{
+  char *s = malloc(Len + 1);
+
+  if (s == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  if (fread(s, 1, Len, fd) != Len) {
+    free(s);
+    return NULL;
+  }
+  s[Len] = '\0';
+  return s;
+}
+
+/**
+ * Loads every operation of a trace file. A record cut short (the mount was
+ * killed while writing it out) ends the trace.
+ * ============================================================================
+ * Return
+ * Operations in the order they were recorded, to be released with
+ * trace_free, or NULL with errno set: EINVAL if the file is not a trace.
+ * ============================================================================
+ * Parameters
+ * @Path: Trace file.
+ * @Count: Set to the number of operations.
+**/
+TRACE_OP *trace_load(const char *Path, size_t *Count)
+{
+  TRACE_HEADER Header;
+  TRACE_OP *Ops = NULL;
+  size_t n = 0, Size = 0;
+  FILE *fd = fopen(Path, "rb");
+
+  if (fd == NULL) {
+    return NULL;
+  }
+  if (fread(&Header, sizeof(TRACE_HEADER), 1, fd) != 1 ||
+      memcmp(Header.Magic, TRACE_MAGIC, sizeof(Header.Magic)) != 0 ||
+      Header.Version != TRACE_VERSION) {
+    fclose(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  while (1) {
+    TRACE_OP Op;
+
+    if (fread(&Op.Rec, sizeof(TRACE_RECORD), 1, fd) != 1 || Op.Rec.Op >= TRACE_OPS) {
+      break;
+    }
+    Op.Path = trace_string(fd, Op.Rec.PathLen);
+    if (Op.Path == NULL) {
+      break;
+    }
+    Op.Name = NULL;
+    if (Op.Rec.Op == TRACE_GETXATTR &&
+        (Op.Rec.Offset > PATH_MAX || (Op.Name = trace_string(fd, Op.Rec.Offset)) == NULL)) {
+      free(Op.Path);
+      break;
+    }
+
+    if (n == Size) {
+      Size = Size == 0 ? 1024 : 2 * Size;
+      Ops = realloc(Ops, Size * sizeof(TRACE_OP));
+      if (Ops == NULL) {
+        log_msg("Out of memory!\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    Ops[n++] = Op;
+  }
+
+  fclose(fd);
+  *Count = n;
+  if (Ops == NULL) {
+    /* An empty trace still loads */
+    Ops = malloc(sizeof(TRACE_OP));
+    if (Ops == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return Ops;
+}
+
+/* Releases a trace loaded by trace_load */
+void trace_free(TRACE_OP *Ops, size_t Count)
+{
+  size_t i;
+
+  for (i = 0; i < Count; i++) {
+    free(Ops[i].Path);
+    free(Ops[i].Name);
+  }
+  free(Ops);
+}
@@ -0,0 +1,80 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "fat16.h"
+
+/* First bytes of a trace file, followed by TRACE_VERSION */
+#define TRACE_MAGIC "FAT16TRC"
+#define TRACE_VERSION 1
+
+/* Buffer of the trace file: records are only written out once it is full */
+#define TRACE_BUFFER (1024 * 1024)
+
+/* Operations recorded by a traced mount */
+enum {
+  TRACE_GETATTR,
+  TRACE_READDIR,
+  TRACE_READ,
+  TRACE_READ_BUF,
+  TRACE_GETXATTR,
+  TRACE_STATFS,
+  TRACE_WRITE,
+  TRACE_CREATE,
+  TRACE_TRUNCATE,
+  TRACE_UNLINK,
+  TRACE_UTIMENS,
+  TRACE_FSYNC,
+  TRACE_FALLOCATE,
+  TRACE_FLUSH,
+  TRACE_RELEASE,
+  TRACE_IOCTL,
+  TRACE_OPEN,
+  TRACE_OPS
+};
+
+/* Start of a trace file */
+typedef struct {
+  BYTE Magic[8];
+  DWORD Version;
+  DWORD Reserved;
+  uint64_t Realtime; /* ns since the epoch when the trace began */
+} __attribute__ ((packed)) TRACE_HEADER;
+
+/* One operation, followed in the file by PathLen bytes of its path (not
+ * terminated). Offset and Size are those of the request, except for
+ * getxattr whose Offset is the length of the attribute name, stored after
+ * the path, and ioctl whose Offset is the cursor of a listing and Size the
+ * command */
+typedef struct {
+  BYTE Op;
+  BYTE Flags;     /* mode of a fallocate */
+  WORD PathLen;
+  DWORD Thread;   /* kernel id of the FUSE thread that served it */
+  uint64_t Start; /* ns since the trace began */
+  DWORD Latency;  /* ns, saturated at 2^32 - 1 */
+  int32_t Result;
+  uint64_t Offset;
+  DWORD Size;
+} __attribute__ ((packed)) TRACE_RECORD;
+
+/* A record of a loaded trace, with its path (and attribute name) */
+typedef struct {
+  TRACE_RECORD Rec;
+  char *Path;
+  char *Name;
+} TRACE_OP;
+
+/* Prototypes (documentation in the functions definitions) */
+extern const char *const trace_op_names[TRACE_OPS];
+uint64_t trace_clock(void);
+int trace_open(const char *Path);
+void trace_record(BYTE Op, BYTE Flags, const char *Path, const char *Name,
+                  uint64_t Offset, DWORD Size, uint64_t Start, int Result);
+void trace_close(void);
+TRACE_OP *trace_load(const char *Path, size_t *Count);
+void trace_free(TRACE_OP *Ops, size_t Count);
+
+#endif
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+
+#include "log.h"
+#include "pool.h"
+#include "usage.h"
+
+struct USAGE_WALK;
+
+/* Directory of the subtree being added up, with the files found in it */
+typedef struct {
+  WORD Cluster;
+  DWORD Index;
+  DWORD Parent;
+  uint64_t Size;
+  uint64_t Files;
+  struct USAGE_WALK *Walk;
+  POOL_JOB Job;
+} USAGE_NODE;
+
+/* State of one walk. Nodes are in the order they were found, so a
+ * directory always comes before its subdirectories */
+typedef struct USAGE_WALK {
+  VOLUME *Vol;
+  POOL_BATCH Batch;
+  pthread_mutex_t lock;
+  USAGE_NODE **Nodes;
+  DWORD Count;
+  DWORD Cap;
+  BYTE *Seen;
+} USAGE_WALK;
+
+static void usage_dir(void *arg);
+
+/* Adds a directory to the walk, found in the node at position Parent */
+static USAGE_NODE *usage_node(USAGE_WALK *Walk, WORD Cluster, DWORD Parent)
+{
+  USAGE_NODE *Node = malloc(sizeof(USAGE_NODE));
+
+  if (Node == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  Node->Cluster = Cluster;
+  Node->Parent = Parent;
+  Node->Size = 0;
+  Node->Files = 0;
+  Node->Walk = Walk;
+
+  pthread_mutex_lock(&Walk->lock);
+  if (Walk->Count == Walk->Cap) {
+    Walk->Cap = Walk->Cap == 0 ? 64 : 2 * Walk->Cap;
+    Walk->Nodes = realloc(Walk->Nodes, Walk->Cap * sizeof(USAGE_NODE *));
+    if (Walk->Nodes == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  Node->Index = Walk->Count;
+  Walk->Nodes[Walk->Count++] = Node;
+  pthread_mutex_unlock(&Walk->lock);
+  return Node;
+}
+
+/* Counts a subdirectory in a directory of the walk: its kept usage if it
+ * was added up before, a new node read on the pool otherwise. A directory
+ * reached a second time (a cycle or a cross-linked directory in a damaged
+ * image) is not counted again */
+static void usage_child(USAGE_NODE *Node, WORD Cluster)
+{
+  USAGE_WALK *Walk = Node->Walk;
+  DIR_USAGE *Known;
+  USAGE_NODE *Child;
+
+  if (Cluster < 2 || Cluster > Walk->Vol->MaxCluster ||
+      __atomic_exchange_n(&Walk->Seen[Cluster], 1, __ATOMIC_RELAXED) != 0) {
+    return;
+  }
+
+  Known = dir_usage(Walk->Vol, Cluster);
+  if (Known != NULL) {
+    Node->Size += Known->Size;
+    Node->Files += Known->Files;
+    Known->Parent = Node->Cluster;
+    return;
+  }
+
+  Child = usage_node(Walk, Cluster, Node->Index);
+  pool_batch_add(&Walk->Batch, &Child->Job, usage_dir, Child);
+}
+
+/* Pool job: adds up the files of one directory and queues its
+ * subdirectories */
+static void usage_dir(void *arg)
+{
+  USAGE_NODE *Node = arg;
+  DIR_LIST *List = dir_list(Node->Walk->Vol, Node->Cluster);
+  DWORD i;
+
+  for (i = 0; i < List->Count; i++) {
+    DIR_ENTRY *Entry = &List->Entries[i];
+
+    if (Entry->DIR_Name[0] == '.') {
+      continue;
+    }
+    if (Entry->DIR_Attr & ATTR_DIRECTORY) {
+      usage_child(Node, Entry->DIR_FstClusLO);
+    } else {
+      Node->Size += Entry->DIR_FileSize;
+      Node->Files++;
+    }
+  }
+  dir_release(List);
+}
+
+/**
+ * Adds up the usage of a directory and of every directory under it that was
+ * not added up yet, and keeps them. Called with the write lock of the
+ * volume taken, so no change is made meanwhile.
+ * ============================================================================
+ * Return
+ * There is no return in this function.
+ * ============================================================================
+ * Parameters
+ * @Vol: Structure that contains essential data about the File System.
+ * @FirstCluster: First cluster of the directory, 0 for the root directory.
+**/
+static void usage_walk(VOLUME *Vol, WORD FirstCluster)
+{
+  USAGE_WALK Walk;
+  USAGE_NODE *Node;
+  DIR_USAGE *Usage;
+  DWORD i;
+
+  if (Vol->Cache->Usage == NULL) {
+    DIR_USAGE **Slots = calloc(DIR_CACHE_SLOTS, sizeof(DIR_USAGE *));
+
+    if (Slots == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    __atomic_store_n(&Vol->Cache->Usage, Slots, __ATOMIC_RELEASE);
+  }
+
+  Walk.Vol = Vol;
+  Walk.Nodes = NULL;
+  Walk.Count = Walk.Cap = 0;
+  Walk.Seen = calloc(DIR_CACHE_SLOTS, 1);
+  if (Walk.Seen == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_init(&Walk.lock, NULL);
+  pool_batch_init(&Walk.Batch);
+
+  Walk.Seen[FirstCluster] = 1;
+  Node = usage_node(&Walk, FirstCluster, 0);
+  pool_batch_add(&Walk.Batch, &Node->Job, usage_dir, Node);
+  pool_batch_wait(&Walk.Batch);
+
+  /* Subdirectories into their parents, from the deepest found */
+  for (i = Walk.Count - 1; i > 0; i--) {
+    Walk.Nodes[Walk.Nodes[i]->Parent]->Size += Walk.Nodes[i]->Size;
+    Walk.Nodes[Walk.Nodes[i]->Parent]->Files += Walk.Nodes[i]->Files;
+  }
+
+  /* Kept subdirectories first, a directory kept has all of its own kept */
+  for (i = Walk.Count; i > 0; i--) {
+    Node = Walk.Nodes[i - 1];
+    Usage = malloc(sizeof(DIR_USAGE));
+    if (Usage == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+    Usage->Size = Node->Size;
+    Usage->Files = Node->Files;
+    Usage->Parent = i > 1 ? Walk.Nodes[Node->Parent]->Cluster : Node->Cluster;
+    __atomic_store_n(&Vol->Cache->Usage[Node->Cluster], Usage, __ATOMIC_RELEASE);
+    free(Node);
+  }
+
+  pthread_mutex_destroy(&Walk.lock);
+  free(Walk.Nodes);
+  free(Walk.Seen);
+}
+
+void usage_get(VOLUME *Vol, WORD FirstCluster, uint64_t *Size, uint64_t *Files)
+{
+  DIR_USAGE *Usage = dir_usage(Vol, FirstCluster);
+
+  if (Usage == NULL) {
+    pthread_mutex_lock(&Vol->WriteLock);
+    if (dir_usage(Vol, FirstCluster) == NULL) {
+      usage_walk(Vol, FirstCluster);
+    }
+    pthread_mutex_unlock(&Vol->WriteLock);
+    Usage = dir_usage(Vol, FirstCluster);
+  }
+
+  *Size = __atomic_load_n(&Usage->Size, __ATOMIC_RELAXED);
+  *Files = __atomic_load_n(&Usage->Files, __ATOMIC_RELAXED);
+}
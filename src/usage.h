@@ -0,0 +1,15 @@
+#ifndef USAGE_H
+#define USAGE_H
+
+#include <stdint.h>
+
+#include "fat16.h"
+
+/* Size of the files under a directory (subdirectories included) and their
+ * number. The first time a directory is asked for, its subtree is read on
+ * the pool workers and the usage of every directory in it is kept (see
+ * dir_usage); changes made through the overlay keep them up to date from
+ * then on, so later calls only read the kept values */
+void usage_get(VOLUME *Vol, WORD FirstCluster, uint64_t *Size, uint64_t *Files);
+
+#endif
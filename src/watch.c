@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "watch.h"
+#include "log.h"
+
+/* Changes of a directory entry that may replace or rewrite a file */
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | \
+                      IN_MOVED_TO | IN_DELETE)
+
+/* A watched file: the watch of its directory and its name in it */
+typedef struct {
+  int wd;
+  char *Name;
+  uint64_t Changed;
+} WATCHED;
+
+static WATCHED *Files;
+static int FileCnt;
+static watch_fn notify;
+static unsigned int interval_ms;
+static int inotify_fd = -1;
+static int stop_pipe[2] = { -1, -1 };
+static pthread_t watch_tid;
+static int running;
+
+/* Monotonic clock in milliseconds */
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Marks the files an inotify event is about as changed */
+static void watch_event(struct inotify_event *Event, uint64_t Now)
+{
+  int i;
+
+  for (i = 0; i < FileCnt; i++) {
+    /* Events were lost on an overflow, any file may have changed */
+    if (Event->mask & IN_Q_OVERFLOW ||
+        (Files[i].wd == Event->wd && Event->len > 0 && strcmp(Files[i].Name, Event->name) == 0)) {
+      Files[i].Changed = Now;
+    }
+  }
+}
+
+/**
+ * Watcher loop: gathers inotify events, reports each changed file once it
+ * has been quiet for WATCH_SETTLE_MS, and every file each interval.
+ * ============================================================================
+ * Return
+ * NULL
+ * ============================================================================
+ * Parameters
+ * @unused: Unused.
+**/
+static void *watch_thread(void *unused)
+{
+  char Events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct pollfd fds[2];
+  uint64_t LastSweep = now_ms(), Now;
+  int i, timeout, settling;
+  ssize_t n;
+
+  fds[0].fd = stop_pipe[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = inotify_fd;
+  fds[1].events = POLLIN;
+
+  for (;;) {
+    /* Sleeps until the next file settles or the next sweep is due */
+    Now = now_ms();
+    timeout = LastSweep + interval_ms > Now ? LastSweep + interval_ms - Now : 0;
+    for (i = 0; i < FileCnt; i++) {
+      if (Files[i].Changed != 0) {
+        settling = Files[i].Changed + WATCH_SETTLE_MS > Now ?
+          Files[i].Changed + WATCH_SETTLE_MS - Now : 0;
+        if (settling < timeout) {
+          timeout = settling;
+        }
+      }
+    }
+
+    if (poll(fds, inotify_fd >= 0 ? 2 : 1, timeout) < 0 && errno != EINTR) {
+      log_msg("Watcher: poll failed: %s\n", strerror(errno));
+      return NULL;
+    }
+    if (fds[0].revents != 0) {
+      return NULL;
+    }
+
+    Now = now_ms();
+    if (inotify_fd >= 0 && fds[1].revents & POLLIN) {
+      n = read(inotify_fd, Events, sizeof(Events));
+      i = 0;
+      while (i < n) {
+        struct inotify_event *Event = (struct inotify_event *) (Events + i);
+
+        watch_event(Event, Now);
+        i += sizeof(struct inotify_event) + Event->len;
+      }
+    }
+
+    if (Now >= LastSweep + interval_ms) {
+      LastSweep = Now;
+      for (i = 0; i < FileCnt; i++) {
+        Files[i].Changed = 0;
+        notify(i);
+      }
+      continue;
+    }
+    for (i = 0; i < FileCnt; i++) {
+      if (Files[i].Changed != 0 && Now >= Files[i].Changed + WATCH_SETTLE_MS) {
+        Files[i].Changed = 0;
+        notify(i);
+      }
+    }
+  }
+}
+
+int watch_start(const char **Paths, int Count, unsigned int interval, watch_fn fn)
+{
+  char Dir[PATH_MAX];
+  int i;
+
+  Files = calloc(Count, sizeof(WATCHED));
+
+  if (Files == NULL) {
+    log_msg("Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  FileCnt = Count;
+  notify = fn;
+  interval_ms = (interval > 0 ? interval : WATCH_INTERVAL) * 1000;
+
+  /* Without inotify the files are still checked every interval */
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    log_msg("Watcher: no inotify (%s), checking every %u s\n", strerror(errno),
+            interval_ms / 1000);
+  }
+
+  for (i = 0; i < Count; i++) {
+    const char *Slash = strrchr(Paths[i], '/');
+
+    if (Slash == NULL) {
+      strcpy(Dir, ".");
+      Files[i].Name = strdup(Paths[i]);
+    } else {
+      snprintf(Dir, sizeof(Dir), "%.*s", Slash == Paths[i] ? 1 : (int) (Slash - Paths[i]),
+               Paths[i]);
+      Files[i].Name = strdup(Slash + 1);
+    }
+    if (Files[i].Name == NULL) {
+      log_msg("Out of memory!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    /* A directory watched twice gets the same watch descriptor */
+    Files[i].wd = inotify_fd >= 0 ? inotify_add_watch(inotify_fd, Dir, WATCH_EVENTS) : -1;
+    if (inotify_fd >= 0 && Files[i].wd < 0) {
+      log_msg("Watcher: cannot watch %s: %s\n", Dir, strerror(errno));
+    }
+  }
+
+  if (pipe(stop_pipe) != 0 || pthread_create(&watch_tid, NULL, watch_thread, NULL) != 0) {
+    watch_stop();
+    return -1;
+  }
+  running = 1;
+  return 0;
+}
+
+void watch_stop(void)
+{
+  int i;
+
+  if (running) {
+    if (write(stop_pipe[1], "", 1) != 1) {
+      log_msg("Watcher: cannot stop: %s\n", strerror(errno));
+    }
+    pthread_join(watch_tid, NULL);
+    running = 0;
+  }
+  for (i = 0; i < 2; i++) {
+    if (stop_pipe[i] >= 0) {
+      close(stop_pipe[i]);
+      stop_pipe[i] = -1;
+    }
+  }
+  if (inotify_fd >= 0) {
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+  for (i = 0; i < FileCnt; i++) {
+    free(Files[i].Name);
+  }
+  free(Files);
+  Files = NULL;
+  FileCnt = 0;
+}
@@ -0,0 +1,25 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+/* Time (ms) a file must stay quiet after a change before it is reported, so
+ * a file being rewritten is reported once it is complete */
+#define WATCH_SETTLE_MS 200
+
+/* Default time (s) between checks of every file when inotify reports nothing
+ * (files on network filesystems, missed events) */
+#define WATCH_INTERVAL 5
+
+/* Called with the position of a file in the list given to watch_start, from
+ * the watcher thread, when it may have changed */
+typedef void (*watch_fn)(int Index);
+
+/* Watches 'Count' files (the directories holding them, so a file renamed
+ * over one is seen too). fn is called for a file WATCH_SETTLE_MS after its
+ * last change, and for every file each 'interval' seconds. Returns 0, or -1
+ * if the watcher thread could not be started */
+int watch_start(const char **Paths, int Count, unsigned int interval, watch_fn fn);
+
+/* Stops and joins the watcher thread */
+void watch_stop(void);
+
+#endif